@@ -0,0 +1,166 @@
+// Measures descriptor iteration over a corpus of synthetic configuration
+// descriptor sets, shaped like those of composite devices (interface
+// associations, alternate settings, class-specific descriptors, SuperSpeed
+// endpoint companions), with a share of them deliberately malformed.
+
+#include "SimpleIOUSB.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define kCorpusSize 4096
+#define kRounds 200
+
+// One in this many descriptor sets is corrupted in some way.
+#define kMalformedEvery 10
+
+typedef struct {
+    uint8_t *data;
+    size_t length;
+} Blob;
+
+static uint32_t sRandomState = 0x2545f491;
+
+static uint32_t Random(uint32_t bound)
+{
+    // xorshift32; deterministic so runs are comparable.
+    sRandomState ^= sRandomState << 13;
+    sRandomState ^= sRandomState >> 17;
+    sRandomState ^= sRandomState << 5;
+    return sRandomState % bound;
+}
+
+static uint8_t *Append(uint8_t *out, uint8_t length, uint8_t type)
+{
+    memset(out, 0, length);
+    out[0] = length;
+    out[1] = type;
+    return out + length;
+}
+
+static Blob MakeBlob(void)
+{
+    uint8_t *start = malloc(0x10000);
+    uint8_t *out = start + sizeof(SIConfigDescriptor);
+
+    uint8_t numInterfaces = (uint8_t)(1 + Random(6));
+    for (uint8_t i = 0; i < numInterfaces; ++i) {
+        // Interface association, as used by composite devices.
+        if (Random(3) == 0)
+            out = Append(out, 8, 0x0b);
+
+        uint8_t numAlternates = (uint8_t)(1 + Random(3));
+        for (uint8_t alt = 0; alt < numAlternates; ++alt) {
+            uint8_t *interface = out;
+            out = Append(out, sizeof(SIInterfaceDescriptor), kSIDescriptorTypeInterface);
+            interface[2] = i;
+            interface[3] = alt;
+
+            // Class-specific interface descriptors (CDC functional, UAC, ...).
+            for (uint32_t cs = Random(4); cs; --cs)
+                out = Append(out, (uint8_t)(5 + Random(8)), 0x24);
+
+            uint8_t numEndpoints = (uint8_t)Random(9);
+            interface[4] = numEndpoints;
+            for (uint8_t e = 0; e < numEndpoints; ++e) {
+                uint8_t *endpoint = out;
+                out = Append(out, sizeof(SIEndpointDescriptor), kSIDescriptorTypeEndpoint);
+                endpoint[2] = (uint8_t)((e & 1 ? 0x80 : 0) | (e + 1));
+                endpoint[3] = (uint8_t)(2 + Random(2));
+                endpoint[4] = 0x00;
+                endpoint[5] = 0x02;
+
+                // SuperSpeed endpoint companion, or a class-specific endpoint.
+                if (Random(2) == 0)
+                    out = Append(out, 6, 0x30);
+                else if (Random(4) == 0)
+                    out = Append(out, 7, 0x25);
+            }
+        }
+    }
+
+    size_t length = (size_t)(out - start);
+    Append(start, sizeof(SIConfigDescriptor), kSIDescriptorTypeConfig);
+    start[2] = length & 0xff;
+    start[3] = (uint8_t)(length >> 8);
+    start[4] = numInterfaces;
+
+    if (Random(kMalformedEvery) == 0) {
+        switch (Random(3)) {
+        case 0: // Truncated part way through a descriptor.
+            length = sizeof(SIConfigDescriptor) + Random((uint32_t)(length - sizeof(SIConfigDescriptor)));
+            break;
+        case 1: // A zero length, which would loop forever if trusted.
+            start[sizeof(SIConfigDescriptor)] = 0;
+            break;
+        case 2: // A length running off the end.
+            start[sizeof(SIConfigDescriptor)] = 0xff;
+            break;
+        }
+    }
+
+    return (Blob) { start, length };
+}
+
+static double Seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+int main(void)
+{
+    static Blob corpus[kCorpusSize];
+    size_t totalBytes = 0;
+    for (int i = 0; i < kCorpusSize; ++i) {
+        corpus[i] = MakeBlob();
+        totalBytes += corpus[i].length;
+    }
+
+    printf("Corpus: %d descriptor sets, %zu bytes (%zu average)\n\n", kCorpusSize, totalBytes,
+        totalBytes / kCorpusSize);
+
+    // Everything: count descriptors of each kind, as a tool like Inspect would.
+    uint64_t descriptors = 0, malformed = 0;
+    double start = Seconds();
+    for (int round = 0; round < kRounds; ++round) {
+        for (int i = 0; i < kCorpusSize; ++i) {
+            SIDescriptorIterator it;
+            SIDescriptorIteratorInit(&it, corpus[i].data, corpus[i].length);
+            while (SIDescriptorIteratorNext(&it))
+                descriptors++;
+            malformed += it.status != kIOReturnSuccess;
+        }
+    }
+    double elapsed = Seconds() - start;
+    double sets = (double)kCorpusSize * kRounds;
+    printf("%-24s %7.1f ns/set  %7.2f ns/descriptor  %8.0f MB/s\n", "all descriptors", elapsed * 1e9 / sets,
+        elapsed * 1e9 / (double)descriptors, (double)totalBytes * kRounds / elapsed / 1e6);
+
+    // Interfaces and their endpoints only, as pipe table setup would.
+    uint64_t endpoints = 0;
+    start = Seconds();
+    for (int round = 0; round < kRounds; ++round) {
+        for (int i = 0; i < kCorpusSize; ++i) {
+            SIDescriptorIterator it;
+            SIDescriptorIteratorInit(&it, corpus[i].data, corpus[i].length);
+            while (SIDescriptorIteratorNextInterface(&it)) {
+                while (SIDescriptorIteratorNextEndpoint(&it))
+                    endpoints++;
+            }
+        }
+    }
+    elapsed = Seconds() - start;
+    printf("%-24s %7.1f ns/set  %7.2f ns/endpoint    %8.0f MB/s\n", "interfaces & endpoints",
+        elapsed * 1e9 / sets, elapsed * 1e9 / (double)endpoints, (double)totalBytes * kRounds / elapsed / 1e6);
+
+    printf("\n%.0f%% of sets malformed; %.1f descriptors and %.1f endpoints per set\n",
+        100.0 * (double)malformed / sets, (double)descriptors / sets, (double)endpoints / sets);
+
+    for (int i = 0; i < kCorpusSize; ++i)
+        free(corpus[i].data);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,188 @@
+// Measures enumeration over synthetic sysfs trees of growing size. Each
+// device gets the attributes the kernel provides (descriptors, busnum,
+// devnum, speed, and usually serial) plus interface directories alongside,
+// which enumeration has to skip.
+
+#define _XOPEN_SOURCE 700 // For nftw.
+
+#include "SimpleIOUSB.h"
+
+#include <fcntl.h>
+#include <ftw.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define kRounds 20
+#define kDevicesPerBus 100
+#define kInterfacesPerDevice 2
+
+static double Seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void WriteFile(char const *dir, char const *name, void const *data, size_t length)
+{
+    char path[0x400];
+    if (snprintf(path, sizeof(path), "%s/%s", dir, name) >= (int)sizeof(path)) {
+        fprintf(stderr, "Path too long: %s/%s\n", dir, name);
+        exit(EXIT_FAILURE);
+    }
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || write(fd, data, length) != (ssize_t)length) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+}
+
+static void WriteString(char const *dir, char const *name, char const *value)
+{
+    char line[0x100];
+    int length = snprintf(line, sizeof(line), "%s\n", value);
+    WriteFile(dir, name, line, (size_t)length);
+}
+
+static void MakeDevice(char const *root, char const *name, unsigned bus, unsigned dev, uint16_t vendorID,
+    uint16_t productID)
+{
+    char dir[0x400], value[0x40];
+    snprintf(dir, sizeof(dir), "%s/bus/usb/devices/%s", root, name);
+    mkdir(dir, 0755);
+
+    uint8_t desc[18 + 9 + kInterfacesPerDevice * (9 + 2 * 7)] = { 0 };
+    SIDeviceDescriptor *device = (SIDeviceDescriptor *)desc;
+    device->bLength = sizeof(SIDeviceDescriptor);
+    device->bDescriptorType = kSIDescriptorTypeDevice;
+    device->bcdUSB = 0x200;
+    device->idVendor = vendorID;
+    device->idProduct = productID;
+    device->bNumConfigurations = 1;
+
+    uint8_t *out = desc + sizeof(SIDeviceDescriptor);
+    uint16_t total = (uint16_t)(sizeof(desc) - sizeof(SIDeviceDescriptor));
+    uint8_t config[] = { 9, kSIDescriptorTypeConfig, (uint8_t)total, (uint8_t)(total >> 8), kInterfacesPerDevice, 1, 0, 0x80, 250 };
+    memcpy(out, config, sizeof(config));
+    out += sizeof(config);
+
+    for (uint8_t i = 0; i < kInterfacesPerDevice; ++i) {
+        uint8_t interface[] = { 9, kSIDescriptorTypeInterface, i, 0, 2, 0xff, 0, 0, 0 };
+        uint8_t endpoints[] = {
+            7, kSIDescriptorTypeEndpoint, (uint8_t)(i * 2 + 1), 2, 0, 2, 0,
+            7, kSIDescriptorTypeEndpoint, (uint8_t)(0x80 | (i * 2 + 2)), 2, 0, 2, 0,
+        };
+        memcpy(out, interface, sizeof(interface));
+        memcpy(out + sizeof(interface), endpoints, sizeof(endpoints));
+        out += sizeof(interface) + sizeof(endpoints);
+    }
+
+    WriteFile(dir, "descriptors", desc, sizeof(desc));
+    snprintf(value, sizeof(value), "%u", bus);
+    WriteString(dir, "busnum", value);
+    snprintf(value, sizeof(value), "%u", dev);
+    WriteString(dir, "devnum", value);
+    WriteString(dir, "speed", "480");
+    if (dev % 4) {
+        snprintf(value, sizeof(value), "SERIAL%04x%04x", bus, dev);
+        WriteString(dir, "serial", value);
+    }
+
+    for (unsigned i = 0; i < kInterfacesPerDevice; ++i) {
+        char interface[0x400];
+        snprintf(interface, sizeof(interface), "%s/bus/usb/devices/%s:1.%u", root, name, i);
+        mkdir(interface, 0755);
+        WriteString(interface, "bInterfaceClass", "ff");
+    }
+}
+
+static void MakeTree(char const *root, unsigned numDevices)
+{
+    char dir[0x400];
+    snprintf(dir, sizeof(dir), "%s/bus", root);
+    mkdir(dir, 0755);
+    snprintf(dir, sizeof(dir), "%s/bus/usb", root);
+    mkdir(dir, 0755);
+    snprintf(dir, sizeof(dir), "%s/bus/usb/devices", root);
+    mkdir(dir, 0755);
+
+    // A root hub per bus, with devices hanging off chains of hubs.
+    for (unsigned created = 0, bus = 1; created < numDevices; ++bus) {
+        char name[0x40];
+        snprintf(name, sizeof(name), "usb%u", bus);
+        MakeDevice(root, name, bus, 1, 0x1d6b, 0x0002);
+        created++;
+
+        for (unsigned dev = 2; dev <= kDevicesPerBus && created < numDevices; ++dev, ++created) {
+            snprintf(name, sizeof(name), "%u-%u.%u", bus, 1 + (dev - 2) / 7, 1 + (dev - 2) % 7);
+            MakeDevice(root, name, bus, dev, (uint16_t)(0x1000 + created % 64), (uint16_t)created);
+        }
+    }
+}
+
+static int RemoveEntry(char const *path, struct stat const *st, int flag, struct FTW *ftw)
+{
+    (void)st;
+    (void)flag;
+    (void)ftw;
+    return remove(path);
+}
+
+static double TimeEnumeration(char const *root, SIFilterSet const *filters, size_t *numFound)
+{
+    double best = 1e9;
+    for (int round = 0; round < kRounds; ++round) {
+        SIDeviceList *list = NULL;
+        double start = Seconds();
+        IOReturn ret = SIEnumerateAt(root, filters, &list);
+        double elapsed = Seconds() - start;
+        if (ret != kIOReturnSuccess) {
+            fprintf(stderr, "Enumeration failed. (%#x)\n", ret);
+            exit(EXIT_FAILURE);
+        }
+
+        *numFound = list->numDevices;
+        SIDeviceListDestroy(list);
+        if (elapsed < best)
+            best = elapsed;
+    }
+
+    return best;
+}
+
+int main(void)
+{
+    static unsigned const kSizes[] = { 100, 1000, 4000 };
+
+    // Filter for a single vendor: about one device in 64.
+    SIFilterSet *filters = SIFilterSetCreate();
+    SIFilter filter = { .vendorID = 0x1000, .flags = kSIFilterAnyProduct };
+    SIFilterSetAdd(filters, &filter);
+
+    puts("devices     all ms   us/device   filtered ms   us/device   found");
+    for (size_t i = 0; i < sizeof(kSizes) / sizeof(kSizes[0]); ++i) {
+        char root[] = "/tmp/si-sysfs-XXXXXX";
+        if (!mkdtemp(root)) {
+            perror("mkdtemp");
+            return EXIT_FAILURE;
+        }
+        MakeTree(root, kSizes[i]);
+
+        size_t all = 0, found = 0;
+        double allTime = TimeEnumeration(root, NULL, &all);
+        double filteredTime = TimeEnumeration(root, filters, &found);
+        printf("%7zu %10.2f %11.2f %13.2f %11.2f %7zu\n", all, allTime * 1e3, allTime * 1e6 / (double)all,
+            filteredTime * 1e3, filteredTime * 1e6 / (double)all, found);
+
+        nftw(root, RemoveEntry, 16, FTW_DEPTH | FTW_PHYS);
+    }
+
+    SIFilterSetDestroy(filters);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,101 @@
+// Measures the cost of matching a hotplug event against filter sets of
+// growing size, next to the linear scan over a filter list that it replaces.
+// Events are a mix of matching and non-matching devices, as on a busy hub.
+
+#include "SimpleIOUSB.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define kEvents 1000000
+#define kFiltersMax 10000
+
+static uint32_t sRandomState = 0x2545f491;
+
+static uint32_t Random(uint32_t bound)
+{
+    // xorshift32; deterministic so runs are comparable.
+    sRandomState ^= sRandomState << 13;
+    sRandomState ^= sRandomState >> 17;
+    sRandomState ^= sRandomState << 5;
+    return sRandomState % bound;
+}
+
+static double Seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+typedef struct {
+    uint16_t vendorID;
+    uint16_t productID;
+} Event;
+
+static SIFilter sFilters[kFiltersMax];
+static Event sEvents[kEvents];
+
+static int ScanMatch(size_t numFilters, uint16_t vendorID, uint16_t productID)
+{
+    for (size_t i = 0; i < numFilters; ++i)
+        if (sFilters[i].vendorID == vendorID
+            && ((sFilters[i].flags & kSIFilterAnyProduct) || sFilters[i].productID == productID))
+            return 1;
+    return 0;
+}
+
+int main(void)
+{
+    for (size_t i = 0; i < kFiltersMax; ++i) {
+        sFilters[i] = (SIFilter) {
+            .vendorID = (uint16_t)(0x1000 + Random(0x100)),
+            .productID = (uint16_t)Random(0x10000),
+            .flags = Random(16) == 0 ? kSIFilterAnyProduct : 0,
+        };
+    }
+
+    puts("filters       set ns/event      scan ns/event   matched");
+
+    for (size_t numFilters = 1; numFilters <= kFiltersMax; numFilters *= 10) {
+        SIFilterSet *set = SIFilterSetCreate();
+        for (size_t i = 0; i < numFilters; ++i)
+            SIFilterSetAdd(set, &sFilters[i]);
+
+        // Half the events are for filtered devices.
+        for (size_t i = 0; i < kEvents; ++i) {
+            if (Random(2)) {
+                SIFilter const *filter = &sFilters[Random((uint32_t)numFilters)];
+                sEvents[i] = (Event) { filter->vendorID, filter->productID };
+            } else {
+                sEvents[i] = (Event) { (uint16_t)(0x2000 + Random(0x100)), (uint16_t)Random(0x10000) };
+            }
+        }
+
+        size_t matched = 0;
+        double start = Seconds();
+        for (size_t i = 0; i < kEvents; ++i)
+            matched += (size_t)SIFilterSetMatch(set, sEvents[i].vendorID, sEvents[i].productID, NULL, 0, NULL);
+        double setTime = Seconds() - start;
+
+        // The linear scan gets slow quickly; sample fewer events for it.
+        size_t scanEvents = numFilters >= 1000 ? kEvents / 100 : kEvents;
+        size_t scanMatched = 0;
+        start = Seconds();
+        for (size_t i = 0; i < scanEvents; ++i)
+            scanMatched += (size_t)ScanMatch(numFilters, sEvents[i].vendorID, sEvents[i].productID);
+        double scanTime = Seconds() - start;
+
+        printf("%7zu %16.1f %18.1f %9zu\n", numFilters, setTime * 1e9 / kEvents, scanTime * 1e9 / (double)scanEvents,
+            matched);
+        if (scanEvents == kEvents && scanMatched != matched) {
+            fprintf(stderr, "Set and scan disagree! (%zu vs %zu)\n", matched, scanMatched);
+            return EXIT_FAILURE;
+        }
+
+        SIFilterSetDestroy(set);
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,181 @@
+// Measures servicing a rack's worth of devices at once, comparing a thread
+// per device against a client pool with one worker per CPU. Each device
+// keeps a few reads in flight, resubmitted from their callbacks.
+
+#include "SimpleIOUSB.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#define kNumDevices 256
+#define kReadsInFlight 4
+#define kReadSize 512
+#define kSeconds 2
+
+// Interrupt-like pacing; devices in a rack mostly sit idle between reports.
+#define kPipeLatencyUs 10000
+
+static uint8_t const kConfigDesc[] = {
+    9, kSIDescriptorTypeConfig, 25, 0, 1, 1, 0, 0x80, 250,
+    9, kSIDescriptorTypeInterface, 0, 0, 1, 0xff, 0xff, 0xff, 0,
+    7, kSIDescriptorTypeEndpoint, 0x81, 0x02, 0x00, 0x02, 0,
+};
+
+typedef struct {
+    SIClient *client;
+    SITransfer *reads[kReadsInFlight];
+    uint8_t buffers[kReadsInFlight][kReadSize];
+    uint64_t completed;
+    int stopping;
+    pthread_t thread;
+} Device;
+
+static Device sDevices[kNumDevices];
+
+static double Seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static double CPUSeconds(void)
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return (double)(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec)
+        + (double)(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+static void ReadCompleted(SITransfer *transfer)
+{
+    Device *device = transfer->context;
+    __atomic_fetch_add(&device->completed, 1, __ATOMIC_RELAXED);
+    if (transfer->result.error == kIOReturnSuccess && !__atomic_load_n(&device->stopping, __ATOMIC_ACQUIRE))
+        SISubmitTransfer(transfer);
+}
+
+static void StartReads(void *context)
+{
+    Device *device = context;
+    for (int i = 0; i < kReadsInFlight; ++i)
+        SISubmitTransfer(device->reads[i]);
+}
+
+static void *ServiceDevice(void *context)
+{
+    Device *device = context;
+    StartReads(device);
+    while (!__atomic_load_n(&device->stopping, __ATOMIC_ACQUIRE))
+        SIHandleEvents(device->client, 100);
+    return NULL;
+}
+
+/// Stop resubmitting and wait for every read to come back.
+static void Drain(void)
+{
+    for (int i = 0; i < kNumDevices; ++i)
+        __atomic_store_n(&sDevices[i].stopping, 1, __ATOMIC_RELEASE);
+    usleep(kPipeLatencyUs * 10);
+}
+
+static uint64_t TotalCompleted(void)
+{
+    uint64_t total = 0;
+    for (int i = 0; i < kNumDevices; ++i)
+        total += __atomic_exchange_n(&sDevices[i].completed, 0, __ATOMIC_RELAXED);
+    return total;
+}
+
+static void Report(char const *name, uint64_t transfers, double elapsed, double cpu)
+{
+    printf("%-24s %9.0f transfers/s  %6.2f CPU s per million\n", name, (double)transfers / elapsed,
+        cpu * 1e6 / (double)transfers);
+}
+
+int main(void)
+{
+    static SISimDevice *sims[kNumDevices];
+    for (int i = 0; i < kNumDevices; ++i) {
+        SIDeviceDescriptor desc = {
+            .bLength = sizeof(SIDeviceDescriptor),
+            .bDescriptorType = kSIDescriptorTypeDevice,
+            .bcdUSB = 0x200,
+            .bMaxPacketSize = 64,
+            .idVendor = 0x5ac,
+            .idProduct = (uint16_t)(0x1000 + i),
+            .bNumConfigurations = 1,
+        };
+
+        sims[i] = SISimDeviceCreate(&desc);
+        SISimDeviceAddConfig(sims[i], kConfigDesc, sizeof(kConfigDesc));
+
+        SISimPipeConfig pipe = { .latencyUs = kPipeLatencyUs, .flags = kSISimPipeAutofill };
+        SISimDeviceConfigurePipe(sims[i], 1, &pipe);
+        SISimDeviceAttach(sims[i]);
+
+        Device *device = &sDevices[i];
+        device->client = SIClientCreateWithBackend(&kSIBackendSimulated);
+        IOReturn ret = SIConnect(device->client, desc.idVendor, desc.idProduct);
+        if (ret != kIOReturnSuccess) {
+            fprintf(stderr, "Failed to connect to device %d. (%#x)\n", i, ret);
+            return EXIT_FAILURE;
+        }
+
+        SISetPipeQueueDepth(device->client, 1, kReadsInFlight);
+        for (int j = 0; j < kReadsInFlight; ++j)
+            device->reads[j] = SITransferCreate(device->client, 1, device->buffers[j], kReadSize, ReadCompleted, device);
+    }
+
+    printf("%d devices, %d reads in flight each, %d us latency:\n", kNumDevices, kReadsInFlight, kPipeLatencyUs);
+
+    double start = Seconds(), cpuStart = CPUSeconds();
+    for (int i = 0; i < kNumDevices; ++i)
+        pthread_create(&sDevices[i].thread, NULL, ServiceDevice, &sDevices[i]);
+    sleep(kSeconds);
+    uint64_t transfers = TotalCompleted();
+    double elapsed = Seconds() - start, cpu = CPUSeconds() - cpuStart;
+    Drain();
+    for (int i = 0; i < kNumDevices; ++i)
+        pthread_join(sDevices[i].thread, NULL);
+    Report("thread per device", transfers, elapsed, cpu);
+
+    for (int i = 0; i < kNumDevices; ++i)
+        sDevices[i].stopping = 0;
+    TotalCompleted();
+
+    SIClientPool *pool = NULL;
+    SIClientPoolConfig config = { .flags = kSIClientPoolPinWorkers };
+    IOReturn ret = SIClientPoolCreate(&config, &pool);
+    if (ret != kIOReturnSuccess) {
+        fprintf(stderr, "Failed to create pool. (%#x)\n", ret);
+        return EXIT_FAILURE;
+    }
+
+    start = Seconds();
+    cpuStart = CPUSeconds();
+    for (int i = 0; i < kNumDevices; ++i) {
+        SIClientPoolAdd(pool, sDevices[i].client);
+        SIClientPoolDispatch(pool, sDevices[i].client, StartReads, &sDevices[i]);
+    }
+    sleep(kSeconds);
+    transfers = TotalCompleted();
+    elapsed = Seconds() - start;
+    cpu = CPUSeconds() - cpuStart;
+    Drain();
+    Report("client pool", transfers, elapsed, cpu);
+
+    SIClientPoolDestroy(pool);
+    for (int i = 0; i < kNumDevices; ++i) {
+        SIClientDestroy(sDevices[i].client);
+        for (int j = 0; j < kReadsInFlight; ++j)
+            SITransferDestroy(sDevices[i].reads[j]);
+        SISimDeviceDestroy(sims[i]);
+    }
+
+    return EXIT_SUCCESS;
+}
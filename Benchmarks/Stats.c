@@ -0,0 +1,195 @@
+// Measures what the per-pipe counters add to each kind of call, by running
+// the same calls with them on and off against a backend which completes
+// everything immediately. Also times taking a snapshot, and the calls again
+// while another thread polls snapshots as fast as it can.
+
+#include "SimpleIOUSB.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define kIterations 2000000
+#define kSnapshots 100000
+
+static int sHandle;
+
+static IOReturn NullConnect(SIClient *client, uint16_t vendorID, uint16_t productID)
+{
+    (void)vendorID;
+    (void)productID;
+
+    client->handle = &sHandle;
+    return kIOReturnSuccess;
+}
+
+static void NullDisconnect(SIClient *client)
+{
+    client->handle = NULL;
+}
+
+static IOReturn NullReadPipe(SIClient *client, uint8_t pipe, void *buffer, uint32_t *bufSizeInOut)
+{
+    (void)client;
+    (void)pipe;
+    (void)buffer;
+    (void)bufSizeInOut;
+
+    return kIOReturnSuccess;
+}
+
+static IOReturn NullAbortPipe(SIClient *client, uint8_t pipe)
+{
+    (void)client;
+    (void)pipe;
+
+    return kIOReturnSuccess;
+}
+
+static SITransferResult NullControlTransfer(SIClient *client, uint8_t requestType, uint8_t request,
+    uint16_t value, uint16_t index, void *data, size_t length)
+{
+    (void)client;
+    (void)requestType;
+    (void)request;
+    (void)value;
+    (void)index;
+    (void)data;
+
+    return (SITransferResult) { .error = kIOReturnSuccess, .length = (uint32_t)length };
+}
+
+static IOReturn NullSubmitTransfer(SITransfer *transfer)
+{
+    transfer->result = (SITransferResult) { .error = kIOReturnSuccess, .length = transfer->length };
+    SITransferCompleted(transfer);
+    return kIOReturnSuccess;
+}
+
+static IOReturn NullHandleEvents(SIClient *client, int timeoutMs)
+{
+    (void)client;
+    (void)timeoutMs;
+
+    return kIOReturnSuccess;
+}
+
+static SIBackend const kNullBackend = {
+    .name = "null",
+    .connect = NullConnect,
+    .disconnect = NullDisconnect,
+    .readPipe = NullReadPipe,
+    .abortPipe = NullAbortPipe,
+    .controlTransfer = NullControlTransfer,
+    .submitTransfer = NullSubmitTransfer,
+    .handleEvents = NullHandleEvents,
+};
+
+static double Seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void Completed(SITransfer *transfer)
+{
+    (void)transfer;
+}
+
+static double RunAsync(SIClient *client)
+{
+    static uint8_t buffer[512];
+    SITransfer transfer;
+    SITransferInit(&transfer, client, 1, buffer, sizeof(buffer), Completed, NULL);
+
+    double start = Seconds();
+    for (int i = 0; i < kIterations; ++i)
+        SISubmitTransfer(&transfer);
+    return (Seconds() - start) * 1e9 / kIterations;
+}
+
+static double RunRead(SIClient *client)
+{
+    static uint8_t buffer[512];
+
+    double start = Seconds();
+    for (int i = 0; i < kIterations; ++i) {
+        uint32_t size = sizeof(buffer);
+        SIReadPipe(client, 1, buffer, &size);
+    }
+    return (Seconds() - start) * 1e9 / kIterations;
+}
+
+static double RunControl(SIClient *client)
+{
+    uint8_t reply[18];
+
+    double start = Seconds();
+    for (int i = 0; i < kIterations; ++i)
+        SIControlTransfer(client, kSIDirectionToHost | kSITypeVendor | kSIRecipientDevice, 0x42, 0, 0, reply,
+            sizeof(reply));
+    return (Seconds() - start) * 1e9 / kIterations;
+}
+
+static int sPolling;
+
+static void *Poll(void *context)
+{
+    SIClient *client = context;
+    SIStats *stats = malloc(sizeof(SIStats));
+    while (__atomic_load_n(&sPolling, __ATOMIC_RELAXED))
+        SIGetStats(client, stats);
+
+    free(stats);
+    return NULL;
+}
+
+int main(void)
+{
+    SIClient *client = SIClientCreateWithBackend(&kNullBackend);
+    if (SIConnect(client, 0, 0) != kIOReturnSuccess)
+        return EXIT_FAILURE;
+
+    static struct {
+        char const *name;
+        double (*run)(SIClient *client);
+    } const kRuns[] = {
+        { "async transfer", RunAsync },
+        { "SIReadPipe", RunRead },
+        { "SIControlTransfer", RunControl },
+    };
+
+    printf("%-18s %10s %10s %10s %12s\n", "", "off (ns)", "on (ns)", "added", "on, polled");
+    for (size_t i = 0; i < sizeof(kRuns) / sizeof(kRuns[0]); ++i) {
+        SISetStatsEnabled(client, 0);
+        double off = kRuns[i].run(client);
+        SISetStatsEnabled(client, 1);
+        double on = kRuns[i].run(client);
+
+        pthread_t poller;
+        sPolling = 1;
+        pthread_create(&poller, NULL, Poll, client);
+        double polled = kRuns[i].run(client);
+        __atomic_store_n(&sPolling, 0, __ATOMIC_RELAXED);
+        pthread_join(poller, NULL);
+
+        printf("%-18s %10.1f %10.1f %10.1f %12.1f\n", kRuns[i].name, off, on, on - off, polled);
+    }
+
+    SIStats *stats = malloc(sizeof(SIStats));
+    double start = Seconds();
+    for (int i = 0; i < kSnapshots; ++i)
+        SIGetStats(client, stats);
+    printf("SIGetStats: %.1f ns per snapshot\n", (Seconds() - start) * 1e9 / kSnapshots);
+
+    SIHistogram const *control = &stats->control[kSITypeVendor >> 5].latency;
+    printf("Vendor requests: %llu, p50 %llu ns, p99 %llu ns\n", (unsigned long long)control->count,
+        (unsigned long long)SIHistogramPercentileNs(control, 50),
+        (unsigned long long)SIHistogramPercentileNs(control, 99));
+
+    free(stats);
+    SIClientDestroy(client);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,149 @@
+// Measures transfer submission as the number of submitting threads grows,
+// first with each thread on a pipe of its own and then with all of them
+// sharing one. The backend completes every transfer as soon as it's
+// submitted, so all that's left to measure is the library's own queueing.
+
+#include "SimpleIOUSB.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define kMaxThreads 8
+#define kTransfersPerThread 1000000
+#define kSharedDepth 4
+
+static int sHandle;
+
+static IOReturn NullConnect(SIClient *client, uint16_t vendorID, uint16_t productID)
+{
+    (void)vendorID;
+    (void)productID;
+
+    client->handle = &sHandle;
+    return kIOReturnSuccess;
+}
+
+static void NullDisconnect(SIClient *client)
+{
+    client->handle = NULL;
+}
+
+static IOReturn NullAbortPipe(SIClient *client, uint8_t pipe)
+{
+    (void)client;
+    (void)pipe;
+
+    return kIOReturnSuccess;
+}
+
+static IOReturn NullSubmitTransfer(SITransfer *transfer)
+{
+    transfer->result = (SITransferResult) { .error = kIOReturnSuccess, .length = transfer->length };
+    SITransferCompleted(transfer);
+    return kIOReturnSuccess;
+}
+
+static IOReturn NullHandleEvents(SIClient *client, int timeoutMs)
+{
+    (void)client;
+    (void)timeoutMs;
+
+    return kIOReturnSuccess;
+}
+
+static SIBackend const kNullBackend = {
+    .name = "null",
+    .connect = NullConnect,
+    .disconnect = NullDisconnect,
+    .abortPipe = NullAbortPipe,
+    .submitTransfer = NullSubmitTransfer,
+    .handleEvents = NullHandleEvents,
+};
+
+typedef struct {
+    SIClient *client;
+    uint8_t pipe;
+    uint8_t buffer[64];
+    int done;
+    pthread_t thread;
+} Submitter;
+
+static void TransferCompleted(SITransfer *transfer)
+{
+    Submitter *submitter = transfer->context;
+    __atomic_store_n(&submitter->done, 1, __ATOMIC_RELEASE);
+}
+
+static void *Submit(void *context)
+{
+    Submitter *submitter = context;
+    SITransfer transfer;
+    SITransferInit(&transfer, submitter->client, submitter->pipe, submitter->buffer,
+        sizeof(submitter->buffer), TransferCompleted, submitter);
+
+    // On a shared pipe, the transfer may have to wait for another thread's
+    // completion to start it.
+    for (int i = 0; i < kTransfersPerThread; ++i) {
+        __atomic_store_n(&submitter->done, 0, __ATOMIC_RELAXED);
+        if (SISubmitTransfer(&transfer) != kIOReturnSuccess)
+            abort();
+        while (!__atomic_load_n(&submitter->done, __ATOMIC_ACQUIRE))
+            sched_yield();
+    }
+
+    return NULL;
+}
+
+static double Seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void Run(SIClient *client, char const *name, int numThreads, int shared)
+{
+    static Submitter submitters[kMaxThreads];
+
+    double start = Seconds();
+    for (int i = 0; i < numThreads; ++i) {
+        submitters[i] = (Submitter) {
+            .client = client,
+            .pipe = (uint8_t)(shared ? 1 : 1 + i % (kSIPipesMax - 1)),
+        };
+        pthread_create(&submitters[i].thread, NULL, Submit, &submitters[i]);
+    }
+    for (int i = 0; i < numThreads; ++i)
+        pthread_join(submitters[i].thread, NULL);
+    double elapsed = Seconds() - start;
+
+    double transfers = (double)numThreads * kTransfersPerThread;
+    printf("%-16s %d thread(s)  %11.0f transfers/s  %6.1f ns per transfer per thread\n", name, numThreads,
+        transfers / elapsed, elapsed * 1e9 / kTransfersPerThread);
+}
+
+int main(void)
+{
+    SIClient *client = SIClientCreateWithBackend(&kNullBackend);
+    if (SIConnect(client, 0, 0) != kIOReturnSuccess)
+        return EXIT_FAILURE;
+
+    // Enough depth that no thread waits on its own pipe.
+    for (uint8_t pipe = 1; pipe < kSIPipesMax; ++pipe)
+        SISetPipeQueueDepth(client, pipe, kMaxThreads);
+
+    for (int numThreads = 1; numThreads < kSIPipesMax; numThreads *= 2)
+        Run(client, "separate pipes", numThreads, 0);
+    Run(client, "separate pipes", kSIPipesMax - 1, 0);
+
+    // Fewer slots than threads, so some transfers always wait their turn.
+    SISetPipeQueueDepth(client, 1, kSharedDepth);
+    for (int numThreads = 1; numThreads <= kMaxThreads; numThreads *= 2)
+        Run(client, "shared pipe", numThreads, 1);
+
+    SIClientDestroy(client);
+    return EXIT_SUCCESS;
+}
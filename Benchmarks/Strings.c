@@ -0,0 +1,186 @@
+// Measures string retrieval the way an inventory scan does it: connect,
+// read the device's strings, move on. Compares one control transfer and
+// allocation per string against a single batched string table, and times
+// UTF-16 decoding on its own.
+
+#include "SimpleIOUSB.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define kScans 200
+#define kDecodes 1000000
+
+// Control transfer turnaround on a typical full-speed hub chain.
+#define kControlLatencyUs 125
+
+static SIDeviceDescriptor const kDeviceDesc = {
+    .bLength = sizeof(SIDeviceDescriptor),
+    .bDescriptorType = kSIDescriptorTypeDevice,
+    .bcdUSB = 0x200,
+    .bMaxPacketSize = 64,
+    .idVendor = 0x5ac,
+    .idProduct = 0x1281,
+    .iManufacturer = 1,
+    .iProduct = 2,
+    .iSerialNumber = 3,
+    .bNumConfigurations = 1,
+};
+
+// A composite device: two functions, each with its own interface string.
+static uint8_t const kConfigDesc[] = {
+    9, kSIDescriptorTypeConfig, 53, 0, 3, 1, 4, 0x80, 250,
+    8, kSIDescriptorTypeInterfaceAssociation, 0, 2, 0x02, 0x02, 0x01, 5,
+    9, kSIDescriptorTypeInterface, 0, 0, 1, 0x02, 0x02, 0x01, 6,
+    7, kSIDescriptorTypeEndpoint, 0x83, 0x03, 0x10, 0x00, 9,
+    9, kSIDescriptorTypeInterface, 1, 0, 0, 0x0a, 0x00, 0x00, 7,
+    9, kSIDescriptorTypeInterface, 2, 0, 1, 0xff, 0xff, 0xff, 8,
+    2, 0x24,
+};
+
+static char const *const kStrings[] = {
+    NULL,
+    "Apple Inc.",
+    "Apple Mobile Device (Recovery Mode)",
+    "CPID:8103 CPRV:11 CPFM:03 SCEP:01 BDID:0C ECID:001A2B3C4D5E6F70 IBFL:3C SRTG:[iBoot-7429.61.2]",
+    "Default",
+    "Serial Function",
+    "Serial Control",
+    "Serial Data",
+    "Recovery Mode Interface",
+};
+
+#define kNumStrings (sizeof(kStrings) / sizeof(kStrings[0]))
+
+static double Seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/// Fetch each string with its own request, as callers used to.
+static IOReturn ScanSerially(SIClient *client)
+{
+    for (uint8_t i = 1; i < kNumStrings; ++i) {
+        SIStringDescriptorBuffer desc;
+        SITransferResult result = SIGetDescriptor(client, kSIDescriptorTypeString, i, &desc, sizeof(desc));
+        if (result.error != kIOReturnSuccess)
+            return result.error;
+
+        char *string = malloc(0x100);
+        if (!SIDecodeStringDescriptor((SIStringDescriptor *)desc, string, 0x100)) {
+            free(string);
+            return kIOReturnBadArgument;
+        }
+        free(string);
+    }
+
+    return kIOReturnSuccess;
+}
+
+static IOReturn ScanTable(SIClient *client)
+{
+    SIStringTable const *table = NULL;
+    return SIGetStringTable(client, &table);
+}
+
+static void BenchmarkScan(SIClient *client, char const *name, IOReturn (*scan)(SIClient *))
+{
+    double start = Seconds();
+    for (int i = 0; i < kScans; ++i) {
+        // Every scan starts from a freshly connected client.
+        SIInvalidateDescriptors(client);
+
+        SIDeviceDescriptor const *device = NULL;
+        IOReturn ret = SIGetDeviceDescriptor(client, &device);
+        if (ret == kIOReturnSuccess)
+            ret = scan(client);
+        if (ret != kIOReturnSuccess) {
+            fprintf(stderr, "%s failed. (%#x)\n", name, ret);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    double elapsed = Seconds() - start;
+    printf("%-28s %8.1f us/device\n", name, elapsed * 1e6 / kScans);
+}
+
+static void BenchmarkDecode(char const *name, char const *string)
+{
+    // Encode once, the same way a device would.
+    SIStringDescriptorBuffer desc = { 0 };
+    size_t units = 0;
+    for (uint8_t const *s = (uint8_t const *)string; *s && units < 126;) {
+        uint32_t cp = *s++;
+        if (cp >= 0xc0) {
+            int extra = cp >= 0xf0 ? 3 : cp >= 0xe0 ? 2 : 1;
+            cp &= 0x3f >> extra;
+            while (extra--)
+                cp = cp << 6 | (*s++ & 0x3f);
+        }
+        if (cp >= 0x10000) {
+            cp -= 0x10000;
+            desc[2 + units * 2] = (uint8_t)(0xd800 | cp >> 10);
+            desc[3 + units * 2] = (uint8_t)((0xd800 | cp >> 10) >> 8);
+            units++;
+            cp = 0xdc00 | (cp & 0x3ff);
+        }
+        desc[2 + units * 2] = cp & 0xff;
+        desc[3 + units * 2] = (uint8_t)(cp >> 8);
+        units++;
+    }
+    desc[0] = (uint8_t)(2 + units * 2);
+    desc[1] = kSIDescriptorTypeString;
+
+    char out[0x200];
+    size_t bytes = 0;
+    double start = Seconds();
+    for (int i = 0; i < kDecodes; ++i)
+        bytes += (size_t)SIDecodeStringDescriptor((SIStringDescriptor *)desc, out, sizeof(out));
+    double elapsed = Seconds() - start;
+
+    if (strcmp(out, string) != 0) {
+        fprintf(stderr, "Decoding \"%s\" gave \"%s\".\n", string, out);
+        exit(EXIT_FAILURE);
+    }
+
+    printf("%-28s %8.1f ns/string %6.2f ns/unit\n", name, elapsed * 1e9 / kDecodes,
+        elapsed * 1e9 / kDecodes / (double)units);
+    (void)bytes;
+}
+
+int main(void)
+{
+    SISimDevice *device = SISimDeviceCreate(&kDeviceDesc);
+    SISimDeviceAddConfig(device, kConfigDesc, sizeof(kConfigDesc));
+    for (uint8_t i = 1; i < kNumStrings; ++i)
+        SISimDeviceSetString(device, i, kStrings[i]);
+
+    SISimPipeConfig control = { .latencyUs = kControlLatencyUs };
+    SISimDeviceConfigurePipe(device, 0, &control);
+    SISimDeviceAttach(device);
+
+    SIClient *client = SIClientCreateWithBackend(&kSIBackendSimulated);
+    IOReturn ret = SIConnect(client, kDeviceDesc.idVendor, kDeviceDesc.idProduct);
+    if (ret != kIOReturnSuccess) {
+        fprintf(stderr, "Failed to connect. (%#x)\n", ret);
+        return EXIT_FAILURE;
+    }
+
+    printf("Scanning %zu strings, %d us control latency:\n", kNumStrings - 1, kControlLatencyUs);
+    BenchmarkScan(client, "one request per string", ScanSerially);
+    BenchmarkScan(client, "string table", ScanTable);
+
+    puts("\nDecoding:");
+    BenchmarkDecode("ASCII", kStrings[3]);
+    BenchmarkDecode("Latin-1", "Bürotechnik Größe Ärger Öl Straße Fräulein");
+    BenchmarkDecode("CJK", "株式会社アップルジャパン製品");
+    BenchmarkDecode("emoji", "Device 😀🚀 Pro");
+
+    SIClientDestroy(client);
+    SISimDeviceDestroy(device);
+    return EXIT_SUCCESS;
+}
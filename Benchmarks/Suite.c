@@ -0,0 +1,479 @@
+// Runs the library's headline measurements against an in-process simulated
+// device, so that they can be tracked from commit to commit: control
+// transfer round trips, bulk throughput across transfer sizes, descriptor
+// fetching and parsing, enumeration (on Linux, over a synthetic sysfs tree)
+// and connecting. A summary goes to stdout, and with '--json' the results
+// are also written to a file ('-' for stdout instead of the summary).
+//
+//     bench-suite [--quick] [--json <path>]
+
+#if defined(__linux__)
+#define _XOPEN_SOURCE 700 // For nftw.
+#endif
+
+#include "SimpleIOUSB.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/utsname.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <ftw.h>
+#endif
+
+#define kJSONVersion 1
+#define kResultsMax 32
+
+// Pipes of the simulated device: 1 is bulk OUT, 2 is bulk IN.
+#define kOutPipe 1
+#define kInPipe 2
+
+static SIDeviceDescriptor const kDeviceDesc = {
+    .bLength = sizeof(SIDeviceDescriptor),
+    .bDescriptorType = kSIDescriptorTypeDevice,
+    .bcdUSB = 0x200,
+    .bMaxPacketSize = 64,
+    .idVendor = 0x05ac,
+    .idProduct = 0x1281,
+    .iManufacturer = 1,
+    .iProduct = 2,
+    .iSerialNumber = 3,
+    .bNumConfigurations = 1,
+};
+
+static uint8_t const kConfigDesc[] = {
+    9, kSIDescriptorTypeConfig, 32, 0, 1, 1, 0, 0x80, 250,
+    9, kSIDescriptorTypeInterface, 0, 0, 2, 0xff, 0xff, 0xff, 0,
+    7, kSIDescriptorTypeEndpoint, 0x04, 0x02, 0x00, 0x02, 0,
+    7, kSIDescriptorTypeEndpoint, 0x85, 0x02, 0x00, 0x02, 0,
+};
+
+// One measurement; distributions fill in 'p50' and 'p99' as well.
+typedef struct {
+    char name[48];
+    char unit[8];
+    double value;
+    double p50;
+    double p99;
+    uint64_t iterations;
+    uint32_t size;
+    int distribution;
+} Result;
+
+static Result sResults[kResultsMax];
+static int sNumResults;
+static int sQuick;
+
+static uint64_t Now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static Result *AddResult(char const *name, char const *unit, uint32_t size)
+{
+    if (sNumResults == kResultsMax) {
+        fprintf(stderr, "Too many results.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    Result *result = &sResults[sNumResults++];
+    snprintf(result->name, sizeof(result->name), "%s", name);
+    snprintf(result->unit, sizeof(result->unit), "%s", unit);
+    result->size = size;
+    return result;
+}
+
+static int CompareSamples(void const *a, void const *b)
+{
+    uint64_t left = *(uint64_t const *)a, right = *(uint64_t const *)b;
+    return left < right ? -1 : left > right;
+}
+
+// Record a distribution of per-iteration times, in nanoseconds.
+static void AddDistribution(char const *name, uint64_t *samples, uint64_t count)
+{
+    qsort(samples, (size_t)count, sizeof(uint64_t), CompareSamples);
+
+    uint64_t total = 0;
+    for (uint64_t i = 0; i < count; ++i)
+        total += samples[i];
+
+    Result *result = AddResult(name, "ns", 0);
+    result->distribution = 1;
+    result->iterations = count;
+    result->value = (double)total / (double)count;
+    result->p50 = (double)samples[count / 2];
+    result->p99 = (double)samples[count * 99 / 100];
+}
+
+static SITransferResult HandleVendorRequest(void *context, uint8_t requestType, uint8_t request,
+    uint16_t value, uint16_t index, void *data, size_t length)
+{
+    (void)context;
+    (void)requestType;
+    (void)request;
+    (void)index;
+
+    size_t reply = length < sizeof(value) ? length : sizeof(value);
+    memcpy(data, &value, reply);
+    return (SITransferResult) { .error = kIOReturnSuccess, .length = (uint32_t)reply };
+}
+
+static SISimDevice *CreateDevice(void)
+{
+    SISimDevice *device = SISimDeviceCreate(&kDeviceDesc);
+    SISimDeviceAddConfig(device, kConfigDesc, sizeof(kConfigDesc));
+    SISimDeviceSetString(device, 1, "Apple Inc.");
+    SISimDeviceSetString(device, 2, "Apple Mobile Device (Recovery Mode)");
+    SISimDeviceSetString(device, 3, "CPID:8103 CPRV:11 SRTG:[iBoot-7429.61.2]");
+    SISimDeviceAddControlHandler(device, kSIDirectionToHost | kSITypeVendor | kSIRecipientDevice, 0x42,
+        HandleVendorRequest, NULL);
+
+    // Reads are answered at once, so the device never holds them up.
+    SISimDeviceConfigurePipe(device, kInPipe, &(SISimPipeConfig) { .flags = kSISimPipeAutofill });
+    SISimDeviceAttach(device);
+    return device;
+}
+
+static SIClient *Connect(void)
+{
+    SIClient *client = SIClientCreateWithBackend(&kSIBackendSimulated);
+    IOReturn ret = SIConnect(client, kDeviceDesc.idVendor, kDeviceDesc.idProduct);
+    if (ret != kIOReturnSuccess) {
+        fprintf(stderr, "Failed to connect. (%#x)\n", ret);
+        exit(EXIT_FAILURE);
+    }
+    return client;
+}
+
+static void RunControl(SIClient *client)
+{
+    uint64_t count = sQuick ? 20000 : 200000;
+    uint64_t *samples = malloc(count * sizeof(uint64_t));
+    uint16_t reply;
+
+    for (uint64_t i = 0; i < count; ++i) {
+        uint64_t start = Now();
+        SITransferResult result = SIControlTransfer(client, kSIDirectionToHost | kSITypeVendor | kSIRecipientDevice,
+            0x42, (uint16_t)i, 0, &reply, sizeof(reply));
+        samples[i] = Now() - start;
+        if (result.error != kIOReturnSuccess) {
+            fprintf(stderr, "Control transfer failed. (%#x)\n", result.error);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    AddDistribution("control_round_trip", samples, count);
+    free(samples);
+}
+
+static void RunBulk(SISimDevice *device, SIClient *client)
+{
+    static uint32_t const kSizes[] = { 64, 512, 4096, 65536, 1048576 };
+    uint64_t volume = sQuick ? (64ull << 20) : (512ull << 20);
+    uint8_t *buffer = calloc(1, kSizes[sizeof(kSizes) / sizeof(kSizes[0]) - 1]);
+    uint8_t *sink = malloc(kSizes[sizeof(kSizes) / sizeof(kSizes[0]) - 1]);
+
+    for (size_t i = 0; i < sizeof(kSizes) / sizeof(kSizes[0]); ++i) {
+        uint32_t size = kSizes[i];
+
+        // Small transfers are bound by the per-call cost, so there's no
+        // point moving the whole volume with them.
+        uint64_t count = volume / size;
+        if (count > (sQuick ? 50000u : 500000u))
+            count = sQuick ? 50000u : 500000u;
+
+        // The device takes each write as it arrives, as a real one would.
+        uint64_t start = Now();
+        for (uint64_t j = 0; j < count; ++j) {
+            uint32_t length = size;
+            if (SIWritePipe(client, kOutPipe, buffer, size) != kIOReturnSuccess
+                || SISimDevicePop(device, kOutPipe, sink, &length) != kIOReturnSuccess) {
+                fprintf(stderr, "Write failed.\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        double elapsed = (double)(Now() - start) / 1e9;
+        Result *result = AddResult("bulk_write", "MB/s", size);
+        result->iterations = count;
+        result->value = (double)count * size / elapsed / 1e6;
+
+        start = Now();
+        for (uint64_t j = 0; j < count; ++j) {
+            uint32_t length = size;
+            if (SIReadPipe(client, kInPipe, buffer, &length) != kIOReturnSuccess) {
+                fprintf(stderr, "Read failed.\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        elapsed = (double)(Now() - start) / 1e9;
+        result = AddResult("bulk_read", "MB/s", size);
+        result->iterations = count;
+        result->value = (double)count * size / elapsed / 1e6;
+    }
+
+    free(sink);
+    free(buffer);
+}
+
+// Walk every descriptor in the configuration, as a driver looking for its
+// interfaces and endpoints would.
+static uint64_t ParseConfig(SIConfigDescriptor const *config)
+{
+    SIDescriptorIterator it;
+    SIDescriptorIteratorInit(&it, config, config->wTotalLength);
+
+    uint64_t numEndpoints = 0;
+    while (SIDescriptorIteratorNextInterface(&it)) {
+        while (SIDescriptorIteratorNextEndpoint(&it))
+            numEndpoints++;
+    }
+    return numEndpoints;
+}
+
+static void RunDescriptors(SIClient *client)
+{
+    uint64_t count = sQuick ? 10000 : 100000;
+    uint64_t *samples = malloc(count * sizeof(uint64_t));
+    SIDeviceDescriptor const *device;
+    SIConfigDescriptor const *config;
+    uint64_t found = 0;
+
+    // Fetching from the device, which invalidating the cache forces.
+    for (uint64_t i = 0; i < count; ++i) {
+        SIInvalidateDescriptors(client);
+        uint64_t start = Now();
+        if (SIGetDeviceDescriptor(client, &device) != kIOReturnSuccess
+            || SIGetConfigDescriptor(client, 0, &config) != kIOReturnSuccess) {
+            fprintf(stderr, "Failed to fetch descriptors.\n");
+            exit(EXIT_FAILURE);
+        }
+        found += ParseConfig(config);
+        samples[i] = Now() - start;
+    }
+    AddDistribution("descriptor_fetch_parse", samples, count);
+
+    // And from the cache, which leaves the parsing.
+    for (uint64_t i = 0; i < count; ++i) {
+        uint64_t start = Now();
+        SIGetConfigDescriptor(client, 0, &config);
+        found += ParseConfig(config);
+        samples[i] = Now() - start;
+    }
+    AddDistribution("descriptor_parse_cached", samples, count);
+
+    for (uint64_t i = 0; i < count / 10; ++i) {
+        SIStringTable const *table;
+        SIInvalidateDescriptors(client);
+        uint64_t start = Now();
+        if (SIGetStringTable(client, &table) != kIOReturnSuccess) {
+            fprintf(stderr, "Failed to fetch strings.\n");
+            exit(EXIT_FAILURE);
+        }
+        samples[i] = Now() - start;
+    }
+    AddDistribution("string_table_fetch", samples, count / 10);
+
+    // Both loops see the configuration's two endpoints every time.
+    if (found != 4 * count)
+        fprintf(stderr, "Parsed %llu endpoints, expected %llu.\n", (unsigned long long)found,
+            (unsigned long long)(4 * count));
+    free(samples);
+}
+
+static void RunConnect(void)
+{
+    uint64_t count = sQuick ? 2000 : 20000;
+    uint64_t *samples = malloc(count * sizeof(uint64_t));
+
+    // Ready means the pipes are known, which takes the descriptors.
+    for (uint64_t i = 0; i < count; ++i) {
+        uint64_t start = Now();
+        SIClient *client = Connect();
+        SIPipeProps props;
+        if (SIGetPipe(client, kInPipe, &props) != kIOReturnSuccess) {
+            fprintf(stderr, "Failed to get pipe.\n");
+            exit(EXIT_FAILURE);
+        }
+        samples[i] = Now() - start;
+        SIClientDestroy(client);
+    }
+
+    AddDistribution("connect_to_ready", samples, count);
+    free(samples);
+}
+
+#if defined(__linux__)
+static void WriteFile(char const *dir, char const *name, void const *data, size_t length)
+{
+    char path[0x400];
+    if (snprintf(path, sizeof(path), "%s/%s", dir, name) >= (int)sizeof(path)) {
+        fprintf(stderr, "Path too long: %s/%s\n", dir, name);
+        exit(EXIT_FAILURE);
+    }
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || write(fd, data, length) != (ssize_t)length) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+}
+
+// Lay out what sysfs has for each device, with the simulated device's
+// descriptors.
+static void MakeTree(char const *root, unsigned numDevices)
+{
+    char dir[0x400];
+    static char const *const kDirs[] = { "bus", "bus/usb", "bus/usb/devices" };
+    for (size_t i = 0; i < sizeof(kDirs) / sizeof(kDirs[0]); ++i) {
+        snprintf(dir, sizeof(dir), "%s/%s", root, kDirs[i]);
+        mkdir(dir, 0755);
+    }
+
+    uint8_t desc[sizeof(kDeviceDesc) + sizeof(kConfigDesc)];
+    memcpy(desc, &kDeviceDesc, sizeof(kDeviceDesc));
+    memcpy(desc + sizeof(kDeviceDesc), kConfigDesc, sizeof(kConfigDesc));
+
+    for (unsigned i = 0; i < numDevices; ++i) {
+        char value[0x40];
+        snprintf(dir, sizeof(dir), "%s/bus/usb/devices/1-%u", root, i + 1);
+        mkdir(dir, 0755);
+
+        WriteFile(dir, "descriptors", desc, sizeof(desc));
+        WriteFile(dir, "busnum", "1\n", 2);
+        WriteFile(dir, "devnum", value, (size_t)snprintf(value, sizeof(value), "%u\n", i + 2));
+        WriteFile(dir, "speed", "480\n", 4);
+        WriteFile(dir, "serial", value, (size_t)snprintf(value, sizeof(value), "SERIAL%08x\n", i));
+    }
+}
+
+static int RemoveEntry(char const *path, struct stat const *st, int flag, struct FTW *ftw)
+{
+    (void)st;
+    (void)flag;
+    (void)ftw;
+    return remove(path);
+}
+
+static void RunEnumerate(void)
+{
+    static unsigned const kNumDevices = 100;
+    char root[] = "/tmp/si-sysfs-XXXXXX";
+    if (!mkdtemp(root)) {
+        perror("mkdtemp");
+        exit(EXIT_FAILURE);
+    }
+    MakeTree(root, kNumDevices);
+
+    uint64_t count = sQuick ? 20 : 200;
+    uint64_t *samples = malloc(count * sizeof(uint64_t));
+    for (uint64_t i = 0; i < count; ++i) {
+        SIDeviceList *list = NULL;
+        uint64_t start = Now();
+        IOReturn ret = SIEnumerateAt(root, NULL, &list);
+        samples[i] = Now() - start;
+        if (ret != kIOReturnSuccess || list->numDevices != kNumDevices) {
+            fprintf(stderr, "Enumeration failed. (%#x)\n", ret);
+            exit(EXIT_FAILURE);
+        }
+        SIDeviceListDestroy(list);
+    }
+
+    AddDistribution("enumerate_100_devices", samples, count);
+    free(samples);
+    nftw(root, RemoveEntry, 16, FTW_DEPTH | FTW_PHYS);
+}
+#endif
+
+static void PrintSummary(FILE *out)
+{
+    for (int i = 0; i < sNumResults; ++i) {
+        Result const *result = &sResults[i];
+        char sized[sizeof(result->name) + sizeof("/4294967295")];
+        char const *name = result->name;
+        if (result->size && snprintf(sized, sizeof(sized), "%s/%u", result->name, result->size) < (int)sizeof(sized))
+            name = sized;
+
+        if (result->distribution)
+            fprintf(out, "%-28s mean %12.1f %s  p50 %12.1f  p99 %12.1f\n", name, result->value, result->unit,
+                result->p50, result->p99);
+        else
+            fprintf(out, "%-28s %17.1f %s\n", name, result->value, result->unit);
+    }
+}
+
+static void WriteJSON(FILE *out)
+{
+    struct utsname host;
+    uname(&host);
+
+    fprintf(out, "{\n  \"version\": %d,\n  \"timestamp\": %lld,\n", kJSONVersion, (long long)time(NULL));
+    fprintf(out, "  \"host\": {\"system\": \"%s\", \"release\": \"%s\", \"machine\": \"%s\", \"cpus\": %ld},\n",
+        host.sysname, host.release, host.machine, sysconf(_SC_NPROCESSORS_ONLN));
+    fprintf(out, "  \"quick\": %s,\n  \"results\": [\n", sQuick ? "true" : "false");
+    for (int i = 0; i < sNumResults; ++i) {
+        Result const *result = &sResults[i];
+        fprintf(out, "    {\"name\": \"%s\", \"unit\": \"%s\", \"value\": %.3f, \"iterations\": %llu", result->name,
+            result->unit, result->value, (unsigned long long)result->iterations);
+        if (result->size)
+            fprintf(out, ", \"size\": %u", result->size);
+        if (result->distribution)
+            fprintf(out, ", \"p50\": %.0f, \"p99\": %.0f", result->p50, result->p99);
+        fprintf(out, "}%s\n", i + 1 < sNumResults ? "," : "");
+    }
+    fprintf(out, "  ]\n}\n");
+}
+
+int main(int argc, char const **argv)
+{
+    char const *jsonPath = NULL;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--quick") == 0) {
+            sQuick = 1;
+        } else if (strcmp(argv[i], "--json") == 0 && i + 1 < argc) {
+            jsonPath = argv[++i];
+        } else {
+            fprintf(stderr, "usage: %s [--quick] [--json <path>]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    SISimDevice *device = CreateDevice();
+    SIClient *client = Connect();
+
+    RunControl(client);
+    RunBulk(device, client);
+    RunDescriptors(client);
+    SIClientDestroy(client);
+
+    RunConnect();
+#if defined(__linux__)
+    RunEnumerate();
+#endif
+    SISimDeviceDestroy(device);
+
+    int toStdout = jsonPath && strcmp(jsonPath, "-") == 0;
+    if (!toStdout)
+        PrintSummary(stdout);
+    if (toStdout) {
+        WriteJSON(stdout);
+    } else if (jsonPath) {
+        FILE *out = fopen(jsonPath, "w");
+        if (!out) {
+            perror(jsonPath);
+            return EXIT_FAILURE;
+        }
+        WriteJSON(out);
+        fclose(out);
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,143 @@
+// Measures image upload throughput against a simulated device, comparing
+// the old read-then-write-in-chunks approach with pipelined uploads.
+
+#include "SimpleIOUSB.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define kImageSize (32 * 1024 * 1024)
+
+// Roughly what a high-speed bulk pipe manages in practice, plus the
+// turnaround between one transfer completing and the next starting.
+#define kPipeBytesPerSecond 40000000
+#define kPipeLatencyUs 150
+
+static SIDeviceDescriptor const kDeviceDesc = {
+    .bLength = sizeof(SIDeviceDescriptor),
+    .bDescriptorType = kSIDescriptorTypeDevice,
+    .bcdUSB = 0x200,
+    .bMaxPacketSize = 64,
+    .idVendor = 0x5ac,
+    .idProduct = 0x1281,
+    .bNumConfigurations = 1,
+};
+
+static uint8_t const kConfigDesc[] = {
+    9, kSIDescriptorTypeConfig, 25, 0, 1, 1, 0, 0x80, 250,
+    9, kSIDescriptorTypeInterface, 0, 0, 1, 0xff, 0xff, 0xff, 0,
+    7, kSIDescriptorTypeEndpoint, 0x04, 0x02, 0x00, 0x02, 0,
+};
+
+static double Seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void Report(char const *name, double elapsed)
+{
+    printf("%-28s %8.2f MB/s\n", name, kImageSize / elapsed / 1e6);
+}
+
+/// Upload the way it used to be done: read the whole image, then write it
+/// out one chunk at a time.
+static IOReturn UploadSerially(SIClient *client, char const *path, uint32_t chunkSize)
+{
+    FILE *file = fopen(path, "rb");
+    if (!file)
+        return kIOReturnNotFound;
+
+    uint8_t *image = malloc(kImageSize);
+    size_t length = fread(image, 1, kImageSize, file);
+    fclose(file);
+
+    IOReturn ret = kIOReturnSuccess;
+    for (size_t offset = 0; offset < length && ret == kIOReturnSuccess; offset += chunkSize) {
+        uint32_t chunk = length - offset < chunkSize ? (uint32_t)(length - offset) : chunkSize;
+        ret = SIWritePipe(client, 1, image + offset, chunk);
+    }
+
+    free(image);
+    return ret;
+}
+
+int main(void)
+{
+    char path[] = "/tmp/SimpleIOUSB-Upload-XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        perror("mkstemp");
+        return EXIT_FAILURE;
+    }
+
+    static uint8_t block[0x10000];
+    for (size_t i = 0; i < sizeof(block); ++i)
+        block[i] = (uint8_t)(i * 31);
+    for (size_t written = 0; written < kImageSize; written += sizeof(block)) {
+        if (write(fd, block, sizeof(block)) != (ssize_t)sizeof(block)) {
+            perror("write");
+            return EXIT_FAILURE;
+        }
+    }
+    close(fd);
+
+    SISimDevice *device = SISimDeviceCreate(&kDeviceDesc);
+    SISimDeviceAddConfig(device, kConfigDesc, sizeof(kConfigDesc));
+
+    SISimPipeConfig pipe = {
+        .latencyUs = kPipeLatencyUs,
+        .bytesPerSecond = kPipeBytesPerSecond,
+        .flags = kSISimPipeDiscard,
+    };
+    SISimDeviceConfigurePipe(device, 1, &pipe);
+    SISimDeviceAttach(device);
+
+    SIClient *client = SIClientCreateWithBackend(&kSIBackendSimulated);
+    IOReturn ret = SIConnect(client, kDeviceDesc.idVendor, kDeviceDesc.idProduct);
+    if (ret != kIOReturnSuccess) {
+        fprintf(stderr, "Failed to connect. (%#x)\n", ret);
+        return EXIT_FAILURE;
+    }
+
+    printf("Uploading %d MiB over a %d MB/s pipe with %d us turnaround\n\n", kImageSize >> 20,
+        kPipeBytesPerSecond / 1000000, kPipeLatencyUs);
+
+    static uint32_t const kChunkSizes[] = { 0x4000, 0x10000 };
+    for (size_t i = 0; i < sizeof(kChunkSizes) / sizeof(*kChunkSizes); ++i) {
+        uint32_t chunkSize = kChunkSizes[i];
+        char name[64];
+
+        double start = Seconds();
+        if ((ret = UploadSerially(client, path, chunkSize)) != kIOReturnSuccess)
+            break;
+        snprintf(name, sizeof(name), "serial, %uK chunks", chunkSize >> 10);
+        Report(name, Seconds() - start);
+
+        for (uint32_t depth = 1; depth <= 4; ++depth) {
+            SIUploadConfig config = { .chunkSize = chunkSize, .depth = depth };
+
+            start = Seconds();
+            if ((ret = SIUploadFile(client, 1, path, &config)) != kIOReturnSuccess)
+                break;
+            snprintf(name, sizeof(name), "pipelined, %uK chunks x%u", chunkSize >> 10, depth);
+            Report(name, Seconds() - start);
+        }
+        puts("");
+    }
+
+    SIClientDestroy(client);
+    SISimDeviceDestroy(device);
+    unlink(path);
+
+    if (ret != kIOReturnSuccess) {
+        fprintf(stderr, "Upload failed. (%#x)\n", ret);
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
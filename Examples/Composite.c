@@ -0,0 +1,113 @@
+#include "Common.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define kUSBProductIDAppleNormal 0x12a8
+
+// Composite device: a data interface, plus a vendor-specific debug
+// interface alongside it, each with a bulk OUT/IN pair.
+static SIDeviceDescriptor const kDeviceDesc = {
+    .bLength = sizeof(SIDeviceDescriptor),
+    .bDescriptorType = kSIDescriptorTypeDevice,
+    .bcdUSB = 0x200,
+    .bMaxPacketSize = 64,
+    .idVendor = kUSBVendorIDApple,
+    .idProduct = kUSBProductIDAppleNormal,
+    .bNumConfigurations = 1,
+};
+
+static uint8_t const kConfigDesc[] = {
+    9, kSIDescriptorTypeConfig, 55, 0, 2, 1, 0, 0x80, 250,
+    9, kSIDescriptorTypeInterface, 0, 0, 2, 0xff, 0xfe, 0x02, 0,
+    7, kSIDescriptorTypeEndpoint, 0x01, 0x02, 0x00, 0x02, 0,
+    7, kSIDescriptorTypeEndpoint, 0x81, 0x02, 0x00, 0x02, 0,
+    9, kSIDescriptorTypeInterface, 1, 0, 2, 0xff, 0x2a, 0x01, 0,
+    7, kSIDescriptorTypeEndpoint, 0x02, 0x02, 0x00, 0x02, 0,
+    7, kSIDescriptorTypeEndpoint, 0x82, 0x02, 0x00, 0x02, 0,
+};
+
+typedef struct {
+    SIClient *client;
+    char const *name;
+    int iterations;
+    IOReturn ret;
+} Worker;
+
+static void *RunWorker(void *context)
+{
+    Worker *worker = context;
+
+    // Each interface numbers its own pipes from 1.
+    uint8_t out[512], in[512];
+    memset(out, worker->name[0], sizeof(out));
+    for (int i = 0; i < worker->iterations; ++i) {
+        uint32_t inSize = sizeof(in);
+        if ((worker->ret = SIWritePipe(worker->client, 1, out, sizeof(out))) != kIOReturnSuccess
+            || (worker->ret = SIReadPipe(worker->client, 2, in, &inSize)) != kIOReturnSuccess)
+            break;
+
+        if (inSize != sizeof(out) || memcmp(in, out, inSize) != 0) {
+            worker->ret = kIOReturnIOError;
+            break;
+        }
+    }
+
+    printf("%s: %d round trips (%#x)\n", worker->name, worker->iterations, worker->ret);
+    return NULL;
+}
+
+int main(int argc, char const **argv)
+{
+    (void)argc;
+    (void)argv;
+
+    SISimDevice *device = SISimDeviceCreate(&kDeviceDesc);
+    SISimDeviceAddConfig(device, kConfigDesc, sizeof(kConfigDesc));
+
+    // Simulated pipes are numbered across interfaces: 1-2 belong to the data
+    // interface and 3-4 to the debug interface.
+    SISimPipeConfig loopback = { .latencyUs = 100, .loopback = 2 };
+    SISimDeviceConfigurePipe(device, 1, &loopback);
+    loopback.loopback = 4;
+    SISimDeviceConfigurePipe(device, 3, &loopback);
+    SISimDeviceAttach(device);
+
+    puts("Connecting...");
+    SIClient *client = SIClientCreateWithBackend(&kSIBackendSimulated);
+    IOReturn ret = SIConnect(client, kUSBVendorIDApple, kUSBProductIDAppleNormal);
+    if (ret != kIOReturnSuccess) {
+        fprintf(stderr, "Failed to connect. (%#x)\n", ret);
+        return EXIT_FAILURE;
+    }
+
+    puts("Claiming the debug interface...");
+    SIClient *debug = NULL;
+    if ((ret = SIClaimInterfaceByClass(client, 0xff, 0x2a, 0x01, &debug)) != kIOReturnSuccess) {
+        fprintf(stderr, "Failed to claim interface. (%#x)\n", ret);
+        return EXIT_FAILURE;
+    }
+
+    // The client already holds the data interface.
+    SIClient *again = NULL;
+    ret = SIClaimInterface(client, 0, &again);
+    printf("Claiming interface 0 again: %#x\n", ret);
+
+    puts("Driving both interfaces at once...");
+    Worker workers[2] = {
+        { .client = client, .name = "data", .iterations = 2000 },
+        { .client = debug, .name = "debug", .iterations = 2000 },
+    };
+
+    pthread_t threads[2];
+    for (int i = 0; i < 2; ++i)
+        pthread_create(&threads[i], NULL, RunWorker, &workers[i]);
+    for (int i = 0; i < 2; ++i)
+        pthread_join(threads[i], NULL);
+
+    SIClientDestroy(debug);
+    SIClientDestroy(client);
+    SISimDeviceDestroy(device);
+    return workers[0].ret == kIOReturnSuccess && workers[1].ret == kIOReturnSuccess ? EXIT_SUCCESS : EXIT_FAILURE;
+}
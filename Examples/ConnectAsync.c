@@ -1,9 +1,13 @@
 #include "Common.h"
 
+#if defined(__APPLE__)
 #include <CoreFoundation/CFRunLoop.h>
+#endif
 
+#include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
 
 void DeviceConnected(SIClient *client)
 {
@@ -13,7 +17,7 @@ void DeviceConnected(SIClient *client)
 
 void DeviceTerminated(uint64_t id)
 {
-    printf("Lost device with ID %#llx.\n", id);
+    printf("Lost device with ID %#" PRIx64 ".\n", id);
 }
 
 int main(int argc, char const **argv)
@@ -33,7 +37,13 @@ int main(int argc, char const **argv)
         return EXIT_FAILURE;
     }
 
+#if defined(__APPLE__)
     CFRunLoopRun();
+#else
+    // Callbacks arrive on a monitor thread of the library's own.
+    for (;;)
+        pause();
+#endif
 
     return EXIT_SUCCESS;
 }
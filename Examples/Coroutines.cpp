@@ -0,0 +1,145 @@
+// Runs a session per simulated device as a C++20 coroutine (see
+// 'SimpleIOUSB.hpp'), with every session sharing the few worker threads of
+// a client pool instead of having a thread each.
+
+#include "SimpleIOUSB.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#define kUSBVendorIDApple 0x5ac
+
+static constexpr int kNumDevices = 256;
+static constexpr int kRounds = 200;
+static constexpr uint8_t kVendorIn = uint8_t(kSIDirectionToHost) | uint8_t(kSITypeVendor) | uint8_t(kSIRecipientDevice);
+
+// One interface with a bulk OUT/IN pair, looped back by the simulator.
+static uint8_t const kConfigDesc[] = {
+    9, kSIDescriptorTypeConfig, 32, 0, 1, 1, 0, 0x80, 250,
+    9, kSIDescriptorTypeInterface, 0, 0, 2, 0xff, 0xff, 0xff, 0,
+    7, kSIDescriptorTypeEndpoint, 0x01, 0x02, 0x00, 0x02, 0,
+    7, kSIDescriptorTypeEndpoint, 0x82, 0x02, 0x00, 0x02, 0,
+};
+
+static SITransferResult HandleVendorRequest(void *context, uint8_t requestType, uint8_t request, uint16_t value,
+    uint16_t index, void *data, size_t length)
+{
+    (void)context;
+    (void)requestType;
+    (void)request;
+    (void)index;
+
+    // Echo the request value back, like a trivial status query.
+    size_t reply = length < sizeof(value) ? length : sizeof(value);
+    std::memcpy(data, &value, reply);
+
+    SITransferResult result {};
+    result.length = static_cast<uint32_t>(reply);
+    return result;
+}
+
+static std::atomic<int> sFinished;
+static std::atomic<int> sFailed;
+
+static si::Task<IOReturn> RoundTrip(SIClient *client, uint16_t value)
+{
+    uint16_t status = 0;
+    SITransferResult result = co_await si::ControlTransfer(client, kVendorIn, 0x42, value, 0, &status,
+        sizeof(status));
+    if (result.error != kIOReturnSuccess)
+        co_return result.error;
+    if (status != value)
+        co_return kIOReturnIOError;
+
+    uint8_t out[64], in[64];
+    std::memset(out, value & 0xff, sizeof(out));
+    if ((result = co_await si::WritePipe(client, 1, out, sizeof(out))).error != kIOReturnSuccess)
+        co_return result.error;
+    if ((result = co_await si::ReadPipe(client, 2, in, sizeof(in))).error != kIOReturnSuccess)
+        co_return result.error;
+
+    co_return result.length == sizeof(out) && std::memcmp(in, out, sizeof(out)) == 0 ? kIOReturnSuccess
+                                                                                     : kIOReturnIOError;
+}
+
+static si::Task<> Session(SIClientPool *pool, SIClient *client)
+{
+    // Hop onto the client's worker, where its completions are handled and
+    // this coroutine resumes from then on.
+    IOReturn ret = co_await si::ResumeOn(pool, client);
+    for (int i = 0; i < kRounds && ret == kIOReturnSuccess; ++i)
+        ret = co_await RoundTrip(client, static_cast<uint16_t>(i));
+
+    if (ret != kIOReturnSuccess) {
+        std::fprintf(stderr, "Session failed. (%#x)\n", ret);
+        sFailed.fetch_add(1);
+    }
+    sFinished.fetch_add(1);
+    sFinished.notify_one();
+}
+
+int main()
+{
+    static SISimDevice *devices[kNumDevices];
+    static SIClient *clients[kNumDevices];
+
+    SIClientPool *pool = nullptr;
+    IOReturn ret = SIClientPoolCreate(nullptr, &pool);
+    if (ret != kIOReturnSuccess) {
+        std::fprintf(stderr, "Failed to create pool. (%#x)\n", ret);
+        return EXIT_FAILURE;
+    }
+
+    std::printf("Connecting to %d devices...\n", kNumDevices);
+    for (int i = 0; i < kNumDevices; ++i) {
+        SIDeviceDescriptor desc {};
+        desc.bLength = sizeof(SIDeviceDescriptor);
+        desc.bDescriptorType = kSIDescriptorTypeDevice;
+        desc.bcdUSB = 0x200;
+        desc.bMaxPacketSize = 64;
+        desc.idVendor = kUSBVendorIDApple;
+        desc.idProduct = static_cast<uint16_t>(0x1000 + i);
+        desc.bNumConfigurations = 1;
+
+        devices[i] = SISimDeviceCreate(&desc);
+        SISimDeviceAddConfig(devices[i], kConfigDesc, sizeof(kConfigDesc));
+        SISimDeviceAddControlHandler(devices[i], kVendorIn, 0x42, HandleVendorRequest, nullptr);
+
+        SISimPipeConfig loopback {};
+        loopback.loopback = 2;
+        SISimDeviceConfigurePipe(devices[i], 1, &loopback);
+        SISimDeviceAttach(devices[i]);
+
+        clients[i] = SIClientCreateWithBackend(&kSIBackendSimulated);
+        if ((ret = SIConnect(clients[i], desc.idVendor, desc.idProduct)) != kIOReturnSuccess
+            || (ret = SIClientPoolAdd(pool, clients[i])) != kIOReturnSuccess) {
+            std::fprintf(stderr, "Failed to set up device %d. (%#x)\n", i, ret);
+            return EXIT_FAILURE;
+        }
+    }
+
+    std::printf("Running %d sessions of %d round trips...\n", kNumDevices, kRounds);
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < kNumDevices; ++i)
+        si::Spawn(Session(pool, clients[i]));
+
+    for (int finished; (finished = sFinished.load()) < kNumDevices;)
+        sFinished.wait(finished);
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    // Each round trip is a control transfer, a write and a read.
+    double transfers = 3.0 * kNumDevices * kRounds;
+    std::printf("%.0f transfers in %.3f s (%.0f transfers/s), %d sessions failed\n", transfers, elapsed.count(),
+        transfers / elapsed.count(), sFailed.load());
+
+    SIClientPoolDestroy(pool);
+    for (int i = 0; i < kNumDevices; ++i) {
+        SIClientDestroy(clients[i]);
+        SISimDeviceDestroy(devices[i]);
+    }
+
+    return sFailed.load() ? EXIT_FAILURE : EXIT_SUCCESS;
+}
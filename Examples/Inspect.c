@@ -2,37 +2,29 @@
 
 #include <stdlib.h>
 
-char const *GetStringDescriptorAlloc(SIClient *client, uint8_t index)
+char const *StringOrEmpty(SIStringTable const *strings, uint8_t index)
 {
-    SIStringDescriptorBuffer desc;
-    SITransferResult result = SIGetDescriptor(client, kSIDescriptorTypeString, index, &desc, sizeof(desc));
-    if (result.error != kIOReturnSuccess)
-        return NULL;
-
-    char *ascii = malloc(0x100);
-    if (!ascii)
-        return NULL;
-
-    if (!SIDecodeStringDescriptor((SIStringDescriptor *)desc, ascii, 0x100)) {
-        free(ascii);
-        return NULL;
-    }
-
-    return ascii;
+    return strings && strings->strings[index] ? strings->strings[index] : "";
 }
 
 int DumpInfo(SIClient *client)
 {
-    SIDeviceDescriptor device = { 0 };
-    SITransferResult result = SIGetDescriptor(client, kSIDescriptorTypeDevice, 0,
-        &device, sizeof(device));
-    if (result.error != kIOReturnSuccess || result.length != sizeof(device)) {
-        fprintf(stderr, "Failed to get device descriptor. (%#x)\n", result.error);
+    // The first of these fetches every descriptor up front; everything
+    // after it (besides strings) is answered from the client's cache.
+    SIDeviceDescriptor const *desc = NULL;
+    IOReturn ret = SIGetDeviceDescriptor(client, &desc);
+    if (ret != kIOReturnSuccess) {
+        fprintf(stderr, "Failed to get device descriptor. (%#x)\n", ret);
         return 0;
     }
 
-    char const *manufacturer = GetStringDescriptorAlloc(client, device.iManufacturer);
-    char const *product = GetStringDescriptorAlloc(client, device.iProduct);
+    SIDeviceDescriptor device = *desc;
+
+    // Every string the descriptors refer to is fetched in one batch.
+    SIStringTable const *strings = NULL;
+    ret = SIGetStringTable(client, &strings);
+    if (ret != kIOReturnSuccess)
+        fprintf(stderr, "Failed to get strings. (%#x)\n", ret);
 
     puts("Device:");
     printf("  bcdUSB:             %#x\n", device.bcdUSB);
@@ -43,14 +35,14 @@ int DumpInfo(SIClient *client)
     printf("  idVendor:           %#x\n", device.idVendor);
     printf("  idProduct:          %#x\n", device.idProduct);
     printf("  bcdDevice:          %#x\n", device.bcdDevice);
-    printf("  iManufacturer:      %#x  # %s\n", device.iManufacturer, manufacturer);
-    printf("  iProduct:           %#x  # %s\n", device.iProduct, product);
-    printf("  iSerialNumber:      %#x\n", device.iSerialNumber);
+    printf("  iManufacturer:      %#x  # %s\n", device.iManufacturer, StringOrEmpty(strings, device.iManufacturer));
+    printf("  iProduct:           %#x  # %s\n", device.iProduct, StringOrEmpty(strings, device.iProduct));
+    printf("  iSerialNumber:      %#x  # %s\n", device.iSerialNumber, StringOrEmpty(strings, device.iSerialNumber));
     printf("  bNumConfigurations: %#x\n", device.bNumConfigurations);
 
     size_t numPipes = 0;
     SIPipeProps pipes[kSIPipesMax];
-    IOReturn ret = SIGetAllPipes(client, pipes, &numPipes);
+    ret = SIGetAllPipes(client, pipes, &numPipes);
     if (ret != kIOReturnSuccess) {
         fprintf(stderr, "Failed to get pipes. (%#x)\n", ret);
         return 0;
@@ -67,47 +59,54 @@ int DumpInfo(SIClient *client)
     }
 
     for (int i = 0; i < device.bNumConfigurations; ++i) {
-        union {
-            uint8_t pad[0x200];
-            SIConfigDescriptor config;
-        } buf;
-
-        result = SIGetDescriptor(client, kSIDescriptorTypeConfig, i, &buf, sizeof(buf));
-        if (result.error != kIOReturnSuccess) {
-            fprintf(stderr, "Failed to get configuration %d descriptor. (%#x)\n", i, result.error);
+        SIConfigDescriptor const *config = NULL;
+        ret = SIGetConfigDescriptor(client, (uint8_t)i, &config);
+        if (ret != kIOReturnSuccess) {
+            fprintf(stderr, "Failed to get configuration %d descriptor. (%#x)\n", i, ret);
             return 0;
         }
 
         printf("Config_%d:\n", i);
-        printf("  wTotalLength: %#x\n", buf.config.wTotalLength);
-        printf("  bNumInterfaces: %#x\n", buf.config.bNumInterfaces);
-        printf("  bConfigurationValue: %#x\n", buf.config.bConfigurationValue);
-        printf("  iConfiguration: %#x\n", buf.config.iConfiguration);
-        printf("  bmAttributes: %#x\n", buf.config.bmAttributes);
-        printf("  bMaxPower: %#x\n", buf.config.bMaxPower);
-
-        for (int j = 0; j < buf.config.bNumInterfaces; ++j) {
-            SIInterfaceDescriptor *interface = (SIInterfaceDescriptor *)(&buf.config + 1) + j;
-
-            printf("  Interface_%d:\n", j);
-            printf("    bInterfaceNumber: %#x\n", interface->bInterfaceNumber);
-            printf("    bAlternateSetting: %#x\n", interface->bAlternateSetting);
-            printf("    bNumEndpoints: %#x\n", interface->bNumEndpoints);
-            printf("    bInterfaceClass: %#x\n", interface->bInterfaceClass);
-            printf("    bInterfaceSubClass: %#x\n", interface->bInterfaceSubClass);
-            printf("    bInterfaceProtocol: %#x\n", interface->bInterfaceProtocol);
-            printf("    iInterface: %#x\n", interface->iInterface);
-
-            for (int k = 0; k < interface->bNumEndpoints; ++k) {
-                SIEndpointDescriptor *endpoint = (SIEndpointDescriptor *)(interface + 1) + k;
-
-                printf("  Endpoint_%d:\n", k);
+        printf("  wTotalLength: %#x\n", config->wTotalLength);
+        printf("  bNumInterfaces: %#x\n", config->bNumInterfaces);
+        printf("  bConfigurationValue: %#x\n", config->bConfigurationValue);
+        printf("  iConfiguration: %#x  # %s\n", config->iConfiguration, StringOrEmpty(strings, config->iConfiguration));
+        printf("  bmAttributes: %#x\n", config->bmAttributes);
+        printf("  bMaxPower: %#x\n", config->bMaxPower);
+
+        SIDescriptorIterator it;
+        SIDescriptorIteratorInit(&it, config, config->wTotalLength);
+
+        SIDescriptorHeader const *desc;
+        while ((desc = SIDescriptorIteratorNext(&it))) {
+            if (desc->bDescriptorType == kSIDescriptorTypeInterface) {
+                SIInterfaceDescriptor const *interface = (SIInterfaceDescriptor const *)desc;
+
+                printf("  Interface_%d_%d:\n", interface->bInterfaceNumber, interface->bAlternateSetting);
+                printf("    bInterfaceNumber: %#x\n", interface->bInterfaceNumber);
+                printf("    bAlternateSetting: %#x\n", interface->bAlternateSetting);
+                printf("    bNumEndpoints: %#x\n", interface->bNumEndpoints);
+                printf("    bInterfaceClass: %#x\n", interface->bInterfaceClass);
+                printf("    bInterfaceSubClass: %#x\n", interface->bInterfaceSubClass);
+                printf("    bInterfaceProtocol: %#x\n", interface->bInterfaceProtocol);
+                printf("    iInterface: %#x  # %s\n", interface->iInterface, StringOrEmpty(strings, interface->iInterface));
+            } else if (desc->bDescriptorType == kSIDescriptorTypeEndpoint) {
+                SIEndpointDescriptor const *endpoint = (SIEndpointDescriptor const *)desc;
+
+                printf("    Endpoint_%#x:\n", endpoint->bEndpointAddress);
                 printf("      bEndpointAddress: %#x\n", endpoint->bEndpointAddress);
                 printf("      bmAttributes: %#x\n", endpoint->bmAttributes);
                 printf("      wMaxPacketSize: %#x\n", endpoint->wMaxPacketSize);
                 printf("      bInterval: %#x\n", endpoint->bInterval);
+            } else {
+                printf("    Descriptor_%#x:\n", desc->bDescriptorType);
+                printf("      bLength: %#x\n", desc->bLength);
+                HexDump(desc, desc->bLength);
             }
         }
+
+        if (it.status != kIOReturnSuccess)
+            fprintf(stderr, "Configuration %d descriptors are malformed. (%#x)\n", i, it.status);
     }
 
     return 1;
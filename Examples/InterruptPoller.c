@@ -0,0 +1,102 @@
+#include "Common.h"
+
+#include <stdlib.h>
+#include <time.h>
+
+#define kNumDevices 32
+
+// HID-like device: one interface with an 8-byte interrupt IN endpoint,
+// polled every 1 to 4 ms depending on the device.
+static uint8_t kConfigDesc[] = {
+    9, kSIDescriptorTypeConfig, 25, 0, 1, 1, 0, 0x80, 50,
+    9, kSIDescriptorTypeInterface, 0, 0, 1, 0x03, 0x00, 0x00, 0,
+    7, kSIDescriptorTypeEndpoint, 0x81, 0x03, 0x08, 0x00, 1,
+};
+
+int main(void)
+{
+    static SISimDevice *devices[kNumDevices];
+    static SIClient *clients[kNumDevices];
+    static uint64_t reports[kNumDevices];
+
+    SIInterruptPoller *poller = NULL;
+    IOReturn ret = SIInterruptPollerCreate(NULL, &poller);
+    if (ret != kIOReturnSuccess) {
+        fprintf(stderr, "Failed to create poller. (%#x)\n", ret);
+        return EXIT_FAILURE;
+    }
+
+    for (int i = 0; i < kNumDevices; ++i) {
+        SIDeviceDescriptor desc = {
+            .bLength = sizeof(SIDeviceDescriptor),
+            .bDescriptorType = kSIDescriptorTypeDevice,
+            .bcdUSB = 0x110,
+            .bMaxPacketSize = 64,
+            .idVendor = kUSBVendorIDApple,
+            .idProduct = (uint16_t)(0x2000 + i),
+            .bNumConfigurations = 1,
+        };
+
+        kConfigDesc[sizeof(kConfigDesc) - 1] = (uint8_t)(1 + i % 4);
+        devices[i] = SISimDeviceCreate(&desc);
+        SISimDeviceAddConfig(devices[i], kConfigDesc, sizeof(kConfigDesc));
+
+        // Always have a report ready, as soon as the host polls for it.
+        SISimPipeConfig reporting = { .flags = kSISimPipeAutofill | kSISimPipePolled };
+        SISimDeviceConfigurePipe(devices[i], 1, &reporting);
+        SISimDeviceAttach(devices[i]);
+
+        clients[i] = SIClientCreateWithBackend(&kSIBackendSimulated);
+        if ((ret = SIConnect(clients[i], desc.idVendor, desc.idProduct)) != kIOReturnSuccess
+            || (ret = SIInterruptPollerAdd(poller, clients[i], 1, &reports[i])) != kIOReturnSuccess) {
+            fprintf(stderr, "Failed to set up device %d. (%#x)\n", i, ret);
+            return EXIT_FAILURE;
+        }
+    }
+
+    printf("Polling %d devices for a second, unplugging one half way...\n", kNumDevices);
+    uint64_t errors = 0;
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int unplugged = 0;;) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        double elapsed = (double)(now.tv_sec - start.tv_sec) + (double)(now.tv_nsec - start.tv_nsec) / 1e9;
+        if (elapsed >= 1.0)
+            break;
+        if (elapsed >= 0.5 && !unplugged++)
+            SISimDeviceDetach(devices[0]);
+
+        SIInterruptEvent const *events;
+        uint32_t numEvents;
+        if (SIInterruptPollerWait(poller, &events, &numEvents, 10) != kIOReturnSuccess)
+            continue;
+
+        for (uint32_t i = 0; i < numEvents; ++i) {
+            if (events[i].status != kIOReturnSuccess) {
+                printf("Device %td stopped reporting. (%#x)\n", (uint64_t *)events[i].context - reports,
+                    events[i].status);
+                errors++;
+                continue;
+            }
+
+            ++*(uint64_t *)events[i].context;
+        }
+    }
+
+    SIInterruptPollerStats stats;
+    SIInterruptPollerGetStats(poller, &stats);
+    printf("%llu reports in %llu batches, with %llu wakeups; latency p50 %.3f ms, p99 %.3f ms\n",
+        (unsigned long long)stats.events, (unsigned long long)stats.batches, (unsigned long long)stats.wakeups,
+        (double)SIHistogramPercentileNs(&stats.latency, 50) / 1e6,
+        (double)SIHistogramPercentileNs(&stats.latency, 99) / 1e6);
+    for (int i = 0; i < 4; ++i)
+        printf("  every %d ms: device %d sent %llu reports\n", 1 + i, i + 4, (unsigned long long)reports[i + 4]);
+
+    SIInterruptPollerDestroy(poller);
+    for (int i = 0; i < kNumDevices; ++i) {
+        SIClientDestroy(clients[i]);
+        SISimDeviceDestroy(devices[i]);
+    }
+
+    return errors == 1 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,119 @@
+#include "Common.h"
+
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Audio-like device: one interface with an isochronous OUT/IN pair, each
+// moving up to 192 bytes (48 kHz 16-bit stereo) every 1 ms frame.
+static SIDeviceDescriptor const kDeviceDesc = {
+    .bLength = sizeof(SIDeviceDescriptor),
+    .bDescriptorType = kSIDescriptorTypeDevice,
+    .bcdUSB = 0x110,
+    .bMaxPacketSize = 64,
+    .idVendor = kUSBVendorIDApple,
+    .idProduct = 0x1000,
+    .bNumConfigurations = 1,
+};
+
+static uint8_t const kConfigDesc[] = {
+    9, kSIDescriptorTypeConfig, 32, 0, 1, 1, 0, 0x80, 250,
+    9, kSIDescriptorTypeInterface, 0, 0, 2, 0xff, 0xff, 0xff, 0,
+    7, kSIDescriptorTypeEndpoint, 0x01, 0x01, 0xc0, 0x00, 1,
+    7, kSIDescriptorTypeEndpoint, 0x82, 0x01, 0xc0, 0x00, 1,
+};
+
+#define kPacketSize 192
+
+static _Atomic uint32_t sSent;
+static _Atomic uint32_t sReceived;
+static _Atomic int sHiccup;
+
+static void FillPackets(void *context, SIIsoPacket *packets, uint32_t numPackets, uint8_t *data)
+{
+    (void)context;
+
+    // Every tenth packet goes out a little short, as rate-matched audio does.
+    for (uint32_t i = 0; i < numPackets; ++i) {
+        uint32_t sequence = atomic_fetch_add(&sSent, 1);
+        if (sequence % 10 == 9)
+            packets[i].length = kPacketSize - 4;
+        memset(data + i * kPacketSize, (int)(sequence & 0xff), packets[i].length);
+    }
+}
+
+static void ReceivePackets(void *context, SIIsoPacket *packets, uint32_t numPackets, uint8_t *data)
+{
+    (void)context;
+    (void)data;
+
+    for (uint32_t i = 0; i < numPackets; ++i) {
+        if (packets[i].status == kIOReturnSuccess && packets[i].actual)
+            atomic_fetch_add(&sReceived, 1);
+    }
+
+    // Hold up completions for longer than the 32 ms queued on each pipe.
+    if (atomic_exchange(&sHiccup, 0)) {
+        struct timespec pause = { 0, 50 * 1000000 };
+        nanosleep(&pause, NULL);
+    }
+}
+
+static void PrintStats(char const *name, SIIsoStream *stream)
+{
+    SIIsoStreamStats stats;
+    SIIsoStreamGetStats(stream, &stats);
+    printf("%s: %llu packets (%llu bytes), %llu failed, %llu frames dropped; "
+           "latency p50 %.2f ms, p99 %.2f ms\n",
+        name, (unsigned long long)stats.packets, (unsigned long long)stats.bytes,
+        (unsigned long long)stats.packetErrors, (unsigned long long)stats.droppedFrames,
+        (double)SIHistogramPercentileNs(&stats.latency, 50) / 1e6,
+        (double)SIHistogramPercentileNs(&stats.latency, 99) / 1e6);
+}
+
+int main(void)
+{
+    SISimDevice *device = SISimDeviceCreate(&kDeviceDesc);
+    SISimDeviceAddConfig(device, kConfigDesc, sizeof(kConfigDesc));
+
+    // Loop the OUT pipe back around to the IN pipe, and have the IN pipe
+    // lose a packet now and then.
+    SISimPipeConfig out = { .loopback = 2 };
+    SISimPipeConfig in = { .failEvery = 250, .failWith = kIOReturnNotResponding };
+    SISimDeviceConfigurePipe(device, 1, &out);
+    SISimDeviceConfigurePipe(device, 2, &in);
+    SISimDeviceAttach(device);
+
+    SIClient *client = SIClientCreateWithBackend(&kSIBackendSimulated);
+    IOReturn ret = SIConnect(client, kDeviceDesc.idVendor, kDeviceDesc.idProduct);
+    if (ret != kIOReturnSuccess) {
+        fprintf(stderr, "Failed to connect. (%#x)\n", ret);
+        return EXIT_FAILURE;
+    }
+
+    SIIsoStream *outStream = NULL, *inStream = NULL;
+    SIIsoStreamConfig outConfig = { .packetSize = kPacketSize, .callback = FillPackets };
+    SIIsoStreamConfig inConfig = { .packetSize = kPacketSize, .callback = ReceivePackets };
+    if ((ret = SIIsoStreamOpen(client, 1, &outConfig, &outStream)) != kIOReturnSuccess
+        || (ret = SIIsoStreamOpen(client, 2, &inConfig, &inStream)) != kIOReturnSuccess) {
+        fprintf(stderr, "Failed to start streaming. (%#x)\n", ret);
+        return EXIT_FAILURE;
+    }
+
+    puts("Streaming for a second, with a hiccup half way...");
+    struct timespec half = { 0, 500 * 1000000 };
+    nanosleep(&half, NULL);
+    atomic_store(&sHiccup, 1);
+    nanosleep(&half, NULL);
+
+    PrintStats("OUT", outStream);
+    PrintStats("IN", inStream);
+    printf("%u packets sent, %u received\n", atomic_load(&sSent), atomic_load(&sReceived));
+
+    SIIsoStreamClose(inStream);
+    SIIsoStreamClose(outStream);
+    SIClientDestroy(client);
+    SISimDeviceDestroy(device);
+    return EXIT_SUCCESS;
+}
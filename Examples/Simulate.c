@@ -0,0 +1,241 @@
+#include "Common.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Recovery-mode-like device: one interface with a bulk OUT/IN pair.
+static SIDeviceDescriptor const kDeviceDesc = {
+    .bLength = sizeof(SIDeviceDescriptor),
+    .bDescriptorType = kSIDescriptorTypeDevice,
+    .bcdUSB = 0x200,
+    .bMaxPacketSize = 64,
+    .idVendor = kUSBVendorIDApple,
+    .idProduct = kUSBProductIDAppleRecovery,
+    .iManufacturer = 1,
+    .iProduct = 2,
+    .iSerialNumber = 3,
+    .bNumConfigurations = 1,
+};
+
+static uint8_t const kConfigDesc[] = {
+    9, kSIDescriptorTypeConfig, 32, 0, 1, 1, 0, 0x80, 250,
+    9, kSIDescriptorTypeInterface, 0, 0, 2, 0xff, 0xff, 0xff, 0,
+    7, kSIDescriptorTypeEndpoint, 0x04, 0x02, 0x00, 0x02, 0,
+    7, kSIDescriptorTypeEndpoint, 0x85, 0x02, 0x00, 0x02, 0,
+};
+
+static SITransferResult HandleVendorRequest(void *context, uint8_t requestType, uint8_t request,
+    uint16_t value, uint16_t index, void *data, size_t length)
+{
+    (void)context;
+    (void)requestType;
+    (void)request;
+    (void)index;
+
+    // Echo the request value back, like a trivial status query.
+    size_t reply = length < sizeof(value) ? length : sizeof(value);
+    memcpy(data, &value, reply);
+    return (SITransferResult) { .error = kIOReturnSuccess, .length = (uint32_t)reply };
+}
+
+typedef struct {
+    int completed;
+    int failed;
+} AsyncCounts;
+
+static void CountTransfer(SITransfer *transfer)
+{
+    AsyncCounts *counts = transfer->context;
+    counts->completed++;
+    if (transfer->result.error != kIOReturnSuccess)
+        counts->failed++;
+}
+
+static double Seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char const **argv)
+{
+    SISimDevice *device = SISimDeviceCreate(&kDeviceDesc);
+    SISimDeviceAddConfig(device, kConfigDesc, sizeof(kConfigDesc));
+    SISimDeviceSetString(device, 1, "Apple Inc.");
+    SISimDeviceSetString(device, 2, "Apple Mobile Device (Recovery Mode)");
+    SISimDeviceSetString(device, 3, "CPID:8103 CPRV:11 SRTG:[iBoot-7429.61.2]");
+    SISimDeviceAddControlHandler(device, kSIDirectionToHost | kSITypeVendor | kSIRecipientDevice,
+        0x42, HandleVendorRequest, NULL);
+
+    // Loop writes on pipe 1 back around to pipe 2.
+    SISimPipeConfig loopback = { .loopback = 2 };
+    SISimDeviceConfigurePipe(device, 1, &loopback);
+    SISimDeviceAttach(device);
+
+    puts("Connecting...");
+    SIClient *client = SIClientCreateWithBackend(&kSIBackendSimulated);
+    IOReturn ret = SIConnect(client, kUSBVendorIDApple, kUSBProductIDAppleRecovery);
+    if (ret != kIOReturnSuccess) {
+        fprintf(stderr, "Failed to connect. (%#x)\n", ret);
+        return EXIT_FAILURE;
+    }
+
+    // Record the setup requests below for Wireshark, if asked to.
+    SICapture *capture = NULL;
+    if (argc > 2) {
+        if ((ret = SICaptureOpen(argv[2], NULL, &capture)) != kIOReturnSuccess) {
+            fprintf(stderr, "Failed to open capture. (%#x)\n", ret);
+            return EXIT_FAILURE;
+        }
+        SISetCapture(client, capture);
+    }
+
+    puts("Getting serial number...");
+    PrintSerial(client);
+
+    uint16_t status = 0;
+    SITransferResult result = SIControlTransfer(client,
+        kSIDirectionToHost | kSITypeVendor | kSIRecipientDevice, 0x42, 0x1234, 0,
+        &status, sizeof(status));
+    if (result.error != kIOReturnSuccess || status != 0x1234) {
+        fprintf(stderr, "Vendor request failed. (%#x)\n", result.error);
+        return EXIT_FAILURE;
+    }
+
+    puts("Batching vendor requests...");
+    enum { kBatchSize = 256 };
+    static uint16_t replies[kBatchSize];
+    static SIControlRequest requests[kBatchSize];
+    static SITransferResult results[kBatchSize];
+    for (int i = 0; i < kBatchSize; ++i) {
+        requests[i] = (SIControlRequest) {
+            .requestType = kSIDirectionToHost | kSITypeVendor | kSIRecipientDevice,
+            .request = 0x42,
+            .value = (uint16_t)i,
+            .length = sizeof(replies[i]),
+            .data = &replies[i],
+        };
+    }
+
+    ret = SIControlTransferBatch(client, requests, kBatchSize, results, kSIBatchStopOnError);
+    if (ret != kIOReturnSuccess || replies[kBatchSize - 1] != kBatchSize - 1) {
+        fprintf(stderr, "Batched requests failed. (%#x)\n", ret);
+        return EXIT_FAILURE;
+    }
+
+    if (capture) {
+        SICaptureStats captureStats;
+        SICaptureGetStats(capture, &captureStats);
+        SISetCapture(client, NULL);
+        SICaptureClose(capture);
+        printf("Captured %llu packets\n", (unsigned long long)captureStats.packets);
+    }
+
+    puts("Round-tripping bulk transfers...");
+    enum { kIterations = 100000 };
+    uint8_t out[512], in[512];
+    memset(out, 0xa5, sizeof(out));
+
+    double start = Seconds();
+    for (int i = 0; i < kIterations; ++i) {
+        uint32_t inSize = sizeof(in);
+        if ((ret = SIWritePipe(client, 1, out, sizeof(out))) != kIOReturnSuccess
+            || (ret = SIReadPipe(client, 2, in, &inSize)) != kIOReturnSuccess
+            || inSize != sizeof(out) || memcmp(in, out, inSize) != 0) {
+            fprintf(stderr, "Loopback failed on iteration %d. (%#x)\n", i, ret);
+            return EXIT_FAILURE;
+        }
+    }
+    double elapsed = Seconds() - start;
+    printf("%d round trips in %.3f s (%.0f ns per transfer)\n", kIterations, elapsed,
+        elapsed * 1e9 / (2.0 * kIterations));
+
+    puts("Sending header and payload in one transfer...");
+    uint32_t header = 0x1234abcd;
+    SIIOVec iov[2] = { { &header, sizeof(header) }, { out, sizeof(out) } };
+    if ((ret = SIWritePipeV(client, 1, iov, 2, kSIWriteZeroLengthPacket)) != kIOReturnSuccess) {
+        fprintf(stderr, "Vectored write failed. (%#x)\n", ret);
+        return EXIT_FAILURE;
+    }
+
+    // The simulated device delivers each piece of the write separately.
+    uint32_t received = 0, inSize = 0;
+    while (received < sizeof(header) + sizeof(out)) {
+        SIIOVec inVec = { in, sizeof(in) };
+        if ((ret = SIReadPipeV(client, 2, &inVec, 1, &inSize)) != kIOReturnSuccess)
+            break;
+        received += inSize;
+    }
+    printf("Received %u of %zu bytes\n", received, sizeof(header) + sizeof(out));
+
+    puts("Queueing asynchronous reads...");
+    enum { kQueued = 8 };
+    static uint8_t buffers[kQueued][512];
+    SITransfer *reads[kQueued];
+    AsyncCounts counts = { 0, 0 };
+
+    // Only four reads are handed to the device at a time; the rest wait
+    // their turn in the pipe's queue.
+    SISetPipeQueueDepth(client, 2, 4);
+    for (int i = 0; i < kQueued; ++i) {
+        reads[i] = SITransferCreate(client, 2, buffers[i], sizeof(buffers[i]), CountTransfer, &counts);
+        SISubmitTransfer(reads[i]);
+    }
+
+    for (int i = 0; i < kQueued; ++i)
+        SIWritePipe(client, 1, out, sizeof(out));
+    while (counts.completed < kQueued)
+        SIHandleEvents(client, 100);
+    printf("%d reads completed, %d failed\n", counts.completed, counts.failed);
+
+    for (int i = 0; i < kQueued; ++i)
+        SITransferDestroy(reads[i]);
+
+    puts("Streaming...");
+    SIStream *stream = NULL;
+    SIStreamConfig config = { .transferSize = sizeof(out) };
+    if ((ret = SIStreamOpen(client, 2, &config, &stream)) != kIOReturnSuccess) {
+        fprintf(stderr, "Failed to open stream. (%#x)\n", ret);
+        return EXIT_FAILURE;
+    }
+
+    enum { kStreamed = 10000 };
+    uint64_t streamed = 0;
+    for (int i = 0; i < kStreamed; ++i) {
+        SIWritePipe(client, 1, out, sizeof(out));
+
+        // Views point straight into the stream's ring; nothing is copied.
+        SIStreamView view;
+        if ((ret = SIStreamPeek(stream, &view, 1000)) != kIOReturnSuccess) {
+            fprintf(stderr, "Stream failed. (%#x)\n", ret);
+            return EXIT_FAILURE;
+        }
+
+        streamed += view.length;
+        SIStreamRelease(stream);
+    }
+
+    SIStreamStats stats;
+    SIStreamGetStats(stream, &stats);
+    printf("Streamed %llu bytes in %llu reads (%llu overruns, %llu stalls)\n",
+        (unsigned long long)streamed, (unsigned long long)stats.reads,
+        (unsigned long long)stats.overruns, (unsigned long long)stats.stalls);
+    SIStreamClose(stream);
+
+    // Leave the trace of all the above for 'trace-decode', if asked to.
+    if (argc > 1) {
+        int fd = open(argv[1], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0 || (ret = SITraceDump(fd)) != kIOReturnSuccess)
+            fprintf(stderr, "Failed to dump trace. (%#x)\n", ret);
+        if (fd >= 0)
+            close(fd);
+    }
+
+    SIClientDestroy(client);
+    SISimDeviceDestroy(device);
+    return EXIT_SUCCESS;
+}
@@ -30,26 +30,74 @@
 //  POSSIBILITY OF SUCH DAMAGE.
 //
 
+#if defined(__linux__)
+#define _GNU_SOURCE // For CPU affinity.
+#endif
+
 #include "SimpleIOUSB.h"
 
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__APPLE__)
 #include <CoreFoundation/CFNumber.h>
 #include <IOKit/IOCFPlugIn.h>
 #include <IOKit/usb/IOUSBLib.h>
+#elif defined(__linux__)
+#include <dirent.h>
+#include <endian.h>
+#include <linux/netlink.h>
+#include <linux/usbdevice_fs.h>
+#include <stdio.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#endif
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 // Set to 1 below (or override in compile flags) for additional debug output.
 #ifndef SI_CONFIG_DEBUG
-#define SI_CONFIG_DEBUG 1
+#define SI_CONFIG_DEBUG 0
+#endif
+
+// Set to 0 (or override in compile flags) to compile out the trace ring.
+#ifndef SI_CONFIG_TRACE
+#define SI_CONFIG_TRACE 1
+#endif
+
+#ifndef __printflike
+#define __printflike(fmtarg, firstvararg) __attribute__((__format__(__printf__, fmtarg, firstvararg)))
 #endif
 
 #if SI_CONFIG_DEBUG
 #include <stdio.h>
 
-#define SIDebug(...)                                                            \
-    do {                                                                        \
-        SIDebugWithContext(__FILE_NAME__, __LINE__, __FUNCTION__, __VA_ARGS__); \
+#define SIDebug(...)                                                        \
+    do {                                                                    \
+        SIDebugWithContext(__FILE_NAME__, __LINE__, __func__, __VA_ARGS__); \
     } while (0)
 
-static void SIDebugWithContext(char const *file, int line, char const *func, char const *fmt, ...) __printflike(4, 5)
+static void SIDebugWithContext(char const *file, int line, char const *func, char const *fmt, ...) __printflike(4, 5);
+
+static void SIDebugWithContext(char const *file, int line, char const *func, char const *fmt, ...)
 {
     fprintf(stderr, "\x1b[34m%s(%s:%d): ", func, file, line);
 
@@ -66,407 +114,9059 @@ static void SIDebugWithContext(char const *file, int line, char const *func, cha
     } while (0)
 #endif
 
-SIClient *SIClientCreate(void)
+// Default control transfer timeout, in milliseconds.
+#define kSIRequestTimeoutDefault 6
+
+static uint64_t SIGetTimeNs(void)
 {
-    SIClient *client = malloc(sizeof(SIClient));
-    return client;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
 }
 
-void SIClientDestroy(SIClient *client)
+static void SISleepUntilNs(uint64_t deadline)
 {
-    SIDebug("Destroying client %p...", (void *)client);
+    uint64_t now;
+    while ((now = SIGetTimeNs()) < deadline) {
+        uint64_t delta = deadline - now;
+        struct timespec ts = { .tv_sec = (time_t)(delta / 1000000000ull), .tv_nsec = (long)(delta % 1000000000ull) };
+        nanosleep(&ts, NULL);
+    }
+}
 
-    if (client->interface) {
-        SIDebug("Closing USB interface...");
+/// Initialize a condition variable for use with 'SICondWaitUntilNs'.
+static void SICondInit(pthread_cond_t *cond)
+{
+#if defined(__APPLE__)
+    pthread_cond_init(cond, NULL);
+#else
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(cond, &attr);
+    pthread_condattr_destroy(&attr);
+#endif
+}
 
-        IOReturn ret = (*client->interface)->USBInterfaceClose(client->interface);
-        if (ret != kIOReturnSuccess)
-            SIDebug("Failed to close interface. (%#x)", ret);
+/// Wait on a condition variable until a monotonic deadline.
+///
+/// \return Zero if signalled, or 'ETIMEDOUT'.
+static int SICondWaitUntilNs(pthread_cond_t *cond, pthread_mutex_t *mutex, uint64_t deadline)
+{
+#if defined(__APPLE__)
+    uint64_t now = SIGetTimeNs();
+    if (now >= deadline)
+        return ETIMEDOUT;
+
+    uint64_t delta = deadline - now;
+    struct timespec ts = { .tv_sec = (time_t)(delta / 1000000000ull), .tv_nsec = (long)(delta % 1000000000ull) };
+    return pthread_cond_timedwait_relative_np(cond, mutex, &ts);
+#else
+    struct timespec ts = { .tv_sec = (time_t)(deadline / 1000000000ull), .tv_nsec = (long)(deadline % 1000000000ull) };
+    return pthread_cond_timedwait(cond, mutex, &ts);
+#endif
+}
 
-        (*client->interface)->Release(client->interface);
+/// Write all of a buffer, or fail.
+static IOReturn SIWriteAll(int fd, void const *data, size_t length)
+{
+    uint8_t const *bytes = data;
+    while (length > 0) {
+        ssize_t written = write(fd, bytes, length);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written <= 0)
+            return kIOReturnIOError;
+
+        bytes += written;
+        length -= (size_t)written;
     }
 
-    if (client->device) {
-        SIDebug("Closing USB device...");
+    return kIOReturnSuccess;
+}
 
-        IOReturn ret = (*client->device)->USBDeviceClose(client->device);
-        if (ret != kIOReturnSuccess)
-            SIDebug("Failed to close device. (%#x)", ret);
+static SITraceEventInfo const kSITraceEvents[kSITraceEventCount] = {
+    [kSITraceConnect] = { "Connect", { "vendorID", "productID", "error" } },
+    [kSITraceClaimInterface] = { "ClaimInterface", { "number", "error" } },
+    [kSITraceReadPipe] = { "ReadPipe", { "pipe", "length", "actual", "error" } },
+    [kSITraceWritePipe] = { "WritePipe", { "pipe", "length", "error" } },
+    [kSITraceControlTransfer] = { "ControlTransfer", { "setup", "actual", "error" } },
+    [kSITraceAbortPipe] = { "AbortPipe", { "pipe", "error" } },
+    [kSITraceSubmitTransfer] = { "SubmitTransfer", { "transfer", "pipe", "length" } },
+    [kSITraceTransferCompleted] = { "TransferCompleted", { "transfer", "pipe", "actual", "error" } },
+    [kSITraceCancelTransfer] = { "CancelTransfer", { "transfer", "pipe", "error" } },
+    [kSITraceCancelToken] = { "CancelToken", { "token" } },
+};
 
-        (*client->device)->Release(client->device);
-    }
+/// Pack a control request's setup packet into one trace argument.
+static inline uint64_t SITraceSetup(uint8_t requestType, uint8_t request, uint16_t value, uint16_t index,
+    size_t length)
+{
+    return (uint64_t)requestType | (uint64_t)request << 8 | (uint64_t)value << 16 | (uint64_t)index << 32
+        | (uint64_t)(uint16_t)length << 48;
+}
 
-    free(client);
+SITraceEventInfo const *SITraceGetEventInfo(uint32_t event)
+{
+    return event < kSITraceEventCount && kSITraceEvents[event].name ? &kSITraceEvents[event] : NULL;
 }
 
-static CFMutableDictionaryRef SIServiceMatchingUSBDevice(uint16_t vendorID, uint16_t productID)
+#if SI_CONFIG_TRACE
+// Records kept per thread; a power of two.
+#define kSITraceRingRecords 4096
+
+/// Ring of a thread's most recent trace records.
+///
+/// Only the owning thread writes to a ring, so recording takes no lock.
+/// Dumps copy records out from under it and then drop any the owner might
+/// have overwritten meanwhile, like a sequence lock.
+typedef struct SITraceRing {
+    struct SITraceRing *next;
+    uint32_t thread; ///< Owning thread's number, or zero once it has exited.
+    uint64_t head;   ///< Number of records ever written.
+    SITraceRecord records[kSITraceRingRecords];
+} SITraceRing;
+
+static pthread_once_t sTraceOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t sTraceKey;
+static pthread_mutex_t sTraceLock = PTHREAD_MUTEX_INITIALIZER;
+static SITraceRing *sTraceRings;
+static uint32_t sTraceThreads;
+static uint64_t sTraceBaseTick;
+static uint64_t sTraceBaseNs;
+static uint32_t sTraceEnabled = 1;
+static __thread SITraceRing *sTraceRing;
+
+/// Read the cheapest free-running counter to hand.
+static inline uint64_t SITraceTicks(void)
 {
-    CFMutableDictionaryRef query = IOServiceMatching(kIOUSBDeviceClassName);
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#elif defined(__aarch64__)
+    uint64_t ticks;
+    __asm__ volatile("mrs %0, cntvct_el0" : "=r"(ticks));
+    return ticks;
+#else
+    return SIGetTimeNs();
+#endif
+}
 
-    CFNumberRef cfVendorID = CFNumberCreate(kCFAllocatorDefault, kCFNumberSInt16Type, &vendorID);
-    CFDictionarySetValue(query, CFSTR(kUSBVendorID), cfVendorID);
-    CFNumberRef cfProductID = CFNumberCreate(kCFAllocatorDefault, kCFNumberSInt16Type, &productID);
-    CFDictionarySetValue(query, CFSTR(kUSBProductID), cfProductID);
+/// Give an exited thread's ring up for reuse, keeping its records.
+static void SITraceThreadExit(void *context)
+{
+    SITraceRing *ring = context;
 
-    // Adding these to the dictionary increased their reference counts, drop
-    // our local reference so their lifetime is tied to the dictionary.
-    CFRelease(cfVendorID);
-    CFRelease(cfProductID);
+    pthread_mutex_lock(&sTraceLock);
+    ring->thread = 0;
+    pthread_mutex_unlock(&sTraceLock);
+}
 
-    return query;
+static void SITraceInit(void)
+{
+    pthread_key_create(&sTraceKey, SITraceThreadExit);
+    sTraceBaseNs = SIGetTimeNs();
+    sTraceBaseTick = SITraceTicks();
 }
 
-static IOReturn SIQueryInterface(io_service_t service, CFUUIDRef pluginType,
-    CFUUIDRef interfaceType, LPVOID *interface)
+/// Give the calling thread a ring, reusing one left by an exited thread.
+static SITraceRing *SITraceAttach(void)
 {
-    SInt32 score = 0;
-    IOCFPlugInInterface **plugin = NULL;
-    IOReturn ret = IOCreatePlugInInterfaceForService(service, pluginType, kIOCFPlugInInterfaceID, &plugin, &score);
-    IOObjectRelease(service);
-    if (ret != kIOReturnSuccess || !plugin) {
-        SIDebug("Failed to create plugin instance. (%#x)", ret);
-        return ret;
-    }
+    pthread_once(&sTraceOnce, SITraceInit);
 
-    HRESULT ok = (*plugin)->QueryInterface(plugin, CFUUIDGetUUIDBytes(interfaceType), interface);
-    (*plugin)->Release(plugin);
-    if (ok != S_OK || !interface) {
-        SIDebug("Failed to query plugin interface. (%#x)", ok);
-        return kIOReturnError;
+    pthread_mutex_lock(&sTraceLock);
+    SITraceRing *ring = sTraceRings;
+    while (ring && ring->thread)
+        ring = ring->next;
+    if (!ring && (ring = calloc(1, sizeof(SITraceRing)))) {
+        ring->next = sTraceRings;
+        sTraceRings = ring;
     }
+    if (ring)
+        ring->thread = ++sTraceThreads;
+    pthread_mutex_unlock(&sTraceLock);
 
-    return kIOReturnSuccess;
+    if (ring)
+        pthread_setspecific(sTraceKey, ring);
+    sTraceRing = ring;
+    return ring;
 }
 
-static IOReturn SIGetDeviceHandle(io_service_t service, SIDeviceHandle *deviceOut)
+static void SITraceRecordEvent(uint32_t event, uint64_t arg0, uint64_t arg1, uint64_t arg2, uint64_t arg3)
 {
-    *deviceOut = NULL;
-    SIDebug("Trying to acquire device handle...");
+    SITraceRing *ring = sTraceRing;
+    if (!ring && !(ring = SITraceAttach()))
+        return;
 
-    SIDeviceInterface **device = NULL;
-    IOReturn ret = SIQueryInterface(service, kIOUSBDeviceUserClientTypeID, kIOUSBDeviceInterfaceID245, (LPVOID *)&device);
-    if (ret != kIOReturnSuccess || !device) {
-        SIDebug("Failed to query device interface. (%#x)", ret);
-        return ret;
-    }
+    uint64_t head = ring->head;
+    SITraceRecord *record = &ring->records[head & (kSITraceRingRecords - 1)];
 
-    if ((ret = (*device)->USBDeviceOpenSeize(device)) != kIOReturnSuccess) {
-        SIDebug("Failed to open device. (%#x)", ret);
-        goto L_failed;
-    }
-    if ((ret = (*device)->SetConfiguration(device, 1)) != kIOReturnSuccess) {
-        SIDebug("Failed to set configuration. (%#x)", ret);
-        goto L_failed;
-    }
+    // A dump which sees any of these stores must also see the previous
+    // record published, so it knows this slot is being overwritten. These
+    // are plain stores on x86 and cheap barriers elsewhere, and unlike a
+    // standalone fence, ThreadSanitizer understands them.
+    __atomic_store_n(&record->tick, SITraceTicks(), __ATOMIC_RELEASE);
+    __atomic_store_n(&record->event, event, __ATOMIC_RELEASE);
+    __atomic_store_n(&record->thread, ring->thread, __ATOMIC_RELEASE);
+    __atomic_store_n(&record->args[0], arg0, __ATOMIC_RELEASE);
+    __atomic_store_n(&record->args[1], arg1, __ATOMIC_RELEASE);
+    __atomic_store_n(&record->args[2], arg2, __ATOMIC_RELEASE);
+    __atomic_store_n(&record->args[3], arg3, __ATOMIC_RELEASE);
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
 
-    *deviceOut = device;
-    return ret;
+/// Record a trace event; pointer arguments must be cast to 'uintptr_t'.
+#define SITrace(event, arg0, arg1, arg2, arg3)                                                    \
+    do {                                                                                          \
+        if (__atomic_load_n(&sTraceEnabled, __ATOMIC_RELAXED))                                    \
+            SITraceRecordEvent(event, (uint64_t)(arg0), (uint64_t)(arg1), (uint64_t)(arg2),       \
+                (uint64_t)(arg3));                                                                \
+    } while (0)
 
-L_failed:
-    if (device) {
-        (*device)->USBDeviceClose(device);
-        (*device)->Release(device);
+/// Copy the records of a ring which are certain not to have been
+/// overwritten during the copy, oldest first.
+static size_t SITraceRingCopy(SITraceRing *ring, SITraceRecord *out)
+{
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    uint64_t first = head > kSITraceRingRecords ? head - kSITraceRingRecords : 0;
+    for (uint64_t i = first; i < head; ++i) {
+        SITraceRecord *record = &ring->records[i & (kSITraceRingRecords - 1)];
+        SITraceRecord *copy = &out[i - first];
+        copy->tick = __atomic_load_n(&record->tick, __ATOMIC_ACQUIRE);
+        copy->event = __atomic_load_n(&record->event, __ATOMIC_ACQUIRE);
+        copy->thread = __atomic_load_n(&record->thread, __ATOMIC_ACQUIRE);
+        for (int arg = 0; arg < 4; ++arg)
+            copy->args[arg] = __atomic_load_n(&record->args[arg], __ATOMIC_ACQUIRE);
     }
 
-    return ret;
+    // The owner may be part way through overwriting the oldest record
+    // still in its ring; the acquires above keep this load after them.
+    uint64_t now = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    uint64_t valid = now >= kSITraceRingRecords ? now - kSITraceRingRecords + 1 : 0;
+    if (valid <= first)
+        return (size_t)(head - first);
+    if (valid >= head)
+        return 0;
+
+    memmove(out, out + (valid - first), (size_t)(head - valid) * sizeof(SITraceRecord));
+    return (size_t)(head - valid);
 }
+#else
+// Arguments are only named, never evaluated, so nothing is left over.
+#define SITrace(event, arg0, arg1, arg2, arg3)                                                    \
+    do {                                                                                          \
+        (void)sizeof(event), (void)sizeof(arg0), (void)sizeof(arg1), (void)sizeof(arg2),          \
+            (void)sizeof(arg3);                                                                   \
+    } while (0)
+#endif
 
-static IOReturn SIGetInterfaceHandle(SIDeviceHandle device, unsigned index, SIInterfaceHandle *interfaceOut)
+void SITraceSetEnabled(int enabled)
 {
-    (void)index;
+#if SI_CONFIG_TRACE
+    __atomic_store_n(&sTraceEnabled, enabled != 0, __ATOMIC_RELAXED);
+#else
+    (void)enabled;
+#endif
+}
 
-    // XXX: Right now, this is a lie, which is why we null-cast the parameter
-    // above so the compiler doesn't call us out for this...
-    SIDebug("Looking for interface with index %u...", index);
+IOReturn SITraceDump(int fd)
+{
+#if SI_CONFIG_TRACE
+    pthread_once(&sTraceOnce, SITraceInit);
 
-    static IOUSBFindInterfaceRequest sInterfaceReq = {
-        .bInterfaceProtocol = kIOUSBFindInterfaceDontCare,
-        .bInterfaceSubClass = kIOUSBFindInterfaceDontCare,
-        .bAlternateSetting = kIOUSBFindInterfaceDontCare,
-        .bInterfaceClass = kIOUSBFindInterfaceDontCare,
-    };
+    // Rings are never freed, so the list can be walked once it's been
+    // sized, while new threads add theirs to the front.
+    pthread_mutex_lock(&sTraceLock);
+    SITraceRing *rings = sTraceRings;
+    pthread_mutex_unlock(&sTraceLock);
 
-    io_iterator_t ifaceIter = IO_OBJECT_NULL;
-    IOReturn ret = (*device)->CreateInterfaceIterator(device, &sInterfaceReq, &ifaceIter);
-    if (ret != kIOReturnSuccess) {
-        SIDebug("Failed to create interface iterator. (%#x)", ret);
-        return ret;
-    }
+    size_t numRings = 0;
+    for (SITraceRing *ring = rings; ring; ring = ring->next)
+        numRings++;
 
-    io_service_t service = IO_OBJECT_NULL;
-    while ((service = IOIteratorNext(ifaceIter))) {
-        // TODO: Index?
+    SITraceRecord *records = numRings ? malloc(numRings * sizeof(rings->records)) : NULL;
+    if (numRings && !records)
+        return kIOReturnNoMemory;
 
-        SIInterfaceHandle interface = NULL;
-        ret = SIQueryInterface(service, kIOUSBInterfaceUserClientTypeID,
-            kIOUSBInterfaceInterfaceID245, (LPVOID *)&interface);
-        if (ret != kIOReturnSuccess || !interface) {
-            SIDebug("Failed to query interface interface. (%#x)", ret);
-            return ret;
-        }
+    size_t count = 0;
+    for (SITraceRing *ring = rings; ring; ring = ring->next)
+        count += SITraceRingCopy(ring, records + count);
 
-        ret = (*interface)->USBInterfaceOpenSeize(interface);
-        if (ret != kIOReturnSuccess) {
-            SIDebug("Failed to open device. (%#x)", ret);
-            return ret;
-        }
+    SITraceHeader header = {
+        .magic = "SITRACE",
+        .version = kSITraceVersion,
+        .recordSize = sizeof(SITraceRecord),
+        .baseTick = sTraceBaseTick,
+        .baseNs = sTraceBaseNs,
+        .dumpTick = SITraceTicks(),
+        .dumpNs = SIGetTimeNs(),
+        .numRecords = count,
+    };
 
-        *interfaceOut = interface;
-        break;
-    }
+    IOReturn ret = SIWriteAll(fd, &header, sizeof(header));
+    if (ret == kIOReturnSuccess)
+        ret = SIWriteAll(fd, records, count * sizeof(SITraceRecord));
 
-    IOObjectRelease(ifaceIter);
+    free(records);
     return ret;
+#else
+    (void)fd;
+    return kIOReturnUnsupported;
+#endif
 }
 
-static IOReturn SIClientInitWithService(SIClient *client, io_service_t service)
+
+/// Get the properties of the default control pipe for a device.
+static SIPipeProps SIControlPipeProps(SIDeviceDescriptor const *device)
 {
-    uint64_t regID = -1;
-    IOReturn ret = IORegistryEntryGetRegistryEntryID(service, &regID);
-    if (ret != kIOReturnSuccess) {
-        SIDebug("Failed to get registry entry ID for service %#x. (%#x)", service, ret);
-        return ret;
-    }
+    return (SIPipeProps) {
+        .direction = kSIPipeDirectionAny,
+        .endpoint = 0,
+        .max = device->bMaxPacketSize,
+        .type = kSIPipeTypeControl,
+        .interval = 0,
+    };
+}
 
-    SIDebug("Trying to initialize with service %#x/%#llx...", service, regID);
+/// Get the length of a periodic pipe's service interval, given the length
+/// of a bus (micro)frame: 'bInterval' frames for interrupt pipes at full and
+/// low speed, and 2^(bInterval - 1) (micro)frames for everything else.
+static uint64_t SIServiceIntervalNs(SIPipeProps const *props, uint32_t frameUs)
+{
+    if (props->type == kSIPipeTypeInterrupt && frameUs >= 1000)
+        return (uint64_t)frameUs * 1000 * (props->interval ? props->interval : 1);
 
-    SIDeviceHandle device = NULL;
-    ret = SIGetDeviceHandle(service, &device);
-    if (ret != kIOReturnSuccess || !device) {
-        SIDebug("Failed to get device handle for service %#x. (%#x)", service, ret);
-        return ret;
-    }
+    uint32_t exponent = props->interval < 1 ? 0 : props->interval > 16 ? 15 : props->interval - 1u;
+    return (uint64_t)frameUs * 1000 << exponent;
+}
 
-    SIDebug("Acquired device handle successfully.");
+/// Get a configuration descriptor's 'wTotalLength', which is little-endian
+/// on the wire and in the cache alike.
+static uint16_t SIConfigTotalLength(void const *config)
+{
+    uint8_t const *bytes = config;
+    return (uint16_t)(bytes[2] | bytes[3] << 8);
+}
 
-    SIInterfaceHandle interface = NULL;
-    ret = SIGetInterfaceHandle(device, 0, &interface);
-    if (ret != kIOReturnSuccess || !interface) {
-        SIDebug("Failed to get interface handle for service %#x. (%#x)", service, ret);
+static void SIConfigSetTotalLength(void *config, uint16_t total)
+{
+    uint8_t *bytes = config;
+    bytes[2] = (uint8_t)total;
+    bytes[3] = (uint8_t)(total >> 8);
+}
 
-        (*device)->USBDeviceClose(device);
-        (*device)->Release(device);
+void SIDescriptorIteratorInit(SIDescriptorIterator *it, void const *config, size_t length)
+{
+    uint8_t const *bytes = config;
+    *it = (SIDescriptorIterator) { .position = bytes, .end = bytes, .status = kIOReturnSuccess };
 
-        return ret;
+    if (length < sizeof(SIConfigDescriptor) || bytes[0] < sizeof(SIConfigDescriptor)
+        || bytes[1] != kSIDescriptorTypeConfig) {
+        it->status = kIOReturnUnderrun;
+        return;
     }
 
-    SIDebug("Acquired interface handle successfully.");
-    SIDebug("Initializing client...");
+    uint16_t total = SIConfigTotalLength(bytes);
+    if (total < length)
+        length = total;
+    if (length < bytes[0]) {
+        it->status = kIOReturnUnderrun;
+        return;
+    }
 
-    client->device = device;
-    client->interface = interface;
-    client->regID = regID;
-    return kIOReturnSuccess;
+    it->position = bytes + bytes[0];
+    it->end = bytes + length;
 }
 
-IOReturn SIConnect(SIClient *client, uint16_t vendorID, uint16_t productID)
+/// Look at the next descriptor without moving past it.
+static SIDescriptorHeader const *SIDescriptorIteratorPeek(SIDescriptorIterator *it)
 {
-    SIDebug("Attempting to connect to device %#x:%#x...", vendorID, productID);
+    size_t remaining = (size_t)(it->end - it->position);
+    if (remaining == 0)
+        return NULL;
 
-    CFMutableDictionaryRef query = SIServiceMatchingUSBDevice(vendorID, productID);
-    if (!query) {
-        SIDebug("Failed to allocate matching dictionary.");
-        return kIOReturnError;
+    if (remaining < sizeof(SIDescriptorHeader) || it->position[0] < sizeof(SIDescriptorHeader)
+        || it->position[0] > remaining) {
+        SIDebug("Malformed descriptor at %p.", (void const *)it->position);
+        it->status = kIOReturnUnderrun;
+        it->position = it->end;
+        return NULL;
     }
 
-    io_iterator_t serviceIter = IO_OBJECT_NULL;
-    IOReturn ret = IOServiceGetMatchingServices(kIOMainPortDefault, query, &serviceIter);
-    if (ret != kIOReturnSuccess) {
-        SIDebug("Failed to get matching services. (%#x)", ret);
-        return ret;
-    }
+    return (SIDescriptorHeader const *)it->position;
+}
 
-    ret = kIOReturnNoDevice;
-    io_service_t service = IO_OBJECT_NULL;
-    while ((service = IOIteratorNext(serviceIter))) {
-        ret = SIClientInitWithService(client, service);
-        if (ret != kIOReturnSuccess) {
-            SIDebug("Failed to create client with service %#x. (%#x)", service, ret);
-            continue;
-        }
+SIDescriptorHeader const *SIDescriptorIteratorNext(SIDescriptorIterator *it)
+{
+    SIDescriptorHeader const *desc = SIDescriptorIteratorPeek(it);
+    if (!desc)
+        return NULL;
 
-        break;
+    // Interfaces and endpoints are handed out as their full structures, so
+    // make sure they really are that long.
+    size_t minLength = sizeof(SIDescriptorHeader);
+    if (desc->bDescriptorType == kSIDescriptorTypeInterface)
+        minLength = sizeof(SIInterfaceDescriptor);
+    else if (desc->bDescriptorType == kSIDescriptorTypeEndpoint)
+        minLength = sizeof(SIEndpointDescriptor);
+
+    if (desc->bLength < minLength) {
+        SIDebug("Descriptor of type %#x is too short (%u bytes).", desc->bDescriptorType, desc->bLength);
+        it->status = kIOReturnUnderrun;
+        it->position = it->end;
+        return NULL;
     }
 
-    IOObjectRelease(serviceIter);
-    return ret;
+    it->position += desc->bLength;
+    if (desc->bDescriptorType == kSIDescriptorTypeInterface)
+        it->interface = (SIInterfaceDescriptor const *)desc;
+
+    return desc;
 }
 
-static void SIHandleFirstMatch(void *context, io_iterator_t serviceIter)
+SIInterfaceDescriptor const *SIDescriptorIteratorNextInterface(SIDescriptorIterator *it)
 {
-    SIAsyncCallbacks const *callbacks = (SIAsyncCallbacks const *)context;
-
-    io_service_t service = IO_OBJECT_NULL;
-    while ((service = IOIteratorNext(serviceIter))) {
-        SIClient *client = SIClientCreate();
-        IOReturn ret = SIClientInitWithService(client, service);
-        if (ret != kIOReturnSuccess) {
-            SIDebug("Failed to create client with service %#x. (%#x)", service, ret);
+    SIDescriptorHeader const *desc;
+    while ((desc = SIDescriptorIteratorNext(it))) {
+        if (desc->bDescriptorType == kSIDescriptorTypeInterface)
+            return (SIInterfaceDescriptor const *)desc;
+    }
 
-            SIClientDestroy(client);
-            continue;
-        }
+    return NULL;
+}
 
-        callbacks->connect(client);
+SIEndpointDescriptor const *SIDescriptorIteratorNextEndpoint(SIDescriptorIterator *it)
+{
+    SIDescriptorHeader const *desc;
+    while ((desc = SIDescriptorIteratorPeek(it)) && desc->bDescriptorType != kSIDescriptorTypeInterface) {
+        if (!SIDescriptorIteratorNext(it))
+            return NULL;
+        if (desc->bDescriptorType == kSIDescriptorTypeEndpoint)
+            return (SIEndpointDescriptor const *)desc;
     }
+
+    return NULL;
 }
 
-static void SIHandleTerminated(void *context, io_iterator_t serviceIter)
+/// Build a pipe table from an interface (alternate setting 0) of a
+/// configuration, or its first interface if 'number' is negative. Pipe 0 is
+/// left for the caller to fill in.
+///
+/// The descriptors may hold several configuration blobs back-to-back; only
+/// the one with the given value is considered.
+static IOReturn SIParsePipes(uint8_t const *desc, size_t size, uint8_t configValue, int number,
+    uint8_t *interfaceOut, SIPipeProps *pipes, uint8_t *numEndpointsOut)
 {
-    SIAsyncCallbacks const *callbacks = (SIAsyncCallbacks const *)context;
+    // Skip whole configuration blobs until the right one turns up.
+    while (size >= sizeof(SIConfigDescriptor) && desc[1] == kSIDescriptorTypeConfig) {
+        SIConfigDescriptor const *config = (SIConfigDescriptor const *)desc;
+        size_t total = (size_t)(desc[2] | desc[3] << 8);
+        if (total < sizeof(SIConfigDescriptor))
+            break;
+        if (total > size)
+            total = size;
 
-    io_service_t service = IO_OBJECT_NULL;
-    while ((service = IOIteratorNext(serviceIter))) {
-        uint64_t entryID;
-        if (IORegistryEntryGetRegistryEntryID(service, &entryID) != kIOReturnSuccess)
-            goto L_next;
+        if (config->bConfigurationValue != configValue) {
+            desc += total;
+            size -= total;
+            continue;
+        }
 
-        if (callbacks)
-            callbacks->disconnect(entryID);
+        SIDescriptorIterator it;
+        SIDescriptorIteratorInit(&it, config, total);
 
-    L_next:
-        // TODO: Check error code?
-        IOObjectRelease(service);
+        SIInterfaceDescriptor const *interface;
+        while ((interface = SIDescriptorIteratorNextInterface(&it))
+            && (interface->bAlternateSetting != 0 || (number >= 0 && interface->bInterfaceNumber != number)))
+            ;
+        if (!interface)
+            break;
+
+        uint8_t numEndpoints = 0;
+        SIEndpointDescriptor const *endpoint;
+        while ((endpoint = SIDescriptorIteratorNextEndpoint(&it)) && numEndpoints + 1 < kSIPipesMax) {
+            uint8_t const *maxPacketSize = (uint8_t const *)&endpoint->wMaxPacketSize;
+            pipes[++numEndpoints] = (SIPipeProps) {
+                .direction = (endpoint->bEndpointAddress & 0x80) ? kSIPipeDirectionIn : kSIPipeDirectionOut,
+                .endpoint = endpoint->bEndpointAddress & 0x0f,
+                .max = (maxPacketSize[0] | maxPacketSize[1] << 8) & 0x7ff,
+                .type = endpoint->bmAttributes & 0x03,
+                .interval = endpoint->bInterval,
+            };
+        }
+
+        *interfaceOut = interface->bInterfaceNumber;
+        *numEndpointsOut = numEndpoints;
+        return kIOReturnSuccess;
     }
+
+    SIDebug("No interface %d found in configuration %u.", number, configValue);
+    return kIOReturnNotFound;
 }
 
-IOReturn SIConnectAsync(uint16_t vendorID, uint16_t productID, SIAsyncCallbacks *callbacks)
+#if defined(__APPLE__)
+#define kSIBackendDefault kSIBackendIOKit
+#elif defined(__linux__)
+#define kSIBackendDefault kSIBackendUsbfs
+#endif
+
+SIClient *SIClientCreate(void)
 {
-    IONotificationPortRef notifyPort = IONotificationPortCreate(kIOMainPortDefault);
-    if (!notifyPort)
-        return kIOReturnError;
+    return SIClientCreateWithBackend(&kSIBackendDefault);
+}
 
-    CFMutableDictionaryRef query = SIServiceMatchingUSBDevice(vendorID, productID);
-    if (!query)
-        return kIOReturnError;
+typedef struct SIAsyncState SIAsyncState;
+
+/// Transfer states, stored in 'SITransfer.state'.
+enum {
+    kSITransferIdle = 0,
+    kSITransferPending = 1, ///< Waiting for a free slot in its pipe's queue.
+    kSITransferActive = 2,  ///< Handed to the backend.
+    kSITransferStateMask = 0xff,
+
+    kSITransferSync = 1 << 8,      ///< Bypasses queue depth accounting.
+    kSITransferUncounted = 1 << 9, ///< Left out of the client's stats, for its caller to count.
+
+    /// Where an active transfer is tracked: one plus its index in
+    /// 'SIPipeQueue.slots', 'kSITransferOverflow', or zero if not yet.
+    kSITransferSlotShift = 16,
+};
+
+// Slot number of transfers tracked on 'SIPipeQueue.overflow'.
+#define kSITransferOverflow (kSIPipeSlots + 1)
+
+typedef struct {
+    SITransfer *head;
+    SITransfer *tail;
+} SITransferList;
+
+// Assumed cache line size, used to keep state written by different threads
+// apart.
+#define kSICacheLineSize 64
+
+// Active transfers tracked per pipe without locking; any beyond this go on
+// the pipe's overflow list.
+#define kSIPipeSlots 32
+
+// One pending transfer, as counted in the top half of 'SIPipeQueue.counts'.
+#define kSIPipePendingOne (1ull << 32)
+
+/// Per-pipe transfer queue.
+///
+/// While a pipe has room, submission and completion take no locks: queued
+/// transfers claim their share of the depth with a CAS on 'counts', and
+/// every transfer handed to the backend publishes itself in 'slots' so that
+/// 'SIAbortPipe' can find it. 'lock' is only taken once the pipe is full,
+/// to keep waiting transfers in order, and for the rare transfer that finds
+/// every slot taken.
+///
+/// A transfer leaving its slot must not reach its owner while someone is
+/// cancelling it, since the owner may free it from the callback. Cancellers
+/// bump 'cancelling' before reading a slot, and completions clear their slot
+/// before waiting for 'cancelling' to drop to zero; with both sides
+/// sequentially consistent, at least one of them sees the other.
+typedef struct {
+    uint64_t counts;     ///< Queued transfers in flight, plus pending ones in the top half.
+    uint32_t depth;      ///< Maximum number of queued transfers in flight.
+    uint32_t cancelling; ///< Threads cancelling transfers found in 'slots'.
+    SITransfer *slots[kSIPipeSlots];
+
+    pthread_mutex_t lock;
+    SITransferList pending;  ///< Transfers waiting for a free slot; guarded by 'lock'.
+    SITransferList overflow; ///< Active transfers without a slot; guarded by 'lock'.
+} __attribute__((aligned(kSICacheLineSize))) SIPipeQueue;
+
+typedef struct SIPoolEntry SIPoolEntry;
+
+struct SIAsyncState {
+    pthread_mutex_t lock; ///< Guards 'handling' and synchronous completions.
+    pthread_cond_t cond;
+    int handling; ///< Whether a thread is inside 'SIBackend.handleEvents'.
+    SIPipeQueue pipes[kSIPipesMax];
+    uint32_t controlTimeoutMs; ///< See 'SISetTimeouts'.
+    uint32_t pipeTimeoutMs;
+    uint32_t statsDisabled; ///< See 'SISetStatsEnabled'.
+    SICapture *capture;     ///< See 'SISetCapture'.
+    SIBufferPool *pools; ///< Buffer pools to free with the client; guarded by 'lock'.
+
+    pthread_mutex_t cacheLock; ///< Guards the cached descriptors and pipes.
+    uint8_t *descriptors;      ///< Descriptor arena (see 'SIDescriptorsFetch'), or NULL.
+    SIStringTable *strings;    ///< String table and its arena, or NULL.
+    SIPipeProps pipeCache[kSIPipesMax];
+    uint8_t numCachedPipes; ///< Zero until the pipe cache has been filled.
+
+    SIClientPool *pool;      ///< Pool servicing the client, or NULL.
+    SIPoolEntry *poolEntry;  ///< Membership of 'pool'; guarded by the pool's lock.
+
+    /// Counters, updated atomically. Control transfers are only counted by
+    /// request type, and 'transfers' and 'latency.count' are left at zero;
+    /// 'SIGetStats' works these out from the rest.
+    SIPipeStats pipeStats[kSIPipesMax];
+    SIPipeStats controlStats[4];
+};
+
+static void SITransferListAppend(SITransferList *list, SITransfer *transfer)
+{
+    transfer->next = NULL;
+    transfer->prev = list->tail;
+    if (list->tail)
+        list->tail->next = transfer;
+    else
+        list->head = transfer;
+    list->tail = transfer;
+}
+
+static void SITransferListRemove(SITransferList *list, SITransfer *transfer)
+{
+    if (transfer->prev)
+        transfer->prev->next = transfer->next;
+    else
+        list->head = transfer->next;
+    if (transfer->next)
+        transfer->next->prev = transfer->prev;
+    else
+        list->tail = transfer->prev;
+
+    transfer->prev = transfer->next = NULL;
+}
+
+// log2(kSIHistogramSubBuckets).
+#define kSIHistogramSubBits 2
+
+/// Pick the 'SIHistogram' bucket for a latency.
+static uint32_t SIHistogramBucket(uint64_t ns)
+{
+    if (ns < kSIHistogramSubBuckets)
+        return (uint32_t)ns;
+
+    uint32_t exponent = 63 - (uint32_t)__builtin_clzll(ns);
+    uint32_t bucket = (exponent - kSIHistogramSubBits + 1) * kSIHistogramSubBuckets
+        + (uint32_t)(ns >> (exponent - kSIHistogramSubBits)) % kSIHistogramSubBuckets;
+    return bucket < kSIHistogramBuckets ? bucket : kSIHistogramBuckets - 1;
+}
+
+uint64_t SIHistogramBucketNs(uint32_t bucket)
+{
+    if (bucket < kSIHistogramSubBuckets)
+        return bucket;
+
+    uint32_t exponent = bucket / kSIHistogramSubBuckets + kSIHistogramSubBits - 1;
+    uint64_t sub = bucket % kSIHistogramSubBuckets;
+    return (kSIHistogramSubBuckets + sub) << (exponent - kSIHistogramSubBits);
+}
+
+uint64_t SIHistogramPercentileNs(SIHistogram const *histogram, double percentile)
+{
+    if (!histogram->count)
+        return 0;
+
+    // Rank of the sample in question, from 1.
+    double exact = percentile / 100.0 * (double)histogram->count;
+    uint64_t rank = (uint64_t)exact;
+    if ((double)rank < exact)
+        rank++;
+    if (rank < 1)
+        rank = 1;
+
+    uint64_t seen = 0;
+    for (uint32_t bucket = 0; bucket < kSIHistogramBuckets - 1; ++bucket) {
+        seen += histogram->buckets[bucket];
+        if (seen >= rank)
+            return SIHistogramBucketNs(bucket + 1) - 1;
+    }
+
+    return SIHistogramBucketNs(kSIHistogramBuckets - 1);
+}
+
+static void SIStatsRecord(SIPipeStats *stats, IOReturn error, uint32_t length, uint64_t ns)
+{
+    if (length)
+        __atomic_add_fetch(&stats->bytes, length, __ATOMIC_RELAXED);
+
+    if (error == kIOReturnTimeout)
+        __atomic_add_fetch(&stats->timeouts, 1, __ATOMIC_RELAXED);
+    else if (error == kIOReturnAborted)
+        __atomic_add_fetch(&stats->aborts, 1, __ATOMIC_RELAXED);
+    else if (error != kIOReturnSuccess)
+        __atomic_add_fetch(&stats->errors, 1, __ATOMIC_RELAXED);
+
+    __atomic_add_fetch(&stats->latency.totalNs, ns, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stats->latency.buckets[SIHistogramBucket(ns)], 1, __ATOMIC_RELAXED);
+}
+
+static int SIStatsEnabled(SIClient *client)
+{
+    return !__atomic_load_n(&client->async->statsDisabled, __ATOMIC_RELAXED);
+}
+
+/// Count a finished transfer against its pipe, or a control transfer
+/// against its request type.
+static void SIStatsRecordTransfer(SIClient *client, uint8_t pipe, uint8_t requestType, SITransferResult const *result)
+{
+    if (pipe >= kSIPipesMax || !SIStatsEnabled(client))
+        return;
+
+    SIAsyncState *async = client->async;
+    SIPipeStats *stats = pipe == 0 ? &async->controlStats[(requestType >> 5) & 3] : &async->pipeStats[pipe];
+    SIStatsRecord(stats, result->error, result->length, result->waitNs + result->transferNs);
+}
+
+static void SIStatsCopy(SIPipeStats *out, SIPipeStats *stats)
+{
+    out->bytes = __atomic_load_n(&stats->bytes, __ATOMIC_RELAXED);
+    out->errors = __atomic_load_n(&stats->errors, __ATOMIC_RELAXED);
+    out->timeouts = __atomic_load_n(&stats->timeouts, __ATOMIC_RELAXED);
+    out->aborts = __atomic_load_n(&stats->aborts, __ATOMIC_RELAXED);
+    out->latency.totalNs = __atomic_load_n(&stats->latency.totalNs, __ATOMIC_RELAXED);
+
+    out->latency.count = 0;
+    for (uint32_t bucket = 0; bucket < kSIHistogramBuckets; ++bucket) {
+        out->latency.buckets[bucket] = __atomic_load_n(&stats->latency.buckets[bucket], __ATOMIC_RELAXED);
+        out->latency.count += out->latency.buckets[bucket];
+    }
+    out->transfers = out->latency.count;
+}
+
+static void SIStatsAdd(SIPipeStats *total, SIPipeStats const *stats)
+{
+    total->transfers += stats->transfers;
+    total->bytes += stats->bytes;
+    total->errors += stats->errors;
+    total->timeouts += stats->timeouts;
+    total->aborts += stats->aborts;
+    total->latency.count += stats->latency.count;
+    total->latency.totalNs += stats->latency.totalNs;
+    for (uint32_t bucket = 0; bucket < kSIHistogramBuckets; ++bucket)
+        total->latency.buckets[bucket] += stats->latency.buckets[bucket];
+}
+
+IOReturn SIGetStats(SIClient *client, SIStats *stats)
+{
+    SIAsyncState *async = client->async;
+    for (uint8_t pipe = 1; pipe < kSIPipesMax; ++pipe)
+        SIStatsCopy(&stats->pipes[pipe], &async->pipeStats[pipe]);
+
+    memset(&stats->pipes[0], 0, sizeof(stats->pipes[0]));
+    for (int type = 0; type < 4; ++type) {
+        SIStatsCopy(&stats->control[type], &async->controlStats[type]);
+        SIStatsAdd(&stats->pipes[0], &stats->control[type]);
+    }
+
+    return kIOReturnSuccess;
+}
+
+void SISetStatsEnabled(SIClient *client, int enabled)
+{
+    __atomic_store_n(&client->async->statsDisabled, !enabled, __ATOMIC_RELAXED);
+}
+
+// Defaults for 'SICaptureConfig'.
+#define kSICaptureSnapLengthDefault 0x10000
+#define kSICaptureBufferSizeDefault 0x400000
+
+// How often the writer flushes a buffer which hasn't filled up.
+#define kSICaptureFlushIntervalNs 100000000ull
+
+// pcapng block types, and the link type of usbmon's binary interface.
+#define kSIPcapngSectionHeader 0x0a0d0d0a
+#define kSIPcapngInterfaceDescription 1
+#define kSIPcapngEnhancedPacket 6
+#define kSIPcapngLinkTypeUsbmon 220
+
+// Enhanced Packet Block fields before the packet, and its trailing length.
+#define kSIPcapngPacketOverhead (7 * sizeof(uint32_t) + sizeof(uint32_t))
+
+/// Header of each packet in a usbmon capture, as 'struct usbmon_packet' in
+/// Linux's usbmon documentation, in host byte order.
+typedef struct {
+    uint64_t id;         ///< Tag matching a submission with its completion.
+    uint8_t type;        ///< 'S'ubmission or 'C'ompletion.
+    uint8_t transferType; ///< 0 isochronous, 1 interrupt, 2 control, 3 bulk.
+    uint8_t endpoint;    ///< Endpoint address, with the direction bit.
+    uint8_t device;
+    uint16_t bus;
+    char setupFlag;      ///< Zero if 'setup' is valid.
+    char dataFlag;       ///< Zero if data follows.
+    int64_t seconds;
+    int32_t microseconds;
+    int32_t status;      ///< Negative errno, or -EINPROGRESS on submission.
+    uint32_t length;     ///< Requested length on submission, actual on completion.
+    uint32_t capturedLength;
+    uint8_t setup[8];
+    int32_t interval;
+    int32_t startFrame;
+    uint32_t transferFlags;
+    uint32_t numDescriptors;
+} SIUsbmonPacket;
+
+/// Isochronous packet descriptor, as 'struct usbmon_isodesc'; as many as
+/// 'SIUsbmonPacket.numDescriptors' come between the header and the data.
+typedef struct {
+    int32_t status;
+    uint32_t offset; ///< Of the packet's data, from the start of the data.
+    uint32_t length; ///< Requested length on submission, actual on completion.
+    uint32_t padding;
+} SIUsbmonIsoDescriptor;
+
+struct SICapture {
+    int fd;
+    uint32_t snapLength;
+    size_t bufferSize;
+    int64_t realtimeOffsetNs; ///< Wall clock time less monotonic time.
+    uint64_t nextID;          ///< Last tag given to a synchronous call.
+    pthread_t writer;
+
+    pthread_mutex_t lock; ///< Guards everything below.
+    pthread_cond_t cond;  ///< Signals the writer.
+    uint8_t *buffers[2];
+    int filling;          ///< Index of the buffer being filled.
+    size_t used;          ///< Bytes in the buffer being filled.
+    size_t flushing;      ///< Bytes in the other buffer for the writer, or zero once written.
+    int closing;
+    SICaptureStats stats;
+};
+
+/// Hand the buffer being filled to the writer, unless it's still busy with
+/// the other one. Called with the lock held.
+static int SICaptureSwap(SICapture *capture)
+{
+    if (capture->flushing)
+        return 0;
+
+    capture->flushing = capture->used;
+    capture->filling ^= 1;
+    capture->used = 0;
+    pthread_cond_signal(&capture->cond);
+    return 1;
+}
+
+static void *SICaptureWriter(void *context)
+{
+    SICapture *capture = context;
+    int timedOut = 0;
+
+    pthread_mutex_lock(&capture->lock);
+    for (;;) {
+        // Flush whatever there is now and then, so that the file keeps up
+        // with a quiet device.
+        if (!capture->flushing && capture->used && (timedOut || capture->closing))
+            SICaptureSwap(capture);
+
+        if (capture->flushing) {
+            uint8_t const *buffer = capture->buffers[capture->filling ^ 1];
+            size_t length = capture->flushing;
+            pthread_mutex_unlock(&capture->lock);
+            IOReturn ret = SIWriteAll(capture->fd, buffer, length);
+            pthread_mutex_lock(&capture->lock);
+
+            if (ret != kIOReturnSuccess)
+                capture->stats.errors++;
+            capture->flushing = 0;
+            continue;
+        }
+
+        if (capture->closing)
+            break;
+        timedOut = SICondWaitUntilNs(&capture->cond, &capture->lock, SIGetTimeNs() + kSICaptureFlushIntervalNs)
+            == ETIMEDOUT;
+    }
+    pthread_mutex_unlock(&capture->lock);
+
+    return NULL;
+}
+
+/// Write the pcapng section header and the description of the one
+/// interface every packet is captured on.
+static IOReturn SICaptureWriteHeader(SICapture *capture)
+{
+    struct {
+        uint32_t type;
+        uint32_t length;
+        uint32_t byteOrder;
+        uint16_t major;
+        uint16_t minor;
+        int64_t sectionLength;
+        uint32_t trailer;
+    } __attribute__((packed)) const section = {
+        .type = kSIPcapngSectionHeader,
+        .length = sizeof(section),
+        .byteOrder = 0x1a2b3c4d,
+        .major = 1,
+        .minor = 0,
+        .sectionLength = -1,
+        .trailer = sizeof(section),
+    };
+
+    // Timestamps are in nanoseconds ('if_tsresol' of 9).
+    struct {
+        uint32_t type;
+        uint32_t length;
+        uint16_t linkType;
+        uint16_t reserved;
+        uint32_t snapLength;
+        uint16_t resolutionCode;
+        uint16_t resolutionLength;
+        uint8_t resolution[4];
+        uint32_t endOfOptions;
+        uint32_t trailer;
+    } __attribute__((packed)) const interface = {
+        .type = kSIPcapngInterfaceDescription,
+        .length = sizeof(interface),
+        .linkType = kSIPcapngLinkTypeUsbmon,
+        .snapLength = (uint32_t)sizeof(SIUsbmonPacket) + capture->snapLength,
+        .resolutionCode = 9,
+        .resolutionLength = 1,
+        .resolution = { 9 },
+        .trailer = sizeof(interface),
+    };
+
+    IOReturn ret = SIWriteAll(capture->fd, &section, sizeof(section));
+    if (ret == kIOReturnSuccess)
+        ret = SIWriteAll(capture->fd, &interface, sizeof(interface));
+    return ret;
+}
+
+IOReturn SICaptureOpen(char const *path, SICaptureConfig const *config, SICapture **captureOut)
+{
+    SICaptureConfig defaults = { 0 };
+    if (!config)
+        config = &defaults;
+
+    SICapture *capture = calloc(1, sizeof(SICapture));
+    if (!capture)
+        return kIOReturnNoMemory;
+
+    // Each buffer must take at least two of the largest packets, so one
+    // can always be handed over half full; isochronous descriptors are never
+    // cut short, so those count in full.
+    capture->snapLength = config->snapLength ? config->snapLength : kSICaptureSnapLengthDefault;
+    size_t largest = kSIPcapngPacketOverhead + sizeof(SIUsbmonPacket)
+        + kSIIsoPacketsMax * sizeof(SIUsbmonIsoDescriptor) + capture->snapLength + 3;
+    capture->bufferSize = config->bufferSize ? config->bufferSize : kSICaptureBufferSizeDefault;
+    if (capture->bufferSize < 2 * largest)
+        capture->bufferSize = 2 * largest;
+
+    IOReturn ret = kIOReturnNoMemory;
+    capture->fd = -1;
+    if (!(capture->buffers[0] = malloc(capture->bufferSize)) || !(capture->buffers[1] = malloc(capture->bufferSize)))
+        goto L_failed;
+
+    if ((capture->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0) {
+        SIDebug("Failed to open '%s': %s", path, strerror(errno));
+        ret = (errno == EACCES || errno == EPERM) ? kIOReturnNotPrivileged : kIOReturnIOError;
+        goto L_failed;
+    }
+    if ((ret = SICaptureWriteHeader(capture)) != kIOReturnSuccess)
+        goto L_failed;
+
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    capture->realtimeOffsetNs = (int64_t)((uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec)
+        - (int64_t)SIGetTimeNs();
+
+    pthread_mutex_init(&capture->lock, NULL);
+    SICondInit(&capture->cond);
+    if (pthread_create(&capture->writer, NULL, SICaptureWriter, capture) != 0) {
+        pthread_cond_destroy(&capture->cond);
+        pthread_mutex_destroy(&capture->lock);
+        ret = kIOReturnNoResources;
+        goto L_failed;
+    }
+
+    *captureOut = capture;
+    return kIOReturnSuccess;
+
+L_failed:
+    if (capture->fd >= 0)
+        close(capture->fd);
+    free(capture->buffers[0]);
+    free(capture->buffers[1]);
+    free(capture);
+    return ret;
+}
+
+void SICaptureClose(SICapture *capture)
+{
+    pthread_mutex_lock(&capture->lock);
+    capture->closing = 1;
+    pthread_cond_signal(&capture->cond);
+    pthread_mutex_unlock(&capture->lock);
+    pthread_join(capture->writer, NULL);
+
+    close(capture->fd);
+    pthread_cond_destroy(&capture->cond);
+    pthread_mutex_destroy(&capture->lock);
+    free(capture->buffers[0]);
+    free(capture->buffers[1]);
+    free(capture);
+}
+
+void SISetCapture(SIClient *client, SICapture *capture)
+{
+    __atomic_store_n(&client->async->capture, capture, __ATOMIC_RELEASE);
+}
+
+void SICaptureGetStats(SICapture *capture, SICaptureStats *stats)
+{
+    pthread_mutex_lock(&capture->lock);
+    *stats = capture->stats;
+    pthread_mutex_unlock(&capture->lock);
+}
+
+/// Get the capture attached to a client, if any.
+static SICapture *SICaptureGet(SIClient *client)
+{
+    return __atomic_load_n(&client->async->capture, __ATOMIC_ACQUIRE);
+}
+
+/// Append one packet to the buffer being filled, timestamped now.
+///
+/// Isochronous descriptors, if any, always go in whole; the snap length
+/// only cuts the data short.
+static void SICaptureRecord(SICapture *capture, SIUsbmonPacket *packet, SIUsbmonIsoDescriptor const *descriptors,
+    void const *data, uint32_t dataLength)
+{
+    uint32_t descLength = packet->numDescriptors * (uint32_t)sizeof(SIUsbmonIsoDescriptor);
+    uint32_t captured = dataLength < capture->snapLength ? dataLength : capture->snapLength;
+    uint64_t now = (uint64_t)((int64_t)SIGetTimeNs() + capture->realtimeOffsetNs);
+    packet->seconds = (int64_t)(now / 1000000000ull);
+    packet->microseconds = (int32_t)(now % 1000000000ull / 1000);
+    packet->capturedLength = descLength + captured;
+
+    uint32_t packetLength = (uint32_t)sizeof(SIUsbmonPacket) + descLength + captured;
+    uint32_t padding = -packetLength & 3;
+    uint32_t blockLength = (uint32_t)kSIPcapngPacketOverhead + packetLength + padding;
+    uint32_t const block[7] = {
+        kSIPcapngEnhancedPacket, blockLength, 0, (uint32_t)(now >> 32), (uint32_t)now,
+        packetLength, (uint32_t)sizeof(SIUsbmonPacket) + descLength + dataLength,
+    };
+
+    pthread_mutex_lock(&capture->lock);
+    if (capture->used + blockLength > capture->bufferSize
+        && (!SICaptureSwap(capture) || capture->used + blockLength > capture->bufferSize)) {
+        capture->stats.dropped++;
+        pthread_mutex_unlock(&capture->lock);
+        return;
+    }
+
+    uint8_t *out = capture->buffers[capture->filling] + capture->used;
+    memcpy(out, block, sizeof(block));
+    memcpy(out += sizeof(block), packet, sizeof(SIUsbmonPacket));
+    out += sizeof(SIUsbmonPacket);
+    if (descLength)
+        memcpy(out, descriptors, descLength);
+    out += descLength;
+    if (captured)
+        memcpy(out, data, captured);
+    memset(out += captured, 0, padding);
+    memcpy(out + padding, &blockLength, sizeof(blockLength));
+
+    capture->used += blockLength;
+    capture->stats.packets++;
+    capture->stats.bytes += blockLength;
+
+    // Hand the buffer over half full, so the writer is done with the other
+    // one before this fills up.
+    if (capture->used >= capture->bufferSize / 2)
+        SICaptureSwap(capture);
+    pthread_mutex_unlock(&capture->lock);
+}
+
+/// Translate a transfer's status into the errno usbmon would report.
+static int32_t SICaptureStatus(IOReturn error)
+{
+    switch (error) {
+    case kIOReturnSuccess:
+        return 0;
+    case kIOReturnAborted:
+        return -ENOENT;
+    case kIOReturnTimeout:
+        return -ETIMEDOUT;
+    case kIOUSBPipeStalled:
+        return -EPIPE;
+    case kIOReturnOverrun:
+        return -EOVERFLOW;
+    case kIOReturnIsoTooOld:
+        return -EXDEV;
+    case kIOReturnNoDevice:
+        return -ENODEV;
+    default:
+        return -EPROTO;
+    }
+}
+
+/// Record the submission ('S') or completion ('C') of a transfer.
+///
+/// The payload only goes with whichever of the two carries it: OUT data on
+/// submission, IN data on completion.
+static void SICapturePacket(SICapture *capture, SIClient *client, uint64_t id, uint8_t type, uint8_t pipe,
+    uint8_t requestType, SISetupPacket const *setup, void const *data, uint32_t length, IOReturn status)
+{
+    // usbmon's transfer type numbers, by 'SIPipeType'.
+    static uint8_t const kTransferTypes[] = { 2, 0, 3, 1 };
+
+    SIUsbmonPacket packet = {
+        .id = id,
+        .type = type,
+        .transferType = 2,
+        .device = (uint8_t)(client->regID & 0x7f),
+        .bus = (uint16_t)(client->regID >> 16),
+        .setupFlag = setup ? 0 : '-',
+        .status = type == 'S' ? -EINPROGRESS : SICaptureStatus(status),
+        .length = length,
+    };
+
+    int in = requestType & kSIDirectionToHost;
+    SIPipeProps props;
+    if (pipe != 0 && SIGetPipe(client, pipe, &props) == kIOReturnSuccess) {
+        in = props.direction == kSIPipeDirectionIn;
+        packet.transferType = kTransferTypes[props.type & 3];
+        packet.endpoint = props.endpoint;
+        packet.interval = props.interval;
+    }
+    if (in)
+        packet.endpoint |= 0x80;
+    if (setup)
+        memcpy(packet.setup, setup, sizeof(packet.setup));
+
+    uint32_t dataLength = length;
+    if ((type == 'S') == (in != 0)) {
+        packet.dataFlag = type == 'S' ? '<' : '>';
+        dataLength = 0;
+    }
+
+    SICaptureRecord(capture, &packet, NULL, data, dataLength);
+}
+
+/// Record a transfer's submission, returning the tag to record its
+/// completion with; zero 'id' picks one for a synchronous call.
+static uint64_t SICaptureSubmit(SICapture *capture, SIClient *client, uint64_t id, uint8_t pipe,
+    SISetupPacket const *setup, void const *data, uint32_t length)
+{
+    if (!id)
+        id = __atomic_add_fetch(&capture->nextID, 1, __ATOMIC_RELAXED);
+
+    SICapturePacket(capture, client, id, 'S', pipe, setup ? setup->bmRequestType : 0, setup, data, length,
+        kIOReturnSuccess);
+    return id;
+}
+
+static void SICaptureComplete(SICapture *capture, SIClient *client, uint64_t id, uint8_t pipe, uint8_t requestType,
+    void const *data, uint32_t actual, IOReturn status)
+{
+    SICapturePacket(capture, client, id, 'C', pipe, requestType, NULL, data, actual, status);
+}
+
+/// Record the submission or completion of an isochronous transfer, with a
+/// descriptor for each of its packets.
+static void SICaptureIsochronous(SICapture *capture, SITransfer *transfer, uint8_t type)
+{
+    SIClient *client = transfer->client;
+    SIPipeProps props;
+    if (SIGetPipe(client, transfer->pipe, &props) != kIOReturnSuccess)
+        return;
+
+    int in = props.direction == kSIPipeDirectionIn;
+    SIUsbmonPacket packet = {
+        .id = (uintptr_t)transfer,
+        .type = type,
+        .transferType = 0,
+        .endpoint = (uint8_t)(props.endpoint | (in ? 0x80 : 0)),
+        .device = (uint8_t)(client->regID & 0x7f),
+        .bus = (uint16_t)(client->regID >> 16),
+        .setupFlag = '-',
+        .status = type == 'S' ? -EINPROGRESS : SICaptureStatus(transfer->result.error),
+        .interval = props.interval,
+        .numDescriptors = transfer->numPackets,
+    };
+
+    // In place of a setup packet, usbmon gives the error count and the
+    // number of descriptors.
+    SIUsbmonIsoDescriptor descriptors[kSIIsoPacketsMax];
+    int32_t iso[2] = { 0, (int32_t)transfer->numPackets };
+    uint32_t offset = 0, end = 0;
+    for (uint32_t i = 0; i < transfer->numPackets; ++i) {
+        SIIsoPacket const *isoPacket = &transfer->packets[i];
+        descriptors[i] = (SIUsbmonIsoDescriptor) {
+            .status = type == 'S' ? 0 : SICaptureStatus(isoPacket->status),
+            .offset = offset,
+            .length = type == 'S' ? isoPacket->length : isoPacket->actual,
+        };
+        if (type == 'C' && isoPacket->status != kIOReturnSuccess)
+            iso[0]++;
+        if (descriptors[i].length)
+            end = offset + descriptors[i].length;
+        offset += isoPacket->length;
+    }
+    memcpy(packet.setup, iso, sizeof(iso));
+    packet.length = type == 'S' ? offset : transfer->result.length;
+
+    uint32_t dataLength = end;
+    if ((type == 'S') == in) {
+        packet.dataFlag = type == 'S' ? '<' : '>';
+        dataLength = 0;
+    }
+
+    SICaptureRecord(capture, &packet, descriptors, transfer->buffer, dataLength);
+}
+
+/// Record the submission or completion of an asynchronous transfer, tagged
+/// with its address as usbmon tags URBs.
+static void SICaptureTransfer(SICapture *capture, SITransfer *transfer, uint8_t type)
+{
+    if (transfer->numPackets) {
+        SICaptureIsochronous(capture, transfer, type);
+        return;
+    }
+
+    SISetupPacket const *setup = NULL;
+    uint8_t *data = transfer->buffer;
+    uint32_t length = transfer->length;
+    if (transfer->pipe == 0) {
+        setup = (SISetupPacket const *)data;
+        data += sizeof(SISetupPacket);
+        length -= (uint32_t)sizeof(SISetupPacket);
+    }
+
+    if (type == 'S')
+        SICaptureSubmit(capture, transfer->client, (uintptr_t)transfer, transfer->pipe, setup, data, length);
+    else
+        SICaptureComplete(capture, transfer->client, (uintptr_t)transfer, transfer->pipe,
+            setup ? setup->bmRequestType : 0, data, transfer->result.length, transfer->result.error);
+}
+
+/// Cancellation token state.
+struct SICancelToken {
+    SIClient *client;
+    uint32_t cancelled;
+};
+
+/// Whether a transfer's cancellation token has been cancelled.
+static int SITransferTokenCancelled(SICancelToken const *token)
+{
+    return token && __atomic_load_n(&token->cancelled, __ATOMIC_SEQ_CST);
+}
+
+/// Take a share of a pipe's depth for a queued transfer, or leave it on the
+/// pending list if the pipe is full.
+///
+/// \param startOut Set to whether the transfer may be started now.
+/// \return 'kIOReturnAborted' if the transfer's token has been cancelled.
+static IOReturn SIPipeQueueAcquire(SIPipeQueue *queue, SITransfer *transfer, int *startOut)
+{
+    uint64_t counts = __atomic_load_n(&queue->counts, __ATOMIC_RELAXED);
+    while ((uint32_t)counts < __atomic_load_n(&queue->depth, __ATOMIC_RELAXED)) {
+        if (__atomic_compare_exchange_n(&queue->counts, &counts, counts + 1, 1, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            *startOut = 1;
+            return kIOReturnSuccess;
+        }
+    }
+
+    // Pending transfers are only counted and promoted with the lock held,
+    // so a completion that sees this one counted will also find it listed.
+    // The same goes for 'SICancelTokenCancel', which looks for them after
+    // marking the token.
+    pthread_mutex_lock(&queue->lock);
+    if (SITransferTokenCancelled(transfer->token)) {
+        pthread_mutex_unlock(&queue->lock);
+        return kIOReturnAborted;
+    }
+
+    counts = __atomic_load_n(&queue->counts, __ATOMIC_RELAXED);
+    int room;
+    do {
+        room = (uint32_t)counts < __atomic_load_n(&queue->depth, __ATOMIC_RELAXED);
+    } while (!__atomic_compare_exchange_n(&queue->counts, &counts, room ? counts + 1 : counts + kSIPipePendingOne,
+        1, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+    if (!room) {
+        __atomic_store_n(&transfer->state, kSITransferPending, __ATOMIC_RELAXED);
+        SITransferListAppend(&queue->pending, transfer);
+    }
+    pthread_mutex_unlock(&queue->lock);
+
+    *startOut = room;
+    return kIOReturnSuccess;
+}
+
+/// Give back a queued transfer's share of a pipe's depth, handing it
+/// straight to the oldest pending transfer if there is one.
+///
+/// \return The promoted transfer, which the caller must start.
+static SITransfer *SIPipeQueueRelease(SIPipeQueue *queue)
+{
+    int locked = 0, promote;
+
+    uint64_t counts = __atomic_load_n(&queue->counts, __ATOMIC_RELAXED);
+    for (;;) {
+        promote = (counts >> 32) && (uint32_t)counts <= __atomic_load_n(&queue->depth, __ATOMIC_RELAXED);
+        if (promote && !locked) {
+            pthread_mutex_lock(&queue->lock);
+            locked = 1;
+            counts = __atomic_load_n(&queue->counts, __ATOMIC_RELAXED);
+            continue;
+        }
+
+        if (__atomic_compare_exchange_n(&queue->counts, &counts, promote ? counts - kSIPipePendingOne : counts - 1,
+                1, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+            break;
+    }
+
+    SITransfer *next = NULL;
+    if (promote) {
+        next = queue->pending.head;
+        SITransferListRemove(&queue->pending, next);
+        __atomic_store_n(&next->state, kSITransferActive, __ATOMIC_RELAXED);
+    }
+    if (locked)
+        pthread_mutex_unlock(&queue->lock);
+
+    return next;
+}
+
+/// Publish a transfer about to be handed to the backend, so that
+/// 'SIAbortPipe' can find it.
+static void SIPipeQueueTrack(SIPipeQueue *queue, SITransfer *transfer, uint32_t state)
+{
+    // Start from somewhere particular to the transfer, so that threads
+    // submitting at once don't all fight over the first free slot.
+    uint32_t start = (uint32_t)((uintptr_t)transfer / sizeof(SITransfer));
+    for (uint32_t i = 0; i < kSIPipeSlots; ++i) {
+        uint32_t slot = (start + i) % kSIPipeSlots;
+        SITransfer *expected = NULL;
+        if (__atomic_load_n(&queue->slots[slot], __ATOMIC_RELAXED) == NULL
+            && __atomic_compare_exchange_n(&queue->slots[slot], &expected, transfer, 0, __ATOMIC_SEQ_CST,
+                __ATOMIC_RELAXED)) {
+            __atomic_store_n(&transfer->state, state | (slot + 1) << kSITransferSlotShift, __ATOMIC_RELAXED);
+            return;
+        }
+    }
+
+    pthread_mutex_lock(&queue->lock);
+    __atomic_store_n(&transfer->state, state | kSITransferOverflow << kSITransferSlotShift, __ATOMIC_RELAXED);
+    SITransferListAppend(&queue->overflow, transfer);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+/// Withdraw a transfer published by 'SIPipeQueueTrack' once the backend is
+/// done with it, waiting out anyone who might still be cancelling it.
+static void SIPipeQueueUntrack(SIPipeQueue *queue, SITransfer *transfer)
+{
+    uint32_t state = __atomic_load_n(&transfer->state, __ATOMIC_RELAXED);
+    uint32_t slot = state >> kSITransferSlotShift;
+    if (slot == kSITransferOverflow) {
+        pthread_mutex_lock(&queue->lock);
+        SITransferListRemove(&queue->overflow, transfer);
+        __atomic_store_n(&transfer->state, state & ~(0xffu << kSITransferSlotShift), __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&queue->lock);
+        return;
+    }
+
+    __atomic_store_n(&queue->slots[slot - 1], NULL, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&queue->cancelling, __ATOMIC_SEQ_CST))
+        sched_yield();
+}
+
+/// Ask the backend to give up a transfer tracked with 'state', unless it has
+/// already left the pipe.
+static IOReturn SIPipeQueueCancelTracked(SIClient *client, SIPipeQueue *queue, SITransfer *transfer,
+    uint32_t state)
+{
+    if (!client->backend->cancelTransfer)
+        return kIOReturnUnsupported;
+
+    IOReturn ret = kIOReturnNotFound;
+    uint32_t slot = state >> kSITransferSlotShift;
+    if (slot == kSITransferOverflow) {
+        pthread_mutex_lock(&queue->lock);
+        for (SITransfer *it = queue->overflow.head; it; it = it->next) {
+            if (it == transfer) {
+                ret = client->backend->cancelTransfer(transfer);
+                break;
+            }
+        }
+        pthread_mutex_unlock(&queue->lock);
+    } else if (slot != 0) {
+        __atomic_fetch_add(&queue->cancelling, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&queue->slots[slot - 1], __ATOMIC_SEQ_CST) == transfer)
+            ret = client->backend->cancelTransfer(transfer);
+        __atomic_fetch_sub(&queue->cancelling, 1, __ATOMIC_SEQ_CST);
+    }
+
+    return ret;
+}
+
+/// Cancel a pipe's transfers with the backend: all of them, or only those
+/// using 'token'.
+///
+/// \return Whether any were left running because the backend can't cancel
+/// single transfers.
+static int SIPipeQueueCancelActive(SIClient *client, SIPipeQueue *queue, SICancelToken const *token)
+{
+    int unsupported = 0;
+
+    __atomic_fetch_add(&queue->cancelling, 1, __ATOMIC_SEQ_CST);
+    for (uint32_t i = 0; i < kSIPipeSlots; ++i) {
+        SITransfer *transfer = __atomic_load_n(&queue->slots[i], __ATOMIC_SEQ_CST);
+        if (!transfer || (token && transfer->token != token))
+            continue;
+
+        if (!client->backend->cancelTransfer || client->backend->cancelTransfer(transfer) == kIOReturnUnsupported)
+            unsupported = 1;
+    }
+    __atomic_fetch_sub(&queue->cancelling, 1, __ATOMIC_SEQ_CST);
+
+    pthread_mutex_lock(&queue->lock);
+    for (SITransfer *transfer = queue->overflow.head; transfer; transfer = transfer->next) {
+        if (token && transfer->token != token)
+            continue;
+
+        if (!client->backend->cancelTransfer || client->backend->cancelTransfer(transfer) == kIOReturnUnsupported)
+            unsupported = 1;
+    }
+    pthread_mutex_unlock(&queue->lock);
+
+    return unsupported;
+}
+
+/// Take transfers waiting for a slot off a pipe's queue: all of them, or
+/// only those using 'token'.
+///
+/// \return The transfers taken, linked in order, for 'SITransferAbortList'.
+static SITransfer *SIPipeQueueDrop(SIPipeQueue *queue, SICancelToken const *token)
+{
+    SITransferList dropped = { NULL, NULL };
+
+    pthread_mutex_lock(&queue->lock);
+    SITransfer *transfer = queue->pending.head;
+    while (transfer) {
+        SITransfer *next = transfer->next;
+        if (!token || transfer->token == token) {
+            SITransferListRemove(&queue->pending, transfer);
+            __atomic_sub_fetch(&queue->counts, kSIPipePendingOne, __ATOMIC_ACQ_REL);
+            __atomic_store_n(&transfer->state, kSITransferIdle, __ATOMIC_RELAXED);
+            SITransferListAppend(&dropped, transfer);
+        }
+        transfer = next;
+    }
+    pthread_mutex_unlock(&queue->lock);
+
+    return dropped.head;
+}
+
+/// Complete transfers taken by 'SIPipeQueueDrop' with 'kIOReturnAborted'.
+static void SITransferAbortList(SITransfer *transfer)
+{
+    while (transfer) {
+        SITransfer *next = transfer->next;
+        transfer->prev = transfer->next = NULL;
+        transfer->result = (SITransferResult) { .error = kIOReturnAborted, .length = 0 };
+        transfer->callback(transfer);
+        transfer = next;
+    }
+}
+
+/// Whether any of a pipe's transfers are still with the backend.
+static int SIPipeQueueBusy(SIPipeQueue *queue)
+{
+    for (uint32_t i = 0; i < kSIPipeSlots; ++i) {
+        if (__atomic_load_n(&queue->slots[i], __ATOMIC_RELAXED))
+            return 1;
+    }
+
+    pthread_mutex_lock(&queue->lock);
+    int busy = queue->overflow.head != NULL;
+    pthread_mutex_unlock(&queue->lock);
+
+    return busy;
+}
+
+SIClient *SIClientCreateWithBackend(SIBackend const *backend)
+{
+    SIClient *client = calloc(1, sizeof(SIClient));
+    if (!client)
+        return NULL;
+
+    // Pipe queues are kept on cache lines of their own, so that threads
+    // driving different pipes don't contend.
+    void *storage = NULL;
+    if (posix_memalign(&storage, kSICacheLineSize, sizeof(SIAsyncState)) != 0) {
+        free(client);
+        return NULL;
+    }
+
+    SIAsyncState *async = memset(storage, 0, sizeof(SIAsyncState));
+
+    pthread_mutex_init(&async->lock, NULL);
+    pthread_mutex_init(&async->cacheLock, NULL);
+    SICondInit(&async->cond);
+    for (uint8_t i = 0; i < kSIPipesMax; ++i) {
+        pthread_mutex_init(&async->pipes[i].lock, NULL);
+        async->pipes[i].depth = kSIQueueDepthDefault;
+    }
+    async->controlTimeoutMs = kSIRequestTimeoutDefault;
+
+    client->backend = backend;
+    client->async = async;
+    return client;
+}
+
+void SIClientDestroy(SIClient *client)
+{
+    SIDebug("Destroying client %p...", (void *)client);
+
+    SIClientPool *pool = __atomic_load_n(&client->async->pool, __ATOMIC_ACQUIRE);
+    if (pool)
+        SIClientPoolRemove(pool, client);
+
+    if (client->handle) {
+        // Give the backend a chance to hand back anything still in flight,
+        // so that no completions arrive after the client is gone.
+        for (uint8_t i = 0; i < kSIPipesMax; ++i)
+            SIAbortPipe(client, i);
+
+        for (int tries = 0; tries < 100; ++tries) {
+            int busy = 0;
+            for (uint8_t i = 0; i < kSIPipesMax; ++i)
+                busy |= SIPipeQueueBusy(&client->async->pipes[i]);
+            if (!busy || SIHandleEvents(client, 10) != kIOReturnSuccess)
+                break;
+        }
+    }
+
+    while (client->async->pools)
+        SIBufferPoolDestroy(client->async->pools);
+
+    if (client->handle) {
+        client->backend->disconnect(client);
+    }
+
+    for (uint8_t i = 0; i < kSIPipesMax; ++i)
+        pthread_mutex_destroy(&client->async->pipes[i].lock);
+    SIInvalidateDescriptors(client);
+    pthread_cond_destroy(&client->async->cond);
+    pthread_mutex_destroy(&client->async->cacheLock);
+    pthread_mutex_destroy(&client->async->lock);
+    free(client->async);
+    free(client);
+}
+
+IOReturn SIConnect(SIClient *client, uint16_t vendorID, uint16_t productID)
+{
+    SIDebug("Attempting to connect to device %#x:%#x via %s...", vendorID, productID,
+        client->backend->name);
+
+    if (client->handle)
+        return kIOReturnExclusiveAccess;
+
+    // Whatever was cached belonged to the last device.
+    SIInvalidateDescriptors(client);
+    IOReturn ret = client->backend->connect(client, vendorID, productID);
+    SITrace(kSITraceConnect, vendorID, productID, ret, 0);
+    return ret;
+}
+
+/// Get a client's control transfer timeout, for backends to pass on.
+static uint32_t SIControlTimeoutMs(SIClient *client)
+{
+    return __atomic_load_n(&client->async->controlTimeoutMs, __ATOMIC_RELAXED);
+}
+
+IOReturn SIClaimInterface(SIClient *client, uint8_t number, SIClient **interfaceOut)
+{
+    SIDebug("Claiming interface %u...", number);
+
+    if (!client->handle)
+        return kIOReturnNotOpen;
+    if (!client->backend->claimInterface)
+        return kIOReturnUnsupported;
+
+    SIClient *target = SIClientCreateWithBackend(client->backend);
+    if (!target)
+        return kIOReturnNoMemory;
+
+    // The interface inherits the device's timeouts.
+    SISetTimeouts(target, SIControlTimeoutMs(client),
+        __atomic_load_n(&client->async->pipeTimeoutMs, __ATOMIC_RELAXED));
+
+    IOReturn ret = client->backend->claimInterface(client, target, number);
+    SITrace(kSITraceClaimInterface, number, ret, 0, 0);
+    if (ret != kIOReturnSuccess) {
+        SIDebug("Failed to claim interface %u. (%#x)", number, ret);
+        SIClientDestroy(target);
+        return ret;
+    }
+
+    target->regID = client->regID;
+    *interfaceOut = target;
+    return kIOReturnSuccess;
+}
+
+IOReturn SIClaimInterfaceByClass(SIClient *client, uint8_t interfaceClass, uint8_t subClass, uint8_t protocol,
+    SIClient **interfaceOut)
+{
+    SIConfigDescriptor const *config = NULL;
+    IOReturn ret = SIGetConfigDescriptor(client, 0, &config);
+    if (ret != kIOReturnSuccess)
+        return ret;
+
+    SIDescriptorIterator it;
+    SIDescriptorIteratorInit(&it, config, SIConfigTotalLength(config));
+
+    // Skip over interfaces which are taken, including the client's own.
+    ret = kIOReturnNotFound;
+    SIInterfaceDescriptor const *interface;
+    while ((interface = SIDescriptorIteratorNextInterface(&it))) {
+        if (interface->bAlternateSetting != 0 || interface->bInterfaceClass != interfaceClass
+            || interface->bInterfaceSubClass != subClass || interface->bInterfaceProtocol != protocol)
+            continue;
+
+        ret = SIClaimInterface(client, interface->bInterfaceNumber, interfaceOut);
+        if (ret != kIOReturnExclusiveAccess)
+            break;
+    }
+
+    return ret;
+}
+
+/// Fill the pipe cache if it's empty; 'cacheLock' must be held.
+static IOReturn SIPipeCacheFill(SIClient *client)
+{
+    SIAsyncState *async = client->async;
+    if (async->numCachedPipes)
+        return kIOReturnSuccess;
+
+    // XXX: There is actually one more endpoint than is listed here, since this
+    // count doesn't include the control endpoint (0).
+    uint8_t numEndpoints = 0;
+    IOReturn ret = client->backend->getNumEndpoints(client, &numEndpoints);
+    if (ret != kIOReturnSuccess) {
+        SIDebug("Failed to get number of endpoints. (%#x)", ret);
+        return ret;
+    }
+
+    uint8_t num = 0;
+    for (uint8_t i = 0; i <= numEndpoints && i < kSIPipesMax; ++i) {
+        ret = client->backend->getPipe(client, i, &async->pipeCache[num]);
+        if (ret != kIOReturnSuccess) {
+            SIDebug("Failed to get number pipe %d properties. (%#x)", i, ret);
+            return ret;
+        }
+
+        num++;
+    }
+
+    async->numCachedPipes = num;
+    return kIOReturnSuccess;
+}
+
+IOReturn SIGetPipe(SIClient *client, uint8_t index, SIPipeProps *pipe)
+{
+    if (!client->handle)
+        return kIOReturnNotOpen;
+
+    SIAsyncState *async = client->async;
+    pthread_mutex_lock(&async->cacheLock);
+    IOReturn ret = SIPipeCacheFill(client);
+    if (ret == kIOReturnSuccess) {
+        if (index < async->numCachedPipes)
+            *pipe = async->pipeCache[index];
+        else
+            ret = kIOReturnBadArgument;
+    }
+    pthread_mutex_unlock(&async->cacheLock);
+
+    return ret;
+}
+
+IOReturn SIGetAllPipes(SIClient *client, SIPipeProps *pipes, size_t *numPipes)
+{
+    if (!client->handle)
+        return kIOReturnNotOpen;
+
+    SIAsyncState *async = client->async;
+    pthread_mutex_lock(&async->cacheLock);
+    IOReturn ret = SIPipeCacheFill(client);
+    if (ret == kIOReturnSuccess) {
+        memcpy(pipes, async->pipeCache, async->numCachedPipes * sizeof(SIPipeProps));
+        *numPipes = async->numCachedPipes;
+    }
+    pthread_mutex_unlock(&async->cacheLock);
+
+    return ret;
+}
+
+
+IOReturn SIReadPipe(SIClient *client, uint8_t pipe, void *buffer, uint32_t *bufSizeInOut)
+{
+    if (!client->handle)
+        return kIOReturnNotOpen;
+
+    // Reads with a timeout have to be cancellable.
+    if (__atomic_load_n(&client->async->pipeTimeoutMs, __ATOMIC_RELAXED)) {
+        SITransferResult result = SIReadPipeWithOptions(client, pipe, buffer, *bufSizeInOut, NULL);
+        *bufSizeInOut = result.length;
+        return result.error;
+    }
+
+    // Only time the call if it's going to be counted.
+    uint32_t length = *bufSizeInOut;
+    SICapture *capture = SICaptureGet(client);
+    uint64_t id = capture ? SICaptureSubmit(capture, client, 0, pipe, NULL, NULL, length) : 0;
+    uint64_t start = SIStatsEnabled(client) ? SIGetTimeNs() : 0;
+    IOReturn ret = client->backend->readPipe(client, pipe, buffer, bufSizeInOut);
+    if (start) {
+        SITransferResult result = { .error = ret, .length = *bufSizeInOut, .transferNs = SIGetTimeNs() - start };
+        SIStatsRecordTransfer(client, pipe, 0, &result);
+    }
+    if (capture)
+        SICaptureComplete(capture, client, id, pipe, 0, buffer, *bufSizeInOut, ret);
+
+    SITrace(kSITraceReadPipe, pipe, length, *bufSizeInOut, ret);
+    return ret;
+}
+
+IOReturn SIWritePipe(SIClient *client, uint8_t pipe, void const *buffer, uint32_t bufSize)
+{
+    if (!client->handle)
+        return kIOReturnNotOpen;
+
+    if (__atomic_load_n(&client->async->pipeTimeoutMs, __ATOMIC_RELAXED))
+        return SIWritePipeWithOptions(client, pipe, buffer, bufSize, NULL).error;
+
+    SICapture *capture = SICaptureGet(client);
+    uint64_t id = capture ? SICaptureSubmit(capture, client, 0, pipe, NULL, buffer, bufSize) : 0;
+    uint64_t start = SIStatsEnabled(client) ? SIGetTimeNs() : 0;
+    IOReturn ret = client->backend->writePipe(client, pipe, buffer, bufSize);
+    if (start) {
+        SITransferResult result = {
+            .error = ret,
+            .length = ret == kIOReturnSuccess ? bufSize : 0,
+            .transferNs = SIGetTimeNs() - start,
+        };
+        SIStatsRecordTransfer(client, pipe, 0, &result);
+    }
+    if (capture)
+        SICaptureComplete(capture, client, id, pipe, 0, NULL, ret == kIOReturnSuccess ? bufSize : 0, ret);
+
+    SITrace(kSITraceWritePipe, pipe, bufSize, ret, 0);
+    return ret;
+}
+
+IOReturn SIAbortPipe(SIClient *client, uint8_t pipe)
+{
+    SIDebug("Aborting pipe %d...", pipe);
+
+    if (!client->handle)
+        return kIOReturnNotOpen;
+    if (pipe >= kSIPipesMax)
+        return kIOReturnBadArgument;
+
+    // Drop anything still waiting for a slot first, so that cancelling the
+    // active transfers doesn't just start the next ones.
+    SIPipeQueue *queue = &client->async->pipes[pipe];
+    SITransfer *dropped = SIPipeQueueDrop(queue, NULL);
+    SIPipeQueueCancelActive(client, queue, NULL);
+    SITransferAbortList(dropped);
+
+    IOReturn ret = client->backend->abortPipe(client, pipe);
+    SITrace(kSITraceAbortPipe, pipe, ret, 0, 0);
+    return ret;
+}
+
+// Largest data stage given a zeroed buffer on the stack when a control
+// transfer is made without one; longer ones get a buffer from the heap.
+#define kSIControlScratchSize 0x100
+
+SITransferResult SIControlTransfer(SIClient *client, uint8_t requestType, uint8_t request,
+    uint16_t value, uint16_t index, void *data, size_t length)
+{
+    if (!client->handle)
+        return (SITransferResult) { .error = kIOReturnNotOpen, .length = 0 };
+    if (length > UINT16_MAX)
+        return (SITransferResult) { .error = kIOReturnBadArgument, .length = 0 };
+
+    // Nothing is shared between calls, so control transfers can be made
+    // from any number of threads; the host controller runs them one at a
+    // time on the default pipe, which is the only ordering USB asks for.
+    // Callers who pass a length without a buffer get zeroes to send, or
+    // somewhere to discard what comes back.
+    uint8_t scratch[kSIControlScratchSize];
+    void *buffer = data;
+    if (length > 0 && !data) {
+        buffer = length <= sizeof(scratch) ? memset(scratch, 0, length) : calloc(1, length);
+        if (!buffer)
+            return (SITransferResult) { .error = kIOReturnNoMemory, .length = 0 };
+    }
+
+    SICapture *capture = SICaptureGet(client);
+    uint64_t id = 0;
+    if (capture) {
+        SISetupPacket setup;
+        SIFillSetupPacket(&setup, requestType, request, value, index, (uint16_t)length);
+        id = SICaptureSubmit(capture, client, 0, 0, &setup, buffer, (uint32_t)length);
+    }
+
+    uint64_t start = SIGetTimeNs();
+    SITransferResult result = client->backend->controlTransfer(client, requestType, request, value, index,
+        buffer, length);
+    result.transferNs = SIGetTimeNs() - start;
+    SIStatsRecordTransfer(client, 0, requestType, &result);
+    if (capture)
+        SICaptureComplete(capture, client, id, 0, requestType, buffer, result.length, result.error);
+    SITrace(kSITraceControlTransfer, SITraceSetup(requestType, request, value, index, length), result.length,
+        result.error, 0);
+
+    if (buffer != data && buffer != scratch)
+        free(buffer);
+
+    return result;
+}
+
+// Size of the first request for each configuration, which is enough to
+// get the whole descriptor set in one go for most devices.
+#define kSIConfigProbeSize 0x100
+
+/// Fetch the device descriptor and every configuration descriptor set into
+/// a single arena.
+///
+/// The arena begins with the offset of each configuration, plus one past
+/// the end, followed by the device descriptor and then the configurations.
+static IOReturn SIDescriptorsFetch(SIClient *client, uint8_t **arenaOut)
+{
+    uint8_t const requestType = kSIDirectionToHost | kSITypeStandard | kSIRecipientDevice;
+
+    SIDeviceDescriptor device;
+    SITransferResult result = client->backend->controlTransfer(client, requestType,
+        kSIRequestGetDescriptor, kSIDescriptorTypeDevice << 8, 0, &device, sizeof(device));
+    if (result.error != kIOReturnSuccess)
+        return result.error;
+    if (result.length != sizeof(device))
+        return kIOReturnUnderrun;
+
+    uint8_t numConfigs = device.bNumConfigurations;
+    size_t headerSize = (numConfigs + 1) * sizeof(uint32_t);
+    size_t size = headerSize + sizeof(device);
+    uint8_t *arena = malloc(size);
+    if (!arena)
+        return kIOReturnNoMemory;
+    memcpy(arena + headerSize, &device, sizeof(device));
+
+    IOReturn ret = kIOReturnSuccess;
+    for (uint8_t i = 0; i < numConfigs; ++i) {
+        uint8_t probe[kSIConfigProbeSize];
+        result = client->backend->controlTransfer(client, requestType, kSIRequestGetDescriptor,
+            kSIDescriptorTypeConfig << 8 | i, 0, probe, sizeof(probe));
+        if ((ret = result.error) != kIOReturnSuccess)
+            goto L_failed;
+        if (result.length < sizeof(SIConfigDescriptor)) {
+            ret = kIOReturnUnderrun;
+            goto L_failed;
+        }
+
+        uint16_t total = SIConfigTotalLength(probe);
+        if (total < sizeof(SIConfigDescriptor)) {
+            ret = kIOReturnUnderrun;
+            goto L_failed;
+        }
+
+        uint8_t *grown = realloc(arena, size + total);
+        if (!grown) {
+            ret = kIOReturnNoMemory;
+            goto L_failed;
+        }
+        arena = grown;
+
+        if (total <= result.length) {
+            memcpy(arena + size, probe, total);
+        } else {
+            result = client->backend->controlTransfer(client, requestType, kSIRequestGetDescriptor,
+                kSIDescriptorTypeConfig << 8 | i, 0, arena + size, total);
+            if ((ret = result.error) != kIOReturnSuccess)
+                goto L_failed;
+            if (result.length < sizeof(SIConfigDescriptor)) {
+                ret = kIOReturnUnderrun;
+                goto L_failed;
+            }
+
+            // Devices do sometimes overstate the total; walking the cached
+            // copy must never run past what was actually returned.
+            total = (uint16_t)result.length;
+            SIConfigSetTotalLength(arena + size, total);
+        }
+
+        ((uint32_t *)arena)[i] = (uint32_t)size;
+        size += total;
+    }
+    ((uint32_t *)arena)[numConfigs] = (uint32_t)size;
+
+    SIDebug("Cached descriptors for %d configuration(s) in %zu bytes.", numConfigs, size);
+
+    *arenaOut = arena;
+    return kIOReturnSuccess;
+
+L_failed:
+    SIDebug("Failed to fetch descriptors. (%#x)", ret);
+    free(arena);
+    return ret;
+}
+
+/// Get the descriptor arena, fetching it if needed; 'cacheLock' must be held.
+static IOReturn SIDescriptorsGet(SIClient *client, uint8_t **arenaOut)
+{
+    SIAsyncState *async = client->async;
+    if (!async->descriptors) {
+        if (!client->handle)
+            return kIOReturnNotOpen;
+
+        IOReturn ret = SIDescriptorsFetch(client, &async->descriptors);
+        if (ret != kIOReturnSuccess)
+            return ret;
+    }
+
+    *arenaOut = async->descriptors;
+    return kIOReturnSuccess;
+}
+
+static SIDeviceDescriptor *SIDescriptorsDevice(uint8_t *arena)
+{
+    // The first offset is where the configurations start, which is also just
+    // past the device descriptor.
+    return (SIDeviceDescriptor *)(arena + ((uint32_t *)arena)[0] - sizeof(SIDeviceDescriptor));
+}
+
+IOReturn SIGetDeviceDescriptor(SIClient *client, SIDeviceDescriptor const **descOut)
+{
+    SIAsyncState *async = client->async;
+    uint8_t *arena = NULL;
+
+    pthread_mutex_lock(&async->cacheLock);
+    IOReturn ret = SIDescriptorsGet(client, &arena);
+    if (ret == kIOReturnSuccess)
+        *descOut = SIDescriptorsDevice(arena);
+    pthread_mutex_unlock(&async->cacheLock);
+
+    return ret;
+}
+
+IOReturn SIGetConfigDescriptor(SIClient *client, uint8_t index, SIConfigDescriptor const **configOut)
+{
+    SIAsyncState *async = client->async;
+    uint8_t *arena = NULL;
+
+    pthread_mutex_lock(&async->cacheLock);
+    IOReturn ret = SIDescriptorsGet(client, &arena);
+    if (ret == kIOReturnSuccess) {
+        if (index < SIDescriptorsDevice(arena)->bNumConfigurations)
+            *configOut = (SIConfigDescriptor const *)(arena + ((uint32_t *)arena)[index]);
+        else
+            ret = kIOReturnNotFound;
+    }
+    pthread_mutex_unlock(&async->cacheLock);
+
+    return ret;
+}
+
+IOReturn SIGetInterfaceDescriptor(SIClient *client, uint8_t number, uint8_t alternate,
+    SIInterfaceDescriptor const **interfaceOut)
+{
+    SIConfigDescriptor const *config = NULL;
+    IOReturn ret = SIGetConfigDescriptor(client, 0, &config);
+    if (ret != kIOReturnSuccess)
+        return ret;
+
+    SIDescriptorIterator it;
+    SIDescriptorIteratorInit(&it, config, SIConfigTotalLength(config));
+
+    SIInterfaceDescriptor const *interface;
+    while ((interface = SIDescriptorIteratorNextInterface(&it))) {
+        if (interface->bInterfaceNumber == number && interface->bAlternateSetting == alternate) {
+            *interfaceOut = interface;
+            return kIOReturnSuccess;
+        }
+    }
+
+    return kIOReturnNotFound;
+}
+
+void SIInvalidateDescriptors(SIClient *client)
+{
+    SIAsyncState *async = client->async;
+
+    pthread_mutex_lock(&async->cacheLock);
+    free(async->descriptors);
+    async->descriptors = NULL;
+    free(async->strings);
+    async->strings = NULL;
+    async->numCachedPipes = 0;
+    pthread_mutex_unlock(&async->cacheLock);
+}
+
+SITransferResult SIGetDescriptor(SIClient *client, SIDescriptorType type, uint8_t index,
+    void *descOut, size_t bufSize)
+{
+    // Device and configuration descriptors are answered from the cache, just
+    // as the device would have answered them.
+    if (type == kSIDescriptorTypeDevice || type == kSIDescriptorTypeConfig) {
+        void const *desc = NULL;
+        size_t length = 0;
+
+        IOReturn ret;
+        if (type == kSIDescriptorTypeDevice) {
+            ret = SIGetDeviceDescriptor(client, (SIDeviceDescriptor const **)&desc);
+            length = sizeof(SIDeviceDescriptor);
+        } else {
+            ret = SIGetConfigDescriptor(client, index, (SIConfigDescriptor const **)&desc);
+            if (ret == kIOReturnNotFound)
+                ret = kIOUSBPipeStalled;
+            if (ret == kIOReturnSuccess)
+                length = SIConfigTotalLength(desc);
+        }
+
+        if (ret != kIOReturnSuccess)
+            return (SITransferResult) { .error = ret, .length = 0 };
+
+        if (length > bufSize)
+            length = bufSize;
+        memcpy(descOut, desc, length);
+        return (SITransferResult) { .error = kIOReturnSuccess, .length = (uint32_t)length };
+    }
+
+    return SIControlTransfer(client,
+        kSIDirectionToHost | kSITypeStandard | kSIRecipientDevice,
+        kSIRequestGetDescriptor, (type << 8) | index,
+        type == kSIDescriptorTypeString ? /* US English */ 0x409 : 0,
+        descOut, bufSize);
+}
+
+/// Decode UTF-16LE code units to UTF-8, without a terminator.
+///
+/// \return Number of bytes written, or SIZE_MAX if 'outSize' is too small.
+static size_t SIDecodeUTF16(uint8_t const *in, size_t count, char *out, size_t outSize)
+{
+    size_t i = 0, o = 0;
+    for (;;) {
+        // Strings are nearly always ASCII, so narrow eight units at a time
+        // for as long as they stay that way.
+#if defined(__SSE2__)
+        while (i + 8 <= count && o + 8 <= outSize) {
+            __m128i units = _mm_loadu_si128((__m128i const *)(in + i * 2));
+            __m128i high = _mm_and_si128(units, _mm_set1_epi16((short)0xff80));
+            if (_mm_movemask_epi8(_mm_cmpeq_epi16(high, _mm_setzero_si128())) != 0xffff)
+                break;
+
+            _mm_storel_epi64((__m128i *)(out + o), _mm_packus_epi16(units, units));
+            i += 8;
+            o += 8;
+        }
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+        while (i + 8 <= count && o + 8 <= outSize) {
+            uint16x8_t units = vreinterpretq_u16_u8(vld1q_u8(in + i * 2));
+            if (vmaxvq_u16(units) >= 0x80)
+                break;
+
+            vst1_u8((uint8_t *)out + o, vmovn_u16(units));
+            i += 8;
+            o += 8;
+        }
+#endif
+        if (i == count)
+            return o;
+
+        // Finish the block that failed the check one unit at a time before
+        // trying again, rather than retrying on every unit.
+        size_t stop = i + 8 < count ? i + 8 : count;
+        while (i < stop) {
+            uint32_t cp = in[i * 2] | in[i * 2 + 1] << 8;
+            i++;
+            if (cp >= 0xd800 && cp < 0xe000) {
+                uint32_t low = i < count ? (uint32_t)(in[i * 2] | in[i * 2 + 1] << 8) : 0;
+                if (cp < 0xdc00 && low >= 0xdc00 && low < 0xe000) {
+                    cp = 0x10000 + ((cp - 0xd800) << 10) + (low - 0xdc00);
+                    i++;
+                } else {
+                    cp = 0xfffd;
+                }
+            }
+
+            size_t n = cp < 0x80 ? 1 : cp < 0x800 ? 2 : cp < 0x10000 ? 3 : 4;
+            if (o + n > outSize)
+                return SIZE_MAX;
+
+            uint8_t *bytes = (uint8_t *)out + o;
+            switch (n) {
+            case 1:
+                bytes[0] = (uint8_t)cp;
+                break;
+            case 2:
+                bytes[0] = (uint8_t)(0xc0 | cp >> 6);
+                bytes[1] = (uint8_t)(0x80 | (cp & 0x3f));
+                break;
+            case 3:
+                bytes[0] = (uint8_t)(0xe0 | cp >> 12);
+                bytes[1] = (uint8_t)(0x80 | (cp >> 6 & 0x3f));
+                bytes[2] = (uint8_t)(0x80 | (cp & 0x3f));
+                break;
+            default:
+                bytes[0] = (uint8_t)(0xf0 | cp >> 18);
+                bytes[1] = (uint8_t)(0x80 | (cp >> 12 & 0x3f));
+                bytes[2] = (uint8_t)(0x80 | (cp >> 6 & 0x3f));
+                bytes[3] = (uint8_t)(0x80 | (cp & 0x3f));
+                break;
+            }
+            o += n;
+        }
+    }
+}
+
+int SIDecodeStringDescriptor(SIStringDescriptor *desc, char *out, size_t outSize)
+{
+    if (desc->bLength < sizeof(SIDescriptorHeader) || outSize == 0)
+        return 0;
+
+    size_t length = SIDecodeUTF16((uint8_t const *)desc + sizeof(SIDescriptorHeader),
+        (desc->bLength - sizeof(SIDescriptorHeader)) / 2, out, outSize - 1);
+    if (length == SIZE_MAX)
+        return 0;
+
+    out[length] = 0;
+    return (int)length + 1;
+}
+
+// Worst-case UTF-8 bytes per UTF-16 unit; surrogate pairs need 4 for 2.
+#define kSIUTF8PerUnit 3
+
+#define SIStringMark(set, index) ((set)[(index) >> 3] |= (uint8_t)(1 << ((index) & 7)))
+
+/// Mark the string indices referenced by the descriptors in an arena.
+static void SIStringsCollect(uint8_t *arena, uint8_t *referenced)
+{
+    SIDeviceDescriptor const *device = SIDescriptorsDevice(arena);
+    SIStringMark(referenced, device->iManufacturer);
+    SIStringMark(referenced, device->iProduct);
+    SIStringMark(referenced, device->iSerialNumber);
+
+    uint32_t const *offsets = (uint32_t const *)arena;
+    for (uint8_t i = 0; i < device->bNumConfigurations; ++i) {
+        SIConfigDescriptor const *config = (SIConfigDescriptor const *)(arena + offsets[i]);
+        SIStringMark(referenced, config->iConfiguration);
+
+        SIDescriptorIterator it;
+        SIDescriptorIteratorInit(&it, config, offsets[i + 1] - offsets[i]);
+
+        SIDescriptorHeader const *desc;
+        while ((desc = SIDescriptorIteratorNext(&it))) {
+            if (desc->bDescriptorType == kSIDescriptorTypeInterface)
+                SIStringMark(referenced, ((SIInterfaceDescriptor const *)desc)->iInterface);
+            else if (desc->bDescriptorType == kSIDescriptorTypeInterfaceAssociation && desc->bLength >= 8)
+                SIStringMark(referenced, ((uint8_t const *)desc)[7]); // iFunction
+        }
+    }
+
+    // Index zero means "no string".
+    referenced[0] &= (uint8_t)~1;
+}
+
+/// Fetch and decode every referenced string into a single allocation, which
+/// begins with the table itself.
+static IOReturn SIStringsFetch(SIClient *client, uint8_t *arena, SIStringTable **tableOut)
+{
+    uint8_t const requestType = kSIDirectionToHost | kSITypeStandard | kSIRecipientDevice;
+
+    // String zero is the table of supported languages. Devices without any
+    // strings are allowed to stall it.
+    SIStringDescriptorBuffer langTable;
+    SITransferResult result = client->backend->controlTransfer(client, requestType,
+        kSIRequestGetDescriptor, kSIDescriptorTypeString << 8, 0, langTable, sizeof(langTable) - 1);
+    if (result.error != kIOReturnSuccess && result.error != kIOUSBPipeStalled)
+        return result.error;
+
+    uint8_t numLangIDs = 0;
+    if (result.error == kIOReturnSuccess && result.length >= sizeof(SIDescriptorHeader)
+        && langTable[1] == kSIDescriptorTypeString) {
+        size_t length = langTable[0] < result.length ? langTable[0] : result.length;
+        numLangIDs = (uint8_t)((length - sizeof(SIDescriptorHeader)) / 2);
+    }
+
+    uint16_t langID = 0;
+    for (uint8_t i = 0; i < numLangIDs; ++i) {
+        uint16_t lang = langTable[2 + i * 2] | langTable[3 + i * 2] << 8;
+        if (i == 0 || lang == 0x409)
+            langID = lang;
+    }
+
+    uint8_t referenced[0x100 / 8] = { 0 };
+    uint8_t indices[0xff];
+    uint32_t count = 0;
+    if (numLangIDs) {
+        SIStringsCollect(arena, referenced);
+        for (int i = 1; i < 0x100; ++i) {
+            if (referenced[i >> 3] & (1 << (i & 7)))
+                indices[count++] = (uint8_t)i;
+        }
+    }
+
+    SIStringDescriptorBuffer *raw = NULL;
+    SIControlRequest requests[0xff];
+    SITransferResult results[0xff];
+    if (count) {
+        if (!(raw = malloc(count * sizeof(*raw))))
+            return kIOReturnNoMemory;
+
+        for (uint32_t i = 0; i < count; ++i) {
+            requests[i] = (SIControlRequest) {
+                .requestType = requestType,
+                .request = kSIRequestGetDescriptor,
+                .value = kSIDescriptorTypeString << 8 | indices[i],
+                .index = langID,
+                .length = sizeof(raw[i]) - 1,
+                .data = raw[i],
+            };
+        }
+
+        // Individual strings that fail are simply left out of the table.
+        IOReturn ret = SIControlTransferBatch(client, requests, count, results, 0);
+        if (ret == kIOReturnNotOpen || ret == kIOReturnNoMemory || ret == kIOReturnNoDevice) {
+            free(raw);
+            return ret;
+        }
+
+        // Trim each descriptor to what was actually received.
+        for (uint32_t i = 0; i < count; ++i) {
+            if (results[i].error != kIOReturnSuccess || results[i].length < sizeof(SIDescriptorHeader)
+                || raw[i][1] != kSIDescriptorTypeString)
+                raw[i][0] = 0;
+            else if (raw[i][0] > results[i].length)
+                raw[i][0] = (uint8_t)results[i].length;
+        }
+    }
+
+    size_t size = sizeof(SIStringTable) + numLangIDs * sizeof(uint16_t);
+    for (uint32_t i = 0; i < count; ++i) {
+        if (raw[i][0] >= sizeof(SIDescriptorHeader))
+            size += (raw[i][0] - sizeof(SIDescriptorHeader)) / 2 * kSIUTF8PerUnit + 1;
+    }
+
+    SIStringTable *table = calloc(1, size);
+    if (!table) {
+        free(raw);
+        return kIOReturnNoMemory;
+    }
+
+    uint16_t *langIDs = (uint16_t *)(table + 1);
+    for (uint8_t i = 0; i < numLangIDs; ++i)
+        langIDs[i] = langTable[2 + i * 2] | langTable[3 + i * 2] << 8;
+    table->langID = langID;
+    table->numLangIDs = numLangIDs;
+    table->langIDs = langIDs;
+
+    // Intern strings as they're decoded; devices tend to repeat themselves
+    // across configurations and interfaces.
+    struct {
+        uint32_t hash;
+        char const *string;
+    } interned[0x200] = { { 0, NULL } };
+
+    char *cursor = (char *)(langIDs + numLangIDs);
+    char *end = (char *)table + size;
+    for (uint32_t i = 0; i < count; ++i) {
+        SIStringDescriptor *desc = (SIStringDescriptor *)raw[i];
+        if (desc->bLength < sizeof(SIDescriptorHeader))
+            continue;
+
+        int length = SIDecodeStringDescriptor(desc, cursor, (size_t)(end - cursor));
+        if (!length)
+            continue;
+
+        uint32_t hash = 2166136261u;
+        for (int j = 0; j < length; ++j)
+            hash = (hash ^ (uint8_t)cursor[j]) * 16777619u;
+
+        size_t slot = hash & 0x1ff;
+        while (interned[slot].string
+            && (interned[slot].hash != hash || strcmp(interned[slot].string, cursor) != 0))
+            slot = (slot + 1) & 0x1ff;
+
+        if (!interned[slot].string) {
+            interned[slot].hash = hash;
+            interned[slot].string = cursor;
+            cursor += length;
+        }
+        table->strings[indices[i]] = interned[slot].string;
+    }
+
+    SIDebug("Cached %u string(s) in %zu bytes.", count, (size_t)(cursor - (char *)table));
+
+    free(raw);
+    *tableOut = table;
+    return kIOReturnSuccess;
+}
+
+IOReturn SIGetStringTable(SIClient *client, SIStringTable const **tableOut)
+{
+    SIAsyncState *async = client->async;
+    uint8_t *arena = NULL;
+
+    pthread_mutex_lock(&async->cacheLock);
+    IOReturn ret = SIDescriptorsGet(client, &arena);
+    if (ret == kIOReturnSuccess && !async->strings)
+        ret = SIStringsFetch(client, arena, &async->strings);
+    if (ret == kIOReturnSuccess)
+        *tableOut = async->strings;
+    pthread_mutex_unlock(&async->cacheLock);
+
+    return ret;
+}
+
+void SIFillSetupPacket(void *buffer, uint8_t requestType, uint8_t request, uint16_t value,
+    uint16_t index, uint16_t length)
+{
+    uint8_t *setup = buffer;
+    setup[0] = requestType;
+    setup[1] = request;
+    setup[2] = value & 0xff;
+    setup[3] = value >> 8;
+    setup[4] = index & 0xff;
+    setup[5] = index >> 8;
+    setup[6] = length & 0xff;
+    setup[7] = length >> 8;
+}
+
+void SITransferInit(SITransfer *transfer, SIClient *client, uint8_t pipe, void *buffer,
+    uint32_t length, SITransferCallback callback, void *context)
+{
+    memset(transfer, 0, sizeof(SITransfer));
+    transfer->client = client;
+    transfer->pipe = pipe;
+    transfer->buffer = buffer;
+    transfer->length = length;
+    transfer->callback = callback;
+    transfer->context = context;
+}
+
+SITransfer *SITransferCreate(SIClient *client, uint8_t pipe, void *buffer, uint32_t length,
+    SITransferCallback callback, void *context)
+{
+    SITransfer *transfer = malloc(sizeof(SITransfer));
+    if (!transfer)
+        return NULL;
+
+    SITransferInit(transfer, client, pipe, buffer, length, callback, context);
+    return transfer;
+}
+
+void SITransferDestroy(SITransfer *transfer)
+{
+    free(transfer);
+}
+
+IOReturn SISetPipeQueueDepth(SIClient *client, uint8_t pipe, uint32_t depth)
+{
+    if (pipe >= kSIPipesMax || depth == 0)
+        return kIOReturnBadArgument;
+
+    // Lowering the depth takes effect as transfers complete; raising it only
+    // applies to transfers submitted from now on.
+    __atomic_store_n(&client->async->pipes[pipe].depth, depth, __ATOMIC_RELAXED);
+
+    return kIOReturnSuccess;
+}
+
+/// Get a pipe's queue depth, for putting back after overriding it.
+static uint32_t SIGetPipeQueueDepth(SIClient *client, uint8_t pipe)
+{
+    return __atomic_load_n(&client->async->pipes[pipe].depth, __ATOMIC_RELAXED);
+}
+
+/// Cancel a set of transfers and reap completions on this thread until
+/// their owner has seen the last of them, or the client can't deliver any
+/// more; 'inFlight' is the owner's count, guarded by 'lock'.
+static void SITransfersDrain(SIClient *client, SITransfer *first, size_t stride, uint32_t count,
+    pthread_mutex_t *lock, uint32_t const *inFlight)
+{
+    for (;;) {
+        pthread_mutex_lock(lock);
+        uint32_t left = *inFlight;
+        pthread_mutex_unlock(lock);
+        if (!left)
+            return;
+
+        for (uint32_t i = 0; i < count; ++i)
+            SICancelTransfer((SITransfer *)((uint8_t *)first + i * stride));
+
+        // Once the client is gone, so are its transfers.
+        IOReturn ret = SIHandleEvents(client, 10);
+        if (ret != kIOReturnSuccess && ret != kIOReturnTimeout) {
+            SIDebug("Gave up on %u transfers in flight. (%#x)", left, ret);
+            return;
+        }
+    }
+}
+
+/// Retire a transfer from its queue, promoting the next pending transfer
+/// into its slot if there is room.
+///
+/// \return The promoted transfer, which the caller must start.
+static SITransfer *SITransferRetire(SIPipeQueue *queue, SITransfer *transfer)
+{
+    SIPipeQueueUntrack(queue, transfer);
+
+    int sync = __atomic_load_n(&transfer->state, __ATOMIC_RELAXED) & kSITransferSync;
+    __atomic_store_n(&transfer->state, kSITransferIdle, __ATOMIC_RELEASE);
+
+    return sync ? NULL : SIPipeQueueRelease(queue);
+}
+
+/// Track a transfer and hand it to the backend, unless its token has been
+/// cancelled; the caller retires it if this fails.
+static IOReturn SITransferStart(SIClient *client, SIPipeQueue *queue, SITransfer *transfer, uint32_t state,
+    uint64_t now)
+{
+    SIPipeQueueTrack(queue, transfer, state);
+    transfer->startedAt = now;
+
+    SICancelToken *token = transfer->token;
+    if (SITransferTokenCancelled(token))
+        return kIOReturnAborted;
+
+    // Calls made through transfers of their own are captured by the call.
+    // Past the backend, the transfer may already have completed.
+    state = __atomic_load_n(&transfer->state, __ATOMIC_RELAXED);
+    SICapture *capture = SICaptureGet(client);
+    if (capture && !(state & kSITransferUncounted))
+        SICaptureTransfer(capture, transfer, 'S');
+
+    IOReturn ret = client->backend->submitTransfer(transfer);
+
+    // The token may have been cancelled after it was checked, but before
+    // the backend had the transfer to cancel. The transfer may also have
+    // completed by now, so only 'state' and the token are safe to look at.
+    if (ret == kIOReturnSuccess && SITransferTokenCancelled(token)
+        && SIPipeQueueCancelTracked(client, queue, transfer, state) == kIOReturnUnsupported)
+        client->backend->abortPipe(client, (uint8_t)(queue - client->async->pipes));
+
+    return ret;
+}
+
+/// Start transfers promoted from a pipe's pending list, failing any which
+/// the backend refuses.
+static void SITransferStartPromoted(SIClient *client, SIPipeQueue *queue, SITransfer *next)
+{
+    while (next) {
+        IOReturn ret = SITransferStart(client, queue, next, kSITransferActive, SIGetTimeNs());
+        if (ret == kIOReturnSuccess)
+            break;
+
+        SITransfer *failed = next;
+        next = SITransferRetire(queue, failed);
+        failed->result = (SITransferResult) { .error = ret, .length = 0 };
+        failed->callback(failed);
+    }
+}
+
+IOReturn SISubmitTransfer(SITransfer *transfer)
+{
+    SIClient *client = transfer->client;
+    if (!client->handle)
+        return kIOReturnNotOpen;
+    if (!client->backend->submitTransfer)
+        return kIOReturnUnsupported;
+    if (transfer->pipe >= kSIPipesMax || !transfer->callback)
+        return kIOReturnBadArgument;
+    if (transfer->pipe == 0 && transfer->length < sizeof(SISetupPacket))
+        return kIOReturnBadArgument;
+    if (transfer->numPackets && (transfer->pipe == 0 || transfer->numPackets > kSIIsoPacketsMax || !transfer->packets))
+        return kIOReturnBadArgument;
+    if (transfer->token && transfer->token->client != client)
+        return kIOReturnBadArgument;
+    if (SITransferTokenCancelled(transfer->token))
+        return kIOReturnAborted;
+
+    uint32_t idle = kSITransferIdle;
+    if (!__atomic_compare_exchange_n(&transfer->state, &idle, kSITransferActive, 0, __ATOMIC_ACQUIRE,
+            __ATOMIC_RELAXED))
+        return kIOReturnBusy;
+
+    transfer->result = (SITransferResult) { .error = kIOReturnSuccess, .length = 0 };
+    transfer->missedFrames = 0;
+    transfer->actual = 0;
+    transfer->queuedAt = SIGetTimeNs();
+
+    uint64_t total = 0;
+    for (uint32_t i = 0; i < transfer->numPackets; ++i) {
+        SIIsoPacket *packet = &transfer->packets[i];
+        packet->actual = 0;
+        packet->status = kIOReturnSuccess;
+        total += packet->length;
+    }
+    if (total > transfer->length) {
+        __atomic_store_n(&transfer->state, kSITransferIdle, __ATOMIC_RELEASE);
+        return kIOReturnBadArgument;
+    }
+
+    // A queued transfer may be started, completed and freed by another
+    // thread before this one is done tracing it.
+    SIPipeQueue *queue = &client->async->pipes[transfer->pipe];
+    SITrace(kSITraceSubmitTransfer, (uintptr_t)transfer, transfer->pipe, transfer->length, 0);
+
+    int start;
+    IOReturn ret = SIPipeQueueAcquire(queue, transfer, &start);
+    if (ret != kIOReturnSuccess) {
+        __atomic_store_n(&transfer->state, kSITransferIdle, __ATOMIC_RELEASE);
+        return ret;
+    }
+    if (!start)
+        return kIOReturnSuccess;
+
+    ret = SITransferStart(client, queue, transfer, kSITransferActive, transfer->queuedAt);
+    if (ret != kIOReturnSuccess) {
+        SIDebug("Failed to submit transfer on pipe %d. (%#x)", transfer->pipe, ret);
+
+        // Another transfer may have gone pending on the slot meanwhile.
+        SITransferStartPromoted(client, queue, SITransferRetire(queue, transfer));
+    }
+
+    return ret;
+}
+
+void SITransferCompleted(SITransfer *transfer)
+{
+    SIClient *client = transfer->client;
+    SIPipeQueue *queue = &client->async->pipes[transfer->pipe];
+
+    transfer->result.waitNs = transfer->startedAt - transfer->queuedAt;
+    transfer->result.transferNs = SIGetTimeNs() - transfer->startedAt;
+    if (!(__atomic_load_n(&transfer->state, __ATOMIC_RELAXED) & kSITransferUncounted)) {
+        uint8_t requestType = transfer->pipe == 0 ? ((SISetupPacket const *)transfer->buffer)->bmRequestType : 0;
+        SIStatsRecordTransfer(client, transfer->pipe, requestType, &transfer->result);
+
+        SICapture *capture = SICaptureGet(client);
+        if (capture)
+            SICaptureTransfer(capture, transfer, 'C');
+    }
+    SITrace(kSITraceTransferCompleted, (uintptr_t)transfer, transfer->pipe, transfer->result.length,
+        transfer->result.error);
+
+    // Start the next transfer before running the callback, so the pipe is
+    // never left idle while user code runs.
+    SITransferStartPromoted(client, queue, SITransferRetire(queue, transfer));
+    transfer->callback(transfer);
+}
+
+IOReturn SICancelTransfer(SITransfer *transfer)
+{
+    SIClient *client = transfer->client;
+    SIPipeQueue *queue = &client->async->pipes[transfer->pipe];
+
+    pthread_mutex_lock(&queue->lock);
+    uint32_t state = __atomic_load_n(&transfer->state, __ATOMIC_RELAXED);
+    if ((state & kSITransferStateMask) == kSITransferPending) {
+        SITransferListRemove(&queue->pending, transfer);
+        __atomic_sub_fetch(&queue->counts, kSIPipePendingOne, __ATOMIC_ACQ_REL);
+        __atomic_store_n(&transfer->state, kSITransferIdle, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&queue->lock);
+
+        SITrace(kSITraceCancelTransfer, (uintptr_t)transfer, transfer->pipe, kIOReturnSuccess, 0);
+        transfer->result = (SITransferResult) { .error = kIOReturnAborted, .length = 0 };
+        transfer->callback(transfer);
+        return kIOReturnSuccess;
+    }
+    pthread_mutex_unlock(&queue->lock);
+
+    IOReturn ret = kIOReturnNotFound;
+    if ((state & kSITransferStateMask) == kSITransferActive)
+        ret = SIPipeQueueCancelTracked(client, queue, transfer, state);
+
+    SITrace(kSITraceCancelTransfer, (uintptr_t)transfer, transfer->pipe, ret, 0);
+    return ret;
+}
+
+SICancelToken *SICancelTokenCreate(SIClient *client)
+{
+    SICancelToken *token = calloc(1, sizeof(SICancelToken));
+    if (!token)
+        return NULL;
+
+    token->client = client;
+    return token;
+}
+
+void SICancelTokenDestroy(SICancelToken *token)
+{
+    free(token);
+}
+
+void SICancelTokenCancel(SICancelToken *token)
+{
+    SIClient *client = token->client;
+    SIDebug("Cancelling token %p on client %p...", (void *)token, (void *)client);
+    SITrace(kSITraceCancelToken, (uintptr_t)token, 0, 0, 0);
+
+    // Transfers starting from here on check the token after they become
+    // visible to the search below, so that none slip past both.
+    __atomic_store_n(&token->cancelled, 1, __ATOMIC_SEQ_CST);
+    if (!client->handle)
+        return;
+
+    for (uint8_t pipe = 0; pipe < kSIPipesMax; ++pipe) {
+        SIPipeQueue *queue = &client->async->pipes[pipe];
+        SITransfer *dropped = SIPipeQueueDrop(queue, token);
+        if (SIPipeQueueCancelActive(client, queue, token))
+            client->backend->abortPipe(client, pipe);
+        SITransferAbortList(dropped);
+    }
+}
+
+void SICancelTokenReset(SICancelToken *token)
+{
+    __atomic_store_n(&token->cancelled, 0, __ATOMIC_SEQ_CST);
+}
+
+int SICancelTokenIsCancelled(SICancelToken const *token)
+{
+    return SITransferTokenCancelled(token);
+}
+
+IOReturn SISetTimeouts(SIClient *client, uint32_t controlMs, uint32_t pipeMs)
+{
+    __atomic_store_n(&client->async->controlTimeoutMs, controlMs, __ATOMIC_RELAXED);
+    __atomic_store_n(&client->async->pipeTimeoutMs, pipeMs, __ATOMIC_RELAXED);
+    return kIOReturnSuccess;
+}
+
+uint64_t SIDeadlineAfterMs(uint32_t ms)
+{
+    return SIGetTimeNs() + (uint64_t)ms * 1000000;
+}
+
+/// Get the time left until a deadline in milliseconds, rounded up, or -1
+/// for no deadline.
+static int SIMsUntil(uint64_t deadline)
+{
+    if (!deadline)
+        return -1;
+
+    uint64_t now = SIGetTimeNs();
+    if (now >= deadline)
+        return 0;
+
+    uint64_t ms = (deadline - now + 999999) / 1000000;
+    return ms > INT_MAX ? INT_MAX : (int)ms;
+}
+
+IOReturn SIHandleEvents(SIClient *client, int timeoutMs)
+{
+    if (!client->handle)
+        return kIOReturnNotOpen;
+    if (!client->backend->handleEvents)
+        return kIOReturnUnsupported;
+
+    // Only one thread talks to the backend at a time; anyone else waits for
+    // it to finish, since it will have run any callbacks that were due.
+    SIAsyncState *async = client->async;
+    pthread_mutex_lock(&async->lock);
+    if (async->handling) {
+        if (timeoutMs < 0) {
+            while (async->handling)
+                pthread_cond_wait(&async->cond, &async->lock);
+        } else if (timeoutMs > 0) {
+            SICondWaitUntilNs(&async->cond, &async->lock, SIGetTimeNs() + (uint64_t)timeoutMs * 1000000);
+        }
+
+        pthread_mutex_unlock(&async->lock);
+        return kIOReturnSuccess;
+    }
+
+    async->handling = 1;
+    pthread_mutex_unlock(&async->lock);
+
+    IOReturn ret = client->backend->handleEvents(client, timeoutMs);
+
+    pthread_mutex_lock(&async->lock);
+    async->handling = 0;
+    pthread_cond_broadcast(&async->cond);
+    pthread_mutex_unlock(&async->lock);
+
+    return ret;
+}
+
+static void SITransferSyncCallback(SITransfer *transfer)
+{
+    SIAsyncState *async = transfer->client->async;
+
+    pthread_mutex_lock(&async->lock);
+    *(int *)transfer->context = 1;
+    pthread_cond_broadcast(&async->cond);
+    pthread_mutex_unlock(&async->lock);
+}
+
+/// Start a transfer to be waited on with 'SITransferWaitSync'.
+///
+/// Synchronous transfers don't count against the pipe's queue depth, but
+/// are still visible to 'SIAbortPipe'.
+///
+/// \param flags 'kSITransferUncounted' if the caller counts the transfer.
+static IOReturn SITransferStartSync(SITransfer *transfer, int *done, uint32_t flags)
+{
+    SIClient *client = transfer->client;
+    SIPipeQueue *queue = &client->async->pipes[transfer->pipe];
+
+    *done = 0;
+    transfer->callback = SITransferSyncCallback;
+    transfer->context = done;
+    transfer->queuedAt = SIGetTimeNs();
+
+    IOReturn ret = SITransferStart(client, queue, transfer, kSITransferActive | kSITransferSync | flags,
+        transfer->queuedAt);
+    if (ret != kIOReturnSuccess)
+        SITransferRetire(queue, transfer);
+
+    return ret;
+}
+
+/// Wait on the calling thread for a transfer started with
+/// 'SITransferStartSync' to complete, cancelling it at 'deadline' (unless
+/// zero) and then reporting 'kIOReturnTimeout'.
+static IOReturn SITransferWaitSyncUntil(SITransfer *transfer, int *done, uint64_t deadline)
+{
+    SIClient *client = transfer->client;
+    SIAsyncState *async = client->async;
+    SIPipeQueue *queue = &async->pipes[transfer->pipe];
+    int expired = 0;
+
+    // Whoever is handling events will reap this transfer for us if it isn't
+    // this thread; otherwise take over until it completes.
+    pthread_mutex_lock(&async->lock);
+    while (!*done) {
+        if (deadline && SIGetTimeNs() >= deadline) {
+            // Still wait for the backend to hand the transfer back, since it
+            // may be writing to the buffer until then.
+            pthread_mutex_unlock(&async->lock);
+            uint32_t state = __atomic_load_n(&transfer->state, __ATOMIC_RELAXED);
+            if (SIPipeQueueCancelTracked(client, queue, transfer, state) == kIOReturnUnsupported)
+                client->backend->abortPipe(client, transfer->pipe);
+            pthread_mutex_lock(&async->lock);
+
+            expired = 1;
+            deadline = 0;
+            continue;
+        }
+
+        if (async->handling) {
+            if (deadline)
+                SICondWaitUntilNs(&async->cond, &async->lock, deadline);
+            else
+                pthread_cond_wait(&async->cond, &async->lock);
+            continue;
+        }
+
+        async->handling = 1;
+        pthread_mutex_unlock(&async->lock);
+        IOReturn ret = client->backend->handleEvents(client, SIMsUntil(deadline));
+        pthread_mutex_lock(&async->lock);
+        async->handling = 0;
+        pthread_cond_broadcast(&async->cond);
+
+        if (ret == kIOReturnNoDevice && !*done) {
+            pthread_mutex_unlock(&async->lock);
+            SITransferRetire(queue, transfer);
+            return ret;
+        }
+    }
+    pthread_mutex_unlock(&async->lock);
+
+    if (expired && transfer->result.error == kIOReturnAborted)
+        transfer->result.error = kIOReturnTimeout;
+
+    return transfer->result.error;
+}
+
+/// Wait on the calling thread for a transfer started with
+/// 'SITransferStartSync' to complete.
+static IOReturn SITransferWaitSync(SITransfer *transfer, int *done)
+{
+    return SITransferWaitSyncUntil(transfer, done, 0);
+}
+
+/// Run a transfer to completion on the calling thread, for backends which
+/// implement their synchronous operations on top of asynchronous ones.
+///
+/// The transfer isn't counted, as the call it's part of will be.
+static IOReturn SITransferRunSync(SITransfer *transfer)
+{
+    int done;
+    IOReturn ret = SITransferStartSync(transfer, &done, kSITransferUncounted);
+    if (ret != kIOReturnSuccess)
+        return ret;
+
+    return SITransferWaitSync(transfer, &done);
+}
+
+/// Get the deadline for a pipe call starting now from the client's pipe
+/// timeout, or zero if it has none.
+static uint64_t SIPipeDeadline(SIClient *client)
+{
+    uint32_t timeoutMs = __atomic_load_n(&client->async->pipeTimeoutMs, __ATOMIC_RELAXED);
+    return timeoutMs ? SIDeadlineAfterMs(timeoutMs) : 0;
+}
+
+/// Run a read or write for 'SIReadPipeWithOptions' or 'SIWritePipeWithOptions'.
+static SITransferResult SIPipeTransferWithOptions(SIClient *client, uint8_t pipe, void *buffer, uint32_t length,
+    int direction, SICallOptions const *options)
+{
+    if (!client->handle)
+        return (SITransferResult) { .error = kIOReturnNotOpen, .length = 0 };
+
+    SICallOptions defaults = { 0 };
+    if (!options)
+        options = &defaults;
+
+    uint64_t deadline = options->deadline ? options->deadline : SIPipeDeadline(client);
+
+    // With nothing to cancel the call for, the backend's own blocking
+    // transfer will do.
+    if (!deadline && !options->token) {
+        uint64_t start = SIGetTimeNs();
+        uint32_t size = length;
+        IOReturn error = direction == kSIPipeDirectionIn ? client->backend->readPipe(client, pipe, buffer, &size)
+                                                          : client->backend->writePipe(client, pipe, buffer, length);
+        return (SITransferResult) {
+            .error = error,
+            .length = direction == kSIPipeDirectionIn || error == kIOReturnSuccess ? size : 0,
+            .transferNs = SIGetTimeNs() - start,
+        };
+    }
+
+    if (!client->backend->submitTransfer)
+        return (SITransferResult) { .error = kIOReturnUnsupported, .length = 0 };
+    if (pipe == 0 || pipe >= kSIPipesMax || (options->token && options->token->client != client))
+        return (SITransferResult) { .error = kIOReturnBadArgument, .length = 0 };
+
+    // Backends take the direction of a transfer from its pipe.
+    SIPipeProps props;
+    IOReturn ret = SIGetPipe(client, pipe, &props);
+    if (ret == kIOReturnSuccess && props.direction != direction)
+        ret = direction == kSIPipeDirectionIn ? kIOReturnNotReadable : kIOReturnNotWritable;
+    if (ret != kIOReturnSuccess)
+        return (SITransferResult) { .error = ret, .length = 0 };
+
+    SITransfer transfer;
+    SITransferInit(&transfer, client, pipe, buffer, length, NULL, NULL);
+    transfer.token = options->token;
+
+    int done;
+    if ((ret = SITransferStartSync(&transfer, &done, kSITransferUncounted)) != kIOReturnSuccess)
+        return (SITransferResult) { .error = ret, .length = 0 };
+
+    SITransferWaitSyncUntil(&transfer, &done, deadline);
+    return transfer.result;
+}
+
+SITransferResult SIReadPipeWithOptions(SIClient *client, uint8_t pipe, void *buffer, uint32_t length,
+    SICallOptions const *options)
+{
+    SICapture *capture = client->handle ? SICaptureGet(client) : NULL;
+    uint64_t id = capture ? SICaptureSubmit(capture, client, 0, pipe, NULL, NULL, length) : 0;
+    SITransferResult result = SIPipeTransferWithOptions(client, pipe, buffer, length, kSIPipeDirectionIn, options);
+    SIStatsRecordTransfer(client, pipe, 0, &result);
+    if (capture)
+        SICaptureComplete(capture, client, id, pipe, 0, buffer, result.length, result.error);
+    SITrace(kSITraceReadPipe, pipe, length, result.length, result.error);
+    return result;
+}
+
+SITransferResult SIWritePipeWithOptions(SIClient *client, uint8_t pipe, void const *buffer, uint32_t length,
+    SICallOptions const *options)
+{
+    SICapture *capture = client->handle ? SICaptureGet(client) : NULL;
+    uint64_t id = capture ? SICaptureSubmit(capture, client, 0, pipe, NULL, buffer, length) : 0;
+    SITransferResult result = SIPipeTransferWithOptions(client, pipe, (void *)buffer, length, kSIPipeDirectionOut,
+        options);
+    SIStatsRecordTransfer(client, pipe, 0, &result);
+    if (capture)
+        SICaptureComplete(capture, client, id, pipe, 0, NULL, result.length, result.error);
+    SITrace(kSITraceWritePipe, pipe, length, result.error, 0);
+    return result;
+}
+
+SITransferResult SIControlTransferWithOptions(SIClient *client, uint8_t requestType, uint8_t request,
+    uint16_t value, uint16_t index, void *data, size_t length, SICallOptions const *options)
+{
+    // Without a deadline or token, the client's control timeout applies
+    // through the backend's own blocking request.
+    if (!options || (!options->deadline && !options->token))
+        return SIControlTransfer(client, requestType, request, value, index, data, length);
+
+    if (!client->handle)
+        return (SITransferResult) { .error = kIOReturnNotOpen, .length = 0 };
+    if (!client->backend->submitTransfer)
+        return (SITransferResult) { .error = kIOReturnUnsupported, .length = 0 };
+    if (length > UINT16_MAX || (options->token && options->token->client != client))
+        return (SITransferResult) { .error = kIOReturnBadArgument, .length = 0 };
+
+    // Asynchronous control transfers carry their setup packet in front of
+    // the data stage.
+    uint8_t scratch[sizeof(SISetupPacket) + kSIControlScratchSize];
+    size_t size = sizeof(SISetupPacket) + length;
+    uint8_t *buffer = size <= sizeof(scratch) ? scratch : malloc(size);
+    if (!buffer)
+        return (SITransferResult) { .error = kIOReturnNoMemory, .length = 0 };
+
+    int in = requestType & kSIDirectionToHost;
+    SIFillSetupPacket(buffer, requestType, request, value, index, (uint16_t)length);
+    if (!in && data)
+        memcpy(buffer + sizeof(SISetupPacket), data, length);
+    else if (!in)
+        memset(buffer + sizeof(SISetupPacket), 0, length);
+
+    SITransfer transfer;
+    SITransferInit(&transfer, client, 0, buffer, (uint32_t)size, NULL, NULL);
+    transfer.token = options->token;
+
+    SICapture *capture = SICaptureGet(client);
+    uint64_t id = capture ? SICaptureSubmit(capture, client, 0, 0, (SISetupPacket const *)buffer,
+                                buffer + sizeof(SISetupPacket), (uint32_t)length)
+                          : 0;
+
+    int done;
+    IOReturn ret = SITransferStartSync(&transfer, &done, kSITransferUncounted);
+    if (ret == kIOReturnSuccess)
+        SITransferWaitSyncUntil(&transfer, &done, options->deadline);
+    else
+        transfer.result = (SITransferResult) { .error = ret, .length = 0 };
+
+    if (capture)
+        SICaptureComplete(capture, client, id, 0, requestType, buffer + sizeof(SISetupPacket), transfer.result.length,
+            transfer.result.error);
+
+    if (in && data)
+        memcpy(data, buffer + sizeof(SISetupPacket), transfer.result.length < length ? transfer.result.length : length);
+    if (buffer != scratch)
+        free(buffer);
+
+    SIStatsRecordTransfer(client, 0, requestType, &transfer.result);
+    SITrace(kSITraceControlTransfer, SITraceSetup(requestType, request, value, index, length), transfer.result.length,
+        transfer.result.error, 0);
+    return transfer.result;
+}
+
+// Vectored transfers are run a few pieces at a time; pieces are whole
+// packets, so a largest-possible bulk packet bounds the bounce buffers.
+#define kSIVectorInFlight 4
+#define kSIVectorBounceMax 1024
+
+/// Position within an I/O vector.
+typedef struct {
+    SIIOVec const *iov;
+    uint32_t count;
+    uint32_t index;
+    size_t offset;
+    size_t remaining; ///< Bytes left across all segments.
+} SIVectorCursor;
+
+/// One transfer of a vectored operation.
+typedef struct {
+    SITransfer transfer;
+    int done;
+    int busy;
+    SIVectorCursor scatter; ///< Where a bounced read's data belongs.
+    uint8_t bounce[kSIVectorBounceMax];
+} SIVectorSlot;
+
+static void SIVectorCursorInit(SIVectorCursor *cursor, SIIOVec const *iov, uint32_t count)
+{
+    *cursor = (SIVectorCursor) { .iov = iov, .count = count };
+    for (uint32_t i = 0; i < count; ++i)
+        cursor->remaining += iov[i].length;
+}
+
+/// Move past empty segments, and the current one once it's been used up.
+static void SIVectorCursorSettle(SIVectorCursor *cursor)
+{
+    while (cursor->index < cursor->count && cursor->offset == cursor->iov[cursor->index].length) {
+        cursor->index++;
+        cursor->offset = 0;
+    }
+}
+
+/// Advance a cursor, gathering its data into a flat buffer, scattering a
+/// flat buffer into it, or (with no buffer) just skipping ahead.
+static void SIVectorCursorAdvance(SIVectorCursor *cursor, uint8_t *flat, size_t length, int gather)
+{
+    while (length) {
+        SIVectorCursorSettle(cursor);
+
+        SIIOVec const *segment = &cursor->iov[cursor->index];
+        size_t chunk = segment->length - cursor->offset;
+        if (chunk > length)
+            chunk = length;
+
+        if (flat) {
+            uint8_t *base = (uint8_t *)segment->base + cursor->offset;
+            if (gather)
+                memcpy(flat, base, chunk);
+            else
+                memcpy(base, flat, chunk);
+            flat += chunk;
+        }
+
+        length -= chunk;
+        cursor->offset += chunk;
+        cursor->remaining -= chunk;
+    }
+}
+
+/// Work out the next piece of a vectored operation.
+///
+/// Pieces run straight from the caller's segments wherever possible; only a
+/// packet which straddles two segments goes through the slot's bounce
+/// buffer. Every piece but the last is a whole number of packets, so that
+/// the device never sees a short packet before the end.
+static void SIVectorNextPiece(SIVectorCursor *cursor, uint32_t max, SIVectorSlot *slot, int gather)
+{
+    SIVectorCursorSettle(cursor);
+
+    SIIOVec const *segment = &cursor->iov[cursor->index];
+    size_t available = segment->length - cursor->offset;
+
+    if (available >= max || available == cursor->remaining) {
+        size_t length = available;
+        if (length != cursor->remaining)
+            length -= length % max;
+
+        // Keep each piece well within what a transfer can describe.
+        size_t limit = (size_t)max << 16;
+        if (length > limit)
+            length = limit;
+
+        slot->transfer.buffer = (uint8_t *)segment->base + cursor->offset;
+        slot->transfer.length = (uint32_t)length;
+        slot->scatter.iov = NULL;
+
+        cursor->offset += length;
+        cursor->remaining -= length;
+        return;
+    }
+
+    uint32_t length = cursor->remaining < max ? (uint32_t)cursor->remaining : max;
+    slot->transfer.buffer = slot->bounce;
+    slot->transfer.length = length;
+    slot->scatter = *cursor;
+
+    SIVectorCursorAdvance(cursor, gather ? slot->bounce : NULL, length, gather);
+}
+
+static IOReturn SICheckDataPipe(SIClient *client, uint8_t pipe, uint8_t direction, uint32_t *maxOut)
+{
+    if (!client->handle)
+        return kIOReturnNotOpen;
+    if (!client->backend->submitTransfer)
+        return kIOReturnUnsupported;
+
+    SIPipeProps props;
+    IOReturn ret = SIGetPipe(client, pipe, &props);
+    if (ret != kIOReturnSuccess)
+        return ret;
+    if (pipe == 0 || props.direction != direction
+        || (props.type != kSIPipeTypeBulk && props.type != kSIPipeTypeInterrupt))
+        return kIOReturnBadArgument;
+    if (props.max == 0 || props.max > kSIVectorBounceMax)
+        return kIOReturnUnsupported;
+
+    *maxOut = props.max;
+    return kIOReturnSuccess;
+}
+
+IOReturn SIWritePipeV(SIClient *client, uint8_t pipe, SIIOVec const *iov, uint32_t count, uint32_t flags)
+{
+    uint32_t max = 0;
+    IOReturn ret = SICheckDataPipe(client, pipe, kSIPipeDirectionOut, &max);
+    if (ret != kIOReturnSuccess)
+        return ret;
+
+    SIVectorCursor cursor;
+    SIVectorCursorInit(&cursor, iov, count);
+
+    // A transfer made up of whole packets only ends, as far as the device
+    // can tell, once it sees a zero-length packet.
+    int terminate = (flags & kSIWriteZeroLengthPacket) && cursor.remaining % max == 0;
+
+    // Like 'SIWritePipe', the client's pipe timeout covers the whole call.
+    uint64_t deadline = SIPipeDeadline(client);
+    SIVectorSlot slots[kSIVectorInFlight];
+    uint32_t submitted = 0, completed = 0;
+    for (;;) {
+        int more = ret == kIOReturnSuccess && (cursor.remaining || terminate);
+        if (!more && completed == submitted)
+            break;
+
+        // Pieces complete in order, so the oldest is the one to wait for.
+        if (!more || submitted - completed == kSIVectorInFlight) {
+            SIVectorSlot *oldest = &slots[completed++ % kSIVectorInFlight];
+            IOReturn error = SITransferWaitSyncUntil(&oldest->transfer, &oldest->done, deadline);
+            if (ret == kIOReturnSuccess)
+                ret = error;
+            continue;
+        }
+
+        SIVectorSlot *slot = &slots[submitted % kSIVectorInFlight];
+        SITransferInit(&slot->transfer, client, pipe, slot->bounce, 0, NULL, NULL);
+        if (cursor.remaining)
+            SIVectorNextPiece(&cursor, max, slot, 1);
+        else
+            terminate = 0;
+
+        if ((ret = SITransferStartSync(&slot->transfer, &slot->done, 0)) == kIOReturnSuccess)
+            submitted++;
+    }
+
+    if (ret != kIOReturnSuccess)
+        SIDebug("Vectored write on pipe %d failed. (%#x)", pipe, ret);
+
+    return ret;
+}
+
+IOReturn SIReadPipeV(SIClient *client, uint8_t pipe, SIIOVec const *iov, uint32_t count, uint32_t *lengthOut)
+{
+    uint32_t max = 0;
+    IOReturn ret = SICheckDataPipe(client, pipe, kSIPipeDirectionIn, &max);
+    if (ret != kIOReturnSuccess)
+        return ret;
+
+    SIVectorCursor cursor;
+    SIVectorCursorInit(&cursor, iov, count);
+
+    // Reads go one piece at a time: a short packet can end the transfer in
+    // any of them, and a read queued behind it would take the start of the
+    // next transfer instead.
+    uint64_t deadline = SIPipeDeadline(client);
+    SIVectorSlot slot;
+    uint32_t total = 0;
+    while (cursor.remaining) {
+        SITransferInit(&slot.transfer, client, pipe, NULL, 0, NULL, NULL);
+        SIVectorNextPiece(&cursor, max, &slot, 0);
+
+        int done;
+        if ((ret = SITransferStartSync(&slot.transfer, &done, 0)) == kIOReturnSuccess)
+            ret = SITransferWaitSyncUntil(&slot.transfer, &done, deadline);
+        uint32_t length = slot.transfer.result.length;
+        if (slot.scatter.iov)
+            SIVectorCursorAdvance(&slot.scatter, slot.bounce, length, 0);
+
+        total += length;
+        if (ret != kIOReturnSuccess || length < slot.transfer.length)
+            break;
+    }
+
+    *lengthOut = total;
+    return ret;
+}
+
+#define kSIUploadChunkSizeDefault 0x10000
+#define kSIUploadDepthDefault 3
+#define kSIUploadDepthMax 16
+
+IOReturn SIUploadBuffer(SIClient *client, uint8_t pipe, void const *data, size_t length,
+    SIUploadConfig const *config)
+{
+    uint32_t max = 0;
+    IOReturn ret = SICheckDataPipe(client, pipe, kSIPipeDirectionOut, &max);
+    if (ret != kIOReturnSuccess)
+        return ret;
+
+    SIUploadConfig defaults = { 0 };
+    if (!config)
+        config = &defaults;
+
+    // Chunks must be whole packets, or the device would see the upload end
+    // after the first one.
+    uint32_t chunkSize = config->chunkSize ? config->chunkSize : kSIUploadChunkSizeDefault;
+    chunkSize = chunkSize < max ? max : chunkSize - chunkSize % max;
+
+    uint32_t depth = config->depth ? config->depth : kSIUploadDepthDefault;
+    if (depth > kSIUploadDepthMax)
+        depth = kSIUploadDepthMax;
+
+    SIDebug("Uploading %zu bytes in %u byte chunks, %u deep...", length, chunkSize, depth);
+
+    SITransfer transfers[kSIUploadDepthMax];
+    int done[kSIUploadDepthMax];
+    uint32_t submitted = 0, completed = 0;
+    size_t offset = 0;
+    uint64_t sent = 0;
+    int terminate = (config->flags & kSIWriteZeroLengthPacket) && length % max == 0;
+
+    for (;;) {
+        int more = ret == kIOReturnSuccess && (offset < length || terminate);
+        if (!more && completed == submitted)
+            break;
+
+        // Keep the pipeline full, only waiting once every slot is in use.
+        // An upload can take far longer than any one transfer should, so
+        // the client's pipe timeout applies to each chunk in turn: the
+        // device has that long to finish the next one. Once the upload has
+        // failed, whatever is left is cancelled straight away.
+        if (!more || submitted - completed == depth) {
+            uint32_t slot = completed++ % depth;
+            uint64_t deadline = ret == kIOReturnSuccess ? SIPipeDeadline(client) : SIGetTimeNs();
+            IOReturn error = SITransferWaitSyncUntil(&transfers[slot], &done[slot], deadline);
+            if (ret == kIOReturnSuccess)
+                ret = error;
+
+            sent += transfers[slot].result.length;
+            if (config->progress && error == kIOReturnSuccess)
+                config->progress(config->context, sent, length);
+            continue;
+        }
+
+        uint32_t slot = submitted % depth;
+        size_t chunk = length - offset < chunkSize ? length - offset : chunkSize;
+        SITransferInit(&transfers[slot], client, pipe, (uint8_t *)data + offset, (uint32_t)chunk, NULL, NULL);
+        if (offset == length)
+            terminate = 0;
+        offset += chunk;
+
+        if ((ret = SITransferStartSync(&transfers[slot], &done[slot], 0)) == kIOReturnSuccess)
+            submitted++;
+    }
+
+    if (ret != kIOReturnSuccess)
+        SIDebug("Upload failed after %" PRIu64 " bytes. (%#x)", sent, ret);
+
+    return ret;
+}
+
+IOReturn SIUploadFile(SIClient *client, uint8_t pipe, char const *path, SIUploadConfig const *config)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        SIDebug("Failed to open '%s': %s", path, strerror(errno));
+        return errno == ENOENT ? kIOReturnNotFound
+            : (errno == EACCES || errno == EPERM) ? kIOReturnNotPrivileged
+                                                  : kIOReturnIOError;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return kIOReturnIOError;
+    }
+
+    // Chunks are sent straight out of the mapping, so the image is never
+    // read into memory of our own.
+    size_t length = (size_t)st.st_size;
+    void *data = NULL;
+    if (length) {
+        data = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            SIDebug("Failed to map '%s': %s", path, strerror(errno));
+            close(fd);
+            return kIOReturnNoMemory;
+        }
+
+        madvise(data, length, MADV_SEQUENTIAL);
+    }
+    close(fd);
+
+    IOReturn ret = SIUploadBuffer(client, pipe, data, length, config);
+
+    if (data)
+        munmap(data, length);
+    return ret;
+}
+
+#define kSIBatchInFlight 8
+
+IOReturn SIControlTransferBatch(SIClient *client, SIControlRequest const *requests, uint32_t count,
+    SITransferResult *results, uint32_t flags)
+{
+    if (!client->handle)
+        return kIOReturnNotOpen;
+
+    for (uint32_t i = 0; i < count; ++i)
+        results[i] = (SITransferResult) { .error = kIOReturnAborted, .length = 0 };
+
+    IOReturn ret = kIOReturnSuccess;
+    if (!client->backend->submitTransfer) {
+        for (uint32_t i = 0; i < count; ++i) {
+            SIControlRequest const *request = &requests[i];
+            results[i] = SIControlTransfer(client, request->requestType, request->request, request->value,
+                request->index, request->data, request->length);
+            if (results[i].error != kIOReturnSuccess && ret == kIOReturnSuccess) {
+                ret = results[i].error;
+                if (flags & kSIBatchStopOnError)
+                    break;
+            }
+        }
+
+        return ret;
+    }
+
+    // Each slot stages a setup packet followed by the data stage, sized for
+    // the largest request in the batch.
+    size_t slotSize = 0;
+    for (uint32_t i = 0; i < count; ++i) {
+        if (requests[i].length > slotSize)
+            slotSize = requests[i].length;
+    }
+    slotSize += sizeof(SISetupPacket);
+
+    uint8_t *staging = malloc(kSIBatchInFlight * slotSize);
+    if (!staging)
+        return kIOReturnNoMemory;
+
+    SITransfer transfers[kSIBatchInFlight];
+    int done[kSIBatchInFlight];
+    int started[kSIBatchInFlight];
+    uint32_t submitted = 0, completed = 0;
+    int stopped = 0;
+
+    for (;;) {
+        int more = !stopped && submitted < count;
+        if (!more && completed == submitted)
+            break;
+
+        // Requests complete in the order they were submitted, so the oldest
+        // is always the one to wait for.
+        if (!more || submitted - completed == kSIBatchInFlight) {
+            uint32_t slot = completed % kSIBatchInFlight;
+            SIControlRequest const *request = &requests[completed];
+
+            if (started[slot]) {
+                SITransferWaitSync(&transfers[slot], &done[slot]);
+                results[completed] = transfers[slot].result;
+
+                if ((request->requestType & kSIDirectionToHost) && request->data)
+                    memcpy(request->data, staging + slot * slotSize + sizeof(SISetupPacket),
+                        transfers[slot].result.length);
+            }
+
+            if (results[completed].error != kIOReturnSuccess) {
+                if (ret == kIOReturnSuccess)
+                    ret = results[completed].error;
+                if (flags & kSIBatchStopOnError)
+                    stopped = 1;
+            }
+
+            completed++;
+            continue;
+        }
+
+        uint32_t slot = submitted % kSIBatchInFlight;
+        SIControlRequest const *request = &requests[submitted];
+        uint8_t *buffer = staging + slot * slotSize;
+
+        SIFillSetupPacket(buffer, request->requestType, request->request, request->value, request->index,
+            request->length);
+        if (!(request->requestType & kSIDirectionToHost)) {
+            if (request->data)
+                memcpy(buffer + sizeof(SISetupPacket), request->data, request->length);
+            else
+                memset(buffer + sizeof(SISetupPacket), 0, request->length);
+        }
+
+        SITransferInit(&transfers[slot], client, 0, buffer, (uint32_t)(sizeof(SISetupPacket) + request->length),
+            NULL, NULL);
+
+        IOReturn error = SITransferStartSync(&transfers[slot], &done[slot], 0);
+        started[slot] = error == kIOReturnSuccess;
+        if (!started[slot])
+            results[submitted] = (SITransferResult) { .error = error, .length = 0 };
+        submitted++;
+    }
+
+    free(staging);
+
+    if (ret != kIOReturnSuccess)
+        SIDebug("Control transfer batch failed. (%#x)", ret);
+
+    return ret;
+}
+
+static size_t SIPageSize(void)
+{
+    static size_t sPageSize;
+    if (!sPageSize) {
+        long size = sysconf(_SC_PAGESIZE);
+        sPageSize = size > 0 ? (size_t)size : 0x1000;
+    }
+
+    return sPageSize;
+}
+
+/// Allocate page-aligned transfer memory, mapped by the backend for DMA if
+/// it can be; 'mappedOut' reports which happened.
+static void *SIAllocBuffers(SIClient *client, size_t size, int *mappedOut)
+{
+    if (client->handle && client->backend->allocBuffers) {
+        void *buffers = client->backend->allocBuffers(client, size);
+        if (buffers) {
+            *mappedOut = 1;
+            return buffers;
+        }
+    }
+
+    void *buffers = NULL;
+    *mappedOut = 0;
+    if (posix_memalign(&buffers, SIPageSize(), size) != 0)
+        return NULL;
+
+    return buffers;
+}
+
+static void SIFreeBuffers(SIClient *client, void *buffers, size_t size, int mapped)
+{
+    if (mapped)
+        client->backend->freeBuffers(client, buffers, size);
+    else
+        free(buffers);
+}
+
+/// Buffer pool state.
+///
+/// Free buffers form a lock-free stack, linked by index; the top of the
+/// stack is packed with a counter bumped on every update, so that a stale
+/// compare-and-swap can't succeed after the stack has changed underneath it.
+struct SIBufferPool {
+    SIClient *client;
+    SIBufferPool *next; ///< Next pool owned by the same client.
+
+    uint8_t *base;
+    size_t size;
+    uint32_t bufferSize;
+    size_t stride; ///< Distance between buffers, in whole pages.
+    uint32_t count;
+    int mapped;
+
+    uint32_t *links; ///< Index + 1 of the next free buffer, or 0.
+    uint64_t top;    ///< Counter << 32 | index + 1 of the first free buffer.
+};
+
+SIBufferPool *SIBufferPoolCreate(SIClient *client, uint32_t bufferSize, uint32_t count)
+{
+    // Free buffers are linked by index + 1, which has to fit in 32 bits.
+    size_t pageSize = SIPageSize();
+    size_t stride = ((size_t)bufferSize + pageSize - 1) & ~(pageSize - 1);
+    if (bufferSize == 0 || count == 0 || count == UINT32_MAX || stride > SIZE_MAX / count)
+        return NULL;
+
+    SIBufferPool *pool = calloc(1, sizeof(SIBufferPool));
+    if (!pool)
+        return NULL;
+
+    pool->client = client;
+    pool->bufferSize = bufferSize;
+    pool->stride = stride;
+    pool->count = count;
+    pool->size = stride * count;
+
+    pool->links = calloc(count, sizeof(uint32_t));
+    pool->base = SIAllocBuffers(client, pool->size, &pool->mapped);
+    if (!pool->links || !pool->base) {
+        SIDebug("Failed to allocate %u buffers of %u bytes.", count, bufferSize);
+        free(pool->links);
+        free(pool);
+        return NULL;
+    }
+
+    for (uint32_t i = 0; i < count; ++i)
+        pool->links[i] = i + 1 < count ? i + 2 : 0;
+    pool->top = 1;
+
+    SIDebug("Created pool of %u buffers (%s).", count, pool->mapped ? "device-mapped" : "host memory");
+
+    SIAsyncState *async = client->async;
+    pthread_mutex_lock(&async->lock);
+    pool->next = async->pools;
+    async->pools = pool;
+    pthread_mutex_unlock(&async->lock);
+
+    return pool;
+}
+
+void SIBufferPoolDestroy(SIBufferPool *pool)
+{
+    SIAsyncState *async = pool->client->async;
+    pthread_mutex_lock(&async->lock);
+    for (SIBufferPool **it = &async->pools; *it; it = &(*it)->next) {
+        if (*it == pool) {
+            *it = pool->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&async->lock);
+
+    SIFreeBuffers(pool->client, pool->base, pool->size, pool->mapped);
+    free(pool->links);
+    free(pool);
+}
+
+void *SIBufferPoolAcquire(SIBufferPool *pool)
+{
+    uint64_t top = __atomic_load_n(&pool->top, __ATOMIC_ACQUIRE);
+    uint64_t next;
+    do {
+        uint32_t index = (uint32_t)top;
+        if (!index)
+            return NULL;
+
+        uint32_t link = __atomic_load_n(&pool->links[index - 1], __ATOMIC_RELAXED);
+        next = ((top >> 32) + 1) << 32 | link;
+    } while (!__atomic_compare_exchange_n(&pool->top, &top, next, 1, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+
+    return pool->base + (size_t)((uint32_t)top - 1) * pool->stride;
+}
+
+void SIBufferPoolRelease(SIBufferPool *pool, void *buffer)
+{
+    // Pushing anything but one of the pool's own buffers would corrupt the
+    // free list, so strays are turned away.
+    uintptr_t address = (uintptr_t)buffer;
+    uintptr_t base = (uintptr_t)pool->base;
+    if (address < base || address - base >= pool->size || (address - base) % pool->stride != 0) {
+        SIDebug("Ignoring buffer %p, which isn't from pool %p.", buffer, (void *)pool);
+        return;
+    }
+
+    uint32_t index = (uint32_t)((address - base) / pool->stride);
+
+    uint64_t top = __atomic_load_n(&pool->top, __ATOMIC_RELAXED);
+    uint64_t next;
+    do {
+        __atomic_store_n(&pool->links[index], (uint32_t)top, __ATOMIC_RELAXED);
+        next = ((top >> 32) + 1) << 32 | (index + 1);
+    } while (!__atomic_compare_exchange_n(&pool->top, &top, next, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+uint32_t SIBufferPoolGetBufferSize(SIBufferPool *pool)
+{
+    return pool->bufferSize;
+}
+
+int SIBufferPoolIsDeviceMapped(SIBufferPool *pool)
+{
+    return pool->mapped;
+}
+
+#define kSIStreamTransferSizeDefault 0x4000
+#define kSIStreamDepthDefault 8
+#define kSIStreamSlotsDefault 64
+
+/// Stream ring entry, naming the buffer a read landed in.
+typedef struct {
+    uint32_t buffer;
+    uint32_t length;
+} SIStreamEntry;
+
+/// Stream state.
+///
+/// The ring is written by whichever thread is running read callbacks (the
+/// producer, serialized by 'lock') and read by a single consumer without
+/// any locking; 'tail' and 'head' are the only state they share. Buffers
+/// move from the free stack to a read, then to the ring, and are reclaimed
+/// onto the free stack once the consumer has released them.
+struct SIStream {
+    SIClient *client;
+    uint8_t pipe;
+    uint32_t flags;
+    uint32_t transferSize;
+    uint32_t depth;
+    uint32_t previousDepth; ///< Pipe's queue depth before the stream, or zero if untouched.
+    uint32_t mask; ///< Ring capacity minus one.
+
+    uint8_t *storage;      ///< Buffers for every ring slot and every read.
+    size_t storageSize;
+    int storageMapped;
+    SIStreamEntry *ring;   ///< Published reads.
+    SITransfer *transfers; ///< Reads, 'depth' of them.
+
+    uint8_t pad0[kSICacheLineSize];
+    uint64_t head; ///< Next entry for the consumer; written by the consumer only.
+    uint8_t pad1[kSICacheLineSize - sizeof(uint64_t)];
+
+    pthread_mutex_t lock;
+    pthread_cond_t producerCond; ///< Signalled on release when the producer is waiting for space.
+    uint64_t tail;               ///< Next entry to publish; written by the producer only.
+    uint64_t reclaimed;          ///< Entries whose buffers have been taken back.
+    uint32_t *free;              ///< Buffers not in use.
+    uint32_t numFree;
+    SIStreamEntry *parked; ///< Completed reads waiting for ring space, oldest first.
+    uint32_t parkedHead;
+    uint32_t numParked;
+    SITransfer **idle; ///< Reads not in flight.
+    uint32_t numIdle;
+    uint32_t inFlight;
+    uint64_t stallStart;
+    SIStreamStats stats;
+    IOReturn status; ///< First error seen; stops the stream.
+    int stopping;
+    int producerWaiting;
+
+    pthread_mutex_t waitLock;
+    pthread_cond_t consumerCond; ///< Signalled on publish when the consumer is waiting.
+    int consumerWaiting;
+
+    pthread_t pump;
+    int pumping;
+};
+
+static inline uint32_t SIStreamCapacity(SIStream *stream)
+{
+    return stream->mask + 1 + stream->depth;
+}
+
+static void SIStreamWakeConsumer(SIStream *stream)
+{
+    if (!__atomic_load_n(&stream->consumerWaiting, __ATOMIC_SEQ_CST))
+        return;
+
+    pthread_mutex_lock(&stream->waitLock);
+    pthread_cond_broadcast(&stream->consumerCond);
+    pthread_mutex_unlock(&stream->waitLock);
+}
+
+/// Record the error which stopped the stream; 'lock' must be held.
+static void SIStreamFail(SIStream *stream, IOReturn error)
+{
+    if (stream->status != kIOReturnSuccess)
+        return;
+
+    SIDebug("Stream on pipe %d stopped. (%#x)", stream->pipe, error);
+    __atomic_store_n(&stream->status, error, __ATOMIC_SEQ_CST);
+    SIStreamWakeConsumer(stream);
+}
+
+/// Take back the buffers of entries the consumer has released; 'lock' must
+/// be held.
+static void SIStreamReclaim(SIStream *stream)
+{
+    uint64_t head = __atomic_load_n(&stream->head, __ATOMIC_ACQUIRE);
+    while (stream->reclaimed != head)
+        stream->free[stream->numFree++] = stream->ring[stream->reclaimed++ & stream->mask].buffer;
+}
+
+/// Publish the oldest parked read if the ring has room; 'lock' must be held.
+static int SIStreamPublish(SIStream *stream)
+{
+    uint64_t used = stream->tail - stream->reclaimed;
+    if (used > stream->mask) {
+        SIStreamReclaim(stream);
+        if ((used = stream->tail - stream->reclaimed) > stream->mask)
+            return 0;
+    }
+
+    SIStreamEntry entry = stream->parked[stream->parkedHead];
+    stream->parkedHead = (stream->parkedHead + 1) % SIStreamCapacity(stream);
+    stream->numParked--;
+
+    stream->ring[stream->tail & stream->mask] = entry;
+    __atomic_store_n(&stream->tail, stream->tail + 1, __ATOMIC_SEQ_CST);
+    SIStreamWakeConsumer(stream);
+
+    stream->stats.reads++;
+    stream->stats.bytes += entry.length;
+    if (used + 1 > stream->stats.highWater)
+        stream->stats.highWater = (uint32_t)(used + 1);
+
+    return 1;
+}
+
+/// Publish what can be published and queue as many reads as there are free
+/// buffers for; 'lock' must be held.
+static void SIStreamResume(SIStream *stream)
+{
+    while (stream->numParked && SIStreamPublish(stream))
+        ;
+
+    // Dropping means never letting parked reads hold up the pipe.
+    if (stream->flags & kSIStreamDropWhenFull) {
+        while (stream->numParked) {
+            SIStreamEntry entry = stream->parked[stream->parkedHead];
+            stream->parkedHead = (stream->parkedHead + 1) % SIStreamCapacity(stream);
+            stream->numParked--;
+
+            stream->free[stream->numFree++] = entry.buffer;
+            stream->stats.overruns++;
+            stream->stats.droppedBytes += entry.length;
+        }
+    }
+
+    SIStreamReclaim(stream);
+    while (stream->numIdle && stream->numFree && !stream->stopping && stream->status == kIOReturnSuccess) {
+        SITransfer *transfer = stream->idle[--stream->numIdle];
+        uint32_t buffer = stream->free[--stream->numFree];
+
+        transfer->buffer = stream->storage + (size_t)buffer * stream->transferSize;
+        stream->inFlight++;
+
+        IOReturn ret = SISubmitTransfer(transfer);
+        if (ret != kIOReturnSuccess) {
+            stream->inFlight--;
+            stream->idle[stream->numIdle++] = transfer;
+            stream->free[stream->numFree++] = buffer;
+            SIStreamFail(stream, ret);
+        }
+    }
+
+    // Reading is paused whenever reads sit idle for lack of buffers.
+    int stalled = stream->numIdle && !stream->stopping && stream->status == kIOReturnSuccess;
+    if (stalled && !stream->stallStart) {
+        stream->stats.stalls++;
+        stream->stallStart = SIGetTimeNs();
+    } else if (!stalled && stream->stallStart) {
+        stream->stats.stalledNs += SIGetTimeNs() - stream->stallStart;
+        stream->stallStart = 0;
+    }
+}
+
+static void SIStreamReadCompleted(SITransfer *transfer)
+{
+    SIStream *stream = transfer->context;
+    uint32_t buffer = (uint32_t)(((uint8_t *)transfer->buffer - stream->storage) / stream->transferSize);
+
+    pthread_mutex_lock(&stream->lock);
+    stream->inFlight--;
+
+    IOReturn error = transfer->result.error;
+    if (error != kIOReturnSuccess && !stream->stopping) {
+        stream->stats.errors++;
+        SIStreamFail(stream, error);
+    }
+
+    if (transfer->result.length && !stream->stopping) {
+        uint32_t slot = (stream->parkedHead + stream->numParked++) % SIStreamCapacity(stream);
+        stream->parked[slot] = (SIStreamEntry) { .buffer = buffer, .length = transfer->result.length };
+    } else {
+        stream->free[stream->numFree++] = buffer;
+    }
+
+    stream->idle[stream->numIdle++] = transfer;
+    SIStreamResume(stream);
+
+    if (stream->stopping && !stream->inFlight)
+        pthread_cond_broadcast(&stream->producerCond);
+    pthread_mutex_unlock(&stream->lock);
+}
+
+/// Stream thread, which keeps completions flowing and restarts reads once
+/// the consumer frees up space.
+static void *SIStreamPump(void *context)
+{
+    SIStream *stream = context;
+
+    pthread_mutex_lock(&stream->lock);
+    while (!stream->stopping || stream->inFlight) {
+        if (!stream->inFlight) {
+            // Nothing is queued, so there will be no completions until the
+            // consumer releases something (or the stream is closed).
+            __atomic_store_n(&stream->producerWaiting, 1, __ATOMIC_SEQ_CST);
+            SIStreamResume(stream);
+            if (!stream->inFlight && !stream->stopping)
+                pthread_cond_wait(&stream->producerCond, &stream->lock);
+            __atomic_store_n(&stream->producerWaiting, 0, __ATOMIC_SEQ_CST);
+            continue;
+        }
+
+        // Poll more often while reads are waiting on the consumer.
+        int timeoutMs = stream->numIdle ? 1 : 100;
+        pthread_mutex_unlock(&stream->lock);
+        IOReturn ret = SIHandleEvents(stream->client, timeoutMs);
+        pthread_mutex_lock(&stream->lock);
+
+        if (ret != kIOReturnSuccess && ret != kIOReturnTimeout) {
+            // Completions can't be reaped any more; give up on them.
+            SIStreamFail(stream, ret);
+            while (!stream->stopping)
+                pthread_cond_wait(&stream->producerCond, &stream->lock);
+            break;
+        }
+
+        SIStreamResume(stream);
+    }
+    pthread_mutex_unlock(&stream->lock);
+
+    return NULL;
+}
+
+static uint32_t SIRoundUpPow2(uint32_t value)
+{
+    uint32_t result = 1;
+    while (result < value)
+        result <<= 1;
+    return result;
+}
+
+IOReturn SIStreamOpen(SIClient *client, uint8_t pipe, SIStreamConfig const *config, SIStream **streamOut)
+{
+    SIPipeProps props;
+    IOReturn ret = SIGetPipe(client, pipe, &props);
+    if (ret != kIOReturnSuccess)
+        return ret;
+    if (pipe == 0 || props.direction != kSIPipeDirectionIn
+        || (props.type != kSIPipeTypeBulk && props.type != kSIPipeTypeInterrupt))
+        return kIOReturnBadArgument;
+
+    SIStreamConfig defaults = { 0 };
+    if (!config)
+        config = &defaults;
+
+    SIStream *stream = calloc(1, sizeof(SIStream));
+    if (!stream)
+        return kIOReturnNoMemory;
+
+    stream->client = client;
+    stream->pipe = pipe;
+    stream->flags = config->flags;
+    stream->transferSize = config->transferSize ? config->transferSize : kSIStreamTransferSizeDefault;
+    stream->depth = config->depth ? config->depth : kSIStreamDepthDefault;
+    stream->mask = SIRoundUpPow2(config->slots ? config->slots : kSIStreamSlotsDefault) - 1;
+    pthread_mutex_init(&stream->lock, NULL);
+    pthread_cond_init(&stream->producerCond, NULL);
+    pthread_mutex_init(&stream->waitLock, NULL);
+    SICondInit(&stream->consumerCond);
+
+    uint32_t capacity = SIStreamCapacity(stream);
+    stream->storageSize = (size_t)capacity * stream->transferSize;
+    stream->storage = SIAllocBuffers(client, stream->storageSize, &stream->storageMapped);
+    stream->ring = calloc(stream->mask + 1, sizeof(SIStreamEntry));
+    stream->transfers = calloc(stream->depth, sizeof(SITransfer));
+    stream->free = calloc(capacity, sizeof(uint32_t));
+    stream->parked = calloc(capacity, sizeof(SIStreamEntry));
+    stream->idle = calloc(stream->depth, sizeof(SITransfer *));
+    if (!stream->storage || !stream->ring || !stream->transfers || !stream->free || !stream->parked || !stream->idle) {
+        ret = kIOReturnNoMemory;
+        goto L_failed;
+    }
+
+    for (uint32_t i = 0; i < capacity; ++i)
+        stream->free[stream->numFree++] = capacity - 1 - i;
+    for (uint32_t i = 0; i < stream->depth; ++i) {
+        SITransferInit(&stream->transfers[i], client, pipe, NULL, stream->transferSize,
+            SIStreamReadCompleted, stream);
+        stream->idle[stream->numIdle++] = &stream->transfers[i];
+    }
+
+    uint32_t previousDepth = SIGetPipeQueueDepth(client, pipe);
+    if ((ret = SISetPipeQueueDepth(client, pipe, stream->depth)) != kIOReturnSuccess)
+        goto L_failed;
+    stream->previousDepth = previousDepth;
+
+    pthread_mutex_lock(&stream->lock);
+    SIStreamResume(stream);
+    ret = stream->status;
+    pthread_mutex_unlock(&stream->lock);
+    if (ret != kIOReturnSuccess)
+        goto L_aborted;
+
+    if (pthread_create(&stream->pump, NULL, SIStreamPump, stream) != 0) {
+        ret = kIOReturnNoResources;
+        goto L_aborted;
+    }
+
+    stream->pumping = 1;
+    *streamOut = stream;
+    return kIOReturnSuccess;
+
+L_aborted:
+    // Some reads may have been queued before things went wrong.
+    pthread_mutex_lock(&stream->lock);
+    stream->stopping = 1;
+    pthread_mutex_unlock(&stream->lock);
+
+L_failed:
+    SIStreamClose(stream);
+    return ret;
+}
+
+void SIStreamClose(SIStream *stream)
+{
+    // Reads are only ever submitted under the lock, and never once stopping,
+    // so one pass cancels every read of the stream's own; other transfers
+    // on the pipe are left alone.
+    pthread_mutex_lock(&stream->lock);
+    stream->stopping = 1;
+    pthread_cond_broadcast(&stream->producerCond);
+    pthread_mutex_unlock(&stream->lock);
+
+    if (stream->pumping) {
+        for (uint32_t i = 0; i < stream->depth; ++i)
+            SICancelTransfer(&stream->transfers[i]);
+        pthread_join(stream->pump, NULL);
+    }
+
+    // The pump stops reaping if the client fails, and isn't there at all
+    // if opening failed.
+    if (stream->transfers)
+        SITransfersDrain(stream->client, stream->transfers, sizeof(SITransfer), stream->depth, &stream->lock,
+            &stream->inFlight);
+    if (stream->previousDepth)
+        SISetPipeQueueDepth(stream->client, stream->pipe, stream->previousDepth);
+
+    pthread_cond_destroy(&stream->consumerCond);
+    pthread_mutex_destroy(&stream->waitLock);
+    pthread_cond_destroy(&stream->producerCond);
+    pthread_mutex_destroy(&stream->lock);
+    free(stream->idle);
+    free(stream->parked);
+    free(stream->free);
+    free(stream->transfers);
+    free(stream->ring);
+    if (stream->storage)
+        SIFreeBuffers(stream->client, stream->storage, stream->storageSize, stream->storageMapped);
+    free(stream);
+}
+
+IOReturn SIStreamPeek(SIStream *stream, SIStreamView *view, int timeoutMs)
+{
+    uint64_t head = stream->head;
+
+    if (__atomic_load_n(&stream->tail, __ATOMIC_ACQUIRE) == head) {
+        IOReturn status = __atomic_load_n(&stream->status, __ATOMIC_SEQ_CST);
+        if (status != kIOReturnSuccess)
+            return status;
+        if (timeoutMs == 0)
+            return kIOReturnTimeout;
+
+        uint64_t deadline = timeoutMs > 0 ? SIGetTimeNs() + (uint64_t)timeoutMs * 1000000 : 0;
+
+        pthread_mutex_lock(&stream->waitLock);
+        __atomic_store_n(&stream->consumerWaiting, 1, __ATOMIC_SEQ_CST);
+        while (__atomic_load_n(&stream->tail, __ATOMIC_SEQ_CST) == head
+            && (status = __atomic_load_n(&stream->status, __ATOMIC_SEQ_CST)) == kIOReturnSuccess) {
+            if (timeoutMs < 0)
+                pthread_cond_wait(&stream->consumerCond, &stream->waitLock);
+            else if (SICondWaitUntilNs(&stream->consumerCond, &stream->waitLock, deadline) == ETIMEDOUT)
+                break;
+        }
+        __atomic_store_n(&stream->consumerWaiting, 0, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&stream->waitLock);
+
+        if (__atomic_load_n(&stream->tail, __ATOMIC_ACQUIRE) == head)
+            return status != kIOReturnSuccess ? status : kIOReturnTimeout;
+    }
+
+    SIStreamEntry entry = stream->ring[head & stream->mask];
+    view->data = stream->storage + (size_t)entry.buffer * stream->transferSize;
+    view->length = entry.length;
+    return kIOReturnSuccess;
+}
+
+void SIStreamRelease(SIStream *stream)
+{
+    uint64_t head = stream->head;
+    if (__atomic_load_n(&stream->tail, __ATOMIC_ACQUIRE) == head)
+        return;
+
+    __atomic_store_n(&stream->head, head + 1, __ATOMIC_SEQ_CST);
+
+    // Only bother the producer if it has run out of buffers.
+    if (__atomic_load_n(&stream->producerWaiting, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&stream->lock);
+        pthread_cond_broadcast(&stream->producerCond);
+        pthread_mutex_unlock(&stream->lock);
+    }
+}
+
+void SIStreamGetStats(SIStream *stream, SIStreamStats *stats)
+{
+    pthread_mutex_lock(&stream->lock);
+    *stats = stream->stats;
+    if (stream->stallStart)
+        stats->stalledNs += SIGetTimeNs() - stream->stallStart;
+    pthread_mutex_unlock(&stream->lock);
+}
+
+#define kSIIsoStreamPacketsDefault 8
+#define kSIIsoStreamDepthDefault 4
+#define kSIIsoStreamFrameUsDefault 1000
+
+/// Isochronous stream transfer, and when it was last filled in.
+typedef struct {
+    SITransfer transfer;
+    uint64_t filledAt;
+} SIIsoStreamSlot;
+
+/// Isochronous stream state.
+///
+/// Transfers are resubmitted straight from their completions, so the pipe
+/// only goes without while a completion is being handled. 'lock' guards
+/// the counters and the bookkeeping below; the callback runs without it.
+struct SIIsoStream {
+    SIClient *client;
+    uint8_t pipe;
+    int in;
+    uint32_t packetSize;
+    uint32_t packetsPerTransfer;
+    uint32_t depth;
+    uint32_t previousDepth; ///< Pipe's queue depth before the stream, or zero if untouched.
+    uint64_t intervalNs; ///< Service interval of the pipe.
+    SIIsoStreamCallback callback;
+    void *context;
+
+    uint8_t *storage;
+    size_t storageSize;
+    int storageMapped;
+    SIIsoPacket *packets;
+    SIIsoStreamSlot *slots;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond; ///< Signalled when the last transfer in flight completes while stopping.
+    uint32_t inFlight;
+    int stopping;
+    SIIsoStreamStats stats;
+
+    /// Interval numbers, counted from where the pipe last started from dry;
+    /// 'originNs' is when interval zero began by the host's clock.
+    uint64_t nextInterval;
+    int64_t originNs;
+    int anchored;
+
+    pthread_t pump;
+    int pumping;
+};
+
+static void SIHistogramRecord(SIHistogram *histogram, uint64_t ns)
+{
+    histogram->count++;
+    histogram->totalNs += ns;
+    histogram->buckets[SIHistogramBucket(ns)]++;
+}
+
+/// Record the error which stopped the stream; 'lock' must be held.
+static void SIIsoStreamFail(SIIsoStream *stream, IOReturn error)
+{
+    if (stream->stats.status != kIOReturnSuccess)
+        return;
+
+    SIDebug("Isochronous stream on pipe %d stopped. (%#x)", stream->pipe, error);
+    stream->stats.status = error;
+}
+
+/// Count a completed transfer's packets, and work out their latencies;
+/// 'lock' must be held.
+static void SIIsoStreamAccount(SIIsoStream *stream, SIIsoStreamSlot *slot, uint64_t now)
+{
+    SITransfer *transfer = &slot->transfer;
+    SIIsoStreamStats *stats = &stream->stats;
+
+    stats->transfers++;
+    if (transfer->result.error != kIOReturnSuccess) {
+        // Nothing was serviced, so there's no telling where the pipe is.
+        if (transfer->result.error != kIOReturnAborted || !stream->stopping)
+            stats->errors++;
+        stream->anchored = 0;
+        return;
+    }
+
+    uint64_t first = stream->nextInterval + transfer->missedFrames;
+    stream->nextInterval = first + transfer->numPackets;
+    stats->droppedFrames += transfer->missedFrames;
+
+    // The last packet's interval can't have ended after now; the earliest
+    // completion seen pins down where the intervals fall.
+    int64_t origin = (int64_t)now - (int64_t)(stream->nextInterval * stream->intervalNs);
+    if (!stream->anchored || origin < stream->originNs) {
+        stream->originNs = origin;
+        stream->anchored = 1;
+    }
+
+    for (uint32_t i = 0; i < transfer->numPackets; ++i) {
+        SIIsoPacket const *packet = &transfer->packets[i];
+        stats->packets++;
+        stats->bytes += packet->actual;
+        if (packet->status == kIOReturnIsoTooOld)
+            stats->droppedFrames++;
+        else if (packet->status != kIOReturnSuccess)
+            stats->packetErrors++;
+
+        int64_t start = stream->originNs + (int64_t)((first + i) * stream->intervalNs);
+        int64_t latency = stream->in ? (int64_t)now - (start + (int64_t)stream->intervalNs)
+                                     : start - (int64_t)slot->filledAt;
+        SIHistogramRecord(&stats->latency, latency > 0 ? (uint64_t)latency : 0);
+    }
+}
+
+/// Fill in a transfer's packets and submit it, unless the stream is done;
+/// 'lock' must not be held.
+static void SIIsoStreamSubmit(SIIsoStream *stream, SIIsoStreamSlot *slot)
+{
+    SITransfer *transfer = &slot->transfer;
+
+    pthread_mutex_lock(&stream->lock);
+    if (stream->stopping || stream->stats.status != kIOReturnSuccess) {
+        pthread_mutex_unlock(&stream->lock);
+        return;
+    }
+
+    // With nothing else queued, the pipe has run dry, and the backend may
+    // not be able to say for how long.
+    if (!stream->inFlight)
+        stream->anchored = 0;
+    stream->inFlight++;
+    pthread_mutex_unlock(&stream->lock);
+
+    for (uint32_t i = 0; i < transfer->numPackets; ++i)
+        transfer->packets[i].length = stream->packetSize;
+
+    if (!stream->in) {
+        stream->callback(stream->context, transfer->packets, transfer->numPackets, transfer->buffer);
+
+        // Close up any gaps left by shortened packets.
+        uint8_t *data = transfer->buffer;
+        uint32_t offset = 0;
+        for (uint32_t i = 0; i < transfer->numPackets; ++i) {
+            uint32_t length = transfer->packets[i].length;
+            if (length > stream->packetSize)
+                length = transfer->packets[i].length = stream->packetSize;
+            if (offset != i * stream->packetSize)
+                memmove(data + offset, data + i * stream->packetSize, length);
+            offset += length;
+        }
+    }
+
+    slot->filledAt = SIGetTimeNs();
+    IOReturn ret = SISubmitTransfer(transfer);
+    if (ret != kIOReturnSuccess) {
+        pthread_mutex_lock(&stream->lock);
+        stream->inFlight--;
+        SIIsoStreamFail(stream, ret);
+        pthread_cond_broadcast(&stream->cond);
+        pthread_mutex_unlock(&stream->lock);
+    }
+}
+
+static void SIIsoStreamCompleted(SITransfer *transfer)
+{
+    SIIsoStream *stream = transfer->context;
+    SIIsoStreamSlot *slot = (SIIsoStreamSlot *)transfer;
+    uint64_t now = SIGetTimeNs();
+
+    if (stream->in && transfer->result.error == kIOReturnSuccess)
+        stream->callback(stream->context, transfer->packets, transfer->numPackets, transfer->buffer);
+
+    pthread_mutex_lock(&stream->lock);
+    stream->inFlight--;
+    SIIsoStreamAccount(stream, slot, now);
+    if (transfer->result.error == kIOReturnNoDevice)
+        SIIsoStreamFail(stream, kIOReturnNoDevice);
+    if (!stream->inFlight)
+        pthread_cond_broadcast(&stream->cond);
+    pthread_mutex_unlock(&stream->lock);
+
+    SIIsoStreamSubmit(stream, slot);
+}
+
+/// Isochronous stream thread, which keeps completions flowing.
+static void *SIIsoStreamPump(void *context)
+{
+    SIIsoStream *stream = context;
+
+    pthread_mutex_lock(&stream->lock);
+    while (stream->inFlight || !stream->stopping) {
+        if (!stream->inFlight) {
+            // Stopped by an error; wait to be closed.
+            pthread_cond_wait(&stream->cond, &stream->lock);
+            continue;
+        }
+
+        pthread_mutex_unlock(&stream->lock);
+        IOReturn ret = SIHandleEvents(stream->client, 100);
+        pthread_mutex_lock(&stream->lock);
+
+        if (ret != kIOReturnSuccess && ret != kIOReturnTimeout) {
+            // Completions can't be reaped any more; give up on them.
+            SIIsoStreamFail(stream, ret);
+            while (!stream->stopping)
+                pthread_cond_wait(&stream->cond, &stream->lock);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&stream->lock);
+
+    return NULL;
+}
+
+IOReturn SIIsoStreamOpen(SIClient *client, uint8_t pipe, SIIsoStreamConfig const *config, SIIsoStream **streamOut)
+{
+    SIPipeProps props;
+    IOReturn ret = SIGetPipe(client, pipe, &props);
+    if (ret != kIOReturnSuccess)
+        return ret;
+    if (pipe == 0 || props.type != kSIPipeTypeIsochronous || !config || !config->callback
+        || config->packetsPerTransfer > kSIIsoPacketsMax)
+        return kIOReturnBadArgument;
+
+    SIIsoStream *stream = calloc(1, sizeof(SIIsoStream));
+    if (!stream)
+        return kIOReturnNoMemory;
+
+    uint32_t frameUs = config->frameUs ? config->frameUs : kSIIsoStreamFrameUsDefault;
+
+    stream->client = client;
+    stream->pipe = pipe;
+    stream->in = props.direction == kSIPipeDirectionIn;
+    stream->packetSize = config->packetSize ? config->packetSize : props.max;
+    stream->packetsPerTransfer = config->packetsPerTransfer ? config->packetsPerTransfer : kSIIsoStreamPacketsDefault;
+    stream->depth = config->depth ? config->depth : kSIIsoStreamDepthDefault;
+    stream->intervalNs = SIServiceIntervalNs(&props, frameUs);
+    stream->callback = config->callback;
+    stream->context = config->context;
+    pthread_mutex_init(&stream->lock, NULL);
+    pthread_cond_init(&stream->cond, NULL);
+    if (!stream->packetSize) {
+        ret = kIOReturnBadArgument;
+        goto L_failed;
+    }
+
+    uint32_t numPackets = stream->depth * stream->packetsPerTransfer;
+    uint32_t transferSize = stream->packetsPerTransfer * stream->packetSize;
+    stream->storageSize = (size_t)stream->depth * transferSize;
+    stream->storage = SIAllocBuffers(client, stream->storageSize, &stream->storageMapped);
+    stream->packets = calloc(numPackets, sizeof(SIIsoPacket));
+    stream->slots = calloc(stream->depth, sizeof(SIIsoStreamSlot));
+    if (!stream->storage || !stream->packets || !stream->slots) {
+        ret = kIOReturnNoMemory;
+        goto L_failed;
+    }
+
+    for (uint32_t i = 0; i < stream->depth; ++i) {
+        SITransfer *transfer = &stream->slots[i].transfer;
+        SITransferInit(transfer, client, pipe, stream->storage + (size_t)i * transferSize, transferSize,
+            SIIsoStreamCompleted, stream);
+        transfer->packets = &stream->packets[i * stream->packetsPerTransfer];
+        transfer->numPackets = stream->packetsPerTransfer;
+    }
+
+    uint32_t previousDepth = SIGetPipeQueueDepth(client, pipe);
+    if ((ret = SISetPipeQueueDepth(client, pipe, stream->depth)) != kIOReturnSuccess)
+        goto L_failed;
+    stream->previousDepth = previousDepth;
+
+    for (uint32_t i = 0; i < stream->depth; ++i)
+        SIIsoStreamSubmit(stream, &stream->slots[i]);
+
+    pthread_mutex_lock(&stream->lock);
+    ret = stream->stats.status;
+    pthread_mutex_unlock(&stream->lock);
+    if (ret != kIOReturnSuccess)
+        goto L_aborted;
+
+    if (pthread_create(&stream->pump, NULL, SIIsoStreamPump, stream) != 0) {
+        ret = kIOReturnNoResources;
+        goto L_aborted;
+    }
+
+    stream->pumping = 1;
+    *streamOut = stream;
+    return kIOReturnSuccess;
+
+L_aborted:
+    // Some transfers may have been submitted before things went wrong.
+    pthread_mutex_lock(&stream->lock);
+    stream->stopping = 1;
+    pthread_mutex_unlock(&stream->lock);
+
+L_failed:
+    SIIsoStreamClose(stream);
+    return ret;
+}
+
+void SIIsoStreamClose(SIIsoStream *stream)
+{
+    pthread_mutex_lock(&stream->lock);
+    stream->stopping = 1;
+    pthread_cond_broadcast(&stream->cond);
+    pthread_mutex_unlock(&stream->lock);
+
+    // Transfers are submitted without the lock, so one may slip past the
+    // first cancellation; those complete on their own, on the frame clock.
+    if (stream->pumping) {
+        for (uint32_t i = 0; i < stream->depth; ++i)
+            SICancelTransfer(&stream->slots[i].transfer);
+        pthread_join(stream->pump, NULL);
+    }
+
+    if (stream->slots)
+        SITransfersDrain(stream->client, &stream->slots[0].transfer, sizeof(SIIsoStreamSlot), stream->depth,
+            &stream->lock, &stream->inFlight);
+    if (stream->previousDepth)
+        SISetPipeQueueDepth(stream->client, stream->pipe, stream->previousDepth);
+
+    pthread_cond_destroy(&stream->cond);
+    pthread_mutex_destroy(&stream->lock);
+    free(stream->slots);
+    free(stream->packets);
+    if (stream->storage)
+        SIFreeBuffers(stream->client, stream->storage, stream->storageSize, stream->storageMapped);
+    free(stream);
+}
+
+void SIIsoStreamGetStats(SIIsoStream *stream, SIIsoStreamStats *stats)
+{
+    pthread_mutex_lock(&stream->lock);
+    *stats = stream->stats;
+    pthread_mutex_unlock(&stream->lock);
+}
+
+// Stands in for the product ID in the keys of 'kSIFilterAnyProduct' filters.
+#define kSIFilterProductAny 0x10000u
+
+/// Filter set entry; entries with the same key are chained together.
+typedef struct {
+    SIFilter filter; ///< With its own copy of 'serialNumber'.
+    uint32_t next;   ///< Index of the next entry with the same key, plus one; zero ends the chain.
+} SIFilterEntry;
+
+typedef struct {
+    uint64_t key;    ///< Zero if the slot is free.
+    uint32_t first;  ///< Index of the first entry, plus one; zero if there are none.
+    uint8_t serials; ///< Whether there are also filters for this product requiring a serial number.
+} SIFilterSlot;
+
+struct SIFilterSet {
+    SIFilterEntry *entries;
+    uint32_t numEntries;
+    uint32_t entryCapacity;
+    SIFilterSlot *slots;
+    uint32_t numSlots; ///< Always a power of two.
+    uint32_t usedSlots;
+};
+
+/// Device being matched against a filter set; the class and serial number
+/// may be filled in on demand by 'load', since they're costlier to get.
+typedef struct SIFilterSubject {
+    uint16_t vendorID;
+    uint16_t productID;
+    uint8_t const *classes;
+    size_t numClasses;
+    char const *serialNumber;
+    uint32_t loaded; ///< Which of 'kSIFilterMatchClass' and 'kSIFilterMatchSerial' are filled in.
+    void (*load)(struct SIFilterSubject *subject, uint32_t what);
+    void *context;
+} SIFilterSubject;
+
+/// Build the hash key for a filter. Keys of filters which need a serial
+/// number include a hash of it; the full string is compared afterwards.
+static uint64_t SIFilterKey(uint16_t vendorID, uint32_t product, char const *serialNumber)
+{
+    uint64_t key = 1ull << 63 | (uint64_t)vendorID << 17 | product;
+    if (serialNumber) {
+        uint32_t hash = 2166136261u;
+        for (uint8_t const *c = (uint8_t const *)serialNumber; *c; ++c)
+            hash = (hash ^ *c) * 16777619u;
+        key |= 1ull << 33 | (uint64_t)(hash & 0x1fffffff) << 34;
+    }
+
+    return key;
+}
+
+static SIFilterSlot *SIFilterSetFind(SIFilterSet const *set, uint64_t key)
+{
+    if (!set->numSlots)
+        return NULL;
+
+    uint32_t mask = set->numSlots - 1;
+    for (uint32_t i = (uint32_t)((key * 0x9e3779b97f4a7c15ull) >> 32) & mask;; i = (i + 1) & mask) {
+        if (set->slots[i].key == key)
+            return &set->slots[i];
+        if (!set->slots[i].key)
+            return NULL;
+    }
+}
+
+/// Find the slot for a key, claiming one if there isn't one yet.
+static SIFilterSlot *SIFilterSetInsert(SIFilterSet *set, uint64_t key)
+{
+    SIFilterSlot *slot = SIFilterSetFind(set, key);
+    if (slot)
+        return slot;
+
+    // Keep the table at most half full, so probe sequences stay short.
+    if ((set->usedSlots + 1) * 2 > set->numSlots) {
+        uint32_t numSlots = set->numSlots ? set->numSlots * 2 : 16;
+        SIFilterSlot *slots = calloc(numSlots, sizeof(SIFilterSlot));
+        if (!slots)
+            return NULL;
+
+        for (uint32_t i = 0; i < set->numSlots; ++i) {
+            SIFilterSlot const *old = &set->slots[i];
+            if (!old->key)
+                continue;
+
+            uint32_t j = (uint32_t)((old->key * 0x9e3779b97f4a7c15ull) >> 32) & (numSlots - 1);
+            while (slots[j].key)
+                j = (j + 1) & (numSlots - 1);
+            slots[j] = *old;
+        }
+
+        free(set->slots);
+        set->slots = slots;
+        set->numSlots = numSlots;
+    }
+
+    uint32_t mask = set->numSlots - 1;
+    uint32_t i = (uint32_t)((key * 0x9e3779b97f4a7c15ull) >> 32) & mask;
+    while (set->slots[i].key)
+        i = (i + 1) & mask;
+
+    set->slots[i].key = key;
+    set->usedSlots++;
+    return &set->slots[i];
+}
+
+SIFilterSet *SIFilterSetCreate(void)
+{
+    return calloc(1, sizeof(SIFilterSet));
+}
+
+void SIFilterSetDestroy(SIFilterSet *set)
+{
+    for (uint32_t i = 0; i < set->numEntries; ++i)
+        free((char *)set->entries[i].filter.serialNumber);
+    free(set->entries);
+    free(set->slots);
+    free(set);
+}
+
+IOReturn SIFilterSetAdd(SIFilterSet *set, SIFilter const *filter)
+{
+    int needsSerial = (filter->flags & kSIFilterMatchSerial) != 0;
+    if (needsSerial && !filter->serialNumber)
+        return kIOReturnBadArgument;
+
+    if (set->numEntries == set->entryCapacity) {
+        uint32_t capacity = set->entryCapacity ? set->entryCapacity * 2 : 16;
+        SIFilterEntry *entries = realloc(set->entries, capacity * sizeof(SIFilterEntry));
+        if (!entries)
+            return kIOReturnNoMemory;
+
+        set->entries = entries;
+        set->entryCapacity = capacity;
+    }
+
+    SIFilterEntry *entry = &set->entries[set->numEntries];
+    entry->filter = *filter;
+    entry->filter.serialNumber = NULL;
+    if (needsSerial && !(entry->filter.serialNumber = strdup(filter->serialNumber)))
+        return kIOReturnNoMemory;
+
+    uint32_t product = (filter->flags & kSIFilterAnyProduct) ? kSIFilterProductAny : filter->productID;
+
+    // Filters needing a serial number are reached through the product's
+    // own slot, which notes that it's worth fetching the serial number.
+    SIFilterSlot *productSlot = SIFilterSetInsert(set, SIFilterKey(filter->vendorID, product, NULL));
+    SIFilterSlot *slot = productSlot;
+    if (productSlot && needsSerial) {
+        productSlot->serials = 1;
+        slot = SIFilterSetInsert(set, SIFilterKey(filter->vendorID, product, filter->serialNumber));
+    }
+
+    if (!slot) {
+        free((char *)entry->filter.serialNumber);
+        return kIOReturnNoMemory;
+    }
+
+    entry->next = slot->first;
+    slot->first = ++set->numEntries;
+    return kIOReturnSuccess;
+}
+
+static void SIFilterSubjectLoad(SIFilterSubject *subject, uint32_t what)
+{
+    if ((subject->loaded & what) != what && subject->load)
+        subject->load(subject, what & ~subject->loaded);
+    subject->loaded |= what;
+}
+
+static int SIFilterEntryMatches(SIFilterEntry const *entry, SIFilterSubject *subject)
+{
+    SIFilter const *filter = &entry->filter;
+    if (filter->serialNumber && strcmp(filter->serialNumber, subject->serialNumber) != 0)
+        return 0;
+
+    if (filter->flags & kSIFilterMatchClass) {
+        SIFilterSubjectLoad(subject, kSIFilterMatchClass);
+        for (size_t i = 0; i < subject->numClasses; ++i) {
+            if (subject->classes[i] == filter->deviceClass)
+                return 1;
+        }
+        return 0;
+    }
+
+    return 1;
+}
+
+static int SIFilterChainMatches(SIFilterSet const *set, SIFilterSlot const *slot, SIFilterSubject *subject)
+{
+    for (uint32_t i = slot->first; i; i = set->entries[i - 1].next) {
+        if (SIFilterEntryMatches(&set->entries[i - 1], subject))
+            return 1;
+    }
+
+    return 0;
+}
+
+static int SIFilterSetMatchSubject(SIFilterSet const *set, SIFilterSubject *subject)
+{
+    uint32_t const products[2] = { subject->productID, kSIFilterProductAny };
+    for (int i = 0; i < 2; ++i) {
+        SIFilterSlot const *slot = SIFilterSetFind(set, SIFilterKey(subject->vendorID, products[i], NULL));
+        if (!slot)
+            continue;
+        if (SIFilterChainMatches(set, slot, subject))
+            return 1;
+        if (!slot->serials)
+            continue;
+
+        SIFilterSubjectLoad(subject, kSIFilterMatchSerial);
+        if (!subject->serialNumber)
+            continue;
+
+        slot = SIFilterSetFind(set, SIFilterKey(subject->vendorID, products[i], subject->serialNumber));
+        if (slot && SIFilterChainMatches(set, slot, subject))
+            return 1;
+    }
+
+    return 0;
+}
+
+int SIFilterSetMatch(SIFilterSet const *set, uint16_t vendorID, uint16_t productID, uint8_t const *classes,
+    size_t numClasses, char const *serialNumber)
+{
+    SIFilterSubject subject = {
+        .vendorID = vendorID,
+        .productID = productID,
+        .classes = classes,
+        .numClasses = numClasses,
+        .serialNumber = serialNumber,
+        .loaded = kSIFilterMatchClass | kSIFilterMatchSerial,
+    };
+
+    return SIFilterSetMatchSubject(set, &subject);
+}
+
+void SIDeviceListDestroy(SIDeviceList *list)
+{
+    free(list);
+}
+
+#if defined(__linux__)
+
+static IOReturn SIReturnFromErrno(int error)
+{
+    switch (error) {
+    case 0:
+        return kIOReturnSuccess;
+    case ENODEV:
+    case ESHUTDOWN:
+        return kIOReturnNoDevice;
+    case EACCES:
+    case EPERM:
+        return kIOReturnNotPrivileged;
+    case EBUSY:
+        return kIOReturnExclusiveAccess;
+    case ENOMEM:
+        return kIOReturnNoMemory;
+    case EINVAL:
+        return kIOReturnBadArgument;
+    case ETIMEDOUT:
+        return kIOReturnTimeout;
+    case EPIPE:
+        return kIOUSBPipeStalled;
+    case ENOENT:
+    case ECONNRESET:
+        return kIOReturnAborted;
+    case EOVERFLOW:
+        return kIOReturnOverrun;
+    case EREMOTEIO:
+        return kIOReturnUnderrun;
+    case EXDEV:
+        return kIOReturnIsoTooOld;
+    case EPROTO:
+    case EILSEQ:
+        return kIOReturnNotResponding;
+    default:
+        return kIOReturnIOError;
+    }
+}
+
+// Events handled per 'epoll_wait' call.
+#define kSIPoolEventsMax 64
+
+typedef struct SIPoolWorker SIPoolWorker;
+
+/// A client's, or a hotplug monitor's, membership of a pool.
+struct SIPoolEntry {
+    SIClient *client;           ///< NULL once removed, or for monitors.
+    SIHotplugMonitor *monitor;  ///< NULL once removed, or for clients.
+    SIPoolWorker *worker;
+    int fd;
+    struct SIPoolEntry *prev;
+    struct SIPoolEntry *next; ///< Next on the worker, or next to be freed once removed.
+};
+
+/// Function queued to run on a worker.
+typedef struct SIPoolTask {
+    void (*function)(void *context);
+    void *context;
+    int *done; ///< Set once run, for callers waiting on the task; NULL if heap-allocated.
+    struct SIPoolTask *next;
+} SIPoolTask;
+
+struct SIPoolWorker {
+    SIClientPool *pool;
+    pthread_t thread;
+    int epoll;
+    int wake;             ///< eventfd used to interrupt 'epoll_wait'.
+    SIPoolEntry *entries; ///< Guarded by the pool's lock.
+    uint32_t numClients;  ///< Guarded by the pool's lock; monitors aren't counted.
+
+    pthread_mutex_t lock; ///< Guards 'tasks', 'stopping', and task 'done' flags.
+    pthread_cond_t cond;  ///< Signalled when tasks finish.
+    SIPoolTask *tasks;
+    SIPoolTask *tasksTail;
+    int stopping;
+
+    SIPoolEntry *released; ///< Removed entries to free after the current batch.
+};
+
+struct SIClientPool {
+    SIClientPoolConfig config;
+    pthread_mutex_t lock; ///< Guards pool membership.
+    uint32_t numWorkers;
+    SIPoolWorker *workers;
+};
+
+/// Get the CPUs this process may run on.
+///
+/// \return Number of CPUs in the set.
+static uint32_t SIPoolAllowedCPUs(cpu_set_t *set)
+{
+    if (sched_getaffinity(0, sizeof(*set), set) == 0 && CPU_COUNT(set) > 0)
+        return (uint32_t)CPU_COUNT(set);
+
+    long numCPUs = sysconf(_SC_NPROCESSORS_ONLN);
+    CPU_ZERO(set);
+    for (long i = 0; i < numCPUs && i < CPU_SETSIZE; ++i)
+        CPU_SET(i, set);
+    return numCPUs > 0 ? (uint32_t)numCPUs : 1;
+}
+
+/// Take an entry out of its worker; the pool lock must be held.
+static void SIPoolDetach(SIPoolEntry *entry)
+{
+    SIPoolWorker *worker = entry->worker;
+
+    epoll_ctl(worker->epoll, EPOLL_CTL_DEL, entry->fd, NULL);
+    if (entry->client) {
+        __atomic_store_n(&entry->client->async->pool, NULL, __ATOMIC_RELEASE);
+        entry->client->async->poolEntry = NULL;
+        worker->numClients--;
+    }
+    entry->client = NULL;
+    entry->monitor = NULL;
+
+    if (entry->prev)
+        entry->prev->next = entry->next;
+    else
+        worker->entries = entry->next;
+    if (entry->next)
+        entry->next->prev = entry->prev;
+
+    // Later events in the batch being handled may still refer to it.
+    entry->next = worker->released;
+    worker->released = entry;
+}
+
+static void SIPoolWake(SIPoolWorker *worker)
+{
+    uint64_t one = 1;
+    while (write(worker->wake, &one, sizeof(one)) < 0 && errno == EINTR)
+        ;
+}
+
+/// Queue a task on a worker; waited-on tasks must stay valid until done.
+static void SIPoolPost(SIPoolWorker *worker, SIPoolTask *task)
+{
+    task->next = NULL;
+
+    pthread_mutex_lock(&worker->lock);
+    if (worker->tasksTail)
+        worker->tasksTail->next = task;
+    else
+        worker->tasks = task;
+    worker->tasksTail = task;
+    pthread_mutex_unlock(&worker->lock);
+
+    SIPoolWake(worker);
+}
+
+static void SIPoolRunTasks(SIPoolWorker *worker)
+{
+    pthread_mutex_lock(&worker->lock);
+    SIPoolTask *task = worker->tasks;
+    worker->tasks = worker->tasksTail = NULL;
+    pthread_mutex_unlock(&worker->lock);
+
+    while (task) {
+        // A waited-on task may be gone as soon as it's marked done.
+        SIPoolTask *next = task->next;
+        task->function(task->context);
+
+        if (task->done) {
+            pthread_mutex_lock(&worker->lock);
+            *task->done = 1;
+            pthread_cond_broadcast(&worker->cond);
+            pthread_mutex_unlock(&worker->lock);
+        } else {
+            free(task);
+        }
+        task = next;
+    }
+}
+
+static void SIPoolFreeReleased(SIPoolWorker *worker)
+{
+    while (worker->released) {
+        SIPoolEntry *entry = worker->released;
+        worker->released = entry->next;
+        free(entry);
+    }
+}
+
+static void *SIPoolWorkerMain(void *context)
+{
+    SIPoolWorker *worker = context;
+    SIClientPool *pool = worker->pool;
+
+    for (;;) {
+        struct epoll_event events[kSIPoolEventsMax];
+        int count = epoll_wait(worker->epoll, events, kSIPoolEventsMax, -1);
+        if (count < 0) {
+            if (errno == EINTR)
+                continue;
+
+            SIDebug("Pool worker failed to wait for events: %s", strerror(errno));
+            break;
+        }
+
+        for (int i = 0; i < count; ++i) {
+            if (events[i].data.ptr == worker) {
+                uint64_t value;
+                while (read(worker->wake, &value, sizeof(value)) < 0 && errno == EINTR)
+                    ;
+                continue;
+            }
+
+            SIPoolEntry *entry = events[i].data.ptr;
+            if (entry->monitor) {
+                IOReturn ret = SIHotplugMonitorHandleEvents(entry->monitor, 0);
+                if (ret != kIOReturnSuccess)
+                    SIDebug("Failed to handle hotplug events. (%#x)", ret);
+                continue;
+            }
+
+            SIClient *client = entry->client;
+            if (!client)
+                continue;
+
+            IOReturn ret = SIHandleEvents(client, 0);
+            if (ret == kIOReturnNoDevice || ret == kIOReturnNotOpen) {
+                pthread_mutex_lock(&pool->lock);
+                if (entry->client)
+                    SIPoolDetach(entry);
+                pthread_mutex_unlock(&pool->lock);
+
+                SIDebug("Client %p has left its pool. (%#x)", (void *)client, ret);
+                if (pool->config.disconnect)
+                    pool->config.disconnect(client, pool->config.context);
+            } else if (ret != kIOReturnSuccess) {
+                SIDebug("Failed to handle events for client %p. (%#x)", (void *)client, ret);
+            }
+        }
+
+        SIPoolRunTasks(worker);
+        SIPoolFreeReleased(worker);
+
+        pthread_mutex_lock(&worker->lock);
+        int stopping = worker->stopping && !worker->tasks;
+        pthread_mutex_unlock(&worker->lock);
+        if (stopping)
+            break;
+    }
+
+    return NULL;
+}
+
+static void SIPoolDestroyWorker(SIPoolWorker *worker)
+{
+    close(worker->wake);
+    close(worker->epoll);
+    pthread_cond_destroy(&worker->cond);
+    pthread_mutex_destroy(&worker->lock);
+}
+
+static void SIPoolStopWorker(SIPoolWorker *worker)
+{
+    pthread_mutex_lock(&worker->lock);
+    worker->stopping = 1;
+    pthread_mutex_unlock(&worker->lock);
+
+    SIPoolWake(worker);
+    pthread_join(worker->thread, NULL);
+    SIPoolFreeReleased(worker);
+}
+
+static IOReturn SIPoolStartWorker(SIClientPool *pool, SIPoolWorker *worker, int cpu)
+{
+    worker->pool = pool;
+    if ((worker->epoll = epoll_create1(EPOLL_CLOEXEC)) < 0)
+        return SIReturnFromErrno(errno);
+
+    if ((worker->wake = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0) {
+        IOReturn ret = SIReturnFromErrno(errno);
+        close(worker->epoll);
+        return ret;
+    }
+
+    pthread_mutex_init(&worker->lock, NULL);
+    pthread_cond_init(&worker->cond, NULL);
+
+    struct epoll_event event = { .events = EPOLLIN, .data.ptr = worker };
+    if (epoll_ctl(worker->epoll, EPOLL_CTL_ADD, worker->wake, &event) < 0
+        || pthread_create(&worker->thread, NULL, SIPoolWorkerMain, worker) != 0) {
+        SIPoolDestroyWorker(worker);
+        return kIOReturnNoResources;
+    }
+
+    if (cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        if (pthread_setaffinity_np(worker->thread, sizeof(set), &set) != 0)
+            SIDebug("Failed to pin pool worker to CPU %d.", cpu);
+    }
+
+    return kIOReturnSuccess;
+}
+
+IOReturn SIClientPoolCreate(SIClientPoolConfig const *config, SIClientPool **poolOut)
+{
+    SIClientPool *pool = calloc(1, sizeof(SIClientPool));
+    if (!pool)
+        return kIOReturnNoMemory;
+    if (config)
+        pool->config = *config;
+
+    cpu_set_t allowed;
+    uint32_t numCPUs = SIPoolAllowedCPUs(&allowed);
+    uint32_t numWorkers = pool->config.numWorkers ? pool->config.numWorkers : numCPUs;
+
+    if (!(pool->workers = calloc(numWorkers, sizeof(SIPoolWorker)))) {
+        free(pool);
+        return kIOReturnNoMemory;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+
+    // Workers are spread across the allowed CPUs in order, wrapping around
+    // if there are more workers than CPUs.
+    int cpu = -1;
+    for (uint32_t i = 0; i < numWorkers; ++i) {
+        if (pool->config.flags & kSIClientPoolPinWorkers) {
+            do
+                cpu = (cpu + 1) % CPU_SETSIZE;
+            while (!CPU_ISSET(cpu, &allowed));
+        }
+
+        IOReturn ret = SIPoolStartWorker(pool, &pool->workers[i], cpu);
+        if (ret != kIOReturnSuccess) {
+            SIDebug("Failed to start pool worker %u. (%#x)", i, ret);
+            for (uint32_t j = 0; j < i; ++j) {
+                SIPoolStopWorker(&pool->workers[j]);
+                SIPoolDestroyWorker(&pool->workers[j]);
+            }
+
+            pthread_mutex_destroy(&pool->lock);
+            free(pool->workers);
+            free(pool);
+            return ret;
+        }
+    }
+
+    SIDebug("Started client pool with %u worker(s).", numWorkers);
+
+    pool->numWorkers = numWorkers;
+    *poolOut = pool;
+    return kIOReturnSuccess;
+}
+
+void SIClientPoolDestroy(SIClientPool *pool)
+{
+    for (uint32_t i = 0; i < pool->numWorkers; ++i)
+        SIPoolStopWorker(&pool->workers[i]);
+
+    // With the workers gone, anything left can be detached in place.
+    pthread_mutex_lock(&pool->lock);
+    for (uint32_t i = 0; i < pool->numWorkers; ++i) {
+        SIPoolWorker *worker = &pool->workers[i];
+        while (worker->entries)
+            SIPoolDetach(worker->entries);
+        SIPoolFreeReleased(worker);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    for (uint32_t i = 0; i < pool->numWorkers; ++i)
+        SIPoolDestroyWorker(&pool->workers[i]);
+
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->workers);
+    free(pool);
+}
+
+IOReturn SIClientPoolAdd(SIClientPool *pool, SIClient *client)
+{
+    if (!client->handle)
+        return kIOReturnNotOpen;
+
+    short events = 0;
+    int fd = client->backend->getEventFD ? client->backend->getEventFD(client, &events) : -1;
+    if (fd < 0)
+        return kIOReturnUnsupported;
+
+    SIPoolEntry *entry = calloc(1, sizeof(SIPoolEntry));
+    if (!entry)
+        return kIOReturnNoMemory;
+
+    IOReturn ret = kIOReturnSuccess;
+    pthread_mutex_lock(&pool->lock);
+    if (client->async->poolEntry) {
+        ret = kIOReturnExclusiveAccess;
+        goto L_failed;
+    }
+
+    SIPoolWorker *worker = &pool->workers[0];
+    for (uint32_t i = 1; i < pool->numWorkers; ++i) {
+        if (pool->workers[i].numClients < worker->numClients)
+            worker = &pool->workers[i];
+    }
+
+    entry->client = client;
+    entry->worker = worker;
+    entry->fd = fd;
+
+    // poll(2) and epoll share their event bits.
+    struct epoll_event event = { .events = (uint16_t)events, .data.ptr = entry };
+    if (epoll_ctl(worker->epoll, EPOLL_CTL_ADD, fd, &event) < 0) {
+        ret = SIReturnFromErrno(errno);
+        goto L_failed;
+    }
+
+    entry->next = worker->entries;
+    if (worker->entries)
+        worker->entries->prev = entry;
+    worker->entries = entry;
+    worker->numClients++;
+
+    client->async->poolEntry = entry;
+    __atomic_store_n(&client->async->pool, pool, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&pool->lock);
+
+    SIDebug("Added client %p to pool worker %td.", (void *)client, worker - pool->workers);
+    return kIOReturnSuccess;
+
+L_failed:
+    pthread_mutex_unlock(&pool->lock);
+    free(entry);
+    return ret;
+}
+
+typedef struct {
+    SIClientPool *pool;
+    SIClient *client;
+    SIPoolWorker *worker;
+    IOReturn ret;
+} SIPoolRemoval;
+
+static void SIPoolRemoveTask(void *context)
+{
+    SIPoolRemoval *removal = context;
+
+    pthread_mutex_lock(&removal->pool->lock);
+    SIPoolEntry *entry = removal->client->async->poolEntry;
+    if (!entry || entry->worker->pool != removal->pool) {
+        removal->ret = kIOReturnNotFound;
+    } else if (entry->worker != removal->worker) {
+        // It left and came back on another worker in the meantime.
+        removal->worker = entry->worker;
+        removal->ret = kIOReturnBusy;
+    } else {
+        SIPoolDetach(entry);
+        removal->ret = kIOReturnSuccess;
+    }
+    pthread_mutex_unlock(&removal->pool->lock);
+}
+
+IOReturn SIClientPoolRemove(SIClientPool *pool, SIClient *client)
+{
+    pthread_mutex_lock(&pool->lock);
+    SIPoolEntry *entry = client->async->poolEntry;
+    if (!entry || entry->worker->pool != pool) {
+        pthread_mutex_unlock(&pool->lock);
+        return kIOReturnNotFound;
+    }
+
+    // On its own worker, nothing else can be touching the client.
+    SIPoolWorker *worker = entry->worker;
+    if (pthread_equal(pthread_self(), worker->thread)) {
+        SIPoolDetach(entry);
+        pthread_mutex_unlock(&pool->lock);
+        return kIOReturnSuccess;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    // Otherwise, have the worker do it between batches of events.
+    SIPoolRemoval removal = { .pool = pool, .client = client, .worker = worker, .ret = kIOReturnBusy };
+    while (removal.ret == kIOReturnBusy) {
+        int done = 0;
+        SIPoolTask task = { .function = SIPoolRemoveTask, .context = &removal, .done = &done };
+        SIPoolPost(removal.worker, &task);
+
+        pthread_mutex_lock(&removal.worker->lock);
+        while (!done)
+            pthread_cond_wait(&removal.worker->cond, &removal.worker->lock);
+        pthread_mutex_unlock(&removal.worker->lock);
+    }
+
+    return removal.ret;
+}
+
+IOReturn SIClientPoolDispatch(SIClientPool *pool, SIClient *client, void (*function)(void *context),
+    void *context)
+{
+    SIPoolTask *task = calloc(1, sizeof(SIPoolTask));
+    if (!task)
+        return kIOReturnNoMemory;
+    task->function = function;
+    task->context = context;
+
+    pthread_mutex_lock(&pool->lock);
+    SIPoolEntry *entry = client->async->poolEntry;
+    if (!entry || entry->worker->pool != pool) {
+        pthread_mutex_unlock(&pool->lock);
+        free(task);
+        return kIOReturnNotFound;
+    }
+
+    SIPoolPost(entry->worker, task);
+    pthread_mutex_unlock(&pool->lock);
+
+    return kIOReturnSuccess;
+}
+
+IOReturn SIClientPoolGetWorker(SIClientPool *pool, SIClient *client, uint32_t *workerOut)
+{
+    IOReturn ret = kIOReturnNotFound;
+
+    pthread_mutex_lock(&pool->lock);
+    SIPoolEntry *entry = client->async->poolEntry;
+    if (entry && entry->worker->pool == pool) {
+        *workerOut = (uint32_t)(entry->worker - pool->workers);
+        ret = kIOReturnSuccess;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return ret;
+}
+
+/// Find a monitor's entry; the pool lock must be held.
+static SIPoolEntry *SIPoolFindMonitor(SIClientPool *pool, SIHotplugMonitor *monitor)
+{
+    for (uint32_t i = 0; i < pool->numWorkers; ++i) {
+        for (SIPoolEntry *entry = pool->workers[i].entries; entry; entry = entry->next) {
+            if (entry->monitor == monitor)
+                return entry;
+        }
+    }
+
+    return NULL;
+}
+
+IOReturn SIClientPoolAddMonitor(SIClientPool *pool, SIHotplugMonitor *monitor)
+{
+    SIPoolEntry *entry = calloc(1, sizeof(SIPoolEntry));
+    if (!entry)
+        return kIOReturnNoMemory;
+
+    IOReturn ret = kIOReturnSuccess;
+    pthread_mutex_lock(&pool->lock);
+    if (SIPoolFindMonitor(pool, monitor)) {
+        ret = kIOReturnExclusiveAccess;
+        goto L_failed;
+    }
+
+    SIPoolWorker *worker = &pool->workers[0];
+    for (uint32_t i = 1; i < pool->numWorkers; ++i) {
+        if (pool->workers[i].numClients < worker->numClients)
+            worker = &pool->workers[i];
+    }
+
+    entry->monitor = monitor;
+    entry->worker = worker;
+    entry->fd = SIHotplugMonitorGetFD(monitor);
+
+    struct epoll_event event = { .events = EPOLLIN, .data.ptr = entry };
+    if (epoll_ctl(worker->epoll, EPOLL_CTL_ADD, entry->fd, &event) < 0) {
+        ret = SIReturnFromErrno(errno);
+        goto L_failed;
+    }
+
+    entry->next = worker->entries;
+    if (worker->entries)
+        worker->entries->prev = entry;
+    worker->entries = entry;
+    pthread_mutex_unlock(&pool->lock);
+
+    SIDebug("Added hotplug monitor %p to pool worker %td.", (void *)monitor, worker - pool->workers);
+    return kIOReturnSuccess;
+
+L_failed:
+    pthread_mutex_unlock(&pool->lock);
+    free(entry);
+    return ret;
+}
+
+typedef struct {
+    SIClientPool *pool;
+    SIHotplugMonitor *monitor;
+    IOReturn ret;
+} SIPoolMonitorRemoval;
+
+static void SIPoolRemoveMonitorTask(void *context)
+{
+    SIPoolMonitorRemoval *removal = context;
+
+    pthread_mutex_lock(&removal->pool->lock);
+    SIPoolEntry *entry = SIPoolFindMonitor(removal->pool, removal->monitor);
+    if (entry)
+        SIPoolDetach(entry);
+    removal->ret = entry ? kIOReturnSuccess : kIOReturnNotFound;
+    pthread_mutex_unlock(&removal->pool->lock);
+}
+
+IOReturn SIClientPoolRemoveMonitor(SIClientPool *pool, SIHotplugMonitor *monitor)
+{
+    pthread_mutex_lock(&pool->lock);
+    SIPoolEntry *entry = SIPoolFindMonitor(pool, monitor);
+    if (!entry) {
+        pthread_mutex_unlock(&pool->lock);
+        return kIOReturnNotFound;
+    }
+
+    // Monitors never change workers, so unlike clients, one trip to the
+    // worker is enough.
+    SIPoolWorker *worker = entry->worker;
+    if (pthread_equal(pthread_self(), worker->thread)) {
+        SIPoolDetach(entry);
+        pthread_mutex_unlock(&pool->lock);
+        return kIOReturnSuccess;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    int done = 0;
+    SIPoolMonitorRemoval removal = { .pool = pool, .monitor = monitor, .ret = kIOReturnNotFound };
+    SIPoolTask task = { .function = SIPoolRemoveMonitorTask, .context = &removal, .done = &done };
+    SIPoolPost(worker, &task);
+
+    pthread_mutex_lock(&worker->lock);
+    while (!done)
+        pthread_cond_wait(&worker->cond, &worker->lock);
+    pthread_mutex_unlock(&worker->lock);
+
+    return removal.ret;
+}
+
+#define kSIInterruptPollerFrameUsDefault 1000
+#define kSIInterruptPollerEventsDefault 1024
+#define kSIInterruptPollerBytesDefault 0x10000
+
+// Tries at cancelling a pipe's reads, 10 ms apart, before giving up on them.
+#define kSIInterruptPollerCancelTries 100
+
+typedef struct SIInterruptClient SIInterruptClient;
+
+/// A polled pipe and its reads.
+typedef struct SIInterruptEndpoint {
+    SIInterruptPoller *poller;
+    SIClient *client;
+    uint8_t pipe;
+    void *context;
+    uint32_t depth;
+    uint32_t previousDepth; ///< Pipe's queue depth before polling it.
+    uint32_t readSize;
+
+    uint8_t *storage; ///< Buffers for every read.
+    size_t storageSize;
+    int storageMapped;
+    SITransfer *transfers;
+
+    uint32_t inFlight;
+    IOReturn status; ///< Error which stopped the pipe being polled, if any.
+    int removing;
+    struct SIInterruptEndpoint *next;
+} SIInterruptEndpoint;
+
+/// A client with polled pipes, watched by the poller's thread.
+struct SIInterruptClient {
+    SIClient *client; ///< NULL once removed.
+    int fd;
+    int watched; ///< Whether 'fd' is still in the epoll set.
+    SIInterruptEndpoint *endpoints;
+    SIInterruptClient *prev;
+    SIInterruptClient *next; ///< Next on the poller, or next to be freed once removed.
+};
+
+/// Events gathered together, along with copies of their data.
+typedef struct {
+    SIInterruptEvent *events;
+    uint32_t count;
+    uint8_t *data;
+    uint32_t used;
+    uint64_t deadline; ///< When the coalescing window closes.
+} SIInterruptBatch;
+
+/// Interrupt poller state.
+///
+/// Completions may run on any thread reaping a client's events, so every
+/// bit of state below 'lock' is guarded by it. Batches move by pointer:
+/// events are gathered into 'filling', queued on 'ready' (without a
+/// callback) once their window has closed, and 'held' while delivered.
+struct SIInterruptPoller {
+    SIInterruptPollerConfig config;
+    uint64_t coalesceNs;
+    int epoll;
+    int wake; ///< eventfd used to interrupt 'epoll_wait'.
+    pthread_t thread;
+    int running;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond; ///< Signalled when reads complete, clients are let go of, or batches are ready.
+    SIInterruptClient *clients;
+    SIInterruptClient *released; ///< Removed clients to free after the current batch of epoll events.
+    SIClient *handling;          ///< Client whose events the poller's thread is handling.
+    SIInterruptBatch batches[3];
+    SIInterruptBatch *filling;
+    SIInterruptBatch *ready;
+    SIInterruptBatch *held;
+    SIInterruptPollerStats stats;
+    int stopping;
+};
+
+static void SIInterruptPollerWake(SIInterruptPoller *poller)
+{
+    uint64_t one = 1;
+    while (write(poller->wake, &one, sizeof(one)) < 0 && errno == EINTR)
+        ;
+}
+
+static void SIInterruptBatchReset(SIInterruptBatch *batch)
+{
+    batch->count = 0;
+    batch->used = 0;
+}
+
+/// Add an event to the batch being gathered; 'lock' must be held.
+///
+/// \return Whether the poller's thread needs waking to close the window.
+static int SIInterruptPollerPost(SIInterruptPoller *poller, SIInterruptEndpoint *endpoint, IOReturn status,
+    void const *data, uint32_t length)
+{
+    SIInterruptBatch *batch = poller->filling;
+    if (batch->count == poller->config.maxEvents || length > poller->config.maxBytes - batch->used) {
+        poller->stats.overruns++;
+        return 0;
+    }
+
+    uint64_t now = SIGetTimeNs();
+    if (!batch->count)
+        batch->deadline = now + poller->coalesceNs;
+
+    if (length)
+        memcpy(batch->data + batch->used, data, length);
+    batch->events[batch->count++] = (SIInterruptEvent) {
+        .client = endpoint->client,
+        .pipe = endpoint->pipe,
+        .status = status,
+        .length = length,
+        .data = batch->data + batch->used,
+        .context = endpoint->context,
+        .timestampNs = now,
+    };
+    batch->used += length;
+    poller->stats.events++;
+    poller->stats.bytes += length;
+
+    // Only the poller's own thread is already awake to see the first event.
+    return batch->count == 1 && !(poller->running && pthread_equal(pthread_self(), poller->thread));
+}
+
+/// Stop polling a pipe on an error, reporting it once; 'lock' must be held.
+static int SIInterruptPollerFail(SIInterruptPoller *poller, SIInterruptEndpoint *endpoint, IOReturn error)
+{
+    if (endpoint->status != kIOReturnSuccess || endpoint->removing)
+        return 0;
+
+    SIDebug("Stopped polling pipe %d of client %p. (%#x)", endpoint->pipe, (void *)endpoint->client, error);
+    endpoint->status = error;
+    poller->stats.errors++;
+    return SIInterruptPollerPost(poller, endpoint, error, NULL, 0);
+}
+
+/// Submit a read counted as in flight, giving up on the pipe if that fails;
+/// 'lock' must not be held.
+static void SIInterruptPollerSubmit(SIInterruptEndpoint *endpoint, SITransfer *transfer)
+{
+    IOReturn ret = SISubmitTransfer(transfer);
+    if (ret == kIOReturnSuccess)
+        return;
+
+    SIInterruptPoller *poller = endpoint->poller;
+    pthread_mutex_lock(&poller->lock);
+    endpoint->inFlight--;
+    int wake = SIInterruptPollerFail(poller, endpoint, ret);
+    pthread_cond_broadcast(&poller->cond);
+    pthread_mutex_unlock(&poller->lock);
+
+    if (wake)
+        SIInterruptPollerWake(poller);
+}
+
+static void SIInterruptPollerCompleted(SITransfer *transfer)
+{
+    SIInterruptEndpoint *endpoint = transfer->context;
+    SIInterruptPoller *poller = endpoint->poller;
+    IOReturn error = transfer->result.error;
+
+    pthread_mutex_lock(&poller->lock);
+    endpoint->inFlight--;
+
+    int wake = 0;
+    if (error != kIOReturnSuccess)
+        wake = SIInterruptPollerFail(poller, endpoint, error);
+    else if (!endpoint->removing && endpoint->status == kIOReturnSuccess)
+        wake = SIInterruptPollerPost(poller, endpoint, error, transfer->buffer, transfer->result.length);
+
+    // Rearm straight away, so the pipe is only ever short the one read.
+    int resubmit = !endpoint->removing && endpoint->status == kIOReturnSuccess;
+    if (resubmit)
+        endpoint->inFlight++;
+    else if (!endpoint->inFlight)
+        pthread_cond_broadcast(&poller->cond);
+    pthread_mutex_unlock(&poller->lock);
+
+    if (wake)
+        SIInterruptPollerWake(poller);
+    if (resubmit)
+        SIInterruptPollerSubmit(endpoint, transfer);
+}
+
+/// Count a batch as delivered; 'lock' must be held.
+static void SIInterruptPollerAccount(SIInterruptPoller *poller, SIInterruptBatch *batch)
+{
+    uint64_t now = SIGetTimeNs();
+    poller->stats.batches++;
+    for (uint32_t i = 0; i < batch->count; ++i) {
+        uint64_t timestamp = batch->events[i].timestampNs;
+        SIHistogramRecord(&poller->stats.latency, now > timestamp ? now - timestamp : 0);
+    }
+}
+
+/// Hand over the batch being gathered once its window has closed; 'lock'
+/// must be held, and is dropped while the callback runs.
+static void SIInterruptPollerDeliver(SIInterruptPoller *poller)
+{
+    SIInterruptBatch *batch = poller->filling;
+    if (!poller->config.callback) {
+        // Without room in the queue, the batch keeps gathering until the
+        // consumer catches up.
+        if (poller->ready->count)
+            return;
+
+        poller->filling = poller->ready;
+        poller->ready = batch;
+        pthread_cond_broadcast(&poller->cond);
+        return;
+    }
+
+    poller->filling = poller->held;
+    poller->held = batch;
+    SIInterruptPollerAccount(poller, batch);
+
+    pthread_mutex_unlock(&poller->lock);
+    poller->config.callback(poller->config.context, batch->events, batch->count);
+    pthread_mutex_lock(&poller->lock);
+
+    SIInterruptBatchReset(batch);
+}
+
+/// Poller thread, which reaps completions for every watched client and
+/// delivers what they gathered as each coalescing window closes.
+static void *SIInterruptPollerMain(void *context)
+{
+    SIInterruptPoller *poller = context;
+    int timeoutMs = -1;
+
+    for (;;) {
+        struct epoll_event events[kSIPoolEventsMax];
+        int count = epoll_wait(poller->epoll, events, kSIPoolEventsMax, timeoutMs);
+        if (count < 0) {
+            if (errno == EINTR)
+                continue;
+
+            SIDebug("Interrupt poller failed to wait for events: %s", strerror(errno));
+            break;
+        }
+
+        pthread_mutex_lock(&poller->lock);
+        if (timeoutMs)
+            poller->stats.wakeups++;
+
+        for (int i = 0; i < count; ++i) {
+            if (events[i].data.ptr == poller) {
+                uint64_t value;
+                while (read(poller->wake, &value, sizeof(value)) < 0 && errno == EINTR)
+                    ;
+                continue;
+            }
+
+            SIInterruptClient *entry = events[i].data.ptr;
+            SIClient *client = entry->client;
+            if (!client || !entry->watched)
+                continue;
+
+            poller->handling = client;
+            pthread_mutex_unlock(&poller->lock);
+            IOReturn ret = SIHandleEvents(client, 0);
+            pthread_mutex_lock(&poller->lock);
+            poller->handling = NULL;
+            pthread_cond_broadcast(&poller->cond);
+
+            // A departed device stays readable; its pipes have been told
+            // already, through their reads failing.
+            if ((ret == kIOReturnNoDevice || ret == kIOReturnNotOpen) && entry->watched) {
+                epoll_ctl(poller->epoll, EPOLL_CTL_DEL, entry->fd, NULL);
+                entry->watched = 0;
+            } else if (ret != kIOReturnSuccess && ret != kIOReturnTimeout) {
+                SIDebug("Failed to handle events for client %p. (%#x)", (void *)client, ret);
+            }
+        }
+
+        while (poller->released) {
+            SIInterruptClient *entry = poller->released;
+            poller->released = entry->next;
+            free(entry);
+        }
+
+        if (poller->stopping) {
+            pthread_mutex_unlock(&poller->lock);
+            break;
+        }
+
+        // Sleep through the rest of the window rather than waking for every
+        // read, then reap whatever completed meanwhile before delivering.
+        timeoutMs = -1;
+        if (poller->filling->count) {
+            uint64_t deadline = poller->filling->deadline;
+            if (SIGetTimeNs() < deadline) {
+                pthread_mutex_unlock(&poller->lock);
+                SISleepUntilNs(deadline);
+                timeoutMs = 0;
+
+                pthread_mutex_lock(&poller->lock);
+                poller->stats.wakeups++;
+                pthread_mutex_unlock(&poller->lock);
+                continue;
+            }
+
+            SIInterruptPollerDeliver(poller);
+        }
+        pthread_mutex_unlock(&poller->lock);
+    }
+
+    return NULL;
+}
+
+static void SIInterruptEndpointDestroy(SIInterruptEndpoint *endpoint)
+{
+    free(endpoint->transfers);
+    if (endpoint->storage)
+        SIFreeBuffers(endpoint->client, endpoint->storage, endpoint->storageSize, endpoint->storageMapped);
+    free(endpoint);
+}
+
+/// Find a client's entry on a poller; 'lock' must be held.
+static SIInterruptClient *SIInterruptPollerFind(SIInterruptPoller *poller, SIClient *client)
+{
+    for (SIInterruptClient *entry = poller->clients; entry; entry = entry->next) {
+        if (entry->client == client)
+            return entry;
+    }
+
+    return NULL;
+}
+
+IOReturn SIInterruptPollerCreate(SIInterruptPollerConfig const *config, SIInterruptPoller **pollerOut)
+{
+    SIInterruptPollerConfig defaults = { 0 };
+    if (!config)
+        config = &defaults;
+
+    SIInterruptPoller *poller = calloc(1, sizeof(SIInterruptPoller));
+    if (!poller)
+        return kIOReturnNoMemory;
+
+    poller->config = *config;
+    if (!poller->config.frameUs)
+        poller->config.frameUs = kSIInterruptPollerFrameUsDefault;
+    if (!poller->config.maxEvents)
+        poller->config.maxEvents = kSIInterruptPollerEventsDefault;
+    if (!poller->config.maxBytes)
+        poller->config.maxBytes = kSIInterruptPollerBytesDefault;
+    poller->coalesceNs = (uint64_t)(config->coalesceUs ? config->coalesceUs : poller->config.frameUs) * 1000;
+    poller->config.coalesceUs = (uint32_t)(poller->coalesceNs / 1000);
+    poller->epoll = poller->wake = -1;
+    pthread_mutex_init(&poller->lock, NULL);
+    SICondInit(&poller->cond);
+
+    IOReturn ret = kIOReturnNoMemory;
+    for (int i = 0; i < 3; ++i) {
+        SIInterruptBatch *batch = &poller->batches[i];
+        batch->events = calloc(poller->config.maxEvents, sizeof(SIInterruptEvent));
+        batch->data = malloc(poller->config.maxBytes);
+        if (!batch->events || !batch->data)
+            goto L_failed;
+    }
+    poller->filling = &poller->batches[0];
+    poller->ready = &poller->batches[1];
+    poller->held = &poller->batches[2];
+
+    if ((poller->epoll = epoll_create1(EPOLL_CLOEXEC)) < 0
+        || (poller->wake = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0) {
+        ret = SIReturnFromErrno(errno);
+        goto L_failed;
+    }
+
+    struct epoll_event event = { .events = EPOLLIN, .data.ptr = poller };
+    if (epoll_ctl(poller->epoll, EPOLL_CTL_ADD, poller->wake, &event) < 0) {
+        ret = SIReturnFromErrno(errno);
+        goto L_failed;
+    }
+
+    if (pthread_create(&poller->thread, NULL, SIInterruptPollerMain, poller) != 0) {
+        ret = kIOReturnNoResources;
+        goto L_failed;
+    }
+
+    poller->running = 1;
+    *pollerOut = poller;
+    return kIOReturnSuccess;
+
+L_failed:
+    SIInterruptPollerDestroy(poller);
+    return ret;
+}
+
+void SIInterruptPollerDestroy(SIInterruptPoller *poller)
+{
+    if (poller->running && pthread_equal(pthread_self(), poller->thread)) {
+        SIDebug("Interrupt pollers can't be destroyed from their own callback.");
+        return;
+    }
+
+    pthread_mutex_lock(&poller->lock);
+    while (poller->clients) {
+        SIInterruptEndpoint *endpoint = NULL;
+        for (SIInterruptClient *entry = poller->clients; entry && !endpoint; entry = entry->next) {
+            for (endpoint = entry->endpoints; endpoint && endpoint->removing; endpoint = endpoint->next)
+                ;
+        }
+
+        // Only removals already under way on other threads are left.
+        if (!endpoint) {
+            pthread_cond_wait(&poller->cond, &poller->lock);
+            continue;
+        }
+
+        SIClient *client = endpoint->client;
+        uint8_t pipe = endpoint->pipe;
+        pthread_mutex_unlock(&poller->lock);
+        SIInterruptPollerRemove(poller, client, pipe);
+        pthread_mutex_lock(&poller->lock);
+    }
+    poller->stopping = 1;
+    pthread_mutex_unlock(&poller->lock);
+
+    if (poller->running) {
+        SIInterruptPollerWake(poller);
+        pthread_join(poller->thread, NULL);
+    }
+
+    while (poller->released) {
+        SIInterruptClient *entry = poller->released;
+        poller->released = entry->next;
+        free(entry);
+    }
+
+    for (int i = 0; i < 3; ++i) {
+        free(poller->batches[i].events);
+        free(poller->batches[i].data);
+    }
+    if (poller->wake >= 0)
+        close(poller->wake);
+    if (poller->epoll >= 0)
+        close(poller->epoll);
+    pthread_cond_destroy(&poller->cond);
+    pthread_mutex_destroy(&poller->lock);
+    free(poller);
+}
+
+IOReturn SIInterruptPollerAdd(SIInterruptPoller *poller, SIClient *client, uint8_t pipe, void *context)
+{
+    if (!client->handle)
+        return kIOReturnNotOpen;
+
+    SIPipeProps props;
+    IOReturn ret = SIGetPipe(client, pipe, &props);
+    if (ret != kIOReturnSuccess)
+        return ret;
+    if (pipe == 0 || props.type != kSIPipeTypeInterrupt || props.direction != kSIPipeDirectionIn || !props.max
+        || props.max > poller->config.maxBytes)
+        return kIOReturnBadArgument;
+
+    short events = 0;
+    int fd = client->backend->getEventFD ? client->backend->getEventFD(client, &events) : -1;
+    if (fd < 0)
+        return kIOReturnUnsupported;
+
+    SIInterruptEndpoint *endpoint = calloc(1, sizeof(SIInterruptEndpoint));
+    SIInterruptClient *entry = calloc(1, sizeof(SIInterruptClient));
+    if (!endpoint || !entry) {
+        free(endpoint);
+        free(entry);
+        return kIOReturnNoMemory;
+    }
+
+    // Reads complete at most once per service interval, and go unreaped
+    // for up to a window at a time.
+    uint64_t intervalNs = SIServiceIntervalNs(&props, poller->config.frameUs);
+    endpoint->poller = poller;
+    endpoint->client = client;
+    endpoint->pipe = pipe;
+    endpoint->context = context;
+    endpoint->depth = poller->config.depth ? poller->config.depth
+                                           : (uint32_t)((poller->coalesceNs + intervalNs - 1) / intervalNs) + 1;
+    endpoint->readSize = props.max;
+    endpoint->storageSize = (size_t)endpoint->depth * endpoint->readSize;
+    endpoint->storage = SIAllocBuffers(client, endpoint->storageSize, &endpoint->storageMapped);
+    endpoint->transfers = calloc(endpoint->depth, sizeof(SITransfer));
+    if (!endpoint->storage || !endpoint->transfers) {
+        free(entry);
+        SIInterruptEndpointDestroy(endpoint);
+        return kIOReturnNoMemory;
+    }
+
+    for (uint32_t i = 0; i < endpoint->depth; ++i) {
+        SITransferInit(&endpoint->transfers[i], client, pipe, endpoint->storage + (size_t)i * endpoint->readSize,
+            endpoint->readSize, SIInterruptPollerCompleted, endpoint);
+    }
+
+    pthread_mutex_lock(&poller->lock);
+    SIInterruptClient *existing = SIInterruptPollerFind(poller, client);
+    for (SIInterruptEndpoint *it = existing ? existing->endpoints : NULL; it; it = it->next) {
+        if (it->pipe == pipe) {
+            ret = kIOReturnExclusiveAccess;
+            goto L_failed;
+        }
+    }
+
+    if (existing) {
+        free(entry);
+        entry = existing;
+    } else {
+        // Pooled clients are already reaped by their worker, and watching
+        // them as well would only mean waking up twice.
+        entry->watched = !__atomic_load_n(&client->async->pool, __ATOMIC_ACQUIRE);
+
+        // poll(2) and epoll share their event bits.
+        struct epoll_event event = { .events = (uint16_t)events, .data.ptr = entry };
+        if (entry->watched && epoll_ctl(poller->epoll, EPOLL_CTL_ADD, fd, &event) < 0) {
+            ret = SIReturnFromErrno(errno);
+            goto L_failed;
+        }
+
+        entry->client = client;
+        entry->fd = fd;
+        entry->next = poller->clients;
+        if (poller->clients)
+            poller->clients->prev = entry;
+        poller->clients = entry;
+    }
+
+    endpoint->next = entry->endpoints;
+    entry->endpoints = endpoint;
+    endpoint->inFlight = endpoint->depth;
+    endpoint->previousDepth = SIGetPipeQueueDepth(client, pipe);
+    SISetPipeQueueDepth(client, pipe, endpoint->depth);
+    pthread_mutex_unlock(&poller->lock);
+
+    for (uint32_t i = 0; i < endpoint->depth; ++i)
+        SIInterruptPollerSubmit(endpoint, &endpoint->transfers[i]);
+
+    SIDebug("Polling pipe %d of client %p with %u reads.", pipe, (void *)client, endpoint->depth);
+    return kIOReturnSuccess;
+
+L_failed:
+    pthread_mutex_unlock(&poller->lock);
+    free(entry);
+    SIInterruptEndpointDestroy(endpoint);
+    return ret;
+}
+
+IOReturn SIInterruptPollerRemove(SIInterruptPoller *poller, SIClient *client, uint8_t pipe)
+{
+    // Reads can only be reaped by the poller's thread once this returns.
+    if (poller->running && pthread_equal(pthread_self(), poller->thread))
+        return kIOReturnNotPermitted;
+
+    pthread_mutex_lock(&poller->lock);
+    SIInterruptClient *entry = SIInterruptPollerFind(poller, client);
+    SIInterruptEndpoint **it = entry ? &entry->endpoints : NULL;
+    while (it && *it && (*it)->pipe != pipe)
+        it = &(*it)->next;
+    if (!it || !*it || (*it)->removing) {
+        pthread_mutex_unlock(&poller->lock);
+        return kIOReturnNotFound;
+    }
+
+    // Completions stop resubmitting from here on, but a read may still be
+    // on its way to the backend when first cancelled.
+    SIInterruptEndpoint *endpoint = *it;
+    endpoint->removing = 1;
+    for (int tries = 0; endpoint->inFlight && tries < kSIInterruptPollerCancelTries; ++tries) {
+        pthread_mutex_unlock(&poller->lock);
+        for (uint32_t i = 0; i < endpoint->depth; ++i)
+            SICancelTransfer(&endpoint->transfers[i]);
+        pthread_mutex_lock(&poller->lock);
+
+        // The poller's thread reaps the cancelled reads, unless it has
+        // stopped watching the client, or someone else gets there first.
+        if (endpoint->inFlight && !entry->watched) {
+            pthread_mutex_unlock(&poller->lock);
+            SIHandleEvents(client, 0);
+            pthread_mutex_lock(&poller->lock);
+        }
+        if (endpoint->inFlight)
+            SICondWaitUntilNs(&poller->cond, &poller->lock, SIGetTimeNs() + 10000000);
+    }
+
+    // Other pipes may have been added in the meantime.
+    for (it = &entry->endpoints; *it != endpoint; it = &(*it)->next)
+        ;
+    *it = endpoint->next;
+    pthread_cond_broadcast(&poller->cond);
+
+    if (!entry->endpoints) {
+        if (entry->watched)
+            epoll_ctl(poller->epoll, EPOLL_CTL_DEL, entry->fd, NULL);
+        entry->client = NULL;
+
+        if (entry->prev)
+            entry->prev->next = entry->next;
+        else
+            poller->clients = entry->next;
+        if (entry->next)
+            entry->next->prev = entry->prev;
+
+        // Events already waited on may still refer to it.
+        entry->next = poller->released;
+        poller->released = entry;
+        while (poller->handling == client)
+            pthread_cond_wait(&poller->cond, &poller->lock);
+    }
+
+    uint32_t inFlight = endpoint->inFlight;
+    pthread_mutex_unlock(&poller->lock);
+
+    if (inFlight) {
+        // The backend still owns some reads, so their storage can't go;
+        // see the header for what's left to the caller.
+        SIDebug("Leaking polled pipe %d with %u reads in flight.", pipe, inFlight);
+        return kIOReturnTimeout;
+    }
+
+    SISetPipeQueueDepth(client, pipe, endpoint->previousDepth);
+    SIInterruptEndpointDestroy(endpoint);
+    if (poller->running)
+        SIInterruptPollerWake(poller);
+    return kIOReturnSuccess;
+}
+
+IOReturn SIInterruptPollerWait(SIInterruptPoller *poller, SIInterruptEvent const **eventsOut,
+    uint32_t *numEventsOut, int timeoutMs)
+{
+    if (poller->config.callback)
+        return kIOReturnUnsupported;
+
+    uint64_t deadline = timeoutMs > 0 ? SIGetTimeNs() + (uint64_t)timeoutMs * 1000000 : 0;
+    IOReturn ret = kIOReturnSuccess;
+
+    pthread_mutex_lock(&poller->lock);
+    SIInterruptBatchReset(poller->held);
+    while (!poller->ready->count) {
+        if (timeoutMs == 0
+            || (timeoutMs > 0 && SICondWaitUntilNs(&poller->cond, &poller->lock, deadline) == ETIMEDOUT)) {
+            ret = kIOReturnTimeout;
+            break;
+        }
+        if (timeoutMs < 0)
+            pthread_cond_wait(&poller->cond, &poller->lock);
+    }
+
+    if (poller->ready->count) {
+        SIInterruptBatch *batch = poller->ready;
+        poller->ready = poller->held;
+        poller->held = batch;
+        SIInterruptPollerAccount(poller, batch);
+
+        // Whatever gathered while the queue was full is overdue by now.
+        if (poller->filling->count && SIGetTimeNs() >= poller->filling->deadline)
+            SIInterruptPollerDeliver(poller);
+        ret = kIOReturnSuccess;
+    }
+
+    *eventsOut = poller->held->events;
+    *numEventsOut = poller->held->count;
+    pthread_mutex_unlock(&poller->lock);
+
+    return ret;
+}
+
+void SIInterruptPollerGetStats(SIInterruptPoller *poller, SIInterruptPollerStats *stats)
+{
+    pthread_mutex_lock(&poller->lock);
+    *stats = poller->stats;
+    pthread_mutex_unlock(&poller->lock);
+}
+
+#else
+
+// XXX: There's no epoll here; IOKit completions are delivered through a
+// run loop instead, which would need a loop of its own per worker.
+
+IOReturn SIClientPoolCreate(SIClientPoolConfig const *config, SIClientPool **poolOut)
+{
+    (void)config;
+    (void)poolOut;
+    return kIOReturnUnsupported;
+}
+
+void SIClientPoolDestroy(SIClientPool *pool)
+{
+    (void)pool;
+}
+
+IOReturn SIClientPoolAdd(SIClientPool *pool, SIClient *client)
+{
+    (void)pool;
+    (void)client;
+    return kIOReturnUnsupported;
+}
+
+IOReturn SIClientPoolRemove(SIClientPool *pool, SIClient *client)
+{
+    (void)pool;
+    (void)client;
+    return kIOReturnNotFound;
+}
+
+IOReturn SIClientPoolDispatch(SIClientPool *pool, SIClient *client, void (*function)(void *context),
+    void *context)
+{
+    (void)pool;
+    (void)client;
+    (void)function;
+    (void)context;
+    return kIOReturnUnsupported;
+}
+
+IOReturn SIClientPoolGetWorker(SIClientPool *pool, SIClient *client, uint32_t *workerOut)
+{
+    (void)pool;
+    (void)client;
+    (void)workerOut;
+    return kIOReturnNotFound;
+}
+
+IOReturn SIClientPoolAddMonitor(SIClientPool *pool, SIHotplugMonitor *monitor)
+{
+    (void)pool;
+    (void)monitor;
+    return kIOReturnUnsupported;
+}
+
+IOReturn SIClientPoolRemoveMonitor(SIClientPool *pool, SIHotplugMonitor *monitor)
+{
+    (void)pool;
+    (void)monitor;
+    return kIOReturnNotFound;
+}
+
+// XXX: Likewise, the poller waits on every client's event descriptor at once.
+
+IOReturn SIInterruptPollerCreate(SIInterruptPollerConfig const *config, SIInterruptPoller **pollerOut)
+{
+    (void)config;
+    (void)pollerOut;
+    return kIOReturnUnsupported;
+}
+
+void SIInterruptPollerDestroy(SIInterruptPoller *poller)
+{
+    (void)poller;
+}
+
+IOReturn SIInterruptPollerAdd(SIInterruptPoller *poller, SIClient *client, uint8_t pipe, void *context)
+{
+    (void)poller;
+    (void)client;
+    (void)pipe;
+    (void)context;
+    return kIOReturnUnsupported;
+}
+
+IOReturn SIInterruptPollerRemove(SIInterruptPoller *poller, SIClient *client, uint8_t pipe)
+{
+    (void)poller;
+    (void)client;
+    (void)pipe;
+    return kIOReturnUnsupported;
+}
+
+IOReturn SIInterruptPollerWait(SIInterruptPoller *poller, SIInterruptEvent const **eventsOut,
+    uint32_t *numEventsOut, int timeoutMs)
+{
+    (void)poller;
+    (void)eventsOut;
+    (void)numEventsOut;
+    (void)timeoutMs;
+    return kIOReturnUnsupported;
+}
+
+void SIInterruptPollerGetStats(SIInterruptPoller *poller, SIInterruptPollerStats *stats)
+{
+    (void)poller;
+    memset(stats, 0, sizeof(*stats));
+}
+
+#endif // __linux__
+
+#if defined(__APPLE__)
+
+// Private run loop mode used to deliver asynchronous completions, so that
+// 'SIHandleEvents' doesn't also service unrelated run loop sources.
+#define kSIRunLoopMode CFSTR("SimpleIOUSB")
+
+/// IOKit connection state, stored in 'SIClient.handle'.
+typedef struct {
+    SIDeviceHandle device;              ///< IOUSB device handle.
+    SIInterfaceHandle interface;        ///< IOUSB interface handle.
+    CFRunLoopRef runLoop;               ///< Run loop completions are delivered on.
+    CFRunLoopSourceRef deviceSource;    ///< Async event source for control requests.
+    CFRunLoopSourceRef interfaceSource; ///< Async event source for pipe I/O.
+    int borrowed; ///< Whether 'device' belongs to the client this interface was claimed from.
+    UInt64 isochNextFrame[kSIPipesMax]; ///< First frame not yet taken on each isochronous pipe, or zero.
+} SIIOKitHandle;
+
+static void SIIOKitDisconnect(SIClient *client)
+{
+    SIIOKitHandle *handle = client->handle;
+
+    if (handle->runLoop) {
+        if (handle->deviceSource)
+            CFRunLoopRemoveSource(handle->runLoop, handle->deviceSource, kSIRunLoopMode);
+        CFRunLoopRemoveSource(handle->runLoop, handle->interfaceSource, kSIRunLoopMode);
+    }
+
+    if (handle->interface) {
+        SIDebug("Closing USB interface...");
+
+        IOReturn ret = (*handle->interface)->USBInterfaceClose(handle->interface);
+        if (ret != kIOReturnSuccess)
+            SIDebug("Failed to close interface. (%#x)", ret);
+
+        (*handle->interface)->Release(handle->interface);
+    }
+
+    if (handle->device && handle->borrowed) {
+        (*handle->device)->Release(handle->device);
+    } else if (handle->device) {
+        SIDebug("Closing USB device...");
+
+        IOReturn ret = (*handle->device)->USBDeviceClose(handle->device);
+        if (ret != kIOReturnSuccess)
+            SIDebug("Failed to close device. (%#x)", ret);
+
+        (*handle->device)->Release(handle->device);
+    }
+
+    free(handle);
+    client->handle = NULL;
+}
+
+static CFMutableDictionaryRef SIServiceMatchingUSBDevice(uint16_t vendorID, uint16_t productID)
+{
+    CFMutableDictionaryRef query = IOServiceMatching(kIOUSBDeviceClassName);
+
+    CFNumberRef cfVendorID = CFNumberCreate(kCFAllocatorDefault, kCFNumberSInt16Type, &vendorID);
+    CFDictionarySetValue(query, CFSTR(kUSBVendorID), cfVendorID);
+    CFNumberRef cfProductID = CFNumberCreate(kCFAllocatorDefault, kCFNumberSInt16Type, &productID);
+    CFDictionarySetValue(query, CFSTR(kUSBProductID), cfProductID);
+
+    // Adding these to the dictionary increased their reference counts, drop
+    // our local reference so their lifetime is tied to the dictionary.
+    CFRelease(cfVendorID);
+    CFRelease(cfProductID);
+
+    return query;
+}
+
+static IOReturn SIQueryInterface(io_service_t service, CFUUIDRef pluginType,
+    CFUUIDRef interfaceType, LPVOID *interface)
+{
+    SInt32 score = 0;
+    IOCFPlugInInterface **plugin = NULL;
+    IOReturn ret = IOCreatePlugInInterfaceForService(service, pluginType, kIOCFPlugInInterfaceID, &plugin, &score);
+    IOObjectRelease(service);
+    if (ret != kIOReturnSuccess || !plugin) {
+        SIDebug("Failed to create plugin instance. (%#x)", ret);
+        return ret;
+    }
+
+    HRESULT ok = (*plugin)->QueryInterface(plugin, CFUUIDGetUUIDBytes(interfaceType), interface);
+    (*plugin)->Release(plugin);
+    if (ok != S_OK || !interface) {
+        SIDebug("Failed to query plugin interface. (%#x)", ok);
+        return kIOReturnError;
+    }
+
+    return kIOReturnSuccess;
+}
+
+static IOReturn SIGetDeviceHandle(io_service_t service, SIDeviceHandle *deviceOut)
+{
+    *deviceOut = NULL;
+    SIDebug("Trying to acquire device handle...");
+
+    SIDeviceInterface **device = NULL;
+    IOReturn ret = SIQueryInterface(service, kIOUSBDeviceUserClientTypeID, kIOUSBDeviceInterfaceID245, (LPVOID *)&device);
+    if (ret != kIOReturnSuccess || !device) {
+        SIDebug("Failed to query device interface. (%#x)", ret);
+        return ret;
+    }
+
+    if ((ret = (*device)->USBDeviceOpenSeize(device)) != kIOReturnSuccess) {
+        SIDebug("Failed to open device. (%#x)", ret);
+        goto L_failed;
+    }
+    if ((ret = (*device)->SetConfiguration(device, 1)) != kIOReturnSuccess) {
+        SIDebug("Failed to set configuration. (%#x)", ret);
+        goto L_failed;
+    }
+
+    *deviceOut = device;
+    return ret;
+
+L_failed:
+    if (device) {
+        (*device)->USBDeviceClose(device);
+        (*device)->Release(device);
+    }
+
+    return ret;
+}
+
+/// Open an interface of a device by number, or its first interface if
+/// 'number' is negative.
+static IOReturn SIGetInterfaceHandle(SIDeviceHandle device, int number, SIInterfaceHandle *interfaceOut)
+{
+    SIDebug("Looking for interface %d...", number);
+
+    static IOUSBFindInterfaceRequest sInterfaceReq = {
+        .bInterfaceProtocol = kIOUSBFindInterfaceDontCare,
+        .bInterfaceSubClass = kIOUSBFindInterfaceDontCare,
+        .bAlternateSetting = kIOUSBFindInterfaceDontCare,
+        .bInterfaceClass = kIOUSBFindInterfaceDontCare,
+    };
+
+    io_iterator_t ifaceIter = IO_OBJECT_NULL;
+    IOReturn ret = (*device)->CreateInterfaceIterator(device, &sInterfaceReq, &ifaceIter);
+    if (ret != kIOReturnSuccess) {
+        SIDebug("Failed to create interface iterator. (%#x)", ret);
+        return ret;
+    }
+
+    ret = kIOReturnNotFound;
+    io_service_t service = IO_OBJECT_NULL;
+    while ((service = IOIteratorNext(ifaceIter))) {
+        SIInterfaceHandle interface = NULL;
+        ret = SIQueryInterface(service, kIOUSBInterfaceUserClientTypeID,
+            kIOUSBInterfaceInterfaceID245, (LPVOID *)&interface);
+        if (ret != kIOReturnSuccess || !interface) {
+            SIDebug("Failed to query interface interface. (%#x)", ret);
+            break;
+        }
+
+        UInt8 actual = 0;
+        if (number >= 0
+            && ((*interface)->GetInterfaceNumber(interface, &actual) != kIOReturnSuccess || actual != number)) {
+            (*interface)->Release(interface);
+            ret = kIOReturnNotFound;
+            continue;
+        }
+
+        ret = (*interface)->USBInterfaceOpenSeize(interface);
+        if (ret != kIOReturnSuccess) {
+            SIDebug("Failed to open interface. (%#x)", ret);
+            (*interface)->Release(interface);
+            break;
+        }
+
+        *interfaceOut = interface;
+        break;
+    }
+
+    IOObjectRelease(ifaceIter);
+    return ret;
+}
+
+static IOReturn SIClientInitWithService(SIClient *client, io_service_t service)
+{
+    uint64_t regID = -1;
+    IOReturn ret = IORegistryEntryGetRegistryEntryID(service, &regID);
+    if (ret != kIOReturnSuccess) {
+        SIDebug("Failed to get registry entry ID for service %#x. (%#x)", service, ret);
+        return ret;
+    }
+
+    SIDebug("Trying to initialize with service %#x/%#llx...", service, regID);
+
+    SIIOKitHandle *handle = calloc(1, sizeof(SIIOKitHandle));
+    if (!handle)
+        return kIOReturnNoMemory;
+
+    SIDeviceHandle device = NULL;
+    ret = SIGetDeviceHandle(service, &device);
+    if (ret != kIOReturnSuccess || !device) {
+        SIDebug("Failed to get device handle for service %#x. (%#x)", service, ret);
+
+        free(handle);
+        return ret;
+    }
+
+    SIDebug("Acquired device handle successfully.");
+
+    SIInterfaceHandle interface = NULL;
+    ret = SIGetInterfaceHandle(device, -1, &interface);
+    if (ret != kIOReturnSuccess || !interface) {
+        SIDebug("Failed to get interface handle for service %#x. (%#x)", service, ret);
+
+        (*device)->USBDeviceClose(device);
+        (*device)->Release(device);
+
+        free(handle);
+        return ret;
+    }
+
+    SIDebug("Acquired interface handle successfully.");
+    SIDebug("Initializing client...");
+
+    handle->device = device;
+    handle->interface = interface;
+    client->handle = handle;
+    client->regID = regID;
+    return kIOReturnSuccess;
+}
+
+static IOReturn SIIOKitConnect(SIClient *client, uint16_t vendorID, uint16_t productID)
+{
+    CFMutableDictionaryRef query = SIServiceMatchingUSBDevice(vendorID, productID);
+    if (!query) {
+        SIDebug("Failed to allocate matching dictionary.");
+        return kIOReturnError;
+    }
+
+    io_iterator_t serviceIter = IO_OBJECT_NULL;
+    IOReturn ret = IOServiceGetMatchingServices(kIOMainPortDefault, query, &serviceIter);
+    if (ret != kIOReturnSuccess) {
+        SIDebug("Failed to get matching services. (%#x)", ret);
+        return ret;
+    }
+
+    ret = kIOReturnNoDevice;
+    io_service_t service = IO_OBJECT_NULL;
+    while ((service = IOIteratorNext(serviceIter))) {
+        ret = SIClientInitWithService(client, service);
+        if (ret != kIOReturnSuccess) {
+            SIDebug("Failed to create client with service %#x. (%#x)", service, ret);
+            continue;
+        }
+
+        break;
+    }
+
+    IOObjectRelease(serviceIter);
+    return ret;
+}
+
+static void SIHandleFirstMatch(void *context, io_iterator_t serviceIter)
+{
+    SIAsyncCallbacks const *callbacks = (SIAsyncCallbacks const *)context;
+
+    io_service_t service = IO_OBJECT_NULL;
+    while ((service = IOIteratorNext(serviceIter))) {
+        SIClient *client = SIClientCreateWithBackend(&kSIBackendIOKit);
+        IOReturn ret = SIClientInitWithService(client, service);
+        if (ret != kIOReturnSuccess) {
+            SIDebug("Failed to create client with service %#x. (%#x)", service, ret);
+
+            SIClientDestroy(client);
+            continue;
+        }
+
+        callbacks->connect(client);
+    }
+}
+
+static void SIHandleTerminated(void *context, io_iterator_t serviceIter)
+{
+    SIAsyncCallbacks const *callbacks = (SIAsyncCallbacks const *)context;
+
+    io_service_t service = IO_OBJECT_NULL;
+    while ((service = IOIteratorNext(serviceIter))) {
+        uint64_t entryID;
+        if (IORegistryEntryGetRegistryEntryID(service, &entryID) != kIOReturnSuccess)
+            goto L_next;
+
+        if (callbacks)
+            callbacks->disconnect(entryID);
+
+    L_next:
+        // TODO: Check error code?
+        IOObjectRelease(service);
+    }
+}
+
+IOReturn SIConnectAsync(uint16_t vendorID, uint16_t productID, SIAsyncCallbacks *callbacks)
+{
+    IONotificationPortRef notifyPort = IONotificationPortCreate(kIOMainPortDefault);
+    if (!notifyPort)
+        return kIOReturnError;
+
+    CFMutableDictionaryRef query = SIServiceMatchingUSBDevice(vendorID, productID);
+    if (!query)
+        return kIOReturnError;
 
     // Each of the calls to 'IOServiceAddMatchingNotification' will consume a
     // reference to this, so we increment the reference count of the matching
     // dictionary so that it lives until the second call.
     CFRetain(query);
 
-    CFRunLoopSourceRef runLoopSource = IONotificationPortGetRunLoopSource(notifyPort);
-    CFRunLoopAddSource(CFRunLoopGetCurrent(), runLoopSource, kCFRunLoopDefaultMode);
+    CFRunLoopSourceRef runLoopSource = IONotificationPortGetRunLoopSource(notifyPort);
+    CFRunLoopAddSource(CFRunLoopGetCurrent(), runLoopSource, kCFRunLoopDefaultMode);
+
+    io_iterator_t sFirstMatchIter = IO_OBJECT_NULL;
+    IOReturn ret = IOServiceAddMatchingNotification(notifyPort, kIOFirstMatchNotification, query,
+        &SIHandleFirstMatch, callbacks, &sFirstMatchIter);
+    if (ret != kIOReturnSuccess)
+        return ret;
+
+    io_iterator_t sTerminatedIter = IO_OBJECT_NULL;
+    ret = IOServiceAddMatchingNotification(notifyPort, kIOTerminatedNotification, query,
+        &SIHandleTerminated, callbacks, &sTerminatedIter);
+    if (ret)
+        return ret;
+
+    SIHandleFirstMatch(callbacks, sFirstMatchIter);
+    SIHandleTerminated(callbacks, sTerminatedIter);
+
+    return kIOReturnSuccess;
+}
+
+// XXX: IOKit has matching notifications of its own, which 'SIConnectAsync'
+// uses; these would need a run loop source rather than a descriptor.
+
+IOReturn SIHotplugMonitorCreate(SIFilterSet const *filters, SIAsyncCallbacks const *callbacks,
+    SIHotplugMonitor **monitorOut)
+{
+    (void)filters;
+    (void)callbacks;
+    (void)monitorOut;
+    return kIOReturnUnsupported;
+}
+
+void SIHotplugMonitorDestroy(SIHotplugMonitor *monitor)
+{
+    (void)monitor;
+}
+
+int SIHotplugMonitorGetFD(SIHotplugMonitor *monitor)
+{
+    (void)monitor;
+    return -1;
+}
+
+IOReturn SIHotplugMonitorHandleEvents(SIHotplugMonitor *monitor, int timeoutMs)
+{
+    (void)monitor;
+    (void)timeoutMs;
+    return kIOReturnUnsupported;
+}
+
+IOReturn SIEnumerateAt(char const *sysfsRoot, SIFilterSet const *filters, SIDeviceList **listOut)
+{
+    (void)sysfsRoot;
+    (void)filters;
+    (void)listOut;
+    return kIOReturnUnsupported;
+}
+
+IOReturn SIEnumerate(SIFilterSet const *filters, SIDeviceList **listOut)
+{
+    (void)filters;
+    (void)listOut;
+    return kIOReturnUnsupported;
+}
+
+IOReturn SIConnectAt(SIClient *client, char const *usbfsRoot, uint16_t vendorID, uint16_t productID)
+{
+    (void)client;
+    (void)usbfsRoot;
+    (void)vendorID;
+    (void)productID;
+    return kIOReturnUnsupported;
+}
+
+static IOReturn SIIOKitGetNumEndpoints(SIClient *client, uint8_t *numEndpoints)
+{
+    SIIOKitHandle *handle = client->handle;
+    return (*handle->interface)->GetNumEndpoints(handle->interface, numEndpoints);
+}
+
+static IOReturn SIIOKitGetPipe(SIClient *client, uint8_t index, SIPipeProps *pipe)
+{
+    SIIOKitHandle *handle = client->handle;
+    return (*handle->interface)->GetPipeProperties(handle->interface, index, //
+        &pipe->direction, &pipe->endpoint, &pipe->type, &pipe->max, &pipe->interval);
+}
+
+static IOReturn SIIOKitReadPipe(SIClient *client, uint8_t pipe, void *buffer, uint32_t *bufSizeInOut)
+{
+    SIIOKitHandle *handle = client->handle;
+    return (*handle->interface)->ReadPipe(handle->interface, pipe, buffer, bufSizeInOut);
+}
+
+static IOReturn SIIOKitWritePipe(SIClient *client, uint8_t pipe, void const *buffer, uint32_t bufSize)
+{
+    SIIOKitHandle *handle = client->handle;
+    return (*handle->interface)->WritePipe(handle->interface, pipe, (void *)buffer, bufSize);
+}
+
+static IOReturn SIIOKitAbortPipe(SIClient *client, uint8_t pipe)
+{
+    SIIOKitHandle *handle = client->handle;
+    return (*handle->interface)->AbortPipe(handle->interface, pipe);
+}
+
+static SITransferResult SIIOKitControlTransfer(SIClient *client, uint8_t requestType, uint8_t request,
+    uint16_t value, uint16_t index, void *data, size_t length)
+{
+    SIIOKitHandle *handle = client->handle;
+
+    IOUSBDevRequestTO req;
+    req.wLenDone = 0;
+    req.pData = data;
+    req.bRequest = request;
+    req.bmRequestType = requestType;
+    req.wLength = OSSwapLittleToHostInt16(length);
+    req.wValue = OSSwapLittleToHostInt16(value);
+    req.wIndex = OSSwapLittleToHostInt16(index);
+    req.completionTimeout = SIControlTimeoutMs(client);
+    req.noDataTimeout = SIControlTimeoutMs(client);
+
+    IOReturn error = (*handle->device)->DeviceRequestTO(handle->device, &req);
+    return (SITransferResult) { .error = error, .length = req.wLenDone };
+}
+
+static void SIIOKitCompletion(void *refcon, IOReturn result, void *arg0)
+{
+    SITransfer *transfer = refcon;
+    transfer->result = (SITransferResult) { .error = result, .length = (uint32_t)(uintptr_t)arg0 };
+    SITransferCompleted(transfer);
+}
+
+static void SIIOKitIsochCompletion(void *refcon, IOReturn result, void *arg0)
+{
+    SITransfer *transfer = refcon;
+    IOUSBIsocFrame *frames = arg0;
+
+    // Short packets are nothing out of the ordinary here.
+    uint32_t total = 0;
+    for (uint32_t i = 0; i < transfer->numPackets; ++i) {
+        IOReturn status = frames[i].frStatus;
+        transfer->packets[i].actual = frames[i].frActCount;
+        transfer->packets[i].status = status == kIOReturnUnderrun ? kIOReturnSuccess : status;
+        total += frames[i].frActCount;
+    }
+    free(frames);
+
+    result = result == kIOReturnUnderrun ? kIOReturnSuccess : result;
+    transfer->result = (SITransferResult) { .error = result, .length = total };
+    SITransferCompleted(transfer);
+}
+
+/// Attach the async event sources to the current thread's run loop; all
+/// completions will be delivered on that thread from then on.
+static IOReturn SIIOKitAttachEventSources(SIIOKitHandle *handle)
+{
+    if (handle->runLoop)
+        return kIOReturnSuccess;
+
+    // The device's source is shared by every client using the device, so
+    // claimed interfaces send their control requests through the interface.
+    IOReturn ret;
+    if (!handle->borrowed) {
+        ret = (*handle->device)->CreateDeviceAsyncEventSource(handle->device, &handle->deviceSource);
+        if (ret != kIOReturnSuccess) {
+            SIDebug("Failed to create device async event source. (%#x)", ret);
+            return ret;
+        }
+    }
+
+    ret = (*handle->interface)->CreateInterfaceAsyncEventSource(handle->interface, &handle->interfaceSource);
+    if (ret != kIOReturnSuccess) {
+        SIDebug("Failed to create interface async event source. (%#x)", ret);
+        return ret;
+    }
+
+    handle->runLoop = CFRunLoopGetCurrent();
+    if (handle->deviceSource)
+        CFRunLoopAddSource(handle->runLoop, handle->deviceSource, kSIRunLoopMode);
+    CFRunLoopAddSource(handle->runLoop, handle->interfaceSource, kSIRunLoopMode);
+    return kIOReturnSuccess;
+}
+
+// Frames ahead of the bus that an isochronous transfer starts, when its
+// pipe has nothing queued.
+#define kSIIOKitIsochLeadFrames 2
+
+/// Submit an isochronous transfer, following straight on from those already
+/// queued on its pipe if they haven't all gone by.
+///
+/// XXX: Packets are taken to be a frame apart, as they are at full speed
+/// with an interval of one; microframes aren't accounted for.
+static IOReturn SIIOKitSubmitIsochronous(SIIOKitHandle *handle, SITransfer *transfer, SIPipeProps const *props)
+{
+    if (!transfer->numPackets)
+        return kIOReturnBadArgument;
+
+    IOUSBIsocFrame *frames = calloc(transfer->numPackets, sizeof(IOUSBIsocFrame));
+    if (!frames)
+        return kIOReturnNoMemory;
+
+    IOReturn ret = kIOReturnBadArgument;
+    for (uint32_t i = 0; i < transfer->numPackets; ++i) {
+        if (transfer->packets[i].length > UINT16_MAX)
+            goto L_failed;
+        frames[i].frReqCount = (UInt16)transfer->packets[i].length;
+    }
+
+    UInt64 busFrame;
+    AbsoluteTime atTime;
+    if ((ret = (*handle->interface)->GetBusFrameNumber(handle->interface, &busFrame, &atTime)) != kIOReturnSuccess)
+        goto L_failed;
+
+    UInt64 *next = &handle->isochNextFrame[transfer->pipe];
+    UInt64 start = *next;
+    if (start <= busFrame) {
+        start = busFrame + kSIIOKitIsochLeadFrames;
+        if (*next)
+            transfer->missedFrames = (uint32_t)(start - *next < UINT32_MAX ? start - *next : UINT32_MAX);
+    }
+
+    if (props->direction == kSIPipeDirectionIn) {
+        ret = (*handle->interface)->ReadIsochPipeAsync(handle->interface, transfer->pipe, transfer->buffer, start,
+            transfer->numPackets, frames, SIIOKitIsochCompletion, transfer);
+    } else {
+        ret = (*handle->interface)->WriteIsochPipeAsync(handle->interface, transfer->pipe, transfer->buffer, start,
+            transfer->numPackets, frames, SIIOKitIsochCompletion, transfer);
+    }
+    if (ret != kIOReturnSuccess)
+        goto L_failed;
+
+    *next = start + transfer->numPackets;
+    return kIOReturnSuccess;
+
+L_failed:
+    free(frames);
+    return ret;
+}
+
+static IOReturn SIIOKitSubmitTransfer(SITransfer *transfer)
+{
+    SIIOKitHandle *handle = transfer->client->handle;
+    IOReturn ret = SIIOKitAttachEventSources(handle);
+    if (ret != kIOReturnSuccess)
+        return ret;
+
+    if (transfer->pipe == 0) {
+        SISetupPacket const *setup = transfer->buffer;
+
+        IOUSBDevRequestTO *req = (IOUSBDevRequestTO *)transfer->backendData;
+        req->bmRequestType = setup->bmRequestType;
+        req->bRequest = setup->bRequest;
+        req->wValue = OSSwapLittleToHostInt16(setup->wValue);
+        req->wIndex = OSSwapLittleToHostInt16(setup->wIndex);
+        req->wLength = OSSwapLittleToHostInt16(setup->wLength);
+        req->pData = (uint8_t *)transfer->buffer + sizeof(SISetupPacket);
+        req->wLenDone = 0;
+        req->completionTimeout = SIControlTimeoutMs(transfer->client);
+        req->noDataTimeout = SIControlTimeoutMs(transfer->client);
+        if (sizeof(SISetupPacket) + req->wLength > transfer->length)
+            return kIOReturnBadArgument;
+
+        if (handle->borrowed)
+            return (*handle->interface)->ControlRequestAsyncTO(handle->interface, 0, req, SIIOKitCompletion, transfer);
+        return (*handle->device)->DeviceRequestAsyncTO(handle->device, req, SIIOKitCompletion, transfer);
+    }
+
+    SIPipeProps props;
+    ret = SIIOKitGetPipe(transfer->client, transfer->pipe, &props);
+    if (ret != kIOReturnSuccess)
+        return ret;
+    if (props.type == kSIPipeTypeIsochronous)
+        return SIIOKitSubmitIsochronous(handle, transfer, &props);
+
+    if (props.direction == kSIPipeDirectionIn) {
+        return (*handle->interface)->ReadPipeAsync(handle->interface, transfer->pipe,
+            transfer->buffer, transfer->length, SIIOKitCompletion, transfer);
+    }
+
+    return (*handle->interface)->WritePipeAsync(handle->interface, transfer->pipe,
+        transfer->buffer, transfer->length, SIIOKitCompletion, transfer);
+}
+
+static IOReturn SIIOKitClaimInterface(SIClient *client, SIClient *target, uint8_t number)
+{
+    SIIOKitHandle *handle = client->handle;
+    SIIOKitHandle *claimed = calloc(1, sizeof(SIIOKitHandle));
+    if (!claimed)
+        return kIOReturnNoMemory;
+
+    SIInterfaceHandle interface = NULL;
+    IOReturn ret = SIGetInterfaceHandle(handle->device, number, &interface);
+    if (ret != kIOReturnSuccess || !interface) {
+        free(claimed);
+        return ret != kIOReturnSuccess ? ret : kIOReturnNotFound;
+    }
+
+    (*handle->device)->AddRef(handle->device);
+    claimed->device = handle->device;
+    claimed->interface = interface;
+    claimed->borrowed = 1;
+    target->handle = claimed;
+    return kIOReturnSuccess;
+}
+
+static IOReturn SIIOKitCancelTransfer(SITransfer *transfer)
+{
+    (void)transfer;
+
+    // XXX: IOUSB can only abort everything on a pipe at once.
+    return kIOReturnUnsupported;
+}
+
+static IOReturn SIIOKitHandleEvents(SIClient *client, int timeoutMs)
+{
+    (void)client;
+
+    CFTimeInterval seconds = timeoutMs < 0 ? 1e10 : timeoutMs / 1000.0;
+    CFRunLoopRunInMode(kSIRunLoopMode, seconds, true);
+    return kIOReturnSuccess;
+}
+
+SIBackend const kSIBackendIOKit = {
+    .name = "iokit",
+    .connect = SIIOKitConnect,
+    .disconnect = SIIOKitDisconnect,
+    .getNumEndpoints = SIIOKitGetNumEndpoints,
+    .getPipe = SIIOKitGetPipe,
+    .readPipe = SIIOKitReadPipe,
+    .writePipe = SIIOKitWritePipe,
+    .abortPipe = SIIOKitAbortPipe,
+    .controlTransfer = SIIOKitControlTransfer,
+    .claimInterface = SIIOKitClaimInterface,
+    .submitTransfer = SIIOKitSubmitTransfer,
+    .cancelTransfer = SIIOKitCancelTransfer,
+    .handleEvents = SIIOKitHandleEvents,
+};
+
+#endif // __APPLE__
+
+#if defined(__linux__)
+
+#define kSIUsbfsRoot "/dev/bus/usb"
+
+// Bulk URBs are limited to this size unless the kernel advertises
+// 'USBDEVFS_CAP_NO_PACKET_SIZE_LIM'.
+#define kSIUsbfsBulkChunkMax 0x4000
+
+/// usbfs connection state, stored in 'SIClient.handle'.
+typedef struct {
+    int fd;                          ///< Open usbfs device node.
+    uint32_t caps;                   ///< 'USBDEVFS_GET_CAPABILITIES' flags.
+    uint8_t interface;               ///< Claimed interface number.
+    uint8_t numEndpoints;            ///< Endpoints on the claimed interface.
+    SIPipeProps pipes[kSIPipesMax];  ///< Pipe table; pipe 0 is control.
+    char path[0x100];                ///< Device node, for claiming more interfaces.
+} SIUsbfsHandle;
+
+static SITransferResult SIUsbfsControl(int fd, uint8_t requestType, uint8_t request,
+    uint16_t value, uint16_t index, void *data, size_t length, uint32_t timeoutMs)
+{
+    if (length > UINT16_MAX)
+        return (SITransferResult) { .error = kIOReturnBadArgument, .length = 0 };
+
+    struct usbdevfs_ctrltransfer req = {
+        .bRequestType = requestType,
+        .bRequest = request,
+        .wValue = value,
+        .wIndex = index,
+        .wLength = (uint16_t)length,
+        .timeout = timeoutMs,
+        .data = data,
+    };
+
+    int done = ioctl(fd, USBDEVFS_CONTROL, &req);
+    if (done < 0)
+        return (SITransferResult) { .error = SIReturnFromErrno(errno), .length = 0 };
+
+    return (SITransferResult) { .error = kIOReturnSuccess, .length = (uint32_t)done };
+}
+
+/// Read the cached device and configuration descriptors from a usbfs node.
+///
+/// \return Number of bytes read, or -1 on failure.
+static ssize_t SIUsbfsReadDescriptors(int fd, uint8_t *buffer, size_t bufSize)
+{
+    if (lseek(fd, 0, SEEK_SET) < 0)
+        return -1;
+
+    size_t total = 0;
+    while (total < bufSize) {
+        ssize_t got = read(fd, buffer + total, bufSize - total);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got < 0)
+            return -1;
+        if (got == 0)
+            break;
+
+        total += (size_t)got;
+    }
+
+    return (ssize_t)total;
+}
+
+static IOReturn SIUsbfsLoadPipes(SIUsbfsHandle *handle, uint8_t configValue, int number)
+{
+    uint8_t desc[0x1000];
+    ssize_t size = SIUsbfsReadDescriptors(handle->fd, desc, sizeof(desc));
+    if (size < (ssize_t)sizeof(SIDeviceDescriptor))
+        return kIOReturnIOError;
+
+    SIDeviceDescriptor const *device = (SIDeviceDescriptor const *)desc;
+    handle->pipes[0] = SIControlPipeProps(device);
+
+    // Configuration blobs follow the device descriptor back-to-back.
+    return SIParsePipes(desc + device->bLength, (size_t)size - device->bLength, configValue, number,
+        &handle->interface, handle->pipes, &handle->numEndpoints);
+}
+
+static void SIUsbfsDisconnect(SIClient *client)
+{
+    SIUsbfsHandle *handle = client->handle;
+
+    SIDebug("Releasing interface %u...", handle->interface);
+    unsigned int number = handle->interface;
+    if (ioctl(handle->fd, USBDEVFS_RELEASEINTERFACE, &number) < 0)
+        SIDebug("Failed to release interface. (%d)", errno);
+
+    close(handle->fd);
+    free(handle);
+    client->handle = NULL;
+}
+
+/// Open a usbfs device node for a new connection.
+static IOReturn SIUsbfsOpen(char const *path, SIUsbfsHandle **handleOut)
+{
+    int fd = open(path, O_RDWR | O_CLOEXEC);
+    if (fd < 0) {
+        SIDebug("Failed to open %s. (%d)", path, errno);
+        return SIReturnFromErrno(errno);
+    }
+
+    SIUsbfsHandle *handle = calloc(1, sizeof(SIUsbfsHandle));
+    if (!handle) {
+        close(fd);
+        return kIOReturnNoMemory;
+    }
+
+    handle->fd = fd;
+    snprintf(handle->path, sizeof(handle->path), "%s", path);
+    if (ioctl(fd, USBDEVFS_GET_CAPABILITIES, &handle->caps) < 0)
+        handle->caps = 0;
+
+    *handleOut = handle;
+    return kIOReturnSuccess;
+}
+
+/// Find an interface's pipes in configuration 1 and claim it, or the first
+/// interface if 'number' is negative.
+static IOReturn SIUsbfsClaim(SIUsbfsHandle *handle, int number)
+{
+    IOReturn ret = SIUsbfsLoadPipes(handle, 1, number);
+    if (ret != kIOReturnSuccess)
+        return ret;
+
+    // Equivalent of 'USBInterfaceOpenSeize'; detach any kernel driver bound
+    // to the interface, then claim it for ourselves. Claims belong to the
+    // open file, so each claimed interface has a descriptor of its own.
+    struct usbdevfs_disconnect_claim claim = { .interface = handle->interface };
+    if (ioctl(handle->fd, USBDEVFS_DISCONNECT_CLAIM, &claim) < 0) {
+        ret = SIReturnFromErrno(errno);
+        SIDebug("Failed to claim interface %u. (%#x)", handle->interface, ret);
+        return ret;
+    }
+
+    SIDebug("Claimed interface %u with %u endpoint(s).", handle->interface, handle->numEndpoints);
+    return kIOReturnSuccess;
+}
+
+static IOReturn SIUsbfsInitWithPath(SIClient *client, char const *path, uint64_t regID)
+{
+    SIDebug("Trying to initialize with %s...", path);
+
+    SIUsbfsHandle *handle = NULL;
+    IOReturn ret = SIUsbfsOpen(path, &handle);
+    if (ret != kIOReturnSuccess)
+        return ret;
+
+    // Match the IOKit backend and select configuration 1, but don't disturb
+    // the device if it's already there, as the kernel would reset it.
+    uint8_t config = 0;
+    SITransferResult result = SIUsbfsControl(handle->fd,
+        kSIDirectionToHost | kSITypeStandard | kSIRecipientDevice,
+        kSIRequestGetConfiguration, 0, 0, &config, sizeof(config), SIControlTimeoutMs(client));
+    ret = result.error;
+    if (ret != kIOReturnSuccess) {
+        SIDebug("Failed to get configuration. (%#x)", ret);
+        goto L_failed;
+    }
+
+    if (config != 1) {
+        unsigned int value = 1;
+        if (ioctl(handle->fd, USBDEVFS_SETCONFIGURATION, &value) < 0) {
+            ret = SIReturnFromErrno(errno);
+            SIDebug("Failed to set configuration. (%#x)", ret);
+            goto L_failed;
+        }
+    }
+
+    if ((ret = SIUsbfsClaim(handle, -1)) != kIOReturnSuccess)
+        goto L_failed;
+
+    client->handle = handle;
+    client->regID = regID;
+    return kIOReturnSuccess;
+
+L_failed:
+    close(handle->fd);
+    free(handle);
+    return ret;
+}
+
+/// Visit every usbfs device node under 'root', along with its device
+/// descriptor, until 'visit' returns nonzero.
+static void SIUsbfsForEachDevice(char const *root,
+    int (*visit)(void *context, char const *path, unsigned bus, unsigned dev, SIDeviceDescriptor const *desc),
+    void *context)
+{
+    DIR *busDir = opendir(root);
+    if (!busDir) {
+        SIDebug("Failed to open %s. (%d)", root, errno);
+        return;
+    }
+
+    int stop = 0;
+    struct dirent *busEntry;
+    while (!stop && (busEntry = readdir(busDir))) {
+        char *end;
+        unsigned long bus = strtoul(busEntry->d_name, &end, 10);
+        if (*end || end == busEntry->d_name)
+            continue;
+
+        char busPath[0x200];
+        if (snprintf(busPath, sizeof(busPath), "%s/%s", root, busEntry->d_name) >= (int)sizeof(busPath))
+            continue;
+        DIR *devDir = opendir(busPath);
+        if (!devDir)
+            continue;
+
+        struct dirent *devEntry;
+        while (!stop && (devEntry = readdir(devDir))) {
+            unsigned long dev = strtoul(devEntry->d_name, &end, 10);
+            if (*end || end == devEntry->d_name)
+                continue;
+
+            char devPath[0x400];
+            snprintf(devPath, sizeof(devPath), "%s/%s", busPath, devEntry->d_name);
+
+            // Device nodes are usually world-readable but not writable, so
+            // check the descriptor before trying to open it for real.
+            int fd = open(devPath, O_RDONLY | O_CLOEXEC);
+            if (fd < 0)
+                continue;
+
+            SIDeviceDescriptor desc;
+            ssize_t size = SIUsbfsReadDescriptors(fd, (uint8_t *)&desc, sizeof(desc));
+            close(fd);
+            if (size != sizeof(desc))
+                continue;
+
+            desc.bcdUSB = le16toh(desc.bcdUSB);
+            desc.idVendor = le16toh(desc.idVendor);
+            desc.idProduct = le16toh(desc.idProduct);
+            desc.bcdDevice = le16toh(desc.bcdDevice);
+            stop = visit(context, devPath, (unsigned)bus, (unsigned)dev, &desc);
+        }
+
+        closedir(devDir);
+    }
+
+    closedir(busDir);
+}
+
+typedef struct {
+    SIClient *client;
+    uint16_t vendorID;
+    uint16_t productID;
+    IOReturn ret;
+} SIUsbfsConnectSearch;
+
+static int SIUsbfsConnectVisit(void *context, char const *path, unsigned bus, unsigned dev,
+    SIDeviceDescriptor const *desc)
+{
+    SIUsbfsConnectSearch *search = context;
+    if (desc->idVendor != search->vendorID || desc->idProduct != search->productID)
+        return 0;
+
+    search->ret = SIUsbfsInitWithPath(search->client, path, ((uint64_t)bus << 16) | dev);
+    if (search->ret != kIOReturnSuccess) {
+        SIDebug("Failed to create client with %s. (%#x)", path, search->ret);
+        return 0;
+    }
+
+    return 1;
+}
+
+static IOReturn SIUsbfsConnectAt(SIClient *client, char const *root, uint16_t vendorID, uint16_t productID)
+{
+    SIUsbfsConnectSearch search = {
+        .client = client,
+        .vendorID = vendorID,
+        .productID = productID,
+        .ret = kIOReturnNoDevice,
+    };
+
+    SIUsbfsForEachDevice(root, SIUsbfsConnectVisit, &search);
+    return search.ret;
+}
+
+static IOReturn SIUsbfsConnect(SIClient *client, uint16_t vendorID, uint16_t productID)
+{
+    return SIUsbfsConnectAt(client, kSIUsbfsRoot, vendorID, productID);
+}
+
+IOReturn SIConnectAt(SIClient *client, char const *usbfsRoot, uint16_t vendorID, uint16_t productID)
+{
+    SIDebug("Attempting to connect to device %#x:%#x under %s...", vendorID, productID, usbfsRoot);
+
+    if (client->backend != &kSIBackendUsbfs)
+        return kIOReturnUnsupported;
+    if (client->handle)
+        return kIOReturnExclusiveAccess;
+
+    SIInvalidateDescriptors(client);
+    IOReturn ret = SIUsbfsConnectAt(client, usbfsRoot, vendorID, productID);
+    SITrace(kSITraceConnect, vendorID, productID, ret, 0);
+    return ret;
+}
+
+// Root of the sysfs mount, where device attributes are read from.
+#define kSISysfsRoot "/sys"
+
+// usbfs nodes are character devices with this major number, and minor
+// numbers assigned from the bus and device numbers.
+#define kSIUsbDeviceMajor 189
+#define kSIUsbDeviceMinor(bus, dev) (((bus) - 1) * 128 + (dev) - 1)
+
+// Bus and device numbers which hotplug monitors can keep track of.
+#define kSIHotplugBusesMax 256
+#define kSIHotplugDevicesMax 128
+
+// Largest uevent the kernel sends.
+#define kSIUeventSizeMax 0x2000
+
+struct SIHotplugMonitor {
+    SIFilterSet const *filters;
+    SIAsyncCallbacks callbacks;
+    int fd; ///< Netlink socket receiving kernel uevents.
+    uint8_t connected[kSIHotplugBusesMax * kSIHotplugDevicesMax / 8];
+};
+
+/// Read a sysfs attribute, relative to a directory descriptor.
+static ssize_t SISysfsRead(int dirFD, char const *name, void *buffer, size_t size)
+{
+    int fd = openat(dirFD, name, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+
+    size_t total = 0;
+    while (total < size) {
+        ssize_t length = read(fd, (uint8_t *)buffer + total, size - total);
+        if (length < 0 && errno == EINTR)
+            continue;
+        if (length <= 0)
+            break;
+        total += (size_t)length;
+    }
+
+    close(fd);
+    return (ssize_t)total;
+}
+
+/// Read a text attribute from sysfs, without its trailing newline.
+static ssize_t SISysfsReadString(int dirFD, char const *name, char *buffer, size_t size)
+{
+    ssize_t length = SISysfsRead(dirFD, name, buffer, size - 1);
+    if (length < 0)
+        return -1;
+
+    if (length > 0 && buffer[length - 1] == '\n')
+        length--;
+    buffer[length] = 0;
+    return length;
+}
+
+/// Collect the device class and every interface class from a device's
+/// descriptors, as read from usbfs or sysfs.
+static size_t SICollectClasses(uint8_t const *desc, size_t size, uint8_t *classes, size_t maxClasses)
+{
+    if (size < sizeof(SIDeviceDescriptor) || !maxClasses)
+        return 0;
+
+    size_t numClasses = 0;
+    classes[numClasses++] = ((SIDeviceDescriptor const *)desc)->bDeviceClass;
+
+    // Configuration blobs follow the device descriptor back-to-back.
+    size_t offset = desc[0];
+    while (offset + sizeof(SIConfigDescriptor) <= size) {
+        size_t total = desc[offset + 2] | desc[offset + 3] << 8;
+        if (total < sizeof(SIConfigDescriptor))
+            break;
+
+        SIDescriptorIterator it;
+        SIDescriptorIteratorInit(&it, desc + offset, total < size - offset ? total : size - offset);
+
+        SIInterfaceDescriptor const *interface;
+        while ((interface = SIDescriptorIteratorNextInterface(&it)) && numClasses < maxClasses)
+            classes[numClasses++] = interface->bInterfaceClass;
+        offset += total;
+    }
+
+    return numClasses;
+}
+
+/// Device being matched by a hotplug monitor; see 'SIHotplugLoad'.
+typedef struct {
+    unsigned bus;
+    unsigned dev;
+    uint8_t classes[1 + 32];
+    char serialNumber[0x100];
+} SIHotplugDevice;
+
+/// Fill in the classes and serial number of a device being matched.
+static void SIHotplugLoad(SIFilterSubject *subject, uint32_t what)
+{
+    SIHotplugDevice *device = subject->context;
+    char path[0x100];
+
+    if (what & kSIFilterMatchClass) {
+        // The descriptors can be read from the node without claiming it.
+        snprintf(path, sizeof(path), "%s/%03u/%03u", kSIUsbfsRoot, device->bus, device->dev);
+        uint8_t desc[0x1000];
+        ssize_t size = -1;
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd >= 0) {
+            size = SIUsbfsReadDescriptors(fd, desc, sizeof(desc));
+            close(fd);
+        }
+
+        subject->classes = device->classes;
+        subject->numClasses = size > 0 ? SICollectClasses(desc, (size_t)size, device->classes, sizeof(device->classes)) : 0;
+    }
+
+    if (what & kSIFilterMatchSerial) {
+        snprintf(path, sizeof(path), "%s/dev/char/%u:%u/serial", kSISysfsRoot, kSIUsbDeviceMajor,
+            kSIUsbDeviceMinor(device->bus, device->dev));
+
+        ssize_t length = SISysfsReadString(AT_FDCWD, path, device->serialNumber, sizeof(device->serialNumber));
+        subject->serialNumber = length > 0 ? device->serialNumber : NULL;
+    }
+}
+
+static int SIHotplugIsTracked(unsigned bus, unsigned dev)
+{
+    return bus < kSIHotplugBusesMax && dev >= 1 && dev <= kSIHotplugDevicesMax;
+}
+
+#define SIHotplugBit(bus, dev) ((bus) * kSIHotplugDevicesMax + (dev) - 1)
+
+/// Connect to a newly seen device, if it matches.
+static void SIHotplugAdd(SIHotplugMonitor *monitor, unsigned bus, unsigned dev, uint16_t vendorID,
+    uint16_t productID)
+{
+    if (!SIHotplugIsTracked(bus, dev))
+        return;
+
+    unsigned bit = SIHotplugBit(bus, dev);
+    if (monitor->connected[bit / 8] & (1 << (bit % 8)))
+        return;
+
+    SIHotplugDevice device = { .bus = bus, .dev = dev };
+    SIFilterSubject subject = {
+        .vendorID = vendorID,
+        .productID = productID,
+        .load = SIHotplugLoad,
+        .context = &device,
+    };
+    if (!SIFilterSetMatchSubject(monitor->filters, &subject))
+        return;
+
+    char path[0x100];
+    snprintf(path, sizeof(path), "%s/%03u/%03u", kSIUsbfsRoot, bus, dev);
+
+    SIClient *client = SIClientCreateWithBackend(&kSIBackendUsbfs);
+    if (!client)
+        return;
+
+    IOReturn ret = SIUsbfsInitWithPath(client, path, ((uint64_t)bus << 16) | dev);
+    if (ret != kIOReturnSuccess) {
+        SIDebug("Failed to create client with %s. (%#x)", path, ret);
+        SIClientDestroy(client);
+        return;
+    }
+
+    monitor->connected[bit / 8] |= (uint8_t)(1 << (bit % 8));
+    if (monitor->callbacks.connect)
+        monitor->callbacks.connect(client);
+}
+
+static void SIHotplugRemove(SIHotplugMonitor *monitor, unsigned bus, unsigned dev)
+{
+    if (!SIHotplugIsTracked(bus, dev))
+        return;
+
+    unsigned bit = SIHotplugBit(bus, dev);
+    if (!(monitor->connected[bit / 8] & (1 << (bit % 8))))
+        return;
+
+    monitor->connected[bit / 8] &= (uint8_t) ~(1 << (bit % 8));
+    if (monitor->callbacks.disconnect)
+        monitor->callbacks.disconnect(((uint64_t)bus << 16) | dev);
+}
+
+static int SIHotplugScanVisit(void *context, char const *path, unsigned bus, unsigned dev,
+    SIDeviceDescriptor const *desc)
+{
+    (void)path;
+    SIHotplugAdd(context, bus, dev, desc->idVendor, desc->idProduct);
+    return 0;
+}
+
+/// Bring the monitor up to date with the devices actually present, for
+/// when uevents may have been missed.
+static void SIHotplugRescan(SIHotplugMonitor *monitor)
+{
+    for (unsigned bit = 0; bit < sizeof(monitor->connected) * 8; ++bit) {
+        if (!(monitor->connected[bit / 8] & (1 << (bit % 8))))
+            continue;
+
+        unsigned bus = bit / kSIHotplugDevicesMax, dev = bit % kSIHotplugDevicesMax + 1;
+        char path[0x100];
+        snprintf(path, sizeof(path), "%s/%03u/%03u", kSIUsbfsRoot, bus, dev);
+        if (access(path, F_OK) != 0)
+            SIHotplugRemove(monitor, bus, dev);
+    }
+
+    SIUsbfsForEachDevice(kSIUsbfsRoot, SIHotplugScanVisit, monitor);
+}
+
+/// Handle one uevent: an "ACTION@DEVPATH" header followed by KEY=VALUE
+/// pairs, all NUL-terminated.
+static void SIHotplugProcess(SIHotplugMonitor *monitor, char const *event, size_t length)
+{
+    char const *action = NULL, *subsystem = NULL, *type = NULL, *product = NULL;
+    char const *busNumber = NULL, *devNumber = NULL;
+
+    for (char const *field = event, *end = event + length; field < end; field += strnlen(field, (size_t)(end - field)) + 1) {
+        if (!strncmp(field, "ACTION=", 7))
+            action = field + 7;
+        else if (!strncmp(field, "SUBSYSTEM=", 10))
+            subsystem = field + 10;
+        else if (!strncmp(field, "DEVTYPE=", 8))
+            type = field + 8;
+        else if (!strncmp(field, "PRODUCT=", 8))
+            product = field + 8;
+        else if (!strncmp(field, "BUSNUM=", 7))
+            busNumber = field + 7;
+        else if (!strncmp(field, "DEVNUM=", 7))
+            devNumber = field + 7;
+    }
+
+    // Interfaces get uevents of their own, which aren't of interest.
+    if (!action || !subsystem || !type || !busNumber || !devNumber || strcmp(subsystem, "usb") != 0
+        || strcmp(type, "usb_device") != 0)
+        return;
+
+    unsigned bus = (unsigned)strtoul(busNumber, NULL, 10);
+    unsigned dev = (unsigned)strtoul(devNumber, NULL, 10);
+
+    if (!strcmp(action, "add") && product) {
+        // PRODUCT is "vendor/product/bcdDevice", in hex without padding.
+        char *end;
+        unsigned long vendorID = strtoul(product, &end, 16);
+        if (*end != '/')
+            return;
+
+        unsigned long productID = strtoul(end + 1, &end, 16);
+        SIDebug("Device %03u/%03u (%04lx:%04lx) arrived.", bus, dev, vendorID, productID);
+        SIHotplugAdd(monitor, bus, dev, (uint16_t)vendorID, (uint16_t)productID);
+    } else if (!strcmp(action, "remove")) {
+        SIDebug("Device %03u/%03u went away.", bus, dev);
+        SIHotplugRemove(monitor, bus, dev);
+    }
+}
+
+IOReturn SIHotplugMonitorCreate(SIFilterSet const *filters, SIAsyncCallbacks const *callbacks,
+    SIHotplugMonitor **monitorOut)
+{
+    SIHotplugMonitor *monitor = calloc(1, sizeof(SIHotplugMonitor));
+    if (!monitor)
+        return kIOReturnNoMemory;
+
+    monitor->filters = filters;
+    monitor->callbacks = *callbacks;
+
+    monitor->fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, NETLINK_KOBJECT_UEVENT);
+    if (monitor->fd < 0) {
+        IOReturn ret = SIReturnFromErrno(errno);
+        SIDebug("Failed to open uevent socket. (%#x)", ret);
+        free(monitor);
+        return ret;
+    }
+
+    // Group 1 carries the kernel's own uevents, as opposed to udev's.
+    struct sockaddr_nl addr = { .nl_family = AF_NETLINK, .nl_groups = 1 };
+    if (bind(monitor->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        IOReturn ret = SIReturnFromErrno(errno);
+        SIDebug("Failed to bind uevent socket. (%#x)", ret);
+        close(monitor->fd);
+        free(monitor);
+        return ret;
+    }
+
+    // Plugging in a hub can produce a burst of events.
+    int bufferSize = 1 << 20;
+    setsockopt(monitor->fd, SOL_SOCKET, SO_RCVBUF, &bufferSize, sizeof(bufferSize));
+
+    // Now that nothing can be missed, pick up what's already there. Anything
+    // which arrives meanwhile is reported once, since it's marked connected.
+    SIHotplugRescan(monitor);
+
+    *monitorOut = monitor;
+    return kIOReturnSuccess;
+}
+
+void SIHotplugMonitorDestroy(SIHotplugMonitor *monitor)
+{
+    close(monitor->fd);
+    free(monitor);
+}
+
+int SIHotplugMonitorGetFD(SIHotplugMonitor *monitor)
+{
+    return monitor->fd;
+}
+
+IOReturn SIHotplugMonitorHandleEvents(SIHotplugMonitor *monitor, int timeoutMs)
+{
+    struct pollfd pfd = { .fd = monitor->fd, .events = POLLIN };
+    int ready = poll(&pfd, 1, timeoutMs);
+    if (ready < 0)
+        return errno == EINTR ? kIOReturnSuccess : SIReturnFromErrno(errno);
+
+    for (;;) {
+        char event[kSIUeventSizeMax];
+        struct sockaddr_nl sender;
+        struct iovec iov = { .iov_base = event, .iov_len = sizeof(event) - 1 };
+        struct msghdr msg = { .msg_name = &sender, .msg_namelen = sizeof(sender), .msg_iov = &iov, .msg_iovlen = 1 };
+
+        ssize_t length = recvmsg(monitor->fd, &msg, 0);
+        if (length < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            if (errno == EINTR)
+                continue;
+
+            // The socket overflowed and events were lost.
+            if (errno == ENOBUFS) {
+                SIDebug("Missed uevents; rescanning.");
+                SIHotplugRescan(monitor);
+                continue;
+            }
+
+            return SIReturnFromErrno(errno);
+        }
+
+        // Only trust the kernel itself.
+        if (msg.msg_namelen != sizeof(sender) || sender.nl_pid != 0)
+            continue;
+
+        event[length] = 0;
+        SIHotplugProcess(monitor, event, (size_t)length);
+    }
+
+    return kIOReturnSuccess;
+}
+
+static void *SIConnectAsyncMain(void *context)
+{
+    SIHotplugMonitor *monitor = context;
+    while (SIHotplugMonitorHandleEvents(monitor, -1) == kIOReturnSuccess)
+        ;
+
+    SIDebug("Stopped watching for devices.");
+    return NULL;
+}
+
+IOReturn SIConnectAsync(uint16_t vendorID, uint16_t productID, SIAsyncCallbacks *callbacks)
+{
+    SIFilterSet *filters = SIFilterSetCreate();
+    if (!filters)
+        return kIOReturnNoMemory;
+
+    SIFilter filter = { .vendorID = vendorID, .productID = productID };
+    IOReturn ret = SIFilterSetAdd(filters, &filter);
+    if (ret != kIOReturnSuccess)
+        goto L_failed;
+
+    // Like the notifications on macOS, the monitor lives for as long as the
+    // process does.
+    SIHotplugMonitor *monitor = NULL;
+    if ((ret = SIHotplugMonitorCreate(filters, callbacks, &monitor)) != kIOReturnSuccess)
+        goto L_failed;
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, SIConnectAsyncMain, monitor) != 0) {
+        SIHotplugMonitorDestroy(monitor);
+        ret = kIOReturnNoResources;
+        goto L_failed;
+    }
+
+    pthread_detach(thread);
+    return kIOReturnSuccess;
+
+L_failed:
+    SIFilterSetDestroy(filters);
+    return ret;
+}
+
+// Largest 'descriptors' attribute read from sysfs; the kernel caps
+// configurations at 64 KiB each, but real devices come nowhere near.
+#define kSISysfsDescriptorsMax 0x10000
+
+/// Device being enumerated; see 'SIEnumerateLoad'.
+typedef struct {
+    int dirFD;
+    uint8_t const *desc;
+    size_t size;
+    int serialLoaded;
+    uint8_t classes[1 + 32];
+    char serialNumber[0x100];
+} SIEnumeratedDevice;
+
+static void SIEnumerateLoad(SIFilterSubject *subject, uint32_t what)
+{
+    SIEnumeratedDevice *device = subject->context;
+
+    if (what & kSIFilterMatchClass) {
+        subject->classes = device->classes;
+        subject->numClasses = SICollectClasses(device->desc, device->size, device->classes, sizeof(device->classes));
+    }
+
+    if (what & kSIFilterMatchSerial) {
+        ssize_t length = SISysfsReadString(device->dirFD, "serial", device->serialNumber, sizeof(device->serialNumber));
+        subject->serialNumber = length > 0 ? device->serialNumber : NULL;
+        device->serialLoaded = 1;
+    }
+}
+
+/// Device record under construction, with its strings and descriptors as
+/// offsets into the builder's data until the list is finished.
+typedef struct {
+    SIDeviceInfo info;
+    size_t path;
+    size_t serialNumber; ///< SIZE_MAX if there isn't one.
+    size_t descriptors;
+} SIDeviceRecord;
+
+typedef struct {
+    SIDeviceRecord *records;
+    size_t numRecords;
+    size_t maxRecords;
+    uint8_t *data;
+    size_t dataLength;
+    size_t dataCapacity;
+    int failed; ///< Set when appending ran out of memory.
+} SIDeviceListBuilder;
+
+/// Append bytes to a builder's data, returning their offset.
+static size_t SIDeviceListAppend(SIDeviceListBuilder *builder, void const *bytes, size_t length)
+{
+    if (builder->dataLength + length > builder->dataCapacity) {
+        size_t capacity = builder->dataCapacity ? builder->dataCapacity : 0x10000;
+        while (capacity < builder->dataLength + length)
+            capacity *= 2;
+
+        uint8_t *data = realloc(builder->data, capacity);
+        if (!data) {
+            builder->failed = 1;
+            return 0;
+        }
+        builder->data = data;
+        builder->dataCapacity = capacity;
+    }
+
+    size_t offset = builder->dataLength;
+    memcpy(builder->data + offset, bytes, length);
+    builder->dataLength += length;
+    return offset;
+}
+
+static uint8_t SISpeedFromSysfs(char const *speed)
+{
+    // Reported in Mbit/s; low speed is "1.5".
+    unsigned long mbps = strtoul(speed, NULL, 10);
+    if (mbps >= 10000)
+        return kSISpeedSuperPlus;
+    if (mbps >= 5000)
+        return kSISpeedSuper;
+    if (mbps >= 480)
+        return kSISpeedHigh;
+    if (mbps >= 12)
+        return kSISpeedFull;
+    if (mbps >= 1)
+        return kSISpeedLow;
+    return kSISpeedUnknown;
+}
+
+static int SIDeviceInfoCompare(void const *a, void const *b)
+{
+    SIDeviceInfo const *left = a, *right = b;
+    return (left->regID > right->regID) - (left->regID < right->regID);
+}
+
+/// Add the device in 'dirFD' to a list, if it matches.
+static IOReturn SIEnumerateDevice(SIDeviceListBuilder *builder, SIFilterSet const *filters, int dirFD,
+    char const *name, uint8_t *desc)
+{
+    // Everything worth filtering on is in the descriptors, so read them first.
+    ssize_t size = SISysfsRead(dirFD, "descriptors", desc, kSISysfsDescriptorsMax);
+    if (size < (ssize_t)sizeof(SIDeviceDescriptor))
+        return kIOReturnSuccess;
+
+    SIEnumeratedDevice device = { .dirFD = dirFD, .desc = desc, .size = (size_t)size };
+    SIDeviceDescriptor const *deviceDesc = (SIDeviceDescriptor const *)desc;
+    uint16_t vendorID = le16toh(deviceDesc->idVendor);
+    uint16_t productID = le16toh(deviceDesc->idProduct);
+
+    if (filters) {
+        SIFilterSubject subject = {
+            .vendorID = vendorID,
+            .productID = productID,
+            .load = SIEnumerateLoad,
+            .context = &device,
+        };
+        if (!SIFilterSetMatchSubject(filters, &subject))
+            return kIOReturnSuccess;
+    }
+
+    char busNumber[16], devNumber[16], speed[16];
+    if (SISysfsReadString(dirFD, "busnum", busNumber, sizeof(busNumber)) <= 0
+        || SISysfsReadString(dirFD, "devnum", devNumber, sizeof(devNumber)) <= 0)
+        return kIOReturnSuccess;
+    if (SISysfsReadString(dirFD, "speed", speed, sizeof(speed)) < 0)
+        speed[0] = 0;
+    if (!device.serialLoaded && SISysfsReadString(dirFD, "serial", device.serialNumber, sizeof(device.serialNumber)) < 0)
+        device.serialNumber[0] = 0;
+
+    if (builder->numRecords == builder->maxRecords) {
+        size_t maxRecords = builder->maxRecords ? builder->maxRecords * 2 : 64;
+        SIDeviceRecord *records = realloc(builder->records, maxRecords * sizeof(SIDeviceRecord));
+        if (!records)
+            return kIOReturnNoMemory;
+        builder->records = records;
+        builder->maxRecords = maxRecords;
+    }
+
+    unsigned long bus = strtoul(busNumber, NULL, 10), dev = strtoul(devNumber, NULL, 10);
+    SIDeviceRecord *record = &builder->records[builder->numRecords++];
+    *record = (SIDeviceRecord) {
+        .info = {
+            .regID = ((uint64_t)bus << 16) | dev,
+            .vendorID = vendorID,
+            .productID = productID,
+            .bus = (uint16_t)bus,
+            .address = (uint8_t)dev,
+            .speed = SISpeedFromSysfs(speed),
+            .descriptorsLength = (size_t)size,
+        },
+        .path = SIDeviceListAppend(builder, name, strlen(name) + 1),
+        .serialNumber = device.serialNumber[0]
+            ? SIDeviceListAppend(builder, device.serialNumber, strlen(device.serialNumber) + 1)
+            : SIZE_MAX,
+        .descriptors = SIDeviceListAppend(builder, desc, (size_t)size),
+    };
+
+    return builder->failed ? kIOReturnNoMemory : kIOReturnSuccess;
+}
+
+IOReturn SIEnumerateAt(char const *sysfsRoot, SIFilterSet const *filters, SIDeviceList **listOut)
+{
+    char path[0x200];
+    snprintf(path, sizeof(path), "%s/bus/usb/devices", sysfsRoot);
+
+    DIR *dir = opendir(path);
+    if (!dir) {
+        IOReturn ret = SIReturnFromErrno(errno);
+        SIDebug("Failed to open %s. (%#x)", path, ret);
+        return ret;
+    }
+
+    IOReturn ret = kIOReturnSuccess;
+    SIDeviceListBuilder builder = { 0 };
+    uint8_t *desc = malloc(kSISysfsDescriptorsMax);
+    if (!desc) {
+        ret = kIOReturnNoMemory;
+        goto L_failed;
+    }
+
+    struct dirent *entry;
+    while ((entry = readdir(dir))) {
+        // Devices are "usbN" (root hubs) or "bus-port.port...", whereas
+        // interfaces are "bus-port...:config.interface".
+        char const *name = entry->d_name;
+        if (name[0] == '.' || strchr(name, ':'))
+            continue;
+
+        int deviceFD = openat(dirfd(dir), name, O_PATH | O_DIRECTORY | O_CLOEXEC);
+        if (deviceFD < 0)
+            continue;
+
+        ret = SIEnumerateDevice(&builder, filters, deviceFD, name, desc);
+        close(deviceFD);
+        if (ret != kIOReturnSuccess)
+            goto L_failed;
+    }
+
+    // Everything goes in one allocation, so the snapshot is freed in one go.
+    size_t recordsSize = builder.numRecords * sizeof(SIDeviceInfo);
+    SIDeviceList *list = malloc(sizeof(SIDeviceList) + recordsSize + builder.dataLength);
+    if (!list) {
+        ret = kIOReturnNoMemory;
+        goto L_failed;
+    }
+
+    list->numDevices = builder.numRecords;
+    list->devices = (SIDeviceInfo *)(list + 1);
+    uint8_t *data = (uint8_t *)list->devices + recordsSize;
+    if (builder.dataLength)
+        memcpy(data, builder.data, builder.dataLength);
+
+    for (size_t i = 0; i < builder.numRecords; ++i) {
+        SIDeviceRecord const *record = &builder.records[i];
+        SIDeviceInfo *info = &list->devices[i];
+        *info = record->info;
+        info->path = (char const *)data + record->path;
+        info->serialNumber = record->serialNumber != SIZE_MAX ? (char const *)data + record->serialNumber : NULL;
+        info->descriptors = data + record->descriptors;
+    }
+    if (list->numDevices)
+        qsort(list->devices, list->numDevices, sizeof(SIDeviceInfo), SIDeviceInfoCompare);
+
+    *listOut = list;
+
+L_failed:
+    free(builder.records);
+    free(builder.data);
+    free(desc);
+    closedir(dir);
+    return ret;
+}
+
+IOReturn SIEnumerate(SIFilterSet const *filters, SIDeviceList **listOut)
+{
+    return SIEnumerateAt(kSISysfsRoot, filters, listOut);
+}
+
+static IOReturn SIUsbfsClaimInterface(SIClient *client, SIClient *target, uint8_t number)
+{
+    SIUsbfsHandle *parent = client->handle;
+
+    SIUsbfsHandle *handle = NULL;
+    IOReturn ret = SIUsbfsOpen(parent->path, &handle);
+    if (ret != kIOReturnSuccess)
+        return ret;
+
+    if ((ret = SIUsbfsClaim(handle, number)) != kIOReturnSuccess) {
+        close(handle->fd);
+        free(handle);
+        return ret;
+    }
+
+    target->handle = handle;
+    return kIOReturnSuccess;
+}
+
+static IOReturn SIUsbfsGetNumEndpoints(SIClient *client, uint8_t *numEndpoints)
+{
+    SIUsbfsHandle *handle = client->handle;
+    *numEndpoints = handle->numEndpoints;
+    return kIOReturnSuccess;
+}
+
+static IOReturn SIUsbfsGetPipe(SIClient *client, uint8_t index, SIPipeProps *pipe)
+{
+    SIUsbfsHandle *handle = client->handle;
+    if (index > handle->numEndpoints)
+        return kIOReturnBadArgument;
+
+    *pipe = handle->pipes[index];
+    return kIOReturnSuccess;
+}
+
+// Each transfer's URB lives in its 'backendData'; isochronous URBs are
+// allocated instead, since their packet descriptors have to follow them, and
+// the one in 'backendData' only holds on to them (see 'SIUsbfsURB').
+#define SIUsbfsTransferURB(transfer) ((struct usbdevfs_urb *)(transfer)->backendData)
+
+typedef char SIUsbfsURBFits[sizeof(struct usbdevfs_urb) <= sizeof(((SITransfer *)0)->backendData) ? 1 : -1];
+
+/// Submit the next URB of a transfer, picking up where the last one left off.
+static IOReturn SIUsbfsSubmitChunk(SIUsbfsHandle *handle, SITransfer *transfer)
+{
+    struct usbdevfs_urb *urb = SIUsbfsTransferURB(transfer);
+
+    if (urb->type != USBDEVFS_URB_TYPE_CONTROL) {
+        uint32_t chunkMax = (handle->caps & USBDEVFS_CAP_NO_PACKET_SIZE_LIM) ? UINT32_MAX : kSIUsbfsBulkChunkMax;
+        uint32_t remaining = transfer->length - transfer->actual;
+        urb->buffer = (uint8_t *)transfer->buffer + transfer->actual;
+        urb->buffer_length = (int)(remaining < chunkMax ? remaining : chunkMax);
+    }
+
+    urb->status = 0;
+    urb->actual_length = 0;
+    urb->usercontext = transfer;
+    if (ioctl(handle->fd, USBDEVFS_SUBMITURB, urb) < 0)
+        return SIReturnFromErrno(errno);
+
+    return kIOReturnSuccess;
+}
+
+/// Get the URB the kernel knows a transfer by.
+static struct usbdevfs_urb *SIUsbfsURB(SITransfer *transfer)
+{
+    struct usbdevfs_urb *urb = SIUsbfsTransferURB(transfer);
+    return urb->type == USBDEVFS_URB_TYPE_ISO ? urb->usercontext : urb;
+}
+
+/// Submit an isochronous transfer, to go out as soon as the pipe is free.
+static IOReturn SIUsbfsSubmitIsochronous(SIUsbfsHandle *handle, SITransfer *transfer, SIPipeProps const *props)
+{
+    if (!transfer->numPackets)
+        return kIOReturnBadArgument;
+
+    struct usbdevfs_urb *urb = calloc(1, sizeof(struct usbdevfs_urb)
+        + transfer->numPackets * sizeof(struct usbdevfs_iso_packet_desc));
+    if (!urb)
+        return kIOReturnNoMemory;
+
+    uint32_t total = 0;
+    for (uint32_t i = 0; i < transfer->numPackets; ++i) {
+        urb->iso_frame_desc[i].length = transfer->packets[i].length;
+        total += transfer->packets[i].length;
+    }
+
+    urb->type = USBDEVFS_URB_TYPE_ISO;
+    urb->endpoint = props->endpoint | (props->direction == kSIPipeDirectionIn ? 0x80 : 0);
+    urb->flags = USBDEVFS_URB_ISO_ASAP;
+    urb->buffer = transfer->buffer;
+    urb->buffer_length = (int)total;
+    urb->number_of_packets = (int)transfer->numPackets;
+    urb->usercontext = transfer;
+
+    struct usbdevfs_urb *holder = SIUsbfsTransferURB(transfer);
+    holder->type = USBDEVFS_URB_TYPE_ISO;
+    holder->usercontext = urb;
+    if (ioctl(handle->fd, USBDEVFS_SUBMITURB, urb) < 0) {
+        IOReturn ret = SIReturnFromErrno(errno);
+        free(urb);
+        return ret;
+    }
+
+    return kIOReturnSuccess;
+}
+
+/// Report an isochronous URB's packets back to its transfer, and free it.
+static void SIUsbfsCompleteIsochronous(SITransfer *transfer, struct usbdevfs_urb *urb)
+{
+    uint32_t total = 0;
+    for (uint32_t i = 0; i < transfer->numPackets; ++i) {
+        struct usbdevfs_iso_packet_desc const *desc = &urb->iso_frame_desc[i];
+        transfer->packets[i].actual = desc->actual_length;
+        transfer->packets[i].status = desc->status ? SIReturnFromErrno(-(int)desc->status) : kIOReturnSuccess;
+        total += desc->actual_length;
+    }
+
+    // The kernel doesn't say how long the pipe sat idle; late packets are
+    // reported as such ('kIOReturnIsoTooOld') instead.
+    transfer->result = (SITransferResult) {
+        .error = urb->status ? SIReturnFromErrno(-urb->status) : kIOReturnSuccess,
+        .length = total,
+    };
+    free(urb);
+}
+
+static IOReturn SIUsbfsSubmitTransfer(SITransfer *transfer)
+{
+    SIUsbfsHandle *handle = transfer->client->handle;
+    if (transfer->pipe > handle->numEndpoints)
+        return kIOReturnBadArgument;
+
+    struct usbdevfs_urb *urb = SIUsbfsTransferURB(transfer);
+    memset(urb, 0, sizeof(struct usbdevfs_urb));
+
+    SIPipeProps const *props = &handle->pipes[transfer->pipe];
+    switch (props->type) {
+    case kSIPipeTypeControl: {
+        // usbfs takes the setup packet and data stage in one buffer, just
+        // like our transfers do, but insists on the exact length.
+        SISetupPacket const *setup = transfer->buffer;
+        uint8_t const *wLength = (uint8_t const *)&setup->wLength;
+        uint32_t length = sizeof(SISetupPacket) + (wLength[0] | wLength[1] << 8);
+        if (transfer->length < length)
+            return kIOReturnBadArgument;
+
+        urb->type = USBDEVFS_URB_TYPE_CONTROL;
+        urb->buffer = transfer->buffer;
+        urb->buffer_length = (int)length;
+        break;
+    }
+    case kSIPipeTypeBulk:
+    case kSIPipeTypeInterrupt:
+        urb->type = props->type == kSIPipeTypeBulk ? USBDEVFS_URB_TYPE_BULK : USBDEVFS_URB_TYPE_INTERRUPT;
+        urb->endpoint = props->endpoint | (props->direction == kSIPipeDirectionIn ? 0x80 : 0);
+        break;
+    case kSIPipeTypeIsochronous:
+        return SIUsbfsSubmitIsochronous(handle, transfer, props);
+    default:
+        return kIOReturnUnsupported;
+    }
+
+    return SIUsbfsSubmitChunk(handle, transfer);
+}
+
+static IOReturn SIUsbfsCancelTransfer(SITransfer *transfer)
+{
+    SIUsbfsHandle *handle = transfer->client->handle;
+
+    // The kernel reports 'EINVAL' for URBs it has already finished with.
+    if (ioctl(handle->fd, USBDEVFS_DISCARDURB, SIUsbfsURB(transfer)) < 0)
+        return errno == EINVAL ? kIOReturnNotFound : SIReturnFromErrno(errno);
+
+    return kIOReturnSuccess;
+}
+
+static IOReturn SIUsbfsHandleEvents(SIClient *client, int timeoutMs)
+{
+    SIUsbfsHandle *handle = client->handle;
+
+    // The node polls writable when there are URBs to reap, and reports an
+    // error condition once the device has gone away.
+    struct pollfd pfd = { .fd = handle->fd, .events = POLLOUT };
+    int ready = poll(&pfd, 1, timeoutMs);
+    if (ready < 0)
+        return errno == EINTR ? kIOReturnSuccess : SIReturnFromErrno(errno);
+    if (ready == 0)
+        return kIOReturnSuccess;
+
+    for (;;) {
+        struct usbdevfs_urb *urb = NULL;
+        if (ioctl(handle->fd, USBDEVFS_REAPURBNDELAY, &urb) < 0) {
+            if (errno == EAGAIN || errno == EINTR)
+                break;
+
+            return SIReturnFromErrno(errno);
+        }
+
+        SITransfer *transfer = urb->usercontext;
+        if (urb->type == USBDEVFS_URB_TYPE_ISO) {
+            SIUsbfsCompleteIsochronous(transfer, urb);
+            SITransferCompleted(transfer);
+            continue;
+        }
+
+        transfer->actual += (uint32_t)urb->actual_length;
+
+        IOReturn ret = urb->status ? SIReturnFromErrno(-urb->status) : kIOReturnSuccess;
+        if (ret == kIOReturnSuccess && urb->type != USBDEVFS_URB_TYPE_CONTROL
+            && urb->actual_length == urb->buffer_length && transfer->actual < transfer->length) {
+            // More to go, and no short packet yet.
+            if ((ret = SIUsbfsSubmitChunk(handle, transfer)) == kIOReturnSuccess)
+                continue;
+        }
+
+        transfer->result = (SITransferResult) { .error = ret, .length = transfer->actual };
+        SITransferCompleted(transfer);
+    }
+
+    return kIOReturnSuccess;
+}
+
+static int SIUsbfsGetEventFD(SIClient *client, short *eventsOut)
+{
+    SIUsbfsHandle *handle = client->handle;
+    *eventsOut = POLLOUT;
+    return handle->fd;
+}
+
+static IOReturn SIUsbfsTransferSync(SIClient *client, uint8_t pipe, void *buffer, uint32_t *bufSizeInOut,
+    int direction)
+{
+    SIUsbfsHandle *handle = client->handle;
+    if (pipe == 0 || pipe > handle->numEndpoints)
+        return kIOReturnBadArgument;
+    if (handle->pipes[pipe].direction != direction)
+        return direction == kSIPipeDirectionIn ? kIOReturnNotReadable : kIOReturnNotWritable;
+
+    SITransfer transfer;
+    SITransferInit(&transfer, client, pipe, buffer, *bufSizeInOut, NULL, NULL);
+    IOReturn ret = SITransferRunSync(&transfer);
+
+    *bufSizeInOut = transfer.result.length;
+    return ret;
+}
+
+static void *SIUsbfsAllocBuffers(SIClient *client, size_t size)
+{
+    SIUsbfsHandle *handle = client->handle;
+    if (!(handle->caps & USBDEVFS_CAP_MMAP))
+        return NULL;
+
+    // The kernel backs this with DMA-able memory and uses it in place for
+    // URBs which point into it, instead of copying through its own buffer.
+    void *buffers = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, handle->fd, 0);
+    if (buffers == MAP_FAILED) {
+        SIDebug("Failed to map %zu bytes from device: %s", size, strerror(errno));
+        return NULL;
+    }
+
+    return buffers;
+}
+
+static void SIUsbfsFreeBuffers(SIClient *client, void *buffers, size_t size)
+{
+    (void)client;
+    munmap(buffers, size);
+}
+
+static IOReturn SIUsbfsReadPipe(SIClient *client, uint8_t pipe, void *buffer, uint32_t *bufSizeInOut)
+{
+    return SIUsbfsTransferSync(client, pipe, buffer, bufSizeInOut, kSIPipeDirectionIn);
+}
+
+static IOReturn SIUsbfsWritePipe(SIClient *client, uint8_t pipe, void const *buffer, uint32_t bufSize)
+{
+    return SIUsbfsTransferSync(client, pipe, (void *)buffer, &bufSize, kSIPipeDirectionOut);
+}
+
+static IOReturn SIUsbfsAbortPipe(SIClient *client, uint8_t pipe)
+{
+    SIUsbfsHandle *handle = client->handle;
+
+    // Everything in flight, synchronous or not, has already been discarded
+    // by 'SIAbortPipe'; there's nothing else to do here.
+    return pipe > handle->numEndpoints ? kIOReturnBadArgument : kIOReturnSuccess;
+}
+
+static SITransferResult SIUsbfsControlTransfer(SIClient *client, uint8_t requestType, uint8_t request,
+    uint16_t value, uint16_t index, void *data, size_t length)
+{
+    SIUsbfsHandle *handle = client->handle;
+    return SIUsbfsControl(handle->fd, requestType, request, value, index, data, length, SIControlTimeoutMs(client));
+}
+
+SIBackend const kSIBackendUsbfs = {
+    .name = "usbfs",
+    .connect = SIUsbfsConnect,
+    .disconnect = SIUsbfsDisconnect,
+    .getNumEndpoints = SIUsbfsGetNumEndpoints,
+    .getPipe = SIUsbfsGetPipe,
+    .readPipe = SIUsbfsReadPipe,
+    .writePipe = SIUsbfsWritePipe,
+    .abortPipe = SIUsbfsAbortPipe,
+    .controlTransfer = SIUsbfsControlTransfer,
+    .claimInterface = SIUsbfsClaimInterface,
+    .submitTransfer = SIUsbfsSubmitTransfer,
+    .cancelTransfer = SIUsbfsCancelTransfer,
+    .handleEvents = SIUsbfsHandleEvents,
+    .getEventFD = SIUsbfsGetEventFD,
+    .allocBuffers = SIUsbfsAllocBuffers,
+    .freeBuffers = SIUsbfsFreeBuffers,
+};
+
+#endif // __linux__
+
+#define kSISimConfigsMax 4
+#define kSISimHandlersMax 32
+#define kSISimInterfacesMax 8
+#define kSISimPipesMax 32
+
+// Returned by 'SISimDevicePipe' for pipes which don't exist.
+#define kSISimNoPipe 0xff
+
+/// A transfer queued on a simulated pipe.
+typedef struct SISimPacket {
+    struct SISimPacket *next;
+    uint32_t length;
+    uint32_t offset;
+    uint8_t data[];
+} SISimPacket;
+
+/// Simulated pipe state.
+typedef struct {
+    SISimPipeConfig config;
+    SISimPacket *head;
+    SISimPacket *tail;
+    uint64_t busyUntil; ///< Virtual bus clock, in nanoseconds.
+    uint32_t count;     ///< Transfers seen, for failure injection.
+    uint32_t aborts;    ///< Bumped by 'SIAbortPipe' to wake waiting readers.
+    SITransfer *reads;  ///< Asynchronous reads waiting for data.
+    SITransfer *readsTail;
+    uint32_t armed;     ///< Transfers waiting on the timer list.
+    uint64_t nextInterval; ///< Periodic pipes: first service interval not yet taken, or zero.
+} SISimPipe;
+
+/// Simulated transfer state, stored in 'SITransfer.backendData'.
+typedef struct {
+    SITransfer *next;
+    uint64_t deadline; ///< When the transfer completes, in nanoseconds.
+    uint8_t pipe;      ///< Pipe on the device, rather than the client.
+} SISimTransferData;
+
+#define SISimTransferData(transfer) ((SISimTransferData *)(transfer)->backendData)
+
+typedef struct {
+    uint8_t requestType;
+    uint8_t request;
+    SISimControlHandler handler;
+    void *context;
+} SISimHandlerEntry;
+
+/// Simulated interface, and where its pipes are in the device's pipe table.
+typedef struct {
+    uint8_t number;
+    uint8_t firstPipe;
+    uint8_t numEndpoints;
+} SISimInterface;
+
+/// Simulated connection state, stored in 'SIClient.handle'; there is one
+/// for each claimed interface, and all of it is guarded by the device lock.
+typedef struct SISimHandle {
+    SISimDevice *device;
+    uint8_t interface;        ///< Index into 'SISimDevice.interfaces'.
+    struct SISimHandle *next; ///< On the device's list of handles.
+
+    pthread_cond_t eventCond;   ///< Signalled when 'completed' gains transfers.
+    SITransfer *completed;      ///< Waiting to be reported by 'handleEvents'.
+    SITransfer *completedTail;
+    int eventPipe[2];           ///< Readable while there are events; created on demand.
+    int eventSignalled;         ///< Whether 'eventPipe' holds a byte.
+} SISimHandle;
+
+struct SISimDevice {
+    SIDeviceDescriptor desc;
+    uint8_t *configs[kSISimConfigsMax];
+    uint16_t configSizes[kSISimConfigsMax];
+    uint8_t numConfigs;
+    uint8_t configValue;
+    SIStringDescriptor *strings[0x100];
+
+    SISimHandlerEntry handlers[kSISimHandlersMax];
+    uint8_t numHandlers;
+
+    SISimInterface interfaces[kSISimInterfacesMax];
+    uint8_t numInterfaces;
+    uint8_t numEndpoints;             ///< Across all interfaces.
+    SIPipeProps pipes[kSISimPipesMax];
+    SISimPipe pipeState[kSISimPipesMax];
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int attached;
+    SIClient *client;     ///< Client connected to the device, if any.
+    SISimHandle *handles; ///< Connections, including claimed interfaces.
+    uint32_t claimed;     ///< Claimed interfaces, by index.
+    uint64_t regID;
+    SISimDevice *next;
+
+    pthread_t worker;           ///< Completes asynchronous transfers on time.
+    pthread_cond_t workerCond;  ///< Wakes the worker when 'timers' changes.
+    int workerStarted;
+    int stopping;
+    SITransfer *timers;         ///< In flight, ordered by deadline.
+};
+
+static pthread_mutex_t sSimRegistryLock = PTHREAD_MUTEX_INITIALIZER;
+static SISimDevice *sSimDevices = NULL;
+static uint64_t sSimNextRegID = 1;
+
+SISimDevice *SISimDeviceCreate(SIDeviceDescriptor const *desc)
+{
+    SISimDevice *device = calloc(1, sizeof(SISimDevice));
+    if (!device)
+        return NULL;
+
+    device->desc = *desc;
+    device->configValue = 1;
+    pthread_mutex_init(&device->lock, NULL);
+    pthread_cond_init(&device->cond, NULL);
+    SICondInit(&device->workerCond);
+
+    pthread_mutex_lock(&sSimRegistryLock);
+    device->regID = sSimNextRegID++;
+    pthread_mutex_unlock(&sSimRegistryLock);
+
+    return device;
+}
+
+void SISimDeviceDestroy(SISimDevice *device)
+{
+    SISimDeviceDetach(device);
+
+    if (device->workerStarted) {
+        pthread_mutex_lock(&device->lock);
+        device->stopping = 1;
+        pthread_cond_signal(&device->workerCond);
+        pthread_mutex_unlock(&device->lock);
+
+        pthread_join(device->worker, NULL);
+    }
+
+    for (uint8_t i = 0; i < device->numConfigs; ++i)
+        free(device->configs[i]);
+    for (size_t i = 0; i < 0x100; ++i)
+        free(device->strings[i]);
+
+    for (uint8_t i = 0; i < kSISimPipesMax; ++i) {
+        SISimPacket *packet = device->pipeState[i].head;
+        while (packet) {
+            SISimPacket *next = packet->next;
+            free(packet);
+            packet = next;
+        }
+    }
+
+    pthread_cond_destroy(&device->workerCond);
+    pthread_cond_destroy(&device->cond);
+    pthread_mutex_destroy(&device->lock);
+    free(device);
+}
+
+/// Lay out the pipes of every interface in a configuration, one after the
+/// other; the device lock must be held.
+static IOReturn SISimParseInterfaces(SISimDevice *device, uint8_t const *config, size_t length)
+{
+    uint8_t configValue = ((SIConfigDescriptor const *)config)->bConfigurationValue;
+    device->pipes[0] = SIControlPipeProps(&device->desc);
+    device->numEndpoints = 0;
+    device->numInterfaces = 0;
+
+    SIDescriptorIterator it;
+    SIDescriptorIteratorInit(&it, config, length);
+
+    SIInterfaceDescriptor const *desc;
+    while ((desc = SIDescriptorIteratorNextInterface(&it)) && device->numInterfaces < kSISimInterfacesMax) {
+        if (desc->bAlternateSetting != 0)
+            continue;
+
+        SIPipeProps pipes[kSIPipesMax];
+        uint8_t number = 0, numEndpoints = 0;
+        IOReturn ret = SIParsePipes(config, length, configValue, desc->bInterfaceNumber, &number, pipes,
+            &numEndpoints);
+        if (ret != kIOReturnSuccess)
+            return ret;
+        if (device->numEndpoints + numEndpoints >= kSISimPipesMax)
+            return kIOReturnNoResources;
+
+        uint8_t firstPipe = (uint8_t)(device->numEndpoints + 1);
+        device->interfaces[device->numInterfaces++] = (SISimInterface) {
+            .number = number,
+            .firstPipe = firstPipe,
+            .numEndpoints = numEndpoints,
+        };
+        memcpy(&device->pipes[firstPipe], &pipes[1], numEndpoints * sizeof(SIPipeProps));
+        device->numEndpoints += numEndpoints;
+    }
+
+    if (!device->numInterfaces) {
+        SIDebug("No interface found in configuration %u.", configValue);
+        return kIOReturnNotFound;
+    }
+
+    return kIOReturnSuccess;
+}
+
+IOReturn SISimDeviceAddConfig(SISimDevice *device, void const *config, size_t length)
+{
+    if (length < sizeof(SIConfigDescriptor) || length > UINT16_MAX)
+        return kIOReturnBadArgument;
+    if (device->numConfigs == kSISimConfigsMax)
+        return kIOReturnNoResources;
+
+    uint8_t *copy = malloc(length);
+    if (!copy)
+        return kIOReturnNoMemory;
+    memcpy(copy, config, length);
+
+    pthread_mutex_lock(&device->lock);
+    device->configs[device->numConfigs] = copy;
+    device->configSizes[device->numConfigs] = (uint16_t)length;
+    device->numConfigs++;
+
+    // Mirror the real backends, which select configuration 1 on connect.
+    SIConfigDescriptor const *header = config;
+    IOReturn ret = kIOReturnSuccess;
+    if (device->numConfigs == 1 || header->bConfigurationValue == 1) {
+        device->configValue = header->bConfigurationValue;
+        ret = SISimParseInterfaces(device, copy, length);
+    }
+    pthread_mutex_unlock(&device->lock);
+
+    return ret;
+}
+
+IOReturn SISimDeviceSetString(SISimDevice *device, uint8_t index, char const *string)
+{
+    // Decode the string to UTF-16; descriptors can hold 126 code units.
+    uint16_t units[126];
+    size_t numUnits = 0;
+    for (uint8_t const *s = (uint8_t const *)string; *s && numUnits < 126;) {
+        uint32_t cp = *s++;
+        if ((cp >= 0x80 && cp < 0xc0) || cp >= 0xf8)
+            return kIOReturnBadArgument; // Stray continuation, or no lead byte at all.
+
+        int extra = cp >= 0xf0 ? 3 : cp >= 0xe0 ? 2 : cp >= 0xc0 ? 1 : 0;
+        cp &= 0x7f >> (extra + !!extra);
+        int length = extra;
+        for (; extra > 0 && (*s & 0xc0) == 0x80; --extra)
+            cp = (cp << 6) | (*s++ & 0x3f);
+        if (extra)
+            return kIOReturnBadArgument;
+
+        // Overlong forms, surrogates and anything beyond U+10FFFF have no
+        // place in UTF-16.
+        static uint32_t const kMinimums[] = { 0, 0x80, 0x800, 0x10000 };
+        if (cp < kMinimums[length] || (cp >= 0xd800 && cp <= 0xdfff) || cp > 0x10ffff)
+            return kIOReturnBadArgument;
+
+        if (cp >= 0x10000) {
+            if (numUnits + 2 > 126)
+                break;
+            cp -= 0x10000;
+            units[numUnits++] = (uint16_t)(0xd800 | (cp >> 10));
+            units[numUnits++] = (uint16_t)(0xdc00 | (cp & 0x3ff));
+        } else {
+            units[numUnits++] = (uint16_t)cp;
+        }
+    }
+
+    size_t length = 2 + numUnits * 2;
+    SIStringDescriptor *desc = malloc(length);
+    if (!desc)
+        return kIOReturnNoMemory;
+
+    desc->bLength = (uint8_t)length;
+    desc->bDescriptorType = kSIDescriptorTypeString;
+    for (size_t i = 0; i < numUnits; ++i) {
+        uint8_t *unit = (uint8_t *)&desc->wData[i];
+        unit[0] = units[i] & 0xff;
+        unit[1] = units[i] >> 8;
+    }
+
+    pthread_mutex_lock(&device->lock);
+    free(device->strings[index]);
+    device->strings[index] = desc;
+    pthread_mutex_unlock(&device->lock);
+
+    // Provide a default language table (US English) if there isn't one.
+    if (index != 0 && !device->strings[0]) {
+        static uint8_t const sLangIDs[] = { 4, kSIDescriptorTypeString, 0x09, 0x04 };
+        SIStringDescriptor *langIDs = malloc(sizeof(sLangIDs));
+        if (!langIDs)
+            return kIOReturnNoMemory;
+        memcpy(langIDs, sLangIDs, sizeof(sLangIDs));
+
+        pthread_mutex_lock(&device->lock);
+        if (!device->strings[0])
+            device->strings[0] = langIDs;
+        else
+            free(langIDs);
+        pthread_mutex_unlock(&device->lock);
+    }
+
+    return kIOReturnSuccess;
+}
+
+IOReturn SISimDeviceAddControlHandler(SISimDevice *device, uint8_t requestType, uint8_t request,
+    SISimControlHandler handler, void *context)
+{
+    pthread_mutex_lock(&device->lock);
+    if (device->numHandlers == kSISimHandlersMax) {
+        pthread_mutex_unlock(&device->lock);
+        return kIOReturnNoResources;
+    }
+
+    device->handlers[device->numHandlers++] = (SISimHandlerEntry) {
+        .requestType = requestType,
+        .request = request,
+        .handler = handler,
+        .context = context,
+    };
+    pthread_mutex_unlock(&device->lock);
+
+    return kIOReturnSuccess;
+}
+
+IOReturn SISimDeviceConfigurePipe(SISimDevice *device, uint8_t pipe, SISimPipeConfig const *config)
+{
+    if (pipe >= kSISimPipesMax)
+        return kIOReturnBadArgument;
+
+    pthread_mutex_lock(&device->lock);
+    device->pipeState[pipe].config = *config;
+    pthread_mutex_unlock(&device->lock);
+
+    return kIOReturnSuccess;
+}
+
+/// Queue a packet on a pipe; the device lock must be held.
+static IOReturn SISimEnqueue(SISimDevice *device, uint8_t pipe, void const *data, uint32_t length)
+{
+    SISimPacket *packet = malloc(sizeof(SISimPacket) + length);
+    if (!packet)
+        return kIOReturnNoMemory;
+
+    packet->next = NULL;
+    packet->length = length;
+    packet->offset = 0;
+    memcpy(packet->data, data, length);
+
+    SISimPipe *state = &device->pipeState[pipe];
+    if (state->tail)
+        state->tail->next = packet;
+    else
+        state->head = packet;
+    state->tail = packet;
+
+    pthread_cond_broadcast(&device->cond);
+    return kIOReturnSuccess;
+}
+
+/// Copy out (part of) the packet at the head of a pipe; the device lock must
+/// be held. Returns the number of bytes copied.
+static uint32_t SISimDequeue(SISimDevice *device, uint8_t pipe, void *data, uint32_t length)
+{
+    SISimPipe *state = &device->pipeState[pipe];
+    SISimPacket *packet = state->head;
+
+    uint32_t avail = packet->length - packet->offset;
+    uint32_t copied = length < avail ? length : avail;
+    memcpy(data, packet->data + packet->offset, copied);
+    packet->offset += copied;
+
+    if (packet->offset == packet->length) {
+        state->head = packet->next;
+        if (!state->head)
+            state->tail = NULL;
+        free(packet);
+    }
+
+    return copied;
+}
+
+/// Count a transfer on a pipe, returning an error if it should fail; the
+/// device lock must be held.
+static IOReturn SISimInjectFailure(SISimPipe *state)
+{
+    SISimPipeConfig const *config = &state->config;
+
+    ++state->count;
+    if (config->failEvery && state->count % config->failEvery == 0)
+        return config->failWith ? config->failWith : kIOReturnIOError;
+
+    return kIOReturnSuccess;
+}
+
+/// Work out when a transfer of a given size completes, advancing the pipe's
+/// bus clock; the device lock must be held.
+static uint64_t SISimDeadline(SISimPipe *state, uint32_t length)
+{
+    SISimPipeConfig const *config = &state->config;
+
+    uint64_t now = SIGetTimeNs();
+    uint64_t start = state->busyUntil > now ? state->busyUntil : now;
+    uint64_t end = start;
+    if (config->bytesPerSecond)
+        end += (uint64_t)length * 1000000000ull / config->bytesPerSecond;
+    state->busyUntil = end;
+
+    return end + (uint64_t)config->latencyUs * 1000;
+}
+
+/// Make a connection's event pipe readable, if anyone is watching it; the
+/// device lock must be held.
+static void SISimSignal(SISimHandle *handle)
+{
+    if (handle->eventPipe[1] < 0 || handle->eventSignalled)
+        return;
+
+    uint8_t byte = 1;
+    if (write(handle->eventPipe[1], &byte, sizeof(byte)) == sizeof(byte))
+        handle->eventSignalled = 1;
+}
+
+/// Hand a transfer which has been completed back to its client's
+/// 'handleEvents'; the device lock must be held.
+static void SISimComplete(SITransfer *transfer)
+{
+    SISimHandle *handle = transfer->client->handle;
+
+    SISimTransferData(transfer)->next = NULL;
+    if (handle->completedTail)
+        SISimTransferData(handle->completedTail)->next = transfer;
+    else
+        handle->completed = transfer;
+    handle->completedTail = transfer;
+
+    pthread_cond_broadcast(&handle->eventCond);
+    SISimSignal(handle);
+}
+
+/// Schedule a transfer to complete at a given time; the device lock must be
+/// held.
+static void SISimArmAt(SISimDevice *device, SITransfer *transfer, uint64_t deadline)
+{
+    SISimPipe *state = &device->pipeState[SISimTransferData(transfer)->pipe];
 
-    io_iterator_t sFirstMatchIter = IO_OBJECT_NULL;
-    IOReturn ret = IOServiceAddMatchingNotification(notifyPort, kIOFirstMatchNotification, query,
-        &SIHandleFirstMatch, callbacks, &sFirstMatchIter);
-    if (ret != kIOReturnSuccess)
-        return ret;
+    // Completing early would overtake transfers already armed on the pipe.
+    if (!state->armed && deadline <= SIGetTimeNs()) {
+        SISimComplete(transfer);
+        return;
+    }
 
-    io_iterator_t sTerminatedIter = IO_OBJECT_NULL;
-    ret = IOServiceAddMatchingNotification(notifyPort, kIOTerminatedNotification, query,
-        &SIHandleTerminated, callbacks, &sTerminatedIter);
-    if (ret)
-        return ret;
+    SISimTransferData(transfer)->deadline = deadline;
+    state->armed++;
 
-    SIHandleFirstMatch(callbacks, sFirstMatchIter);
-    SIHandleTerminated(callbacks, sTerminatedIter);
+    SITransfer **it = &device->timers;
+    while (*it && SISimTransferData(*it)->deadline <= deadline)
+        it = &SISimTransferData(*it)->next;
+    SISimTransferData(transfer)->next = *it;
+    *it = transfer;
+
+    if (device->timers == transfer)
+        pthread_cond_signal(&device->workerCond);
+}
+
+/// Schedule a transfer to complete once its pipe's timing allows; the
+/// device lock must be held.
+static void SISimArm(SISimDevice *device, SITransfer *transfer, uint32_t length)
+{
+    uint8_t pipe = SISimTransferData(transfer)->pipe;
+    SISimPipe *state = &device->pipeState[pipe];
+    uint64_t deadline = SISimDeadline(state, length);
+
+    // Polled pipes hand over one read per interval, as each interval ends.
+    SIPipeProps const *props = &device->pipes[pipe];
+    if ((state->config.flags & kSISimPipePolled) && props->type == kSIPipeTypeInterrupt
+        && props->direction == kSIPipeDirectionIn) {
+        uint64_t intervalNs = SIServiceIntervalNs(props, state->config.frameUs ? state->config.frameUs : 1000);
+        uint64_t end = deadline / intervalNs + 1;
+        if (state->nextInterval > end)
+            end = state->nextInterval;
+        state->nextInterval = end + 1;
+        deadline = end * intervalNs;
+    }
+
+    SISimArmAt(device, transfer, deadline);
+}
+
+/// Satisfy asynchronous reads waiting on a pipe from its queued data; the
+/// device lock must be held.
+static void SISimFeedReads(SISimDevice *device, uint8_t pipe)
+{
+    SISimPipe *state = &device->pipeState[pipe];
+    while (state->reads && state->head) {
+        SITransfer *transfer = state->reads;
+        state->reads = SISimTransferData(transfer)->next;
+        if (!state->reads)
+            state->readsTail = NULL;
+
+        uint32_t length = SISimDequeue(device, pipe, transfer->buffer, transfer->length);
+        transfer->result = (SITransferResult) { .error = kIOReturnSuccess, .length = length };
+        SISimArm(device, transfer, length);
+    }
+}
+
+/// Remove a transfer from a singly-linked list, if present.
+static int SISimUnlink(SITransfer **list, SITransfer **tail, SITransfer *transfer)
+{
+    SITransfer *prev = NULL;
+    for (SITransfer **it = list; *it; prev = *it, it = &SISimTransferData(*it)->next) {
+        if (*it != transfer)
+            continue;
+
+        *it = SISimTransferData(transfer)->next;
+        if (tail && *tail == transfer)
+            *tail = prev;
+        return 1;
+    }
+
+    return 0;
+}
+
+static void *SISimWorker(void *context)
+{
+    SISimDevice *device = context;
+
+    pthread_mutex_lock(&device->lock);
+    while (!device->stopping) {
+        uint64_t now = SIGetTimeNs();
+        while (device->timers && SISimTransferData(device->timers)->deadline <= now) {
+            SITransfer *transfer = device->timers;
+            device->timers = SISimTransferData(transfer)->next;
+            device->pipeState[SISimTransferData(transfer)->pipe].armed--;
+            SISimComplete(transfer);
+        }
+
+        if (device->timers)
+            SICondWaitUntilNs(&device->workerCond, &device->lock, SISimTransferData(device->timers)->deadline);
+        else
+            pthread_cond_wait(&device->workerCond, &device->lock);
+    }
+    pthread_mutex_unlock(&device->lock);
+
+    return NULL;
+}
+
+IOReturn SISimDevicePush(SISimDevice *device, uint8_t pipe, void const *data, uint32_t length)
+{
+    if (pipe == 0 || pipe > device->numEndpoints || device->pipes[pipe].direction != kSIPipeDirectionIn)
+        return kIOReturnBadArgument;
+
+    pthread_mutex_lock(&device->lock);
+    IOReturn ret = SISimEnqueue(device, pipe, data, length);
+    SISimFeedReads(device, pipe);
+    pthread_mutex_unlock(&device->lock);
+
+    return ret;
+}
+
+IOReturn SISimDevicePop(SISimDevice *device, uint8_t pipe, void *data, uint32_t *lengthInOut)
+{
+    if (pipe == 0 || pipe > device->numEndpoints || device->pipes[pipe].direction != kSIPipeDirectionOut)
+        return kIOReturnBadArgument;
+
+    pthread_mutex_lock(&device->lock);
+    IOReturn ret = kIOReturnUnderrun;
+    if (device->pipeState[pipe].head) {
+        *lengthInOut = SISimDequeue(device, pipe, data, *lengthInOut);
+        ret = kIOReturnSuccess;
+    }
+    pthread_mutex_unlock(&device->lock);
+
+    return ret;
+}
+
+IOReturn SISimDeviceAttach(SISimDevice *device)
+{
+    if (!device->numConfigs)
+        return kIOReturnNotReady;
+
+    pthread_mutex_lock(&sSimRegistryLock);
+    if (!device->attached) {
+        device->attached = 1;
+        device->next = sSimDevices;
+        sSimDevices = device;
+    }
+    pthread_mutex_unlock(&sSimRegistryLock);
 
     return kIOReturnSuccess;
 }
 
-IOReturn SIGetPipe(SIClient *client, uint8_t index, SIPipeProps *pipe)
+void SISimDeviceDetach(SISimDevice *device)
 {
-    return (*client->interface)->GetPipeProperties(client->interface, index, //
-        &pipe->direction, &pipe->endpoint, &pipe->type, &pipe->max, &pipe->interval);
+    pthread_mutex_lock(&sSimRegistryLock);
+    for (SISimDevice **it = &sSimDevices; *it; it = &(*it)->next) {
+        if (*it == device) {
+            *it = device->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&sSimRegistryLock);
+
+    pthread_mutex_lock(&device->lock);
+    device->attached = 0;
+    pthread_cond_broadcast(&device->cond);
+    for (SISimHandle *handle = device->handles; handle; handle = handle->next) {
+        pthread_cond_broadcast(&handle->eventCond);
+        SISimSignal(handle);
+    }
+
+    // Anything still in flight is lost along with the device.
+    for (uint8_t i = 0; i < kSISimPipesMax; ++i) {
+        SISimPipe *state = &device->pipeState[i];
+        while (state->reads) {
+            SITransfer *transfer = state->reads;
+            state->reads = SISimTransferData(transfer)->next;
+            transfer->result = (SITransferResult) { .error = kIOReturnNoDevice, .length = 0 };
+            SISimComplete(transfer);
+        }
+        state->readsTail = NULL;
+    }
+
+    while (device->timers) {
+        SITransfer *transfer = device->timers;
+        device->timers = SISimTransferData(transfer)->next;
+        device->pipeState[SISimTransferData(transfer)->pipe].armed--;
+        transfer->result = (SITransferResult) { .error = kIOReturnNoDevice, .length = 0 };
+        SISimComplete(transfer);
+    }
+    pthread_mutex_unlock(&device->lock);
 }
 
-IOReturn SIGetAllPipes(SIClient *client, SIPipeProps *pipes, size_t *numPipes)
+/// Connect a client to one of a device's interfaces, by index; the device
+/// lock must be held.
+static IOReturn SISimHandleCreate(SISimDevice *device, uint8_t interface, SIClient *client)
 {
-    // XXX: There is actually one more endpoint than is listed here, since this
-    // count doesn't include the control endpoint (0).
-    uint8_t numEndpoints = 0;
-    IOReturn ret = (*client->interface)->GetNumEndpoints(client->interface, &numEndpoints);
-    if (ret != kIOReturnSuccess) {
-        SIDebug("Failed to get number of endpoints. (%#x)", ret);
-        return ret;
+    if (device->claimed & (1u << interface))
+        return kIOReturnExclusiveAccess;
+
+    SISimHandle *handle = calloc(1, sizeof(SISimHandle));
+    if (!handle)
+        return kIOReturnNoMemory;
+
+    handle->device = device;
+    handle->interface = interface;
+    handle->eventPipe[0] = handle->eventPipe[1] = -1;
+    SICondInit(&handle->eventCond);
+
+    handle->next = device->handles;
+    device->handles = handle;
+    device->claimed |= 1u << interface;
+
+    client->handle = handle;
+    client->regID = device->regID;
+    return kIOReturnSuccess;
+}
+
+static IOReturn SISimConnect(SIClient *client, uint16_t vendorID, uint16_t productID)
+{
+    IOReturn ret = kIOReturnNoDevice;
+
+    pthread_mutex_lock(&sSimRegistryLock);
+    for (SISimDevice *device = sSimDevices; device; device = device->next) {
+        if (device->desc.idVendor != vendorID || device->desc.idProduct != productID)
+            continue;
+
+        if (device->client) {
+            ret = kIOReturnExclusiveAccess;
+            continue;
+        }
+
+        pthread_mutex_lock(&device->lock);
+        ret = SISimHandleCreate(device, 0, client);
+        pthread_mutex_unlock(&device->lock);
+        if (ret != kIOReturnSuccess)
+            continue;
+
+        device->client = client;
+        break;
     }
+    pthread_mutex_unlock(&sSimRegistryLock);
 
-    uint8_t num = 0;
-    for (uint8_t i = 0; i <= numEndpoints; ++i) {
-        SIPipeProps pipe;
-        ret = SIGetPipe(client, i, &pipe);
-        if (ret != kIOReturnSuccess) {
-            SIDebug("Failed to get number pipe %d properties. (%#x)", i, ret);
-            return ret;
+    return ret;
+}
+
+static void SISimDisconnect(SIClient *client)
+{
+    SISimHandle *handle = client->handle;
+    SISimDevice *device = handle->device;
+
+    pthread_mutex_lock(&sSimRegistryLock);
+    if (device->client == client)
+        device->client = NULL;
+    pthread_mutex_unlock(&sSimRegistryLock);
+
+    pthread_mutex_lock(&device->lock);
+    for (SISimHandle **it = &device->handles; *it; it = &(*it)->next) {
+        if (*it == handle) {
+            *it = handle->next;
+            break;
         }
+    }
+    device->claimed &= ~(1u << handle->interface);
+    pthread_mutex_unlock(&device->lock);
+
+    if (handle->eventPipe[0] >= 0) {
+        close(handle->eventPipe[0]);
+        close(handle->eventPipe[1]);
+    }
+
+    pthread_cond_destroy(&handle->eventCond);
+    free(handle);
+    client->handle = NULL;
+}
+
+static IOReturn SISimClaimInterface(SIClient *client, SIClient *target, uint8_t number)
+{
+    SISimHandle *handle = client->handle;
+    SISimDevice *device = handle->device;
 
-        pipes[num++] = pipe;
+    pthread_mutex_lock(&device->lock);
+    IOReturn ret = kIOReturnNotFound;
+    for (uint8_t i = 0; i < device->numInterfaces; ++i) {
+        if (device->interfaces[i].number == number) {
+            ret = SISimHandleCreate(device, i, target);
+            break;
+        }
     }
+    pthread_mutex_unlock(&device->lock);
+
+    return ret;
+}
+
+/// Map a client's pipe onto the device's pipe table.
+static uint8_t SISimDevicePipe(SISimHandle *handle, uint8_t pipe)
+{
+    SISimInterface const *interface = &handle->device->interfaces[handle->interface];
+    if (pipe == 0)
+        return 0;
+    if (pipe > interface->numEndpoints)
+        return kSISimNoPipe;
+
+    return (uint8_t)(interface->firstPipe + pipe - 1);
+}
 
-    *numPipes = num;
+static IOReturn SISimGetNumEndpoints(SIClient *client, uint8_t *numEndpoints)
+{
+    SISimHandle *handle = client->handle;
+    *numEndpoints = handle->device->interfaces[handle->interface].numEndpoints;
     return kIOReturnSuccess;
 }
 
-IOReturn SIReadPipe(SIClient *client, uint8_t pipe, void *buffer, uint32_t *bufSizeInOut)
+static IOReturn SISimGetPipe(SIClient *client, uint8_t index, SIPipeProps *pipe)
+{
+    SISimHandle *handle = client->handle;
+    uint8_t devicePipe = SISimDevicePipe(handle, index);
+    if (devicePipe == kSISimNoPipe)
+        return kIOReturnBadArgument;
+
+    *pipe = handle->device->pipes[devicePipe];
+    return kIOReturnSuccess;
+}
+
+/// Take data for a read from a pipe which has some queued, or is set to
+/// autofill; the device lock must be held.
+static uint32_t SISimTakeRead(SISimDevice *device, uint8_t pipe, void *buffer, uint32_t length)
 {
-    SIDebug("Reading %d byte(s) from pipe %d...", *bufSizeInOut, pipe);
-    return (*client->interface)->ReadPipe(client->interface, pipe, buffer, bufSizeInOut);
+    SISimPipe *state = &device->pipeState[pipe];
+    if (state->head)
+        return SISimDequeue(device, pipe, buffer, length);
+
+    memset(buffer, (int)(state->count & 0xff), length);
+    return length;
 }
 
-IOReturn SIWritePipe(SIClient *client, uint8_t pipe, void const *buffer, uint32_t bufSize)
+/// Deliver data written by the host to an OUT pipe; the device lock must
+/// be held.
+static IOReturn SISimDeliver(SISimDevice *device, uint8_t pipe, void const *buffer, uint32_t length)
 {
-    SIDebug("Writing %d byte(s) to pipe %d...", bufSize, pipe);
-    return (*client->interface)->WritePipe(client->interface, pipe, (void *)buffer, bufSize);
+    SISimPipeConfig const *config = &device->pipeState[pipe].config;
+    if (config->flags & kSISimPipeDiscard)
+        return kIOReturnSuccess;
+
+    uint8_t target = config->loopback;
+    if (!target)
+        return SISimEnqueue(device, pipe, buffer, length);
+
+    if (target > device->numEndpoints || device->pipes[target].direction != kSIPipeDirectionIn)
+        return kIOReturnBadArgument;
+
+    IOReturn ret = SISimEnqueue(device, target, buffer, length);
+    SISimFeedReads(device, target);
+    return ret;
 }
 
-IOReturn SIAbortPipe(SIClient *client, uint8_t pipe)
+/// Carry out an isochronous transfer, scheduling its packets on the pipe's
+/// frame clock; the device lock must be held.
+static IOReturn SISimIsochronous(SISimDevice *device, uint8_t pipe, SITransfer *transfer)
 {
-    SIDebug("Aborting pipe %d...", pipe);
-    return (*client->interface)->AbortPipe(client->interface, pipe);
+    SIPipeProps const *props = &device->pipes[pipe];
+    SISimPipe *state = &device->pipeState[pipe];
+    if (!transfer->numPackets)
+        return kIOReturnBadArgument;
+    for (uint32_t i = 0; i < transfer->numPackets && props->direction == kSIPipeDirectionOut; ++i) {
+        if (transfer->packets[i].length > props->max)
+            return kIOReturnBadArgument;
+    }
+
+    uint8_t *data = transfer->buffer;
+    uint32_t total = 0;
+    for (uint32_t i = 0; i < transfer->numPackets; ++i) {
+        SIIsoPacket *packet = &transfer->packets[i];
+        uint32_t length = packet->length < props->max ? packet->length : props->max;
+
+        if ((packet->status = SISimInjectFailure(state)) != kIOReturnSuccess)
+            length = 0;
+        else if (props->direction == kSIPipeDirectionOut)
+            packet->status = SISimDeliver(device, pipe, data, length);
+        else if (state->head || (state->config.flags & kSISimPipeAutofill))
+            length = SISimTakeRead(device, pipe, data, length);
+        else
+            length = 0;
+
+        packet->actual = packet->status == kIOReturnSuccess ? length : 0;
+        total += packet->actual;
+        data += packet->length;
+    }
+
+    // Packets go out one per interval, starting with the one after the
+    // interval in progress, or straight after those already queued.
+    uint64_t intervalNs = SIServiceIntervalNs(props, state->config.frameUs ? state->config.frameUs : 1000);
+    uint64_t first = SIGetTimeNs() / intervalNs + 1;
+    if (state->nextInterval >= first)
+        first = state->nextInterval;
+    else if (state->nextInterval)
+        transfer->missedFrames = (uint32_t)(first - state->nextInterval < UINT32_MAX ? first - state->nextInterval
+                                                                                     : UINT32_MAX);
+    state->nextInterval = first + transfer->numPackets;
+
+    transfer->result = (SITransferResult) { .error = kIOReturnSuccess, .length = total };
+    SISimArmAt(device, transfer, state->nextInterval * intervalNs + (uint64_t)state->config.latencyUs * 1000);
+    return kIOReturnSuccess;
 }
 
-#define kSIRequestTimeoutDefault 6
+static IOReturn SISimReadPipe(SIClient *client, uint8_t pipe, void *buffer, uint32_t *bufSizeInOut)
+{
+    SISimHandle *handle = client->handle;
+    SISimDevice *device = handle->device;
+    if (pipe == 0 || (pipe = SISimDevicePipe(handle, pipe)) == kSISimNoPipe)
+        return kIOReturnBadArgument;
+    if (device->pipes[pipe].direction != kSIPipeDirectionIn)
+        return kIOReturnNotReadable;
+    if (device->pipes[pipe].type == kSIPipeTypeIsochronous)
+        return kIOReturnUnsupported;
 
-SITransferResult SIControlTransfer(SIClient *client, uint8_t requestType, uint8_t request,
+    SISimPipe *state = &device->pipeState[pipe];
+    IOReturn ret = kIOReturnSuccess;
+    uint32_t length = 0;
+    uint64_t deadline = 0;
+
+    pthread_mutex_lock(&device->lock);
+    uint32_t aborts = state->aborts;
+    while (device->attached && state->aborts == aborts && !state->head
+        && !(state->config.flags & kSISimPipeAutofill))
+        pthread_cond_wait(&device->cond, &device->lock);
+
+    if (!device->attached) {
+        ret = kIOReturnNoDevice;
+    } else if (state->aborts != aborts) {
+        ret = kIOReturnAborted;
+    } else {
+        if ((ret = SISimInjectFailure(state)) == kIOReturnSuccess)
+            length = SISimTakeRead(device, pipe, buffer, *bufSizeInOut);
+        deadline = SISimDeadline(state, length);
+    }
+    pthread_mutex_unlock(&device->lock);
+
+    SISleepUntilNs(deadline);
+
+    *bufSizeInOut = length;
+    return ret;
+}
+
+static IOReturn SISimWritePipe(SIClient *client, uint8_t pipe, void const *buffer, uint32_t bufSize)
+{
+    SISimHandle *handle = client->handle;
+    SISimDevice *device = handle->device;
+    if (pipe == 0 || (pipe = SISimDevicePipe(handle, pipe)) == kSISimNoPipe)
+        return kIOReturnBadArgument;
+    if (device->pipes[pipe].direction != kSIPipeDirectionOut)
+        return kIOReturnNotWritable;
+    if (device->pipes[pipe].type == kSIPipeTypeIsochronous)
+        return kIOReturnUnsupported;
+
+    SISimPipe *state = &device->pipeState[pipe];
+    IOReturn ret = kIOReturnNoDevice;
+    uint64_t deadline = 0;
+
+    pthread_mutex_lock(&device->lock);
+    if (device->attached) {
+        if ((ret = SISimInjectFailure(state)) == kIOReturnSuccess)
+            ret = SISimDeliver(device, pipe, buffer, bufSize);
+        deadline = SISimDeadline(state, ret == kIOReturnSuccess ? bufSize : 0);
+    }
+    pthread_mutex_unlock(&device->lock);
+
+    SISleepUntilNs(deadline);
+    return ret;
+}
+
+static IOReturn SISimAbortPipe(SIClient *client, uint8_t pipe)
+{
+    SISimHandle *handle = client->handle;
+    SISimDevice *device = handle->device;
+    if ((pipe = SISimDevicePipe(handle, pipe)) == kSISimNoPipe)
+        return kIOReturnBadArgument;
+
+    pthread_mutex_lock(&device->lock);
+    device->pipeState[pipe].aborts++;
+    pthread_cond_broadcast(&device->cond);
+    pthread_mutex_unlock(&device->lock);
+
+    return kIOReturnSuccess;
+}
+
+/// Answer the standard requests a device handles on its own; the device
+/// lock must be held. Returns false if the request isn't one of them.
+static int SISimStandardRequest(SISimDevice *device, uint8_t requestType, uint8_t request,
+    uint16_t value, void *data, size_t length, SITransferResult *result)
+{
+    if ((requestType & 0x7f) != (kSITypeStandard | kSIRecipientDevice))
+        return 0;
+
+    void const *reply = NULL;
+    size_t replySize = 0;
+    switch (request) {
+    case kSIRequestGetDescriptor: {
+        uint8_t type = value >> 8, index = value & 0xff;
+        if (type == kSIDescriptorTypeDevice) {
+            reply = &device->desc;
+            replySize = sizeof(device->desc);
+        } else if (type == kSIDescriptorTypeConfig && index < device->numConfigs) {
+            reply = device->configs[index];
+            replySize = device->configSizes[index];
+        } else if (type == kSIDescriptorTypeString && device->strings[index]) {
+            reply = device->strings[index];
+            replySize = device->strings[index]->bLength;
+        } else {
+            *result = (SITransferResult) { .error = kIOUSBPipeStalled, .length = 0 };
+            return 1;
+        }
+        break;
+    }
+    case kSIRequestGetConfiguration:
+        reply = &device->configValue;
+        replySize = 1;
+        break;
+    case kSIRequestSetConfiguration:
+        device->configValue = value & 0xff;
+        *result = (SITransferResult) { .error = kIOReturnSuccess, .length = 0 };
+        return 1;
+    case kSIRequestGetStatus: {
+        static uint8_t const sStatus[2] = { 0 };
+        reply = sStatus;
+        replySize = sizeof(sStatus);
+        break;
+    }
+    default:
+        return 0;
+    }
+
+    size_t copied = length < replySize ? length : replySize;
+    memcpy(data, reply, copied);
+    *result = (SITransferResult) { .error = kIOReturnSuccess, .length = (uint32_t)copied };
+    return 1;
+}
+
+/// Answer a control request, either directly or through a handler.
+static SITransferResult SISimControlRequest(SISimDevice *device, uint8_t requestType, uint8_t request,
     uint16_t value, uint16_t index, void *data, size_t length)
 {
-    // Use the global null buffer if no data pointer is passed in but a
-    // non-zero length is specified.
-    if (length > 0 && data == NULL) {
-        static char sNullBuffer[0x1000] = { 0 };
-        memset(sNullBuffer, 0, sizeof sNullBuffer);
-        data = &sNullBuffer;
+    SITransferResult result = { .error = kIOUSBPipeStalled, .length = 0 };
+    SISimHandlerEntry entry = { 0 };
+
+    pthread_mutex_lock(&device->lock);
+    if (!SISimStandardRequest(device, requestType, request, value, data, length, &result)) {
+        for (uint8_t i = 0; i < device->numHandlers; ++i) {
+            if (device->handlers[i].requestType == requestType && device->handlers[i].request == request) {
+                entry = device->handlers[i];
+                break;
+            }
+        }
     }
+    pthread_mutex_unlock(&device->lock);
 
-    SIDebug("Performing control transfer: %#x, %#x, %#x, %#x, %p, %#zx", requestType, request,
-        value, index, data, length);
+    // Handlers run unlocked, so they are free to push data to pipes.
+    if (entry.handler)
+        result = entry.handler(entry.context, requestType, request, value, index, data, length);
 
-    IOUSBDevRequestTO req;
-    req.wLenDone = 0;
-    req.pData = data;
-    req.bRequest = request;
-    req.bmRequestType = requestType;
-    req.wLength = OSSwapLittleToHostInt16(length);
-    req.wValue = OSSwapLittleToHostInt16(value);
-    req.wIndex = OSSwapLittleToHostInt16(index);
-    req.completionTimeout = kSIRequestTimeoutDefault;
-    req.noDataTimeout = kSIRequestTimeoutDefault;
+    return result;
+}
 
-    IOReturn error = (*client->device)->DeviceRequestTO(client->device, &req);
-    return (SITransferResult) { .error = error, .length = req.wLenDone };
+static SITransferResult SISimControlTransfer(SIClient *client, uint8_t requestType, uint8_t request,
+    uint16_t value, uint16_t index, void *data, size_t length)
+{
+    SISimDevice *device = ((SISimHandle *)client->handle)->device;
+    SISimPipe *state = &device->pipeState[0];
+
+    pthread_mutex_lock(&device->lock);
+    if (!device->attached) {
+        pthread_mutex_unlock(&device->lock);
+        return (SITransferResult) { .error = kIOReturnNoDevice, .length = 0 };
+    }
+
+    IOReturn injected = SISimInjectFailure(state);
+    uint64_t deadline = SISimDeadline(state, injected == kIOReturnSuccess ? (uint32_t)length : 0);
+    pthread_mutex_unlock(&device->lock);
+
+    SITransferResult result = { .error = injected, .length = 0 };
+    if (injected == kIOReturnSuccess)
+        result = SISimControlRequest(device, requestType, request, value, index, data, length);
+
+    SISleepUntilNs(deadline);
+    return result;
 }
 
-SITransferResult SIGetDescriptor(SIClient *client, SIDescriptorType type, uint8_t index,
-    void *descOut, size_t bufSize)
+static IOReturn SISimSubmitTransfer(SITransfer *transfer)
 {
-    return SIControlTransfer(client,
-        kSIDirectionToHost | kSITypeStandard | kSIRecipientDevice,
-        kSIRequestGetDescriptor, (type << 8) | index,
-        type == kSIDescriptorTypeString ? /* US English */ 0x409 : 0,
-        descOut, bufSize);
+    SISimHandle *handle = transfer->client->handle;
+    SISimDevice *device = handle->device;
+    uint8_t pipe = SISimDevicePipe(handle, transfer->pipe);
+    if (pipe == kSISimNoPipe)
+        return kIOReturnBadArgument;
+
+    // The pipe is only touched under the lock, since 'SIAbortPipe' may try
+    // to cancel the transfer before it gets here.
+    pthread_mutex_lock(&device->lock);
+    if (!device->attached) {
+        pthread_mutex_unlock(&device->lock);
+        return kIOReturnNoDevice;
+    }
+    SISimTransferData(transfer)->pipe = pipe;
+
+    if (!device->workerStarted) {
+        if (pthread_create(&device->worker, NULL, SISimWorker, device) != 0) {
+            pthread_mutex_unlock(&device->lock);
+            return kIOReturnNoResources;
+        }
+
+        device->workerStarted = 1;
+    }
+
+    SISimPipe *state = &device->pipeState[pipe];
+    if (device->pipes[pipe].type == kSIPipeTypeIsochronous) {
+        IOReturn ret = SISimIsochronous(device, pipe, transfer);
+        pthread_mutex_unlock(&device->lock);
+        return ret;
+    }
+
+    IOReturn error = SISimInjectFailure(state);
+    if (error != kIOReturnSuccess) {
+        transfer->result = (SITransferResult) { .error = error, .length = 0 };
+        SISimArm(device, transfer, 0);
+    } else if (pipe == 0) {
+        uint8_t const *setup = transfer->buffer;
+        size_t length = (size_t)(setup[6] | setup[7] << 8);
+        if (length > transfer->length - sizeof(SISetupPacket))
+            length = transfer->length - sizeof(SISetupPacket);
+
+        pthread_mutex_unlock(&device->lock);
+        SITransferResult result = SISimControlRequest(device, setup[0], setup[1],
+            (uint16_t)(setup[2] | setup[3] << 8), (uint16_t)(setup[4] | setup[5] << 8),
+            (uint8_t *)transfer->buffer + sizeof(SISetupPacket), length);
+        pthread_mutex_lock(&device->lock);
+
+        transfer->result = result;
+        SISimArm(device, transfer, result.length);
+    } else if (device->pipes[pipe].direction == kSIPipeDirectionIn) {
+        if (state->head || (state->config.flags & kSISimPipeAutofill)) {
+            uint32_t length = SISimTakeRead(device, pipe, transfer->buffer, transfer->length);
+            transfer->result = (SITransferResult) { .error = kIOReturnSuccess, .length = length };
+            SISimArm(device, transfer, length);
+        } else {
+            SISimTransferData(transfer)->next = NULL;
+            if (state->readsTail)
+                SISimTransferData(state->readsTail)->next = transfer;
+            else
+                state->reads = transfer;
+            state->readsTail = transfer;
+        }
+    } else {
+        error = SISimDeliver(device, pipe, transfer->buffer, transfer->length);
+        transfer->result = (SITransferResult) {
+            .error = error,
+            .length = error == kIOReturnSuccess ? transfer->length : 0,
+        };
+        SISimArm(device, transfer, transfer->result.length);
+    }
+    pthread_mutex_unlock(&device->lock);
+
+    return kIOReturnSuccess;
 }
 
-int SIDecodeStringDescriptor(SIStringDescriptor *desc, char *out, size_t outSize)
+static IOReturn SISimCancelTransfer(SITransfer *transfer)
 {
-    if (outSize < desc->bLength)
-        return 0;
+    SISimDevice *device = ((SISimHandle *)transfer->client->handle)->device;
+
+    pthread_mutex_lock(&device->lock);
+    SISimPipe *state = &device->pipeState[SISimTransferData(transfer)->pipe];
+    int found = SISimUnlink(&state->reads, &state->readsTail, transfer);
+    if (!found && SISimUnlink(&device->timers, NULL, transfer)) {
+        state->armed--;
+        found = 1;
+    }
+
+    if (found) {
+        transfer->result = (SITransferResult) { .error = kIOReturnAborted, .length = 0 };
+        SISimComplete(transfer);
+    }
+    pthread_mutex_unlock(&device->lock);
+
+    return found ? kIOReturnSuccess : kIOReturnNotFound;
+}
+
+static IOReturn SISimHandleEvents(SIClient *client, int timeoutMs)
+{
+    SISimHandle *handle = client->handle;
+    SISimDevice *device = handle->device;
+    uint64_t deadline = timeoutMs > 0 ? SIGetTimeNs() + (uint64_t)timeoutMs * 1000000 : 0;
+
+    pthread_mutex_lock(&device->lock);
+    while (!handle->completed) {
+        if (!device->attached) {
+            pthread_mutex_unlock(&device->lock);
+            return kIOReturnNoDevice;
+        }
 
-    int i;
-    for (i = 0; i < desc->bLength / 2; ++i)
-        out[i] = (char)(desc->wData[i] & 0xff);
-    out[i - 1] = 0;
+        if (timeoutMs == 0)
+            break;
+        if (timeoutMs < 0)
+            pthread_cond_wait(&handle->eventCond, &device->lock);
+        else if (SICondWaitUntilNs(&handle->eventCond, &device->lock, deadline) == ETIMEDOUT)
+            break;
+    }
+
+    SITransfer *transfer = handle->completed;
+    handle->completed = handle->completedTail = NULL;
+
+    // Once detached, stay readable so that the departure gets noticed.
+    if (handle->eventSignalled && device->attached) {
+        uint8_t byte;
+        if (read(handle->eventPipe[0], &byte, sizeof(byte)) == sizeof(byte))
+            handle->eventSignalled = 0;
+    }
+    pthread_mutex_unlock(&device->lock);
+
+    while (transfer) {
+        SITransfer *next = SISimTransferData(transfer)->next;
+        SITransferCompleted(transfer);
+        transfer = next;
+    }
+
+    return kIOReturnSuccess;
+}
+
+static int SISimGetEventFD(SIClient *client, short *eventsOut)
+{
+    SISimHandle *handle = client->handle;
+    SISimDevice *device = handle->device;
+
+    pthread_mutex_lock(&device->lock);
+    if (handle->eventPipe[0] < 0) {
+        int fds[2];
+        if (pipe(fds) == 0) {
+            for (int i = 0; i < 2; ++i) {
+                fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL) | O_NONBLOCK);
+                fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+            }
 
-    return i;
+            handle->eventPipe[0] = fds[0];
+            handle->eventPipe[1] = fds[1];
+            if (handle->completed || !device->attached)
+                SISimSignal(handle);
+        }
+    }
+    int fd = handle->eventPipe[0];
+    pthread_mutex_unlock(&device->lock);
+
+    *eventsOut = POLLIN;
+    return fd;
 }
+
+SIBackend const kSIBackendSimulated = {
+    .name = "simulated",
+    .connect = SISimConnect,
+    .disconnect = SISimDisconnect,
+    .getNumEndpoints = SISimGetNumEndpoints,
+    .getPipe = SISimGetPipe,
+    .readPipe = SISimReadPipe,
+    .writePipe = SISimWritePipe,
+    .abortPipe = SISimAbortPipe,
+    .controlTransfer = SISimControlTransfer,
+    .claimInterface = SISimClaimInterface,
+    .submitTransfer = SISimSubmitTransfer,
+    .cancelTransfer = SISimCancelTransfer,
+    .handleEvents = SISimHandleEvents,
+    .getEventFD = SISimGetEventFD,
+};
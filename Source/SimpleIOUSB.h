@@ -32,7 +32,46 @@
 
 #pragma once
 
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__APPLE__)
 #include <IOKit/IOTypes.h>
+#else
+/// IOKit-style return code; IOKit isn't available here, so the codes this
+/// library can return are mirrored below with their IOKit values.
+typedef int IOReturn;
+
+#define kIOReturnSuccess 0
+#define kIOReturnError ((IOReturn)0xe00002bc)
+#define kIOReturnNoMemory ((IOReturn)0xe00002bd)
+#define kIOReturnNoResources ((IOReturn)0xe00002be)
+#define kIOReturnNoDevice ((IOReturn)0xe00002c0)
+#define kIOReturnNotPrivileged ((IOReturn)0xe00002c1)
+#define kIOReturnBadArgument ((IOReturn)0xe00002c2)
+#define kIOReturnExclusiveAccess ((IOReturn)0xe00002c5)
+#define kIOReturnUnsupported ((IOReturn)0xe00002c7)
+#define kIOReturnInternalError ((IOReturn)0xe00002c9)
+#define kIOReturnIOError ((IOReturn)0xe00002ca)
+#define kIOReturnNotOpen ((IOReturn)0xe00002cd)
+#define kIOReturnNotReadable ((IOReturn)0xe00002ce)
+#define kIOReturnNotWritable ((IOReturn)0xe00002cf)
+#define kIOReturnBusy ((IOReturn)0xe00002d5)
+#define kIOReturnTimeout ((IOReturn)0xe00002d6)
+#define kIOReturnNotReady ((IOReturn)0xe00002d8)
+#define kIOReturnNoSpace ((IOReturn)0xe00002db)
+#define kIOReturnNotPermitted ((IOReturn)0xe00002e2)
+#define kIOReturnUnderrun ((IOReturn)0xe00002e7)
+#define kIOReturnOverrun ((IOReturn)0xe00002e8)
+#define kIOReturnAborted ((IOReturn)0xe00002eb)
+#define kIOReturnNoBandwidth ((IOReturn)0xe00002ec)
+#define kIOReturnNotResponding ((IOReturn)0xe00002ed)
+#define kIOReturnIsoTooOld ((IOReturn)0xe00002ee)
+#define kIOReturnIsoTooNew ((IOReturn)0xe00002ef)
+#define kIOReturnNotFound ((IOReturn)0xe00002f0)
+
+#define kIOUSBPipeStalled ((IOReturn)0xe000404f)
+#endif
 
 #ifdef __cplusplus
 extern "C" {
@@ -48,25 +87,66 @@ struct IOUSBInterfaceStruct245;
 typedef struct IOUSBInterfaceStruct245 SIInterfaceInterface;
 typedef SIInterfaceInterface **SIInterfaceHandle;
 
+typedef struct SIBackend SIBackend;
+
 /// SimpleIOUSB client type.
 ///
 /// You are discouraged from using this structure directly! This is C, so I
 /// can't stop you, but these would be private members if this were C++.
-typedef struct {
-    SIDeviceHandle device;       ///< IOUSB device handle.
-    SIInterfaceHandle interface; ///< IOUSB interface handle.
-    uint64_t regID;              ///< Registry ID of the underlying device.
+///
+/// Once connected, a client may be used from any number of threads:
+///
+/// - Each pipe has its own queue, so transfers on different pipes never wait
+///   on one another. Submitting to a pipe below its queue depth is lock-free;
+///   only transfers that have to wait for a slot take the pipe's lock.
+/// - Control transfers take no lock of the library's; the host controller
+///   runs them one at a time on the default pipe. Requests which must not be
+///   interleaved with another thread's are for the caller to serialize.
+/// - Completions are reaped by one thread at a time, and callbacks run on
+///   whichever thread that is.
+///
+/// Connecting, disconnecting and destroying the client must not race with
+/// anything else.
+typedef struct SIClient {
+    SIBackend const *backend;   ///< Transport backend servicing this client.
+    void *handle;               ///< Backend-specific connection state.
+    uint64_t regID;             ///< Registry ID of the underlying device.
+    struct SIAsyncState *async; ///< Asynchronous transfer bookkeeping.
 } SIClient;
 
-/// Create a client.
+/// Create a client using the default backend for this platform.
 SIClient *SIClientCreate(void);
 
+/// Create a client using a specific backend.
+SIClient *SIClientCreateWithBackend(SIBackend const *backend);
+
 /// Destroy a client, closing any connections if open.
 void SIClientDestroy(SIClient *client);
 
 /// Connect to a USB device by vendor & product ID.
 IOReturn SIConnect(SIClient *client, uint16_t vendorID, uint16_t productID);
 
+/// Like 'SIConnect', but for usbfs clients, looking for device nodes under
+/// 'usbfsRoot' rather than '/dev/bus/usb'. Only available on Linux.
+IOReturn SIConnectAt(SIClient *client, char const *usbfsRoot, uint16_t vendorID, uint16_t productID);
+
+/// Claim another interface of the device a client is connected to.
+///
+/// Clients are connected to the first interface of configuration 1, but
+/// composite devices often have several. Each interface claimed this way
+/// gets a client of its own, with its own pipe table, transfer queues and
+/// locks, so that interfaces can be driven from separate threads without
+/// contending with each other. Control transfers still reach the device.
+///
+/// Interface clients are released with 'SIClientDestroy', which must happen
+/// before the client they were claimed from is destroyed.
+IOReturn SIClaimInterface(SIClient *client, uint8_t number, SIClient **interfaceOut);
+
+/// Claim the first interface with a given class, subclass and protocol that
+/// isn't claimed yet, like 'SIClaimInterface'.
+IOReturn SIClaimInterfaceByClass(SIClient *client, uint8_t interfaceClass, uint8_t subClass, uint8_t protocol,
+    SIClient **interfaceOut);
+
 /// USB asynchronous connection callbacks.
 typedef struct {
     void (*connect)(SIClient *client);
@@ -74,8 +154,118 @@ typedef struct {
 } SIAsyncCallbacks;
 
 /// Connect asynchronously to a USB device by vendor & product ID.
+///
+/// On macOS, notifications are delivered through the current thread's run
+/// loop. On Linux, this starts an 'SIHotplugMonitor' with a thread of its
+/// own, which the callbacks are invoked on.
 IOReturn SIConnectAsync(uint16_t vendorID, uint16_t productID, SIAsyncCallbacks *callbacks);
 
+/// Device filter flags.
+typedef enum {
+    kSIFilterAnyProduct = 1 << 0,  ///< Match every product of the vendor.
+    kSIFilterMatchClass = 1 << 1,  ///< Also require 'deviceClass'.
+    kSIFilterMatchSerial = 1 << 2, ///< Also require 'serialNumber'.
+} SIFilterFlags;
+
+/// Device filter.
+typedef struct {
+    uint16_t vendorID;
+    uint16_t productID;
+    uint32_t flags;           ///< 'SIFilterFlags'.
+    uint8_t deviceClass;      ///< Matches the device class or any interface class.
+    char const *serialNumber; ///< Copied when the filter is added.
+} SIFilter;
+
+/// Set of device filters, hashed on vendor & product ID (and serial number,
+/// for filters requiring one), so that matching a device costs the same no
+/// matter how many filters there are.
+typedef struct SIFilterSet SIFilterSet;
+
+/// Create an empty filter set.
+SIFilterSet *SIFilterSetCreate(void);
+
+/// Destroy a filter set; monitors using it must be destroyed first.
+void SIFilterSetDestroy(SIFilterSet *set);
+
+/// Add a filter; sets in use by a monitor must not be changed.
+IOReturn SIFilterSetAdd(SIFilterSet *set, SIFilter const *filter);
+
+/// Check whether a device matches any filter in a set.
+///
+/// 'classes' holds the device class followed by its interface classes, and
+/// 'serialNumber' may be NULL if there isn't one.
+int SIFilterSetMatch(SIFilterSet const *set, uint16_t vendorID, uint16_t productID, uint8_t const *classes,
+    size_t numClasses, char const *serialNumber);
+
+/// Hotplug monitor, reporting devices which match a filter set as they come
+/// and go. Only available on Linux, where kernel uevents are read from a
+/// netlink socket.
+typedef struct SIHotplugMonitor SIHotplugMonitor;
+
+/// Create a hotplug monitor.
+///
+/// Devices which are already present and match are connected (and reported
+/// to 'callbacks->connect') before this returns. Connected clients belong to
+/// the callee, and disconnects are reported by registry ID for devices that
+/// were connected. The filter set must outlive the monitor.
+IOReturn SIHotplugMonitorCreate(SIFilterSet const *filters, SIAsyncCallbacks const *callbacks,
+    SIHotplugMonitor **monitorOut);
+
+/// Destroy a hotplug monitor.
+void SIHotplugMonitorDestroy(SIHotplugMonitor *monitor);
+
+/// Get a descriptor which polls readable while the monitor has events
+/// waiting, for use with an existing event loop.
+int SIHotplugMonitorGetFD(SIHotplugMonitor *monitor);
+
+/// Wait for hotplug events and invoke the callbacks for those that match.
+///
+/// A negative timeout waits indefinitely; zero only polls.
+IOReturn SIHotplugMonitorHandleEvents(SIHotplugMonitor *monitor, int timeoutMs);
+
+/// Device speeds.
+typedef enum {
+    kSISpeedUnknown = 0,
+    kSISpeedLow,       ///< 1.5 Mbit/s.
+    kSISpeedFull,      ///< 12 Mbit/s.
+    kSISpeedHigh,      ///< 480 Mbit/s.
+    kSISpeedSuper,     ///< 5 Gbit/s.
+    kSISpeedSuperPlus, ///< 10 Gbit/s or more.
+} SISpeed;
+
+/// Attached device, as found by 'SIEnumerate'.
+typedef struct {
+    uint64_t regID; ///< Registry ID, as a client connected to it would have.
+    uint16_t vendorID;
+    uint16_t productID;
+    uint16_t bus;
+    uint8_t address;
+    uint8_t speed;              ///< 'SISpeed'.
+    char const *path;           ///< Bus and port path, e.g. "1-2.3".
+    char const *serialNumber;   ///< NULL if the device doesn't have one.
+    uint8_t const *descriptors; ///< Device descriptor, then each configuration's.
+    size_t descriptorsLength;
+} SIDeviceInfo;
+
+/// Snapshot of attached devices, sorted by bus and address.
+typedef struct {
+    size_t numDevices;
+    SIDeviceInfo *devices;
+} SIDeviceList;
+
+/// List attached devices matching a filter set (or all of them, if NULL).
+///
+/// Unlike 'SIConnect', this doesn't open any devices, so it's cheap and
+/// leaves devices owned by other processes alone. Only available on Linux,
+/// where everything is read from sysfs.
+IOReturn SIEnumerate(SIFilterSet const *filters, SIDeviceList **listOut);
+
+/// Like 'SIEnumerate', but reading from sysfs mounted at 'sysfsRoot'.
+IOReturn SIEnumerateAt(char const *sysfsRoot, SIFilterSet const *filters, SIDeviceList **listOut);
+
+/// Free a device list, including the records' strings and descriptors.
+void SIDeviceListDestroy(SIDeviceList *list);
+
 /// Properties of a USB pipe.
 typedef struct {
     uint8_t direction;
@@ -85,23 +275,100 @@ typedef struct {
     uint8_t interval;
 } SIPipeProps;
 
+/// Pipe directions, as reported by 'SIPipeProps.direction'.
+typedef enum {
+    kSIPipeDirectionOut = 0,
+    kSIPipeDirectionIn = 1,
+    kSIPipeDirectionAny = 3,
+} SIPipeDirection;
+
+/// Pipe transfer types, as reported by 'SIPipeProps.type'.
+typedef enum {
+    kSIPipeTypeControl = 0,
+    kSIPipeTypeIsochronous = 1,
+    kSIPipeTypeBulk = 2,
+    kSIPipeTypeInterrupt = 3,
+} SIPipeType;
+
 #define kSIPipesMax 8
 
 /// Get pipe properties by pipe index.
+///
+/// Pipe properties are cached the first time they're needed on a connection.
 IOReturn SIGetPipe(SIClient *client, uint8_t index, SIPipeProps *pipe);
 
 /// Get properties for all available pipes.
 IOReturn SIGetAllPipes(SIClient *client, SIPipeProps *pipes, size_t *numPipes);
 
 /// Read from a pipe.
+///
+/// Fails with 'kIOReturnTimeout' once the client's pipe timeout, if any,
+/// passes (see 'SISetTimeouts').
 IOReturn SIReadPipe(SIClient *client, uint8_t pipe, void *buffer, uint32_t *bufSizeInOut);
 
-/// Write to a pipe.
+/// Write to a pipe; times out like 'SIReadPipe'.
 IOReturn SIWritePipe(SIClient *client, uint8_t pipe, void const *buffer, uint32_t bufSize);
 
 /// Abort a pipe.
 IOReturn SIAbortPipe(SIClient *client, uint8_t pipe);
 
+/// Segment of an I/O vector.
+typedef struct {
+    void *base;
+    size_t length;
+} SIIOVec;
+
+/// Flags for 'SIWritePipeV'.
+typedef enum {
+    /// Follow the data with a zero-length packet if it is a whole number of
+    /// packets long, so the device can tell where the transfer ends.
+    kSIWriteZeroLengthPacket = 1 << 0,
+} SIWriteFlags;
+
+/// Write data gathered from several segments to a pipe as one transfer.
+///
+/// Data is sent straight from the segments, in pieces which are whole
+/// multiples of the pipe's max packet size, with several in flight at
+/// once. Only a packet which straddles two segments is copied. Like
+/// 'SIWritePipe', it fails with 'kIOReturnTimeout' once the client's pipe
+/// timeout passes.
+IOReturn SIWritePipeV(SIClient *client, uint8_t pipe, SIIOVec const *iov, uint32_t count, uint32_t flags);
+
+/// Read one transfer from a pipe, scattering it across several segments.
+///
+/// As with 'SIWritePipeV', only packets which straddle two segments are
+/// copied. Reading stops at the first short packet; the number of bytes
+/// read is stored in 'lengthOut'. The client's pipe timeout applies to
+/// the whole read.
+IOReturn SIReadPipeV(SIClient *client, uint8_t pipe, SIIOVec const *iov, uint32_t count, uint32_t *lengthOut);
+
+/// Upload progress callback, invoked on the uploading thread as each chunk
+/// completes.
+typedef void (*SIUploadProgressCallback)(void *context, uint64_t sent, uint64_t total);
+
+/// Upload configuration; zero fields take their defaults.
+typedef struct {
+    uint32_t chunkSize; ///< Bytes per transfer, rounded down to whole packets; 64K by default.
+    uint32_t depth;     ///< Chunks kept in flight, up to 16; 3 by default.
+    uint32_t flags;     ///< 'SIWriteFlags' applied to the upload as a whole.
+    SIUploadProgressCallback progress;
+    void *context;
+} SIUploadConfig;
+
+/// Upload a buffer to a bulk or interrupt OUT pipe as one transfer.
+///
+/// The buffer is sent in chunks, with the next ones already queued while
+/// the current one completes, so the pipe never goes idle between them. A
+/// NULL config uses the defaults. The client's pipe timeout applies to each
+/// chunk rather than the whole upload.
+IOReturn SIUploadBuffer(SIClient *client, uint8_t pipe, void const *data, size_t length,
+    SIUploadConfig const *config);
+
+/// Upload a file, such as a firmware image, like 'SIUploadBuffer'.
+///
+/// The file is memory-mapped and sent straight from the mapping.
+IOReturn SIUploadFile(SIClient *client, uint8_t pipe, char const *path, SIUploadConfig const *config);
+
 /// USB request direction flags.
 typedef enum {
     kSIDirectionToDevice = 0x00,
@@ -139,21 +406,630 @@ typedef enum {
 
 /// Tuple type returned from control transfers.
 typedef struct {
-    IOReturn error;  ///< IOKit error, if applicable.
-    uint32_t length; ///< Length of the reply, or 'wLenDone'.
+    IOReturn error;      ///< IOKit error, if applicable.
+    uint32_t length;     ///< Length of the reply, or 'wLenDone'.
+    uint64_t waitNs;     ///< Time spent queued before reaching the backend.
+    uint64_t transferNs; ///< Time spent with the backend (and device).
 } SITransferResult;
 
 /// Perform a USB control transfer.
+///
+/// A NULL 'data' with a non-zero 'length' sends zeroes, or discards the
+/// reply, using a buffer private to the call. Lengths beyond 'wLength''s
+/// 16 bits fail with 'kIOReturnBadArgument'.
 SITransferResult SIControlTransfer(SIClient *client, uint8_t requestType, uint8_t request,
     uint16_t value, uint16_t index, void *data, size_t length);
 
+/// Control request, for 'SIControlTransferBatch'.
+typedef struct {
+    uint8_t requestType;
+    uint8_t request;
+    uint16_t value;
+    uint16_t index;
+    uint16_t length;
+    void *data;
+} SIControlRequest;
+
+/// Flags for 'SIControlTransferBatch'.
+typedef enum {
+    /// Don't submit any more requests once one has failed. Requests already
+    /// in flight still complete; the rest report 'kIOReturnAborted'.
+    kSIBatchStopOnError = 1 << 0,
+} SIBatchFlags;
+
+/// Perform a sequence of control requests, in order.
+///
+/// Requests are submitted back-to-back, with several in flight at once,
+/// rather than each waiting for the one before it. The outcome of each is
+/// stored in the matching entry of 'results'; the first error is returned.
+IOReturn SIControlTransferBatch(SIClient *client, SIControlRequest const *requests, uint32_t count,
+    SITransferResult *results, uint32_t flags);
+
+/// USB setup packet, as sent at the start of a control transfer.
+///
+/// Fields are little-endian, as they appear on the wire.
+typedef struct SI_PACKED {
+    uint8_t bmRequestType;
+    uint8_t bRequest;
+    uint16_t wValue;
+    uint16_t wIndex;
+    uint16_t wLength;
+} SISetupPacket;
+
+/// Fill in the setup packet at the start of a control transfer buffer.
+void SIFillSetupPacket(void *buffer, uint8_t requestType, uint8_t request, uint16_t value,
+    uint16_t index, uint16_t length);
+
+/// Isochronous packet, one of those making up a transfer on an isochronous
+/// pipe; each is serviced in a (micro)frame of its own.
+///
+/// Packet data lies back-to-back in the transfer's buffer, each packet
+/// taking 'length' bytes whether or not that many arrive, so the data of
+/// an IN transfer isn't contiguous once any packet comes up short.
+typedef struct {
+    uint32_t length; ///< Bytes to send, or room for those received.
+    uint32_t actual; ///< Bytes transferred; set on completion.
+    IOReturn status; ///< Outcome of this packet alone; set on completion.
+} SIIsoPacket;
+
+/// Most packets in one isochronous transfer.
+#define kSIIsoPacketsMax 128
+
+typedef struct SITransfer SITransfer;
+typedef struct SICancelToken SICancelToken;
+
+/// Asynchronous transfer completion callback.
+typedef void (*SITransferCallback)(SITransfer *transfer);
+
+/// Asynchronous transfer.
+///
+/// Transfers on pipe 0 are control transfers; their buffer must begin with
+/// an 'SISetupPacket' (see 'SIFillSetupPacket'), followed by the data stage.
+/// The length reported on completion never includes the setup packet.
+///
+/// Transfers on isochronous pipes are made up of 'packets', which must
+/// fit in the buffer together; the length reported is their total. A
+/// transfer fails as a whole only when it can't be carried out at all, so
+/// check the status of each packet as well.
+///
+/// Transfers may be embedded in other structures and set up with
+/// 'SITransferInit', in which case they need no cleanup.
+struct SITransfer {
+    SIClient *client;            ///< Client to perform the transfer on.
+    uint8_t pipe;                ///< Pipe index to transfer on.
+    void *buffer;                ///< Data buffer.
+    uint32_t length;             ///< Data buffer size.
+    SITransferCallback callback; ///< Invoked on completion.
+    void *context;               ///< Arbitrary user data.
+    SICancelToken *token;        ///< Aborts the transfer when cancelled; optional.
+    SIIsoPacket *packets;        ///< Isochronous pipes only; see 'SIIsoPacket'.
+    uint32_t numPackets;         ///< Entries in 'packets', up to 'kSIIsoPacketsMax'.
+    SITransferResult result;     ///< Valid once the callback is invoked.
+
+    /// Isochronous pipes: service intervals which went by without a packet
+    /// queued on the pipe, just before this transfer's first, as far as
+    /// the backend can tell; valid once the callback is invoked.
+    uint32_t missedFrames;
+
+    // The remaining members are private, for use by the library and backends.
+    struct SITransfer *prev;
+    struct SITransfer *next;
+    uint32_t state;
+    uint32_t actual;
+    uint64_t queuedAt;  ///< When submitted, in nanoseconds.
+    uint64_t startedAt; ///< When handed to the backend, in nanoseconds.
+    uint64_t backendData[10];
+};
+
+/// Default number of transfers kept in flight per pipe.
+#define kSIQueueDepthDefault 4
+
+/// Initialize caller-owned transfer storage.
+void SITransferInit(SITransfer *transfer, SIClient *client, uint8_t pipe, void *buffer,
+    uint32_t length, SITransferCallback callback, void *context);
+
+/// Allocate and initialize a transfer.
+SITransfer *SITransferCreate(SIClient *client, uint8_t pipe, void *buffer, uint32_t length,
+    SITransferCallback callback, void *context);
+
+/// Destroy a transfer allocated with 'SITransferCreate'; it must not be in flight.
+void SITransferDestroy(SITransfer *transfer);
+
+/// Submit a transfer.
+///
+/// Up to the pipe's queue depth worth of transfers are handed to the backend
+/// at once; the rest wait in submission order and are started as earlier
+/// ones complete. Callbacks are invoked from 'SIHandleEvents', and may
+/// resubmit their transfer.
+IOReturn SISubmitTransfer(SITransfer *transfer);
+
+/// Cancel a submitted transfer.
+///
+/// Transfers still waiting for a slot complete immediately (on the calling
+/// thread) with 'kIOReturnAborted'; those already in flight complete with
+/// the same error via 'SIHandleEvents' once the backend has given them up.
+IOReturn SICancelTransfer(SITransfer *transfer);
+
+/// Set the maximum number of transfers in flight on a pipe.
+IOReturn SISetPipeQueueDepth(SIClient *client, uint8_t pipe, uint32_t depth);
+
+/// Wait for transfer completions and invoke their callbacks.
+///
+/// A negative timeout waits indefinitely; zero only polls.
+IOReturn SIHandleEvents(SIClient *client, int timeoutMs);
+
+/// Set the timeouts of blocking calls made without a deadline of their own.
+///
+/// Control transfers give up after 'controlMs' (6 ms unless set) and pipe
+/// reads and writes after 'pipeMs' (none unless set); zero waits forever.
+/// Interfaces claimed afterwards start out with the same timeouts.
+IOReturn SISetTimeouts(SIClient *client, uint32_t controlMs, uint32_t pipeMs);
+
+/// Get the deadline a number of milliseconds from now, for 'SICallOptions'.
+uint64_t SIDeadlineAfterMs(uint32_t ms);
+
+/// Cancels a group of transfers and blocking calls on one client at once.
+///
+/// Where the backend can't cancel single transfers (IOKit), cancelling a
+/// token aborts every pipe one of its transfers is on.
+SICancelToken *SICancelTokenCreate(SIClient *client);
+
+/// Destroy a cancellation token; nothing may be using it.
+void SICancelTokenDestroy(SICancelToken *token);
+
+/// Cancel everything using a token.
+///
+/// Transfers waiting in a pipe's queue complete straight away with
+/// 'kIOReturnAborted'; those in flight do so once the backend gives them
+/// up. Anything started with the token afterwards fails with the same
+/// error, until the token is reset.
+void SICancelTokenCancel(SICancelToken *token);
+
+/// Make a cancelled token usable again.
+void SICancelTokenReset(SICancelToken *token);
+
+/// Whether a token has been cancelled.
+int SICancelTokenIsCancelled(SICancelToken const *token);
+
+/// Options for a single blocking call; zero fields take the defaults.
+///
+/// Calls with a deadline or a token run as asynchronous transfers which the
+/// calling thread waits on, completing those of other threads meanwhile
+/// (see 'SIHandleEvents').
+typedef struct {
+    uint64_t deadline;    ///< When to give up with 'kIOReturnTimeout' (see 'SIDeadlineAfterMs').
+    SICancelToken *token; ///< Aborts the call when cancelled.
+} SICallOptions;
+
+/// Read from a pipe, subject to a deadline and a cancellation token.
+///
+/// Without a deadline, the client's pipe timeout applies.
+SITransferResult SIReadPipeWithOptions(SIClient *client, uint8_t pipe, void *buffer, uint32_t length,
+    SICallOptions const *options);
+
+/// Write to a pipe, subject to a deadline and a cancellation token.
+SITransferResult SIWritePipeWithOptions(SIClient *client, uint8_t pipe, void const *buffer, uint32_t length,
+    SICallOptions const *options);
+
+/// Perform a control transfer, subject to a deadline and a cancellation token.
+SITransferResult SIControlTransferWithOptions(SIClient *client, uint8_t requestType, uint8_t request,
+    uint16_t value, uint16_t index, void *data, size_t length, SICallOptions const *options);
+
+/// Sub-buckets per power of two in an 'SIHistogram'.
+#define kSIHistogramSubBuckets 4
+
+/// Buckets in an 'SIHistogram'; the last also takes everything beyond 2^37 ns.
+#define kSIHistogramBuckets 144
+
+/// Log-linear latency histogram.
+///
+/// Below 4 ns each bucket is a single nanosecond; from there on, every power
+/// of two is split into 'kSIHistogramSubBuckets' equal parts, so a bucket is
+/// never wider than a quarter of its lower bound.
+typedef struct {
+    uint64_t count;   ///< Samples in all buckets.
+    uint64_t totalNs; ///< Sum of all samples.
+    uint64_t buckets[kSIHistogramBuckets];
+} SIHistogram;
+
+/// Get the lowest latency counted by a histogram bucket.
+uint64_t SIHistogramBucketNs(uint32_t bucket);
+
+/// Get an upper bound on a percentile (0-100) of a histogram's samples, or
+/// zero if it has none.
+uint64_t SIHistogramPercentileNs(SIHistogram const *histogram, double percentile);
+
+/// Counters for the transfers on one pipe, or of one type of control request.
+typedef struct {
+    uint64_t transfers; ///< Transfers completed, successfully or not.
+    uint64_t bytes;     ///< Bytes transferred.
+    uint64_t errors;    ///< Transfers failed, besides those timed out or aborted.
+    uint64_t timeouts;  ///< Transfers failed with 'kIOReturnTimeout'.
+    uint64_t aborts;    ///< Transfers failed with 'kIOReturnAborted'.
+    SIHistogram latency; ///< From submission (or call) to completion.
+} SIPipeStats;
+
+/// Snapshot of a client's transfer counters.
+typedef struct {
+    SIPipeStats pipes[kSIPipesMax]; ///< By pipe; pipe 0 counts every control transfer.
+    SIPipeStats control[4];         ///< Control transfers by request type ('kSIType*' >> 5).
+} SIStats;
+
+/// Take a snapshot of a client's transfer counters.
+///
+/// Counters are kept for the client's lifetime, whatever it's connected to.
+/// Taking a snapshot never blocks transfers, so it's cheap enough to poll;
+/// each counter is exact, but ones updated while the snapshot is taken may
+/// be a transfer apart.
+IOReturn SIGetStats(SIClient *client, SIStats *stats);
+
+/// Turn a client's counters on or off; they start out on. Blocking calls
+/// only read the clock while counters are on.
+void SISetStatsEnabled(SIClient *client, int enabled);
+
+/// Capture of USB traffic to a pcapng file, as Linux usbmon would record it
+/// (link type 220), for opening in Wireshark.
+///
+/// Every transfer made by the clients a capture is attached to is recorded
+/// as a submission and a completion, with its setup packet, payload, status
+/// and timestamps. Packets are copied into memory and written out by a
+/// thread of the capture's own; when it falls behind, packets are dropped
+/// and counted rather than holding up transfers.
+typedef struct SICapture SICapture;
+
+/// Capture configuration; zero fields take their defaults.
+typedef struct {
+    uint32_t snapLength; ///< Most payload bytes kept per packet; 64K by default.
+    uint32_t bufferSize; ///< Size of each of the two write buffers; 4M by default.
+} SICaptureConfig;
+
+/// Capture counters.
+typedef struct {
+    uint64_t packets;  ///< Packets written or waiting to be.
+    uint64_t bytes;    ///< Bytes of pcapng written or waiting to be.
+    uint64_t dropped;  ///< Packets dropped while the writer was behind.
+    uint32_t errors;   ///< Failed writes to the file.
+} SICaptureStats;
+
+/// Create a capture file and start its writer. A NULL config uses the defaults.
+IOReturn SICaptureOpen(char const *path, SICaptureConfig const *config, SICapture **captureOut);
+
+/// Write out everything captured and close the file.
+///
+/// Detach the capture from its clients first; it must not be closed while
+/// their transfers might still be recording into it.
+void SICaptureClose(SICapture *capture);
+
+/// Attach a capture to a client, or detach it with NULL.
+///
+/// Several clients can share one capture. Transfers already in flight when
+/// the capture is attached are recorded from their completion on.
+void SISetCapture(SIClient *client, SICapture *capture);
+
+/// Get a snapshot of a capture's counters.
+void SICaptureGetStats(SICapture *capture, SICaptureStats *stats);
+
+/// Pool of page-aligned transfer buffers, owned by a client.
+///
+/// Where the backend supports it (usbfs with 'USBDEVFS_CAP_MMAP'), pool
+/// memory is mapped from the device itself, so transfers into and out of
+/// it skip the kernel's bounce copy. Acquiring and releasing buffers never
+/// allocates and takes no locks, so either may happen on any thread.
+typedef struct SIBufferPool SIBufferPool;
+
+/// Create a pool of buffers for a connected client.
+///
+/// Pools still alive when the client is destroyed are destroyed with it.
+SIBufferPool *SIBufferPoolCreate(SIClient *client, uint32_t bufferSize, uint32_t count);
+
+/// Destroy a buffer pool; none of its buffers may be in flight.
+void SIBufferPoolDestroy(SIBufferPool *pool);
+
+/// Take a buffer from a pool, or NULL if all are in use.
+void *SIBufferPoolAcquire(SIBufferPool *pool);
+
+/// Return a buffer to the pool it was acquired from; pointers which aren't
+/// the start of one of the pool's buffers are ignored.
+void SIBufferPoolRelease(SIBufferPool *pool, void *buffer);
+
+/// Get the usable size of each of a pool's buffers.
+uint32_t SIBufferPoolGetBufferSize(SIBufferPool *pool);
+
+/// Check whether a pool's buffers are mapped from the device.
+int SIBufferPoolIsDeviceMapped(SIBufferPool *pool);
+
+/// Continuous reader for a bulk or interrupt IN pipe.
+///
+/// A stream keeps a fixed number of reads queued on its pipe at all times,
+/// driven by a thread of its own, and publishes each completed read into a
+/// single-producer/single-consumer ring. Reads land directly in ring
+/// storage (mapped from the device, like an 'SIBufferPool', where
+/// possible), so the consumer is handed views rather than copies.
+typedef struct SIStream SIStream;
+
+/// Stream flags.
+typedef enum {
+    /// Keep reading when the ring is full, dropping new data (and counting
+    /// it as an overrun) instead of pausing the pipe until space frees up.
+    kSIStreamDropWhenFull = 1 << 0,
+} SIStreamFlags;
+
+/// Stream configuration; zero fields take their defaults.
+typedef struct {
+    uint32_t transferSize; ///< Size of each read; 16K by default.
+    uint32_t depth;        ///< Reads kept queued; 8 by default.
+    uint32_t slots;        ///< Ring capacity in reads, rounded up to a power of two; 64 by default.
+    uint32_t flags;        ///< 'SIStreamFlags'.
+} SIStreamConfig;
+
+/// View of one read's payload, owned by the stream until released.
+typedef struct {
+    void const *data;
+    uint32_t length;
+} SIStreamView;
+
+/// Stream counters.
+typedef struct {
+    uint64_t reads;        ///< Reads published to the ring.
+    uint64_t bytes;        ///< Bytes published to the ring.
+    uint64_t overruns;     ///< Reads dropped because the ring was full.
+    uint64_t droppedBytes; ///< Bytes dropped because the ring was full.
+    uint64_t stalls;       ///< Times reading paused because the ring was full.
+    uint64_t stalledNs;    ///< Total time spent paused.
+    uint32_t highWater;    ///< Most reads ever waiting in the ring at once.
+    uint32_t errors;       ///< Reads which failed.
+} SIStreamStats;
+
+/// Start streaming from a pipe.
+///
+/// The stream takes over the pipe until closed; don't submit other reads on
+/// it in the meantime. A NULL config uses the defaults.
+IOReturn SIStreamOpen(SIClient *client, uint8_t pipe, SIStreamConfig const *config, SIStream **streamOut);
+
+/// Stop streaming and free the stream, including any unreleased views.
+///
+/// The stream's reads are cancelled and waited for, leaving any other
+/// transfers on the pipe alone, and the pipe's queue depth is put back.
+void SIStreamClose(SIStream *stream);
+
+/// Get the oldest unreleased read, waiting for one if the ring is empty.
+///
+/// A negative timeout waits indefinitely; zero only polls. Returns
+/// 'kIOReturnTimeout' if nothing arrived in time, or the error which
+/// stopped the stream once everything before it has been released. Calling
+/// this again before 'SIStreamRelease' returns the same view.
+IOReturn SIStreamPeek(SIStream *stream, SIStreamView *view, int timeoutMs);
+
+/// Release the oldest read, handing its storage back to the stream.
+void SIStreamRelease(SIStream *stream);
+
+/// Get a snapshot of the stream's counters.
+void SIStreamGetStats(SIStream *stream, SIStreamStats *stats);
+
+/// Continuous transfer on an isochronous IN or OUT pipe.
+///
+/// An isochronous stream keeps several transfers of many packets each in
+/// flight, from a thread of its own, so that the pipe has a packet queued
+/// for every service interval. Transfers are handed to a callback: on IN
+/// pipes once they complete, with the packets received, and on OUT pipes
+/// before every submission, to fill in the packets to send.
+typedef struct SIIsoStream SIIsoStream;
+
+/// Isochronous stream callback, invoked on the stream's thread.
+///
+/// Packet 'i' has its data at 'data + i * packetSize'. OUT callbacks may
+/// shorten packets by lowering their 'length', down to zero; the stream
+/// packs the data together before sending it.
+typedef void (*SIIsoStreamCallback)(void *context, SIIsoPacket *packets, uint32_t numPackets, uint8_t *data);
+
+/// Isochronous stream configuration; zero fields take their defaults,
+/// except for 'callback', which is required.
+typedef struct {
+    uint32_t packetSize;         ///< Bytes per packet; the pipe's maximum packet size by default.
+    uint32_t packetsPerTransfer; ///< 8 by default; more means fewer completions, but more latency.
+    uint32_t depth;              ///< Transfers kept in flight; 4 by default.
+    uint32_t frameUs;            ///< Length of a bus (micro)frame: 1000 by default, 125 at high speed.
+    SIIsoStreamCallback callback;
+    void *context;
+} SIIsoStreamConfig;
+
+/// Isochronous stream counters.
+typedef struct {
+    uint64_t transfers;     ///< Transfers completed, successfully or not.
+    uint64_t packets;       ///< Packets serviced, successfully or not.
+    uint64_t bytes;         ///< Bytes transferred.
+    uint64_t packetErrors;  ///< Packets which failed, besides those dropped.
+    uint64_t droppedFrames; ///< Service intervals missed for want of a packet queued in time.
+    uint32_t errors;        ///< Transfers which failed as a whole.
+    IOReturn status;        ///< Error which stopped the stream, if any.
+
+    /// Per packet: for IN, from the end of its service interval to the
+    /// callback; for OUT, from the callback to the start of its interval.
+    /// Intervals are placed on the host's clock by the earliest completion
+    /// seen, so this reflects the buffering and the jitter on top of it.
+    SIHistogram latency;
+} SIIsoStreamStats;
+
+/// Start streaming on an isochronous pipe.
+///
+/// The stream takes over the pipe until closed, and stops on the first
+/// error it can't carry on from, such as the device going away.
+/// Unlike other streams, a config is required, for its callback.
+IOReturn SIIsoStreamOpen(SIClient *client, uint8_t pipe, SIIsoStreamConfig const *config, SIIsoStream **streamOut);
+
+/// Stop streaming and free the stream, once its transfers in flight have
+/// been cancelled or are done; the pipe's queue depth is put back.
+void SIIsoStreamClose(SIIsoStream *stream);
+
+/// Get a snapshot of the stream's counters.
+void SIIsoStreamGetStats(SIIsoStream *stream, SIIsoStreamStats *stats);
+
+/// Set of clients serviced by a fixed number of worker threads.
+///
+/// Each worker runs an epoll loop over the event descriptors of its
+/// clients and calls 'SIHandleEvents' for whichever are ready, so transfer
+/// callbacks run on the worker. A client stays on the worker it was given
+/// for as long as it's in the pool. Pools are only available on Linux,
+/// and only for backends with 'SIBackend.getEventFD'.
+typedef struct SIClientPool SIClientPool;
+
+/// Pool flags.
+typedef enum {
+    /// Bind each worker thread to its own CPU.
+    kSIClientPoolPinWorkers = 1 << 0,
+} SIClientPoolFlags;
+
+/// Client pool configuration; zero fields take their defaults.
+typedef struct {
+    uint32_t numWorkers; ///< Worker threads; one per online CPU by default.
+    uint32_t flags;      ///< 'SIClientPoolFlags'.
+
+    /// Called on the client's worker once its device has gone away, after
+    /// the client has been removed from the pool; optional. The client may
+    /// be destroyed from here.
+    void (*disconnect)(SIClient *client, void *context);
+    void *context;
+} SIClientPoolConfig;
+
+/// Create a client pool and start its workers. A NULL config uses the defaults.
+IOReturn SIClientPoolCreate(SIClientPoolConfig const *config, SIClientPool **poolOut);
+
+/// Stop a pool's workers and destroy it; clients still in it are removed,
+/// but not destroyed.
+void SIClientPoolDestroy(SIClientPool *pool);
+
+/// Add a connected client to the least busy worker.
+IOReturn SIClientPoolAdd(SIClientPool *pool, SIClient *client);
+
+/// Remove a client from its pool.
+///
+/// Once this returns, the worker will not touch the client again, unless
+/// called from within a callback on that worker, in which case it takes
+/// effect as soon as the callback returns.
+IOReturn SIClientPoolRemove(SIClientPool *pool, SIClient *client);
+
+/// Run a function on the worker servicing a client.
+///
+/// This is the place to submit a client's transfers from, so that they're
+/// only ever touched by one thread.
+IOReturn SIClientPoolDispatch(SIClientPool *pool, SIClient *client, void (*function)(void *context),
+    void *context);
+
+/// Get the index of the worker servicing a client.
+IOReturn SIClientPoolGetWorker(SIClientPool *pool, SIClient *client, uint32_t *workerOut);
+
+/// Have one of the pool's workers handle a hotplug monitor's events.
+///
+/// Arrivals and departures are then reported on that worker, so the
+/// 'connect' callback can add each new client to the pool as it comes.
+/// The monitor must be removed from the pool before it's destroyed.
+IOReturn SIClientPoolAddMonitor(SIClientPool *pool, SIHotplugMonitor *monitor);
+
+/// Stop handling a hotplug monitor's events; like 'SIClientPoolRemove',
+/// the worker won't touch the monitor again once this returns.
+IOReturn SIClientPoolRemoveMonitor(SIClientPool *pool, SIHotplugMonitor *monitor);
+
+/// Poller for the interrupt IN pipes of many clients.
+///
+/// A poller keeps reads armed on every pipe added to it, resubmitting each
+/// one as soon as it completes, and waits on all of their clients' event
+/// descriptors from a single thread. Completed reads are copied into
+/// events, and events arriving within a coalescing window of each other
+/// are delivered together, to a callback or through 'SIInterruptPollerWait',
+/// so the cost of waking up is shared by however many devices reported in
+/// the meantime. Pollers are only available on Linux, and only for backends
+/// with 'SIBackend.getEventFD'.
+typedef struct SIInterruptPoller SIInterruptPoller;
+
+/// A read completed on a polled pipe.
+typedef struct {
+    SIClient *client;
+    uint8_t pipe;
+    IOReturn status;      ///< An error stops the pipe being polled until it's added again.
+    uint32_t length;
+    uint8_t const *data;  ///< Copy of what was read, valid until the batch is done with.
+    void *context;        ///< As given to 'SIInterruptPollerAdd'.
+    uint64_t timestampNs; ///< When the read's completion was reaped, on the monotonic clock.
+} SIInterruptEvent;
+
+/// Interrupt poller callback, invoked on the poller's thread with each batch.
+typedef void (*SIInterruptPollerCallback)(void *context, SIInterruptEvent const *events, uint32_t numEvents);
+
+/// Interrupt poller configuration; zero fields take their defaults.
+typedef struct {
+    uint32_t frameUs;    ///< Length of a bus (micro)frame: 1000 by default, 125 at high speed.
+    uint32_t coalesceUs; ///< How long to gather events before delivering them; one frame by default.
+
+    /// Reads kept armed on each pipe; by default, enough to cover every
+    /// service interval in a coalescing window, plus one.
+    uint32_t depth;
+
+    uint32_t maxEvents; ///< Events gathered per batch; 1024 by default.
+    uint32_t maxBytes;  ///< Data gathered per batch; 64K by default.
+
+    /// Called with each batch; optional. Without one, batches are queued
+    /// for 'SIInterruptPollerWait'.
+    SIInterruptPollerCallback callback;
+    void *context;
+} SIInterruptPollerConfig;
+
+/// Interrupt poller counters.
+typedef struct {
+    uint64_t events;   ///< Events delivered or waiting to be.
+    uint64_t bytes;    ///< Data in those events.
+    uint64_t batches;  ///< Batches delivered.
+    uint64_t wakeups;  ///< Times the poller's thread woke up.
+    uint64_t overruns; ///< Events dropped because their batch was full.
+    uint32_t errors;   ///< Pipes which stopped being polled on an error.
+    SIHistogram latency; ///< From each read's completion being reaped to its batch being delivered.
+} SIInterruptPollerStats;
+
+/// Create an interrupt poller and start its thread. A NULL config uses the defaults.
+IOReturn SIInterruptPollerCreate(SIInterruptPollerConfig const *config, SIInterruptPoller **pollerOut);
+
+/// Stop polling every pipe and destroy the poller; not from its callback.
+void SIInterruptPollerDestroy(SIInterruptPoller *poller);
+
+/// Start polling an interrupt IN pipe of a connected client.
+///
+/// The poller takes over the pipe until it's removed; don't submit other
+/// reads on it in the meantime. Clients already in an 'SIClientPool' are
+/// left to their worker to reap, and must stay in the pool while polled.
+/// Otherwise, blocking calls made on a client may reap its reads as well,
+/// in which case events are gathered on whichever thread gets there first.
+IOReturn SIInterruptPollerAdd(SIInterruptPoller *poller, SIClient *client, uint8_t pipe, void *context);
+
+/// Stop polling a pipe, once its reads have been cancelled, and put back
+/// its queue depth; not from the poller's callback. Events from it which
+/// were already gathered are still delivered.
+///
+/// If the backend still hasn't handed the reads back after about a second
+/// of cancelling, this gives up with 'kIOReturnTimeout': the pipe is no
+/// longer polled, but its reads and their buffers are leaked rather than
+/// freed under the backend, and the queue depth stays as it was. The client
+/// should then be destroyed before the poller, as the reads still refer to
+/// it.
+IOReturn SIInterruptPollerRemove(SIInterruptPoller *poller, SIClient *client, uint8_t pipe);
+
+/// Get the next batch of events, for pollers without a callback.
+///
+/// A negative timeout waits indefinitely; zero only polls. The events stay
+/// valid until the next call, and 'kIOReturnTimeout' is returned if no
+/// batch was ready in time.
+IOReturn SIInterruptPollerWait(SIInterruptPoller *poller, SIInterruptEvent const **eventsOut,
+    uint32_t *numEventsOut, int timeoutMs);
+
+/// Get a snapshot of the poller's counters.
+void SIInterruptPollerGetStats(SIInterruptPoller *poller, SIInterruptPollerStats *stats);
+
 /// USB descriptor types.
 typedef enum {
     kSIDescriptorTypeDevice = 0x01,
     kSIDescriptorTypeConfig = 0x02,
     kSIDescriptorTypeString = 0x03,
-    kSIDescriptorTypeInterface = 0x03,
+    kSIDescriptorTypeInterface = 0x04,
     kSIDescriptorTypeEndpoint = 0x05,
+    kSIDescriptorTypeInterfaceAssociation = 0x0b,
 } SIDescriptorType;
 
 /// USB device descriptor.
@@ -216,18 +1092,320 @@ typedef struct SI_PACKED {
     uint16_t wData[];
 } SIStringDescriptor;
 
+/// Header common to all descriptors.
+typedef struct SI_PACKED {
+    uint8_t bLength;
+    uint8_t bDescriptorType;
+} SIDescriptorHeader;
+
+/// Iterator over the descriptors in a configuration descriptor set.
+///
+/// Iterators never allocate and never read past the end of the set (or its
+/// 'wTotalLength', whichever is shorter). A malformed descriptor ends the
+/// iteration early, with 'status' set to 'kIOReturnUnderrun'.
+typedef struct {
+    uint8_t const *position;
+    uint8_t const *end;
+    SIInterfaceDescriptor const *interface; ///< Interface of the latest descriptor, if any.
+    IOReturn status;
+} SIDescriptorIterator;
+
+/// Start iterating over the descriptors following a configuration descriptor.
+void SIDescriptorIteratorInit(SIDescriptorIterator *it, void const *config, size_t length);
+
+/// Get the next descriptor of any type, including class-specific ones.
+SIDescriptorHeader const *SIDescriptorIteratorNext(SIDescriptorIterator *it);
+
+/// Get the next interface descriptor (of any alternate setting), skipping
+/// everything before it.
+SIInterfaceDescriptor const *SIDescriptorIteratorNextInterface(SIDescriptorIterator *it);
+
+/// Get the next endpoint descriptor of the current interface, skipping
+/// class-specific descriptors; returns NULL once the next interface is
+/// reached, leaving it to be returned by 'SIDescriptorIteratorNextInterface'.
+SIEndpointDescriptor const *SIDescriptorIteratorNextEndpoint(SIDescriptorIterator *it);
+
 /// Buffer type alias appropriate for holding a string descriptor.
 typedef uint8_t SIStringDescriptorBuffer[0x100];
 
 /// Get a USB descriptor.
+///
+/// Device and configuration descriptors are served from the client's
+/// descriptor cache; other types are requested from the device.
 SITransferResult SIGetDescriptor(SIClient *client, SIDescriptorType type, uint8_t index,
     void *descOut, size_t bufSize);
 
-/// Decode a string descriptor to ASCII.
+/// Get the device descriptor.
+///
+/// The first descriptor query on a connection fetches the device descriptor
+/// and every configuration descriptor set, and caches them; later queries
+/// are answered from memory. Descriptors returned this way point into the
+/// cache and stay valid until it is invalidated.
+IOReturn SIGetDeviceDescriptor(SIClient *client, SIDeviceDescriptor const **descOut);
+
+/// Get a configuration descriptor by index, followed by all of its
+/// interface, endpoint, and other descriptors ('wTotalLength' bytes).
+IOReturn SIGetConfigDescriptor(SIClient *client, uint8_t index, SIConfigDescriptor const **configOut);
+
+/// Find an interface descriptor in the first configuration.
+IOReturn SIGetInterfaceDescriptor(SIClient *client, uint8_t number, uint8_t alternate,
+    SIInterfaceDescriptor const **interfaceOut);
+
+/// Discard cached descriptors and pipe properties.
+///
+/// Call this if the device re-enumerates or changes configuration; anything
+/// previously returned from the cache must not be used afterwards.
+void SIInvalidateDescriptors(SIClient *client);
+
+/// Decode a string descriptor to NUL-terminated UTF-8.
 ///
-/// \return Number of bytes decoded, or zero on failure.
+/// Unpaired surrogates are replaced with U+FFFD.
+///
+/// \return Number of bytes written, including the terminator, or zero if
+/// the descriptor is malformed or the output buffer is too small.
 int SIDecodeStringDescriptor(SIStringDescriptor *desc, char *out, size_t outSize);
 
+/// Strings referenced by a device's descriptors, decoded to UTF-8.
+///
+/// All strings live in one allocation, and identical strings share storage.
+typedef struct {
+    uint16_t langID;            ///< Language the strings were requested in, or zero if none.
+    uint8_t numLangIDs;
+    uint16_t const *langIDs;    ///< Languages supported by the device.
+    char const *strings[0x100]; ///< By descriptor index; NULL if unreferenced or unavailable.
+} SIStringTable;
+
+/// Get every string referenced by the device, configuration, interface, and
+/// interface association descriptors.
+///
+/// The first call fetches the language table and then all referenced
+/// strings as one batch of control transfers, in US English if the device
+/// supports it and in its first language otherwise. The table is cached
+/// with the descriptors and stays valid until they are invalidated.
+IOReturn SIGetStringTable(SIClient *client, SIStringTable const **tableOut);
+
+/// Events recorded by the library's trace, one per call site.
+///
+/// Each thread records into a ring of its own, keeping its most recent
+/// events as raw arguments to be formatted offline (see 'SITraceDump' and
+/// 'Tools/TraceDecode.c'). The trace is compiled out entirely when the
+/// library is built with 'SI_CONFIG_TRACE=0'.
+typedef enum {
+    kSITraceConnect = 1,
+    kSITraceClaimInterface,
+    kSITraceReadPipe,
+    kSITraceWritePipe,
+    kSITraceControlTransfer,
+    kSITraceAbortPipe,
+    kSITraceSubmitTransfer,
+    kSITraceTransferCompleted,
+    kSITraceCancelTransfer,
+    kSITraceCancelToken,
+    kSITraceEventCount,
+} SITraceEvent;
+
+/// Version of the trace dump format.
+#define kSITraceVersion 1
+
+/// One traced event, as recorded.
+typedef struct {
+    uint64_t tick;    ///< Raw timestamp; see 'SITraceHeader'.
+    uint32_t event;   ///< 'SITraceEvent'.
+    uint32_t thread;  ///< Number of the recording thread, from 1.
+    uint64_t args[4]; ///< Arguments, as named by 'SITraceGetEventInfo'.
+} SITraceRecord;
+
+/// Header of a trace dump, followed by its records in no particular order.
+///
+/// Timestamps are in ticks of a free-running counter; two samples taken
+/// along with the monotonic clock convert them to nanoseconds.
+typedef struct {
+    char magic[8];        ///< "SITRACE", NUL-terminated.
+    uint32_t version;     ///< 'kSITraceVersion'.
+    uint32_t recordSize;  ///< Size of each 'SITraceRecord'.
+    uint64_t baseTick;    ///< Ticks when tracing started...
+    uint64_t baseNs;      ///< ...and the monotonic time then.
+    uint64_t dumpTick;    ///< Ticks when the dump was taken...
+    uint64_t dumpNs;      ///< ...and the monotonic time then.
+    uint64_t numRecords;
+} SITraceHeader;
+
+/// Name and argument names of a trace event.
+typedef struct {
+    char const *name;
+    char const *args[4]; ///< NULL past the last argument.
+} SITraceEventInfo;
+
+/// Describe a trace event, or return NULL if it isn't known.
+SITraceEventInfo const *SITraceGetEventInfo(uint32_t event);
+
+/// Turn tracing on or off at run time; it starts out on.
+void SITraceSetEnabled(int enabled);
+
+/// Write the contents of every thread's trace ring to a file descriptor.
+///
+/// Rings outlive their threads, so a dump taken after a failure still
+/// holds what led up to it. Returns 'kIOReturnUnsupported' if tracing has
+/// been compiled out. Not async-signal-safe.
+IOReturn SITraceDump(int fd);
+
+/// Transport backend.
+///
+/// Every client operation is routed through one of these. Backends own the
+/// client's 'handle' from a successful 'connect' until 'disconnect'. Pipe
+/// indices follow the IOKit convention, where pipe 0 is the default control
+/// pipe and the interface's endpoints follow in descriptor order.
+struct SIBackend {
+    char const *name;
+
+    IOReturn (*connect)(SIClient *client, uint16_t vendorID, uint16_t productID);
+    void (*disconnect)(SIClient *client);
+
+    /// Get the number of endpoints, excluding the control endpoint.
+    IOReturn (*getNumEndpoints)(SIClient *client, uint8_t *numEndpoints);
+    IOReturn (*getPipe)(SIClient *client, uint8_t index, SIPipeProps *pipe);
+
+    IOReturn (*readPipe)(SIClient *client, uint8_t pipe, void *buffer, uint32_t *bufSizeInOut);
+    IOReturn (*writePipe)(SIClient *client, uint8_t pipe, void const *buffer, uint32_t bufSize);
+    IOReturn (*abortPipe)(SIClient *client, uint8_t pipe);
+
+    SITransferResult (*controlTransfer)(SIClient *client, uint8_t requestType, uint8_t request,
+        uint16_t value, uint16_t index, void *data, size_t length);
+
+    /// Connect 'target' to another interface of the device 'client' is
+    /// connected to, with a pipe table of its own; optional.
+    IOReturn (*claimInterface)(SIClient *client, SIClient *target, uint8_t number);
+
+    /// Start a transfer; completions are reported from 'handleEvents'.
+    IOReturn (*submitTransfer)(SITransfer *transfer);
+    IOReturn (*cancelTransfer)(SITransfer *transfer);
+
+    /// Wait for completions, reporting each through 'SITransferCompleted'.
+    IOReturn (*handleEvents)(SIClient *client, int timeoutMs);
+
+    /// Get a descriptor which polls ready for 'eventsOut' (poll(2) flags)
+    /// while 'handleEvents' has work to do, for use by event loops; optional.
+    /// Returns -1 if there isn't one.
+    int (*getEventFD)(SIClient *client, short *eventsOut);
+
+    /// Allocate page-aligned transfer memory the device can use directly,
+    /// or return NULL to fall back to ordinary memory; optional.
+    void *(*allocBuffers)(SIClient *client, size_t size);
+    void (*freeBuffers)(SIClient *client, void *buffers, size_t size);
+};
+
+/// Report completion of a transfer started through 'SIBackend.submitTransfer'.
+///
+/// This is only for use by backends; 'transfer->result' must be set first.
+void SITransferCompleted(SITransfer *transfer);
+
+#if defined(__APPLE__)
+/// IOKit/IOUSB backend; the default on macOS.
+extern SIBackend const kSIBackendIOKit;
+#endif
+
+#if defined(__linux__)
+/// Linux usbfs ('/dev/bus/usb') backend; the default on Linux.
+extern SIBackend const kSIBackendUsbfs;
+#endif
+
+/// In-process simulated device backend.
+///
+/// Clients using this backend connect to simulated devices which have been
+/// attached with 'SISimDeviceAttach', matching on vendor & product ID just
+/// like a real device would.
+extern SIBackend const kSIBackendSimulated;
+
+/// Simulated USB device.
+typedef struct SISimDevice SISimDevice;
+
+/// Control request handler for a simulated device.
+///
+/// Handlers are invoked on the thread performing the control transfer. For
+/// requests towards the host, 'data' should be filled in and the number of
+/// bytes written returned as the result length.
+typedef SITransferResult (*SISimControlHandler)(void *context, uint8_t requestType, uint8_t request,
+    uint16_t value, uint16_t index, void *data, size_t length);
+
+/// Simulated pipe behavior flags.
+typedef enum {
+    kSISimPipeAutofill = 1 << 0, ///< IN pipes: synthesize data instead of waiting for pushed data.
+    kSISimPipeDiscard = 1 << 1,  ///< OUT pipes: drop written data instead of queueing it.
+    kSISimPipePolled = 1 << 2,   ///< Interrupt IN pipes: complete reads once per service interval.
+} SISimPipeFlags;
+
+/// Simulated pipe configuration.
+///
+/// Throughput caps are modeled as a per-pipe bus clock, so concurrent
+/// transfers on the same pipe queue up behind each other; latency is added
+/// on top of that and does not.
+///
+/// Isochronous pipes run on a frame clock instead: each packet takes up a
+/// service interval ('frameUs' times 2^(bInterval - 1)), transfers follow
+/// straight on from those already queued, and a transfer submitted after
+/// its pipe has run dry starts at the next interval, with the ones passed
+/// by reported as missed. Failures are injected into individual packets.
+/// IN packets are filled from pushed data (or autofilled), up to the
+/// maximum packet size, and otherwise come back empty; OUT packets are
+/// each delivered as a transfer of their own.
+///
+/// Interrupt IN pipes marked 'kSISimPipePolled' are polled the way a host
+/// controller would: at most one read completes per service interval (see
+/// 'frameUs'), at the end of the first interval after its data is ready.
+typedef struct {
+    uint32_t latencyUs;      ///< Fixed latency added to every transfer.
+    uint64_t bytesPerSecond; ///< Throughput cap; zero is unlimited.
+    uint32_t failEvery;      ///< Fail every Nth transfer; zero never fails.
+    IOReturn failWith;       ///< Error returned by injected failures.
+    uint32_t flags;          ///< See 'SISimPipeFlags'.
+    uint8_t loopback;        ///< OUT pipes: deliver written data to this IN pipe instead.
+    uint32_t frameUs;        ///< Periodic pipes: (micro)frame length; 1000 unless set.
+} SISimPipeConfig;
+
+/// Create a simulated device from its device descriptor.
+SISimDevice *SISimDeviceCreate(SIDeviceDescriptor const *desc);
+
+/// Destroy a simulated device, detaching it first if needed.
+///
+/// Any clients connected to the device must be destroyed beforehand.
+void SISimDeviceDestroy(SISimDevice *device);
+
+/// Add a configuration; 'config' is the full blob, 'wTotalLength' bytes long.
+///
+/// Pipes are taken from every interface (alternate setting 0) of the
+/// configuration whose value is 1, which the real backends select on
+/// connect. They are numbered across interfaces in descriptor order, so the
+/// first interface's pipes keep the numbers its clients see.
+IOReturn SISimDeviceAddConfig(SISimDevice *device, void const *config, size_t length);
+
+/// Set the string for a string descriptor index, given as UTF-8; malformed
+/// UTF-8 fails with 'kIOReturnBadArgument'.
+IOReturn SISimDeviceSetString(SISimDevice *device, uint8_t index, char const *string);
+
+/// Register a handler for a given control request.
+///
+/// Standard descriptor and configuration requests are answered by the
+/// simulator itself; anything without a handler stalls.
+IOReturn SISimDeviceAddControlHandler(SISimDevice *device, uint8_t requestType, uint8_t request,
+    SISimControlHandler handler, void *context);
+
+/// Configure the behavior of a pipe; pipe 0 applies to control transfers.
+IOReturn SISimDeviceConfigurePipe(SISimDevice *device, uint8_t pipe, SISimPipeConfig const *config);
+
+/// Queue data to be read by the host from an IN pipe, as one transfer.
+IOReturn SISimDevicePush(SISimDevice *device, uint8_t pipe, void const *data, uint32_t length);
+
+/// Take the oldest transfer written by the host to an OUT pipe.
+///
+/// Returns 'kIOReturnUnderrun' if nothing has been written.
+IOReturn SISimDevicePop(SISimDevice *device, uint8_t pipe, void *data, uint32_t *lengthInOut);
+
+/// Make a simulated device visible to clients using 'kSIBackendSimulated'.
+IOReturn SISimDeviceAttach(SISimDevice *device);
+
+/// Unplug a simulated device; transfers on connected clients will fail.
+void SISimDeviceDetach(SISimDevice *device);
+
 #undef SI_PACKED
 
 #ifdef __cplusplus
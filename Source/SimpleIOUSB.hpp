@@ -0,0 +1,507 @@
+//
+//  SimpleIOUSB.hpp
+//
+//  Copyright (c) 2022-2025 Jon Palmisciano. All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are met:
+//
+//  1. Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+//
+//  2. Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+//
+//  3. Neither the name of the copyright holder nor the names of its
+//     contributors may be used to endorse or promote products derived from
+//     this software without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+//  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+//  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+//  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+//  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+//  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+//  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+//  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+//  CONTRACT, STRICT LIABILITY, OR TORT(INCLUDING NEGLIGENCE OR OTHERWISE)
+//  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+//  POSSIBILITY OF SUCH DAMAGE.
+//
+
+#pragma once
+
+// Optional C++20 layer over the asynchronous transfer API, for running
+// device sessions as coroutines:
+//
+//     si::Task<> Session(SIClientPool *pool, SIClient *client)
+//     {
+//         co_await si::ResumeOn(pool, client);
+//         SITransferResult result = co_await si::ReadPipe(client, 1, buffer, sizeof(buffer));
+//         ...
+//     }
+//
+//     si::Spawn(Session(pool, client));
+//
+// Each operation embeds its 'SITransfer' in the awaiting coroutine's frame,
+// so nothing is allocated per operation, and the coroutine is resumed
+// straight from the transfer's completion callback: on whichever thread is
+// running 'SIHandleEvents' for the client, which for pooled clients is
+// their worker. Everything here is header-only; the C API is unchanged.
+
+#include "SimpleIOUSB.h"
+
+#if !defined(__cpp_impl_coroutine)
+#error "SimpleIOUSB.hpp requires C++20 coroutines."
+#endif
+
+#include <atomic>
+#include <coroutine>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <optional>
+#include <utility>
+
+namespace si {
+
+namespace detail {
+
+/// Shared by the transfer awaitables: submit on suspension, and resume the
+/// awaiting coroutine from the completion callback.
+class TransferAwaiter {
+public:
+    TransferAwaiter(TransferAwaiter const &) = delete;
+    TransferAwaiter &operator=(TransferAwaiter const &) = delete;
+
+    bool await_ready() const noexcept { return false; }
+
+    bool await_suspend(std::coroutine_handle<> handle) noexcept
+    {
+        handle_ = handle;
+        IOReturn ret = SISubmitTransfer(&transfer_);
+        if (ret != kIOReturnSuccess) {
+            Fail(ret);
+            return false;
+        }
+
+        // The transfer may have completed already, on this thread or
+        // another; if so, carry on without suspending.
+        int submitting = kSubmitting;
+        return state_.compare_exchange_strong(submitting, kSuspended, std::memory_order_acq_rel);
+    }
+
+    SITransferResult await_resume() const noexcept { return transfer_.result; }
+
+protected:
+    TransferAwaiter(SIClient *client, uint8_t pipe, void *buffer, uint32_t length, SICancelToken *token,
+        SITransferCallback callback) noexcept
+    {
+        SITransferInit(&transfer_, client, pipe, buffer, length, callback, this);
+        transfer_.token = token;
+    }
+
+    void Fail(IOReturn error) noexcept
+    {
+        transfer_.result = SITransferResult {};
+        transfer_.result.error = error;
+    }
+
+    static void Completed(SITransfer *transfer) noexcept
+    {
+        auto *self = static_cast<TransferAwaiter *>(transfer->context);
+        std::coroutine_handle<> handle = self->handle_;
+
+        // Once resumed, the coroutine may destroy this awaiter.
+        if (self->state_.exchange(kCompleted, std::memory_order_acq_rel) == kSuspended)
+            handle.resume();
+    }
+
+    SITransfer transfer_;
+
+private:
+    enum { kSubmitting, kSuspended, kCompleted };
+
+    std::coroutine_handle<> handle_;
+    std::atomic<int> state_ { kSubmitting };
+};
+
+class ReadPipeAwaiter : public TransferAwaiter {
+public:
+    ReadPipeAwaiter(SIClient *client, uint8_t pipe, void *buffer, uint32_t length, SICancelToken *token) noexcept
+        : TransferAwaiter(client, pipe, buffer, length, token, Completed)
+    {
+    }
+};
+
+class WritePipeAwaiter : public TransferAwaiter {
+public:
+    WritePipeAwaiter(SIClient *client, uint8_t pipe, void const *buffer, uint32_t length,
+        SICancelToken *token) noexcept
+        : TransferAwaiter(client, pipe, const_cast<void *>(buffer), length, token, Completed)
+    {
+    }
+};
+
+/// Largest data stage a control transfer carries in the awaiting frame.
+inline constexpr size_t kControlInlineSize = 0x100;
+
+class ControlTransferAwaiter : public TransferAwaiter {
+public:
+    ControlTransferAwaiter(SIClient *client, uint8_t requestType, uint8_t request, uint16_t value, uint16_t index,
+        void *data, uint16_t length, SICancelToken *token) noexcept
+        : TransferAwaiter(client, 0, storage_, static_cast<uint32_t>(sizeof(SISetupPacket) + length), token,
+            ControlCompleted)
+        , data_(data)
+    {
+        if (length > kControlInlineSize)
+            return;
+
+        SIFillSetupPacket(storage_, requestType, request, value, index, length);
+        if (!(requestType & kSIDirectionToHost) && data)
+            std::memcpy(storage_ + sizeof(SISetupPacket), data, length);
+        else if (!(requestType & kSIDirectionToHost))
+            std::memset(storage_ + sizeof(SISetupPacket), 0, length);
+    }
+
+    bool await_suspend(std::coroutine_handle<> handle) noexcept
+    {
+        if (transfer_.length > sizeof(storage_)) {
+            Fail(kIOReturnBadArgument);
+            return false;
+        }
+        return TransferAwaiter::await_suspend(handle);
+    }
+
+private:
+    static void ControlCompleted(SITransfer *transfer) noexcept
+    {
+        auto *self = static_cast<ControlTransferAwaiter *>(static_cast<TransferAwaiter *>(transfer->context));
+        uint8_t requestType = reinterpret_cast<SISetupPacket const *>(self->storage_)->bmRequestType;
+        if ((requestType & kSIDirectionToHost) && self->data_)
+            std::memcpy(self->data_, self->storage_ + sizeof(SISetupPacket), transfer->result.length);
+        Completed(transfer);
+    }
+
+    void *data_;
+    alignas(8) uint8_t storage_[sizeof(SISetupPacket) + kControlInlineSize];
+};
+
+class ControlTransferInPlaceAwaiter : public TransferAwaiter {
+public:
+    ControlTransferInPlaceAwaiter(SIClient *client, void *buffer, uint32_t length, SICancelToken *token) noexcept
+        : TransferAwaiter(client, 0, buffer, length, token, Completed)
+    {
+    }
+};
+
+/// Continues a coroutine on a client's pool worker.
+class ResumeOnAwaiter {
+public:
+    ResumeOnAwaiter(SIClientPool *pool, SIClient *client) noexcept
+        : pool_(pool)
+        , client_(client)
+    {
+    }
+
+    bool await_ready() const noexcept { return false; }
+
+    bool await_suspend(std::coroutine_handle<> handle) noexcept
+    {
+        // Once dispatched, the worker may resume the coroutine (and destroy
+        // this awaiter) before the call even returns.
+        IOReturn ret = SIClientPoolDispatch(pool_, client_, Resume, handle.address());
+        if (ret == kIOReturnSuccess)
+            return true;
+
+        ret_ = ret;
+        return false;
+    }
+
+    IOReturn await_resume() const noexcept { return ret_; }
+
+private:
+    static void Resume(void *context) noexcept { std::coroutine_handle<>::from_address(context).resume(); }
+
+    SIClientPool *pool_;
+    SIClient *client_;
+    IOReturn ret_ = kIOReturnSuccess;
+};
+
+template <typename Promise>
+struct FinalAwaiter {
+    bool await_ready() const noexcept { return false; }
+
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept
+    {
+        Promise &promise = handle.promise();
+        if (promise.detached) {
+            handle.destroy();
+            return std::noop_coroutine();
+        }
+        return promise.continuation ? promise.continuation : std::noop_coroutine();
+    }
+
+    void await_resume() const noexcept { }
+};
+
+struct PromiseBase {
+    std::coroutine_handle<> continuation;
+    bool detached = false;
+
+    std::suspend_always initial_suspend() const noexcept { return {}; }
+
+    // The library doesn't throw, and a session which does has nowhere to go.
+    void unhandled_exception() const noexcept { std::terminate(); }
+};
+
+template <typename T>
+struct Promise : PromiseBase {
+    std::optional<T> value;
+
+    void return_value(T result) { value.emplace(std::move(result)); }
+    T Take() { return std::move(*value); }
+};
+
+template <>
+struct Promise<void> : PromiseBase {
+    void return_void() const noexcept { }
+    void Take() const noexcept { }
+};
+
+} // namespace detail
+
+/// Coroutine which starts when awaited (or spawned) and resumes its awaiter
+/// when it finishes, without a thread hop.
+template <typename T = void>
+class [[nodiscard]] Task {
+public:
+    struct promise_type : detail::Promise<T> {
+        Task get_return_object() noexcept { return Task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+        detail::FinalAwaiter<promise_type> final_suspend() const noexcept { return {}; }
+    };
+
+    Task(Task &&other) noexcept
+        : handle_(std::exchange(other.handle_, nullptr))
+    {
+    }
+
+    Task &operator=(Task &&other) noexcept
+    {
+        if (this != &other) {
+            if (handle_)
+                handle_.destroy();
+            handle_ = std::exchange(other.handle_, nullptr);
+        }
+        return *this;
+    }
+
+    ~Task()
+    {
+        if (handle_)
+            handle_.destroy();
+    }
+
+    auto operator co_await() && noexcept
+    {
+        struct Awaiter {
+            std::coroutine_handle<promise_type> handle;
+
+            bool await_ready() const noexcept { return false; }
+
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<> continuation) noexcept
+            {
+                handle.promise().continuation = continuation;
+                return handle;
+            }
+
+            T await_resume() { return handle.promise().Take(); }
+        };
+        return Awaiter { handle_ };
+    }
+
+private:
+    explicit Task(std::coroutine_handle<promise_type> handle) noexcept
+        : handle_(handle)
+    {
+    }
+
+    friend void Spawn(Task<void> task) noexcept;
+
+    std::coroutine_handle<promise_type> handle_;
+};
+
+/// Start a task without waiting for it; it cleans up after itself when done.
+inline void Spawn(Task<void> task) noexcept
+{
+    auto handle = std::exchange(task.handle_, nullptr);
+    handle.promise().detached = true;
+    handle.resume();
+}
+
+/// Read from a pipe: 'co_await' gives the 'SITransferResult'.
+///
+/// Like everything else here, the buffer must stay valid until the
+/// operation completes, and cancelling 'token' aborts it.
+inline detail::ReadPipeAwaiter ReadPipe(SIClient *client, uint8_t pipe, void *buffer, uint32_t length,
+    SICancelToken *token = nullptr) noexcept
+{
+    return detail::ReadPipeAwaiter(client, pipe, buffer, length, token);
+}
+
+/// Write to a pipe.
+inline detail::WritePipeAwaiter WritePipe(SIClient *client, uint8_t pipe, void const *buffer, uint32_t length,
+    SICancelToken *token = nullptr) noexcept
+{
+    return detail::WritePipeAwaiter(client, pipe, buffer, length, token);
+}
+
+/// Perform a control transfer of up to 'detail::kControlInlineSize' bytes,
+/// staged in the awaiting frame; longer ones fail with 'kIOReturnBadArgument'
+/// (see 'ControlTransferInPlace').
+inline detail::ControlTransferAwaiter ControlTransfer(SIClient *client, uint8_t requestType, uint8_t request,
+    uint16_t value, uint16_t index, void *data, uint16_t length, SICancelToken *token = nullptr) noexcept
+{
+    return detail::ControlTransferAwaiter(client, requestType, request, value, index, data, length, token);
+}
+
+/// Perform a control transfer on a buffer laid out as for 'SITransfer': an
+/// 'SISetupPacket' (see 'SIFillSetupPacket'), followed by the data stage.
+inline detail::ControlTransferInPlaceAwaiter ControlTransferInPlace(SIClient *client, void *buffer, uint32_t length,
+    SICancelToken *token = nullptr) noexcept
+{
+    return detail::ControlTransferInPlaceAwaiter(client, buffer, length, token);
+}
+
+/// Continue on the worker servicing a client in a pool, where its
+/// completions will resume the coroutine from then on. 'co_await' gives the
+/// result of 'SIClientPoolDispatch'; on failure, the coroutine carries on
+/// where it was.
+inline detail::ResumeOnAwaiter ResumeOn(SIClientPool *pool, SIClient *client) noexcept
+{
+    return detail::ResumeOnAwaiter(pool, client);
+}
+
+/// Hotplug monitor whose events are awaited rather than called back.
+///
+/// Events are delivered from 'HandleEvents', which should be called from
+/// the thread the awaiting coroutines run on whenever 'GetFD' polls
+/// readable; a monitor isn't meant to be shared between threads.
+class HotplugMonitor {
+public:
+    struct Event {
+        SIClient *client; ///< Connected client, which belongs to the awaiter; NULL for disconnects.
+        uint64_t id;      ///< Registry ID of a disconnected device.
+    };
+
+    HotplugMonitor() = default;
+    HotplugMonitor(HotplugMonitor const &) = delete;
+    HotplugMonitor &operator=(HotplugMonitor const &) = delete;
+
+    ~HotplugMonitor()
+    {
+        if (monitor_)
+            SIHotplugMonitorDestroy(monitor_);
+        for (Event const &event : events_) {
+            if (event.client)
+                SIClientDestroy(event.client);
+        }
+    }
+
+    /// Start monitoring; devices already present are queued as connected.
+    IOReturn Open(SIFilterSet const *filters)
+    {
+        static SIAsyncCallbacks const kCallbacks = { Connected, Disconnected };
+
+        sCurrent = this;
+        IOReturn ret = SIHotplugMonitorCreate(filters, &kCallbacks, &monitor_);
+        sCurrent = nullptr;
+        Deliver();
+        return ret;
+    }
+
+    /// Get the monitor's descriptor, or -1 if it isn't open.
+    int GetFD() const noexcept { return monitor_ ? SIHotplugMonitorGetFD(monitor_) : -1; }
+
+    /// Wait for hotplug events and resume whichever coroutines they're for.
+    IOReturn HandleEvents(int timeoutMs)
+    {
+        if (!monitor_)
+            return kIOReturnNotOpen;
+
+        sCurrent = this;
+        IOReturn ret = SIHotplugMonitorHandleEvents(monitor_, timeoutMs);
+        sCurrent = nullptr;
+        Deliver();
+        return ret;
+    }
+
+    class NextAwaiter {
+    public:
+        explicit NextAwaiter(HotplugMonitor *monitor) noexcept
+            : monitor_(monitor)
+        {
+        }
+
+        bool await_ready() const noexcept { return !monitor_->events_.empty(); }
+
+        void await_suspend(std::coroutine_handle<> handle) noexcept
+        {
+            handle_ = handle;
+            *monitor_->waitersTail_ = this;
+            monitor_->waitersTail_ = &next_;
+        }
+
+        Event await_resume()
+        {
+            if (event_)
+                return *event_;
+
+            Event event = monitor_->events_.front();
+            monitor_->events_.pop_front();
+            return event;
+        }
+
+    private:
+        friend class HotplugMonitor;
+
+        HotplugMonitor *monitor_;
+        NextAwaiter *next_ = nullptr;
+        std::coroutine_handle<> handle_;
+        std::optional<Event> event_;
+    };
+
+    /// Wait for the next device to come or go.
+    NextAwaiter Next() noexcept { return NextAwaiter(this); }
+
+private:
+    static void Connected(SIClient *client) { sCurrent->events_.push_back(Event { client, 0 }); }
+    static void Disconnected(uint64_t id) { sCurrent->events_.push_back(Event { nullptr, id }); }
+
+    // Hand queued events to waiting coroutines, oldest first; a resumed
+    // coroutine may wait again, joining the back of the line.
+    void Deliver()
+    {
+        while (waiters_ && !events_.empty()) {
+            NextAwaiter *waiter = waiters_;
+            if (!(waiters_ = waiter->next_))
+                waitersTail_ = &waiters_;
+
+            waiter->event_ = events_.front();
+            events_.pop_front();
+            waiter->handle_.resume();
+        }
+    }
+
+    // Monitor callbacks carry no context, but are only invoked from within
+    // 'SIHotplugMonitorCreate' and 'SIHotplugMonitorHandleEvents'.
+    static inline thread_local HotplugMonitor *sCurrent = nullptr;
+
+    SIHotplugMonitor *monitor_ = nullptr;
+    std::deque<Event> events_;
+    NextAwaiter *waiters_ = nullptr;
+    NextAwaiter **waitersTail_ = &waiters_;
+};
+
+} // namespace si
@@ -0,0 +1,454 @@
+// Runs the usbfs backend against a fake device node: a regular file holding
+// the node's descriptors, under a temporary root passed to 'SIConnectAt',
+// with the usbfs ioctls answered by the 'ioctl' defined below in place of
+// libc's. Bulk OUT data loops back around to bulk IN.
+
+#include "SimpleIOUSB.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/usbdevice_fs.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define kVendorID 0x1234
+#define kProductID 0x5678
+
+static SIDeviceDescriptor const kDeviceDesc = {
+    .bLength = sizeof(SIDeviceDescriptor),
+    .bDescriptorType = kSIDescriptorTypeDevice,
+    .bcdUSB = 0x200,
+    .bMaxPacketSize = 64,
+    .idVendor = kVendorID,
+    .idProduct = kProductID,
+    .bNumConfigurations = 1,
+};
+
+// Interface 2, with bulk OUT 1, bulk IN 2 and isochronous IN 3.
+static uint8_t const kConfigDesc[] = {
+    9, kSIDescriptorTypeConfig, 39, 0, 1, 1, 0, 0x80, 50,
+    9, kSIDescriptorTypeInterface, 2, 0, 3, 0xff, 0xff, 0xff, 0,
+    7, kSIDescriptorTypeEndpoint, 0x01, 0x02, 0x00, 0x02, 0,
+    7, kSIDescriptorTypeEndpoint, 0x82, 0x02, 0x00, 0x02, 0,
+    7, kSIDescriptorTypeEndpoint, 0x83, 0x01, 0xc0, 0x00, 1,
+};
+
+#define kURBsMax 16
+
+static struct {
+    char root[0x100];
+    int claimed;                        ///< Claimed interface, or -1.
+    uint8_t loopback[0x20000];          ///< Bulk OUT data not yet read back.
+    size_t loopbackLength;
+    struct usbdevfs_urb *pending[kURBsMax];  ///< Submitted, not yet complete.
+    struct usbdevfs_urb *reapable[kURBsMax]; ///< Complete, not yet reaped.
+    int numPending;
+    int numReapable;
+    int submitted[kURBsMax];            ///< 'buffer_length' of each bulk URB submitted.
+    int numSubmitted;
+} sNode = { .claimed = -1 };
+
+static int sFailures = 0;
+
+#define CHECK(condition)                                                        \
+    do {                                                                        \
+        if (!(condition)) {                                                     \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+            sFailures++;                                                         \
+        }                                                                       \
+    } while (0)
+
+/// Whether 'fd' is open on something under the fake root.
+static int IsFakeNode(int fd)
+{
+    char link[0x40], path[0x200];
+    snprintf(link, sizeof(link), "/proc/self/fd/%d", fd);
+    ssize_t length = readlink(link, path, sizeof(path) - 1);
+    if (length < 0)
+        return 0;
+
+    path[length] = '\0';
+    size_t rootLength = strlen(sNode.root);
+    return rootLength && strncmp(path, sNode.root, rootLength) == 0 && path[rootLength] == '/';
+}
+
+static void Complete(struct usbdevfs_urb *urb)
+{
+    if (sNode.numReapable < kURBsMax)
+        sNode.reapable[sNode.numReapable++] = urb;
+}
+
+/// Hand looped back data to an IN URB, if there's any.
+static int FillIn(struct usbdevfs_urb *urb)
+{
+    if (!sNode.loopbackLength)
+        return 0;
+
+    size_t length = (size_t)urb->buffer_length;
+    if (length > sNode.loopbackLength)
+        length = sNode.loopbackLength;
+
+    memcpy(urb->buffer, sNode.loopback, length);
+    memmove(sNode.loopback, sNode.loopback + length, sNode.loopbackLength - length);
+    sNode.loopbackLength -= length;
+    urb->actual_length = (int)length;
+    return 1;
+}
+
+static int FakeControl(struct usbdevfs_ctrltransfer *req)
+{
+    if (req->bRequestType == (kSIDirectionToHost | kSITypeStandard | kSIRecipientDevice)
+        && req->bRequest == kSIRequestGetConfiguration && req->wLength == 1) {
+        *(uint8_t *)req->data = 1;
+        return 1;
+    }
+
+    // Vendor request 0x01 reads back its wValue, over and over.
+    if (req->bRequestType == (kSIDirectionToHost | kSITypeVendor | kSIRecipientDevice) && req->bRequest == 0x01) {
+        for (uint16_t i = 0; i < req->wLength; ++i)
+            ((uint8_t *)req->data)[i] = (uint8_t)(req->wValue + i);
+        return req->wLength;
+    }
+
+    errno = EPIPE;
+    return -1;
+}
+
+static int FakeSubmit(struct usbdevfs_urb *urb)
+{
+    urb->status = 0;
+    urb->actual_length = 0;
+
+    switch (urb->type) {
+    case USBDEVFS_URB_TYPE_CONTROL: {
+        struct usbdevfs_ctrltransfer req;
+        uint8_t *setup = urb->buffer;
+        req.bRequestType = setup[0];
+        req.bRequest = setup[1];
+        req.wValue = (uint16_t)(setup[2] | setup[3] << 8);
+        req.wIndex = (uint16_t)(setup[4] | setup[5] << 8);
+        req.wLength = (uint16_t)(setup[6] | setup[7] << 8);
+        req.data = setup + sizeof(SISetupPacket);
+        if (urb->buffer_length != (int)sizeof(SISetupPacket) + req.wLength) {
+            errno = EINVAL;
+            return -1;
+        }
+
+        int done = FakeControl(&req);
+        urb->status = done < 0 ? -errno : 0;
+        urb->actual_length = done < 0 ? 0 : done;
+        Complete(urb);
+        return 0;
+    }
+    case USBDEVFS_URB_TYPE_BULK:
+        if (sNode.numSubmitted < kURBsMax)
+            sNode.submitted[sNode.numSubmitted++] = urb->buffer_length;
+
+        if (!(urb->endpoint & 0x80)) {
+            if (sNode.loopbackLength + (size_t)urb->buffer_length > sizeof(sNode.loopback)) {
+                errno = ENOMEM;
+                return -1;
+            }
+
+            memcpy(sNode.loopback + sNode.loopbackLength, urb->buffer, (size_t)urb->buffer_length);
+            sNode.loopbackLength += (size_t)urb->buffer_length;
+            urb->actual_length = urb->buffer_length;
+            Complete(urb);
+        } else if (FillIn(urb)) {
+            Complete(urb);
+        } else if (sNode.numPending < kURBsMax) {
+            sNode.pending[sNode.numPending++] = urb;
+        }
+        return 0;
+    case USBDEVFS_URB_TYPE_ISO: {
+        // Every third packet comes up short, and every fourth arrives late.
+        uint8_t *data = urb->buffer;
+        for (int i = 0; i < urb->number_of_packets; ++i) {
+            struct usbdevfs_iso_packet_desc *desc = &urb->iso_frame_desc[i];
+            desc->actual_length = i % 3 == 2 ? desc->length / 2 : desc->length;
+            desc->status = i % 4 == 3 ? -EXDEV : 0;
+            memset(data, i, desc->actual_length);
+            data += desc->length;
+        }
+        Complete(urb);
+        return 0;
+    }
+    default:
+        errno = EINVAL;
+        return -1;
+    }
+}
+
+static int FakeDiscard(struct usbdevfs_urb *urb)
+{
+    for (int i = 0; i < sNode.numPending; ++i) {
+        if (sNode.pending[i] != urb)
+            continue;
+
+        sNode.pending[i] = sNode.pending[--sNode.numPending];
+        urb->status = -ENOENT;
+        Complete(urb);
+        return 0;
+    }
+
+    errno = EINVAL;
+    return -1;
+}
+
+static int FakeReap(struct usbdevfs_urb **urbOut)
+{
+    if (!sNode.numReapable) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    *urbOut = sNode.reapable[0];
+    memmove(sNode.reapable, sNode.reapable + 1, --sNode.numReapable * sizeof(sNode.reapable[0]));
+    return 0;
+}
+
+int ioctl(int fd, unsigned long request, ...)
+{
+    va_list args;
+    va_start(args, request);
+    void *arg = va_arg(args, void *);
+    va_end(args);
+
+    if (!IsFakeNode(fd))
+        return (int)syscall(SYS_ioctl, fd, request, arg);
+
+    switch (request) {
+    case USBDEVFS_GET_CAPABILITIES:
+        // No 'USBDEVFS_CAP_NO_PACKET_SIZE_LIM', so bulk transfers go in chunks.
+        *(uint32_t *)arg = 0;
+        return 0;
+    case USBDEVFS_CONTROL:
+        return FakeControl(arg);
+    case USBDEVFS_SETCONFIGURATION:
+        return 0;
+    case USBDEVFS_DISCONNECT_CLAIM:
+        sNode.claimed = (int)((struct usbdevfs_disconnect_claim *)arg)->interface;
+        return 0;
+    case USBDEVFS_RELEASEINTERFACE:
+        if (*(unsigned int *)arg != (unsigned int)sNode.claimed) {
+            errno = EINVAL;
+            return -1;
+        }
+        sNode.claimed = -1;
+        return 0;
+    case USBDEVFS_SUBMITURB:
+        return FakeSubmit(arg);
+    case USBDEVFS_DISCARDURB:
+        return FakeDiscard(arg);
+    case USBDEVFS_REAPURBNDELAY:
+        return FakeReap(arg);
+    default:
+        errno = ENOTTY;
+        return -1;
+    }
+}
+
+static int CreateNode(char *busPath, size_t busSize, char *devPath, size_t devSize)
+{
+    snprintf(sNode.root, sizeof(sNode.root), "%s/si-usbfs-XXXXXX", getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp");
+    if (!mkdtemp(sNode.root))
+        return -1;
+
+    snprintf(busPath, busSize, "%s/001", sNode.root);
+    snprintf(devPath, devSize, "%s/002", busPath);
+    if (mkdir(busPath, 0700) < 0)
+        return -1;
+
+    int fd = open(devPath, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (fd < 0)
+        return -1;
+
+    int ok = write(fd, &kDeviceDesc, sizeof(kDeviceDesc)) == (ssize_t)sizeof(kDeviceDesc)
+        && write(fd, kConfigDesc, sizeof(kConfigDesc)) == (ssize_t)sizeof(kConfigDesc);
+    close(fd);
+    return ok ? 0 : -1;
+}
+
+static void Completed(SITransfer *transfer)
+{
+    *(int *)transfer->context = 1;
+}
+
+static void TestPipes(SIClient *client)
+{
+    SIPipeProps pipe;
+    CHECK(SIGetPipe(client, 0, &pipe) == kIOReturnSuccess);
+    CHECK(pipe.type == kSIPipeTypeControl && pipe.max == 64);
+
+    CHECK(SIGetPipe(client, 1, &pipe) == kIOReturnSuccess);
+    CHECK(pipe.type == kSIPipeTypeBulk && pipe.direction == kSIPipeDirectionOut);
+    CHECK(pipe.endpoint == 1 && pipe.max == 512);
+
+    CHECK(SIGetPipe(client, 2, &pipe) == kIOReturnSuccess);
+    CHECK(pipe.type == kSIPipeTypeBulk && pipe.direction == kSIPipeDirectionIn);
+    CHECK(pipe.endpoint == 2 && pipe.max == 512);
+
+    CHECK(SIGetPipe(client, 3, &pipe) == kIOReturnSuccess);
+    CHECK(pipe.type == kSIPipeTypeIsochronous && pipe.direction == kSIPipeDirectionIn);
+    CHECK(pipe.endpoint == 3 && pipe.max == 192 && pipe.interval == 1);
+
+    CHECK(SIGetPipe(client, 4, &pipe) == kIOReturnBadArgument);
+    CHECK(sNode.claimed == 2);
+}
+
+static void TestBulk(SIClient *client)
+{
+    static uint8_t out[40000], in[0x10000];
+    for (size_t i = 0; i < sizeof(out); ++i)
+        out[i] = (uint8_t)(i * 7);
+
+    // Without 'USBDEVFS_CAP_NO_PACKET_SIZE_LIM' a big write goes in chunks.
+    sNode.numSubmitted = 0;
+    CHECK(SIWritePipe(client, 1, out, sizeof(out)) == kIOReturnSuccess);
+    CHECK(sNode.numSubmitted == 3);
+    CHECK(sNode.submitted[0] == 0x4000 && sNode.submitted[1] == 0x4000);
+    CHECK(sNode.submitted[2] == (int)sizeof(out) - 2 * 0x4000);
+
+    // A read with room to spare keeps going after full chunks, and stops at
+    // the first short one.
+    sNode.numSubmitted = 0;
+    uint32_t length = sizeof(in);
+    CHECK(SIReadPipe(client, 2, in, &length) == kIOReturnSuccess);
+    CHECK(length == sizeof(out));
+    CHECK(memcmp(in, out, sizeof(out)) == 0);
+    CHECK(sNode.numSubmitted == 3);
+
+    CHECK(SIWritePipe(client, 1, out, 100) == kIOReturnSuccess);
+    length = sizeof(in);
+    CHECK(SIReadPipe(client, 2, in, &length) == kIOReturnSuccess);
+    CHECK(length == 100);
+
+    CHECK(SIWritePipe(client, 2, out, 100) == kIOReturnNotWritable);
+}
+
+static void TestCancel(SIClient *client)
+{
+    uint8_t buffer[512];
+    int done = 0;
+
+    // Nothing to read, so this sits with the kernel until given up.
+    SITransfer transfer;
+    SITransferInit(&transfer, client, 2, buffer, sizeof(buffer), Completed, &done);
+    CHECK(SISubmitTransfer(&transfer) == kIOReturnSuccess);
+    CHECK(SIHandleEvents(client, 0) == kIOReturnSuccess);
+    CHECK(!done && sNode.numPending == 1);
+
+    CHECK(SICancelTransfer(&transfer) == kIOReturnSuccess);
+    for (int i = 0; i < 10 && !done; ++i)
+        SIHandleEvents(client, 100);
+    CHECK(done);
+    CHECK(transfer.result.error == kIOReturnAborted && transfer.result.length == 0);
+}
+
+static void TestIsochronous(SIClient *client)
+{
+    uint8_t buffer[8 * 192];
+    SIIsoPacket packets[8];
+    for (int i = 0; i < 8; ++i)
+        packets[i].length = 192;
+
+    int done = 0;
+    SITransfer transfer;
+    SITransferInit(&transfer, client, 3, buffer, sizeof(buffer), Completed, &done);
+    transfer.packets = packets;
+    transfer.numPackets = 8;
+    CHECK(SISubmitTransfer(&transfer) == kIOReturnSuccess);
+    for (int i = 0; i < 10 && !done; ++i)
+        SIHandleEvents(client, 100);
+    CHECK(done);
+
+    uint32_t total = 0;
+    for (int i = 0; i < 8; ++i) {
+        CHECK(packets[i].actual == (i % 3 == 2 ? 96u : 192u));
+        CHECK(packets[i].status == (i % 4 == 3 ? kIOReturnIsoTooOld : kIOReturnSuccess));
+        CHECK(buffer[i * 192] == i);
+        total += packets[i].actual;
+    }
+    CHECK(transfer.result.error == kIOReturnSuccess && transfer.result.length == total);
+}
+
+static void TestControl(SIClient *client)
+{
+    uint8_t data[16];
+    SITransferResult result = SIControlTransfer(client, kSIDirectionToHost | kSITypeVendor | kSIRecipientDevice,
+        0x01, 0x40, 0, data, sizeof(data));
+    CHECK(result.error == kIOReturnSuccess && result.length == sizeof(data));
+    CHECK(data[0] == 0x40 && data[15] == 0x4f);
+
+    // Through the URB path, with the setup packet in the buffer.
+    uint8_t buffer[sizeof(SISetupPacket) + 4];
+    SIFillSetupPacket(buffer, kSIDirectionToHost | kSITypeVendor | kSIRecipientDevice, 0x01, 0x10, 0, 4);
+    int done = 0;
+    SITransfer transfer;
+    SITransferInit(&transfer, client, 0, buffer, sizeof(buffer), Completed, &done);
+    CHECK(SISubmitTransfer(&transfer) == kIOReturnSuccess);
+    for (int i = 0; i < 10 && !done; ++i)
+        SIHandleEvents(client, 100);
+    CHECK(done);
+    CHECK(transfer.result.error == kIOReturnSuccess && transfer.result.length == 4);
+    CHECK(buffer[sizeof(SISetupPacket)] == 0x10 && buffer[sizeof(SISetupPacket) + 3] == 0x13);
+
+    result = SIControlTransfer(client, kSIDirectionToHost | kSITypeVendor | kSIRecipientDevice, 0x02, 0, 0,
+        data, sizeof(data));
+    CHECK(result.error == kIOUSBPipeStalled);
+}
+
+int main(void)
+{
+    char busPath[0x200], devPath[0x300];
+    if (CreateNode(busPath, sizeof(busPath), devPath, sizeof(devPath)) < 0) {
+        perror("Failed to create device node");
+        return EXIT_FAILURE;
+    }
+
+    SIClient *client = SIClientCreateWithBackend(&kSIBackendUsbfs);
+    if (!client) {
+        fprintf(stderr, "Out of memory.\n");
+        return EXIT_FAILURE;
+    }
+
+    CHECK(SIConnectAt(client, sNode.root, kVendorID, kProductID + 1) == kIOReturnNoDevice);
+
+    IOReturn ret = SIConnectAt(client, sNode.root, kVendorID, kProductID);
+    if (ret != kIOReturnSuccess) {
+        fprintf(stderr, "Failed to connect. (%#x)\n", ret);
+        sFailures++;
+    } else {
+        CHECK(SIConnectAt(client, sNode.root, kVendorID, kProductID) == kIOReturnExclusiveAccess);
+
+        // A read left waiting for data that never comes fails rather than hangs.
+        SISetTimeouts(client, 1000, 1000);
+
+        TestPipes(client);
+        TestBulk(client);
+        TestCancel(client);
+        TestIsochronous(client);
+        TestControl(client);
+    }
+
+    SIClientDestroy(client);
+    CHECK(sNode.claimed == -1);
+
+    unlink(devPath);
+    rmdir(busPath);
+    rmdir(sNode.root);
+
+    if (sFailures) {
+        fprintf(stderr, "%d check(s) failed.\n", sFailures);
+        return EXIT_FAILURE;
+    }
+
+    puts("All usbfs checks passed.");
+    return EXIT_SUCCESS;
+}
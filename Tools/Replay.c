@@ -0,0 +1,789 @@
+// Replays a capture written by 'SICaptureOpen' (or any usbmon capture in
+// pcapng) against a simulated device which answers every control request
+// and read exactly as the captured device did, then reports how long the
+// library took over it. Transfers are replayed one at a time in the order
+// they were submitted, as fast as possible or, with '--timed', at the pace
+// they were captured at.
+//
+//     capture-replay [--timed] [--repeat <count>] <capture.pcapng>
+
+#include "SimpleIOUSB.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define kMaxInterfaces 16
+#define kMaxEndpoints 32
+#define kMaxClients 8
+
+// pcapng block types and the usbmon link type.
+#define kSectionHeader 0x0a0d0d0a
+#define kInterfaceDescription 1
+#define kEnhancedPacket 6
+#define kLinkTypeUsbmon 220
+
+// Header of each packet in a usbmon capture ('struct usbmon_packet').
+typedef struct {
+    uint64_t id;
+    uint8_t type;
+    uint8_t transferType;
+    uint8_t endpoint;
+    uint8_t device;
+    uint16_t bus;
+    char setupFlag;
+    char dataFlag;
+    int64_t seconds;
+    int32_t microseconds;
+    int32_t status;
+    uint32_t length;
+    uint32_t capturedLength;
+    uint8_t setup[8];
+    int32_t interval;
+    int32_t startFrame;
+    uint32_t transferFlags;
+    uint32_t numDescriptors;
+} UsbmonPacket;
+
+// usbmon's transfer types.
+enum { kUsbmonIsochronous, kUsbmonInterrupt, kUsbmonControl, kUsbmonBulk };
+
+// One submission and its completion.
+typedef struct {
+    uint64_t id;
+    uint64_t submitNs;
+    uint64_t completeNs;
+    uint8_t endpoint;
+    uint8_t transferType;
+    int complete;
+    SISetupPacket setup;
+    uint32_t requested;
+    uint8_t *out;
+    uint32_t outLength;
+    uint8_t *in;
+    uint32_t inLength; ///< Actual length on completion.
+    int32_t status;
+} Transaction;
+
+typedef struct {
+    Transaction *transactions;
+    size_t count;
+    size_t capacity;
+    int haveDevice;
+    uint16_t bus;
+    uint8_t device;
+    uint64_t skipped;
+} Capture;
+
+// Where each captured endpoint ended up on the replaying side.
+typedef struct {
+    uint8_t address;
+    uint8_t type; ///< 'SIPipeType'.
+    SIClient *client;
+    uint8_t pipe;       ///< As the client sees it.
+    uint8_t devicePipe; ///< As the simulated device sees it.
+} Endpoint;
+
+typedef struct {
+    Capture capture;
+    SIDeviceDescriptor desc;
+    SISimDevice *device;
+    SIClient *clients[kMaxClients];
+    int numClients;
+    Endpoint endpoints[kMaxEndpoints];
+    int numEndpoints;
+    int timed;
+    uint64_t startNs; ///< When the replay started, less when the capture did.
+    Transaction const *current;
+    uint64_t mismatches;
+} Replay;
+
+static uint64_t Now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static void SleepUntil(uint64_t deadline)
+{
+    uint64_t now;
+    while ((now = Now()) < deadline) {
+        uint64_t delta = deadline - now;
+        struct timespec ts = { .tv_sec = (time_t)(delta / 1000000000ull), .tv_nsec = (long)(delta % 1000000000ull) };
+        nanosleep(&ts, NULL);
+    }
+}
+
+// Translate a captured status back to what the library reported.
+static IOReturn StatusToIOReturn(int32_t status)
+{
+    switch (-status) {
+    case 0:
+        return kIOReturnSuccess;
+    case ENOENT:
+    case ECONNRESET:
+        return kIOReturnAborted;
+    case ETIMEDOUT:
+        return kIOReturnTimeout;
+    case EPIPE:
+        return kIOUSBPipeStalled;
+    case EOVERFLOW:
+        return kIOReturnOverrun;
+    case ENODEV:
+    case ESHUTDOWN:
+        return kIOReturnNoDevice;
+    default:
+        return kIOReturnIOError;
+    }
+}
+
+// Copy a payload, making up what was cut off by the snap length with zeroes.
+static uint8_t *Copy(void const *data, uint32_t captured, uint32_t length)
+{
+    uint8_t *copy = calloc(1, length ? length : 1);
+    if (!copy) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(copy, data, captured < length ? captured : length);
+    return copy;
+}
+
+static Transaction *FindOpen(Capture *capture, uint64_t id)
+{
+    // Completions usually follow their submissions closely.
+    for (size_t i = capture->count; i-- > 0;) {
+        if (capture->transactions[i].id == id && !capture->transactions[i].complete)
+            return &capture->transactions[i];
+    }
+    return NULL;
+}
+
+static void AddPacket(Capture *capture, UsbmonPacket const *packet, uint8_t const *data, uint64_t ns)
+{
+    // Replay the first device seen; isochronous transfers can't be.
+    if (!capture->haveDevice) {
+        capture->haveDevice = 1;
+        capture->bus = packet->bus;
+        capture->device = packet->device;
+    }
+    if (packet->bus != capture->bus || packet->device != capture->device
+        || packet->transferType == kUsbmonIsochronous) {
+        capture->skipped++;
+        return;
+    }
+
+    // Captures can start or end mid-transfer.
+    uint32_t dataLength = packet->dataFlag == 0 ? packet->capturedLength : 0;
+    if (packet->type == 'C') {
+        Transaction *transaction = FindOpen(capture, packet->id);
+        if (!transaction) {
+            capture->skipped++;
+            return;
+        }
+
+        transaction->complete = 1;
+        transaction->completeNs = ns;
+        transaction->status = packet->status;
+        transaction->inLength = packet->length;
+        if (transaction->endpoint & 0x80)
+            transaction->in = Copy(data, dataLength, packet->length);
+        return;
+    }
+    if (packet->type != 'S') {
+        capture->skipped++;
+        return;
+    }
+
+    if (capture->count == capture->capacity) {
+        size_t capacity = capture->capacity ? capture->capacity * 2 : 1024;
+        Transaction *transactions = realloc(capture->transactions, capacity * sizeof(Transaction));
+        if (!transactions) {
+            fprintf(stderr, "Out of memory.\n");
+            exit(EXIT_FAILURE);
+        }
+        capture->transactions = transactions;
+        capture->capacity = capacity;
+    }
+
+    Transaction *transaction = &capture->transactions[capture->count++];
+    *transaction = (Transaction) {
+        .id = packet->id,
+        .submitNs = ns,
+        .endpoint = packet->endpoint,
+        .transferType = packet->transferType,
+        .requested = packet->length,
+    };
+    if (packet->setupFlag == 0) {
+        memcpy(&transaction->setup, packet->setup, sizeof(transaction->setup));
+        transaction->endpoint = transaction->setup.bmRequestType & kSIDirectionToHost;
+    }
+    if (!(transaction->endpoint & 0x80)) {
+        transaction->outLength = packet->length;
+        transaction->out = Copy(data, dataLength, packet->length);
+    }
+}
+
+// Convert a timestamp to nanoseconds, by the interface's 'if_tsresol'.
+static uint64_t TimestampNs(uint64_t timestamp, uint8_t resolution)
+{
+    if (resolution & 0x80) {
+        int shift = resolution & 0x7f;
+        return shift >= 64 ? 0 : (uint64_t)((double)timestamp * 1e9 / (double)(1ull << shift));
+    }
+    for (int digits = resolution; digits > 9; --digits)
+        timestamp /= 10;
+    for (int digits = resolution; digits < 9; ++digits)
+        timestamp *= 10;
+    return timestamp;
+}
+
+static int LoadCapture(char const *path, Capture *capture)
+{
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        perror(path);
+        return -1;
+    }
+
+    uint16_t linkTypes[kMaxInterfaces];
+    uint8_t resolutions[kMaxInterfaces];
+    uint32_t numInterfaces = 0;
+    uint8_t *block = NULL;
+    size_t blockCapacity = 0;
+    int ret = -1;
+
+    uint32_t header[2];
+    while (fread(header, sizeof(header), 1, file) == 1) {
+        uint32_t type = header[0], length = header[1];
+        if (length < 12 || length % 4) {
+            fprintf(stderr, "Malformed block in capture.\n");
+            goto L_done;
+        }
+        if (length > blockCapacity) {
+            // On failure, 'block' is still ours to free.
+            uint8_t *grown = realloc(block, length);
+            if (!grown) {
+                fprintf(stderr, "Out of memory.\n");
+                goto L_done;
+            }
+            block = grown;
+            blockCapacity = length;
+        }
+        if (fread(block, length - sizeof(header), 1, file) != 1) {
+            fprintf(stderr, "Capture is truncated.\n");
+            goto L_done;
+        }
+
+        uint8_t const *body = block;
+        size_t bodyLength = length - 12;
+        if (type == kSectionHeader) {
+            if (bodyLength < 16 || *(uint32_t const *)body != 0x1a2b3c4d) {
+                fprintf(stderr, "Only captures in this machine's byte order are supported.\n");
+                goto L_done;
+            }
+            numInterfaces = 0;
+        } else if (type == kInterfaceDescription && bodyLength >= 8 && numInterfaces < kMaxInterfaces) {
+            linkTypes[numInterfaces] = *(uint16_t const *)body;
+            resolutions[numInterfaces] = 6;
+
+            // Look for 'if_tsresol' among the options.
+            for (size_t offset = 8; offset + 4 <= bodyLength;) {
+                uint16_t code = *(uint16_t const *)(body + offset), optionLength = *(uint16_t const *)(body + offset + 2);
+                if (code == 0 || offset + 4 + optionLength > bodyLength)
+                    break;
+                if (code == 9 && optionLength >= 1)
+                    resolutions[numInterfaces] = body[offset + 4];
+                offset += 4 + ((optionLength + 3u) & ~3u);
+            }
+            numInterfaces++;
+        } else if (type == kEnhancedPacket && bodyLength >= 20) {
+            uint32_t const *fields = (uint32_t const *)body;
+            uint32_t interface = fields[0], captured = fields[3];
+            if (interface >= numInterfaces || linkTypes[interface] != kLinkTypeUsbmon || captured > bodyLength - 20
+                || captured < sizeof(UsbmonPacket)) {
+                capture->skipped++;
+                continue;
+            }
+
+            UsbmonPacket packet;
+            memcpy(&packet, body + 20, sizeof(packet));
+            if (packet.capturedLength > captured - sizeof(UsbmonPacket))
+                packet.capturedLength = captured - (uint32_t)sizeof(UsbmonPacket);
+
+            uint64_t timestamp = (uint64_t)fields[1] << 32 | fields[2];
+            AddPacket(capture, &packet, body + 20 + sizeof(UsbmonPacket), TimestampNs(timestamp, resolutions[interface]));
+        }
+    }
+    ret = 0;
+
+L_done:
+    free(block);
+    fclose(file);
+    return ret;
+}
+
+// Find the longest captured reply to a standard GET_DESCRIPTOR request.
+static Transaction const *FindDescriptor(Capture const *capture, uint8_t type, uint8_t index)
+{
+    Transaction const *found = NULL;
+    for (size_t i = 0; i < capture->count; ++i) {
+        Transaction const *transaction = &capture->transactions[i];
+        if (transaction->complete && transaction->status == 0 && transaction->endpoint == 0x80
+            && transaction->setup.bmRequestType == (kSIDirectionToHost | kSITypeStandard | kSIRecipientDevice)
+            && transaction->setup.bRequest == kSIRequestGetDescriptor
+            && transaction->setup.wValue == (type << 8 | index)
+            && (!found || transaction->inLength > found->inLength))
+            found = transaction;
+    }
+    return found;
+}
+
+// Turn a captured string descriptor back into the UTF-8 the simulator
+// takes; unpaired surrogates are dropped.
+static void SetString(SISimDevice *device, uint8_t index, Transaction const *transaction)
+{
+    uint8_t const *desc = transaction->in;
+    uint32_t length = desc[0] < transaction->inLength ? desc[0] : transaction->inLength;
+    char string[126 * 4 + 1];
+    size_t used = 0;
+
+    for (uint32_t i = 2; i + 1 < length; i += 2) {
+        uint32_t cp = (uint32_t)(desc[i] | desc[i + 1] << 8);
+        if (cp >= 0xd800 && cp < 0xdc00 && i + 3 < length) {
+            uint32_t low = (uint32_t)(desc[i + 2] | desc[i + 3] << 8);
+            if (low < 0xdc00 || low >= 0xe000)
+                continue;
+            cp = 0x10000 + ((cp - 0xd800) << 10) + (low - 0xdc00);
+            i += 2;
+        } else if (cp >= 0xd800 && cp < 0xe000) {
+            continue;
+        }
+
+        if (cp < 0x80) {
+            string[used++] = (char)cp;
+        } else if (cp < 0x800) {
+            string[used++] = (char)(0xc0 | cp >> 6);
+            string[used++] = (char)(0x80 | (cp & 0x3f));
+        } else if (cp < 0x10000) {
+            string[used++] = (char)(0xe0 | cp >> 12);
+            string[used++] = (char)(0x80 | (cp >> 6 & 0x3f));
+            string[used++] = (char)(0x80 | (cp & 0x3f));
+        } else {
+            string[used++] = (char)(0xf0 | cp >> 18);
+            string[used++] = (char)(0x80 | (cp >> 12 & 0x3f));
+            string[used++] = (char)(0x80 | (cp >> 6 & 0x3f));
+            string[used++] = (char)(0x80 | (cp & 0x3f));
+        }
+    }
+    string[used] = '\0';
+
+    SISimDeviceSetString(device, index, string);
+}
+
+static int HasEndpoint(uint8_t const *config, size_t length, uint8_t address)
+{
+    SIDescriptorIterator it;
+    SIDescriptorIteratorInit(&it, config, length);
+
+    SIDescriptorHeader const *desc;
+    while ((desc = SIDescriptorIteratorNext(&it))) {
+        if (desc->bDescriptorType == kSIDescriptorTypeEndpoint
+            && ((SIEndpointDescriptor const *)desc)->bEndpointAddress == address)
+            return 1;
+    }
+    return 0;
+}
+
+// Build a configuration holding every endpoint the capture uses, seven to
+// an interface.
+static size_t SynthesizeConfig(Replay const *replay, uint8_t *config)
+{
+    int numInterfaces = (replay->numEndpoints + kSIPipesMax - 2) / (kSIPipesMax - 1);
+    if (!numInterfaces)
+        numInterfaces = 1;
+
+    size_t length = sizeof(SIConfigDescriptor);
+    for (int i = 0; i < numInterfaces; ++i) {
+        int first = i * (kSIPipesMax - 1), count = replay->numEndpoints - first;
+        if (count > kSIPipesMax - 1)
+            count = kSIPipesMax - 1;
+        if (count < 0)
+            count = 0;
+
+        SIInterfaceDescriptor interface = {
+            .bLength = sizeof(SIInterfaceDescriptor),
+            .bDescriptorType = kSIDescriptorTypeInterface,
+            .bInterfaceNumber = (uint8_t)i,
+            .bNumEndpoints = (uint8_t)count,
+            .bInterfaceClass = 0xff,
+            .bInterfaceSubClass = 0xff,
+            .bInterfaceProtocol = 0xff,
+        };
+        memcpy(config + length, &interface, sizeof(interface));
+        length += sizeof(interface);
+
+        for (int j = first; j < first + count; ++j) {
+            SIEndpointDescriptor endpoint = {
+                .bLength = sizeof(SIEndpointDescriptor),
+                .bDescriptorType = kSIDescriptorTypeEndpoint,
+                .bEndpointAddress = replay->endpoints[j].address,
+                .bmAttributes = replay->endpoints[j].type,
+                .wMaxPacketSize = 512,
+                .bInterval = replay->endpoints[j].type == kSIPipeTypeInterrupt ? 1 : 0,
+            };
+            memcpy(config + length, &endpoint, sizeof(endpoint));
+            length += sizeof(endpoint);
+        }
+    }
+
+    SIConfigDescriptor header = {
+        .bLength = sizeof(SIConfigDescriptor),
+        .bDescriptorType = kSIDescriptorTypeConfig,
+        .wTotalLength = (uint16_t)length,
+        .bNumInterfaces = (uint8_t)numInterfaces,
+        .bConfigurationValue = 1,
+        .bmAttributes = 0x80,
+        .bMaxPower = 250,
+    };
+    memcpy(config, &header, sizeof(header));
+    return length;
+}
+
+// Answer a control request from the transaction being replayed.
+static SITransferResult HandleRequest(void *context, uint8_t requestType, uint8_t request, uint16_t value,
+    uint16_t index, void *data, size_t length)
+{
+    Replay *replay = context;
+    Transaction const *transaction = replay->current;
+    SISetupPacket const *setup = &transaction->setup;
+    if (setup->bmRequestType != requestType || setup->bRequest != request || setup->wValue != value
+        || setup->wIndex != index || setup->wLength != length) {
+        replay->mismatches++;
+        return (SITransferResult) { .error = kIOUSBPipeStalled, .length = 0 };
+    }
+
+    if (replay->timed)
+        SleepUntil(replay->startNs + transaction->completeNs);
+
+    uint32_t reply = 0;
+    if (transaction->in) {
+        reply = transaction->inLength < length ? transaction->inLength : (uint32_t)length;
+        memcpy(data, transaction->in, reply);
+    }
+    return (SITransferResult) { .error = StatusToIOReturn(transaction->status), .length = reply };
+}
+
+static Endpoint *FindEndpoint(Replay *replay, uint8_t address)
+{
+    for (int i = 0; i < replay->numEndpoints; ++i) {
+        if (replay->endpoints[i].address == address)
+            return &replay->endpoints[i];
+    }
+    return NULL;
+}
+
+static int SetUp(Replay *replay)
+{
+    Capture *capture = &replay->capture;
+
+    // Gather the endpoints and control requests the capture uses; the
+    // simulator has room for a handler per distinct request, not per
+    // transfer.
+    static uint8_t handled[0x10000 / 8];
+    for (size_t i = 0; i < capture->count; ++i) {
+        Transaction const *transaction = &capture->transactions[i];
+        if ((transaction->endpoint & 0x7f) == 0) {
+            uint8_t requestType = transaction->setup.bmRequestType, request = transaction->setup.bRequest;
+            unsigned key = (unsigned)requestType << 8 | request;
+            if (handled[key / 8] & (1 << key % 8))
+                continue;
+
+            IOReturn ret = SISimDeviceAddControlHandler(replay->device, requestType, request, HandleRequest, replay);
+            if (ret != kIOReturnSuccess) {
+                fprintf(stderr, "Failed to handle control request %#04x/%#04x. (%#x)\n", requestType, request, ret);
+                return -1;
+            }
+            handled[key / 8] |= (uint8_t)(1 << key % 8);
+        } else if (!FindEndpoint(replay, transaction->endpoint) && replay->numEndpoints < kMaxEndpoints) {
+            replay->endpoints[replay->numEndpoints++] = (Endpoint) {
+                .address = transaction->endpoint,
+                .type = transaction->transferType == kUsbmonInterrupt ? kSIPipeTypeInterrupt : kSIPipeTypeBulk,
+            };
+        }
+    }
+
+    // Use the captured descriptors where there are any, as long as they
+    // describe every endpoint.
+    static uint8_t config[0x10000];
+    size_t configLength = 0;
+    Transaction const *configDesc = FindDescriptor(capture, kSIDescriptorTypeConfig, 0);
+    if (configDesc && configDesc->inLength >= sizeof(SIConfigDescriptor)
+        && configDesc->inLength >= ((SIConfigDescriptor const *)configDesc->in)->wTotalLength) {
+        configLength = ((SIConfigDescriptor const *)configDesc->in)->wTotalLength;
+        memcpy(config, configDesc->in, configLength);
+        for (int i = 0; i < replay->numEndpoints; ++i) {
+            if (!HasEndpoint(config, configLength, replay->endpoints[i].address))
+                configLength = 0;
+        }
+    }
+    if (!configLength)
+        configLength = SynthesizeConfig(replay, config);
+    SISimDeviceAddConfig(replay->device, config, configLength);
+
+    for (unsigned index = 0; index < 256; ++index) {
+        Transaction const *string = FindDescriptor(capture, kSIDescriptorTypeString, (uint8_t)index);
+        if (string && string->inLength >= 2)
+            SetString(replay->device, (uint8_t)index, string);
+    }
+
+    SISimDeviceAttach(replay->device);
+    SIClient *client = SIClientCreateWithBackend(&kSIBackendSimulated);
+    if (!client) {
+        fprintf(stderr, "Out of memory.\n");
+        return -1;
+    }
+
+    IOReturn ret = SIConnect(client, replay->desc.idVendor, replay->desc.idProduct);
+    if (ret != kIOReturnSuccess) {
+        SIClientDestroy(client);
+        fprintf(stderr, "Failed to connect to the replayed device. (%#x)\n", ret);
+        return -1;
+    }
+    replay->clients[replay->numClients++] = client;
+
+    // Pipes are numbered across interfaces on the device, and from one on
+    // each interface's client.
+    SIDescriptorIterator it;
+    SIDescriptorIteratorInit(&it, config, configLength);
+    SIInterfaceDescriptor const *interface;
+    uint8_t devicePipe = 0;
+    int first = 1;
+    while ((interface = SIDescriptorIteratorNextInterface(&it))) {
+        if (interface->bAlternateSetting != 0)
+            continue;
+        if (!first && replay->numClients < kMaxClients
+            && SIClaimInterface(replay->clients[0], interface->bInterfaceNumber, &client) == kIOReturnSuccess)
+            replay->clients[replay->numClients++] = client;
+        else if (!first)
+            break;
+        first = 0;
+
+        SIPipeProps props;
+        for (uint8_t pipe = 1; pipe < kSIPipesMax && SIGetPipe(client, pipe, &props) == kIOReturnSuccess; ++pipe) {
+            uint8_t address = (uint8_t)(props.endpoint | (props.direction == kSIPipeDirectionIn ? 0x80 : 0));
+            Endpoint *endpoint = FindEndpoint(replay, address);
+            ++devicePipe;
+            if (!endpoint)
+                continue;
+
+            endpoint->client = client;
+            endpoint->pipe = pipe;
+            endpoint->devicePipe = devicePipe;
+
+            // What's written is already known to match the capture.
+            if (!(address & 0x80))
+                SISimDeviceConfigurePipe(replay->device, devicePipe, &(SISimPipeConfig) { .flags = kSISimPipeDiscard });
+        }
+    }
+
+    return 0;
+}
+
+static void ReplayControl(Replay *replay, Transaction const *transaction, uint8_t *buffer)
+{
+    SISetupPacket const *setup = &transaction->setup;
+    if (transaction->out)
+        memcpy(buffer, transaction->out, transaction->outLength);
+
+    replay->current = transaction;
+    SITransferResult result = SIControlTransfer(replay->clients[0], setup->bmRequestType, setup->bRequest,
+        setup->wValue, setup->wIndex, buffer, setup->wLength);
+
+    // Standard requests are answered by the simulator from the descriptors.
+    if (result.error != StatusToIOReturn(transaction->status)
+        || (transaction->in && (result.length != transaction->inLength
+            || memcmp(buffer, transaction->in, result.length) != 0)))
+        replay->mismatches++;
+}
+
+static void ReplayPipe(Replay *replay, Transaction const *transaction, uint8_t *buffer)
+{
+    Endpoint const *endpoint = FindEndpoint(replay, transaction->endpoint);
+    if (!endpoint || !endpoint->client) {
+        replay->capture.skipped++;
+        return;
+    }
+
+    // Failures are injected for the one transfer; reads don't wait for
+    // data when there's going to be none.
+    IOReturn expected = StatusToIOReturn(transaction->status);
+    SISimPipeConfig normal = { .flags = transaction->endpoint & 0x80 ? 0 : kSISimPipeDiscard };
+    if (expected != kIOReturnSuccess) {
+        SISimPipeConfig failing = { .failEvery = 1, .failWith = expected, .flags = normal.flags | kSISimPipeAutofill };
+        SISimDeviceConfigurePipe(replay->device, endpoint->devicePipe, &failing);
+    }
+
+    IOReturn ret;
+    if (transaction->endpoint & 0x80) {
+        if (replay->timed)
+            SleepUntil(replay->startNs + transaction->completeNs);
+        if (expected == kIOReturnSuccess)
+            SISimDevicePush(replay->device, endpoint->devicePipe, transaction->in, transaction->inLength);
+
+        uint32_t length = transaction->requested;
+        ret = SIReadPipe(endpoint->client, endpoint->pipe, buffer, &length);
+        if (ret == kIOReturnSuccess && (length != transaction->inLength || memcmp(buffer, transaction->in, length) != 0))
+            replay->mismatches++;
+    } else {
+        ret = SIWritePipe(endpoint->client, endpoint->pipe, transaction->out, transaction->outLength);
+        if (replay->timed)
+            SleepUntil(replay->startNs + transaction->completeNs);
+    }
+
+    if (ret != expected)
+        replay->mismatches++;
+    if (expected != kIOReturnSuccess)
+        SISimDeviceConfigurePipe(replay->device, endpoint->devicePipe, &normal);
+}
+
+static void PrintHistogram(char const *name, SIPipeStats const *stats)
+{
+    if (!stats->transfers)
+        return;
+
+    printf("  %-22s %10" PRIu64 " %12" PRIu64 " %10" PRIu64 " %10" PRIu64 " %10" PRIu64 "\n", name, stats->transfers,
+        stats->bytes, stats->errors, SIHistogramPercentileNs(&stats->latency, 50),
+        SIHistogramPercentileNs(&stats->latency, 99));
+}
+
+int main(int argc, char const **argv)
+{
+    Replay replay = { 0 };
+    unsigned long repeat = 1;
+    char const *path = NULL;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--timed") == 0)
+            replay.timed = 1;
+        else if (strcmp(argv[i], "--repeat") == 0 && i + 1 < argc)
+            repeat = strtoul(argv[++i], NULL, 0);
+        else if (!path && argv[i][0] != '-')
+            path = argv[i];
+        else
+            path = NULL, i = argc;
+    }
+    if (!path || !repeat) {
+        fprintf(stderr, "usage: %s [--timed] [--repeat <count>] <capture.pcapng>\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    Capture *capture = &replay.capture;
+    if (LoadCapture(path, capture) != 0)
+        return EXIT_FAILURE;
+
+    // Transfers still in flight when the capture ended have nothing to
+    // answer them with.
+    size_t kept = 0;
+    for (size_t i = 0; i < capture->count; ++i) {
+        Transaction *transaction = &capture->transactions[i];
+        if (transaction->complete) {
+            capture->transactions[kept++] = *transaction;
+        } else {
+            free(transaction->out);
+            capture->skipped++;
+        }
+    }
+    capture->count = kept;
+    if (!capture->count) {
+        fprintf(stderr, "Nothing to replay.\n");
+        return EXIT_FAILURE;
+    }
+
+    Transaction const *deviceDesc = FindDescriptor(capture, kSIDescriptorTypeDevice, 0);
+    replay.desc = (SIDeviceDescriptor) {
+        .bLength = sizeof(SIDeviceDescriptor),
+        .bDescriptorType = kSIDescriptorTypeDevice,
+        .bcdUSB = 0x200,
+        .bMaxPacketSize = 64,
+        .idVendor = 0xffff,
+        .idProduct = 0xffff,
+        .bNumConfigurations = 1,
+    };
+    if (deviceDesc && deviceDesc->inLength >= sizeof(replay.desc))
+        memcpy(&replay.desc, deviceDesc->in, sizeof(replay.desc));
+
+    replay.device = SISimDeviceCreate(&replay.desc);
+    if (!replay.device || SetUp(&replay) != 0)
+        return EXIT_FAILURE;
+
+    // Each transfer's data stage is bounded by its requested length.
+    uint32_t largest = 0;
+    for (size_t i = 0; i < capture->count; ++i) {
+        if (capture->transactions[i].requested > largest)
+            largest = capture->transactions[i].requested;
+    }
+    uint8_t *buffer = malloc(largest ? largest : 1);
+    if (!buffer) {
+        fprintf(stderr, "Out of memory.\n");
+        return EXIT_FAILURE;
+    }
+
+    uint64_t firstNs = capture->transactions[0].submitNs, bytes = 0;
+    uint64_t start = Now();
+    for (unsigned long pass = 0; pass < repeat; ++pass) {
+        replay.startNs = Now() - firstNs;
+        for (size_t i = 0; i < capture->count; ++i) {
+            Transaction const *transaction = &capture->transactions[i];
+            if (replay.timed)
+                SleepUntil(replay.startNs + transaction->submitNs);
+
+            if ((transaction->endpoint & 0x7f) == 0)
+                ReplayControl(&replay, transaction, buffer);
+            else
+                ReplayPipe(&replay, transaction, buffer);
+            bytes += transaction->endpoint & 0x80 ? transaction->inLength : transaction->outLength;
+        }
+    }
+    double elapsed = (double)(Now() - start) / 1e9;
+
+    uint64_t transactions = (uint64_t)capture->count * repeat;
+    printf("Replayed %" PRIu64 " transfers (%" PRIu64 " bytes) in %.3f s: %.0f transfers/s, %.1f MB/s\n",
+        transactions, bytes, elapsed, (double)transactions / elapsed, (double)bytes / elapsed / 1e6);
+    printf("%" PRIu64 " mismatched, %" PRIu64 " packets skipped\n", replay.mismatches, capture->skipped);
+    printf("  %-22s %10s %12s %10s %10s %10s\n", "", "transfers", "bytes", "errors", "p50 (ns)", "p99 (ns)");
+
+    SIStats *stats = malloc(sizeof(SIStats));
+    static char const *const kRequestTypes[] = { "standard", "class", "vendor", "reserved" };
+    if (!stats)
+        fprintf(stderr, "Out of memory; skipping latencies.\n");
+    for (int i = 0; stats && i < replay.numClients; ++i) {
+        SIGetStats(replay.clients[i], stats);
+        char name[32];
+        for (int type = 0; i == 0 && type < 4; ++type) {
+            snprintf(name, sizeof(name), "control (%s)", kRequestTypes[type]);
+            PrintHistogram(name, &stats->control[type]);
+        }
+        for (int j = 0; j < replay.numEndpoints; ++j) {
+            if (replay.endpoints[j].client != replay.clients[i])
+                continue;
+            snprintf(name, sizeof(name), "endpoint %#04x", replay.endpoints[j].address);
+            PrintHistogram(name, &stats->pipes[replay.endpoints[j].pipe]);
+        }
+    }
+    free(stats);
+
+    for (int i = replay.numClients; i-- > 0;)
+        SIClientDestroy(replay.clients[i]);
+    SISimDeviceDestroy(replay.device);
+    for (size_t i = 0; i < capture->count; ++i) {
+        free(capture->transactions[i].out);
+        free(capture->transactions[i].in);
+    }
+    free(capture->transactions);
+    free(buffer);
+    return replay.mismatches ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,126 @@
+// Decodes a dump written by 'SITraceDump' into one line of text per event,
+// or a JSON array with '--json', ordered by time.
+//
+//     trace-decode [--json] <dump>
+
+#include "SimpleIOUSB.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static int CompareRecords(void const *a, void const *b)
+{
+    SITraceRecord const *left = a, *right = b;
+    return left->tick < right->tick ? -1 : left->tick > right->tick;
+}
+
+// Errors, transfers and the like read better in hex.
+static int IsHexArgument(char const *name)
+{
+    return strcmp(name, "error") == 0 || strcmp(name, "transfer") == 0 || strcmp(name, "token") == 0
+        || strcmp(name, "setup") == 0 || strcmp(name, "vendorID") == 0 || strcmp(name, "productID") == 0;
+}
+
+// IOReturn codes are recorded sign-extended.
+static uint64_t ArgumentValue(char const *name, uint64_t value)
+{
+    return strcmp(name, "error") == 0 ? (uint32_t)value : value;
+}
+
+// Convert ticks to nanoseconds since tracing started, by the two clock
+// samples in the header.
+static double TicksToNs(SITraceHeader const *header, uint64_t tick)
+{
+    double delta = (double)(int64_t)(tick - header->baseTick);
+    if (header->dumpTick == header->baseTick)
+        return delta;
+
+    return delta * (double)(header->dumpNs - header->baseNs) / (double)(header->dumpTick - header->baseTick);
+}
+
+static void PrintText(SITraceHeader const *header, SITraceRecord const *record)
+{
+    SITraceEventInfo const *info = SITraceGetEventInfo(record->event);
+    printf("%14.3f us  T%-3u ", TicksToNs(header, record->tick) / 1e3, record->thread);
+    if (!info) {
+        printf("Unknown(%u) %#" PRIx64 " %#" PRIx64 " %#" PRIx64 " %#" PRIx64 "\n", record->event,
+            record->args[0], record->args[1], record->args[2], record->args[3]);
+        return;
+    }
+
+    printf("%-18s", info->name);
+    for (int i = 0; i < 4 && info->args[i]; ++i) {
+        if (IsHexArgument(info->args[i]))
+            printf(" %s=%#" PRIx64, info->args[i], ArgumentValue(info->args[i], record->args[i]));
+        else
+            printf(" %s=%" PRIu64, info->args[i], ArgumentValue(info->args[i], record->args[i]));
+    }
+    putchar('\n');
+}
+
+static void PrintJSON(SITraceHeader const *header, SITraceRecord const *record, int last)
+{
+    SITraceEventInfo const *info = SITraceGetEventInfo(record->event);
+    printf("  {\"ns\": %.0f, \"thread\": %u, ", TicksToNs(header, record->tick), record->thread);
+    if (!info) {
+        printf("\"event\": %u, \"args\": [%" PRIu64 ", %" PRIu64 ", %" PRIu64 ", %" PRIu64 "]}", record->event,
+            record->args[0], record->args[1], record->args[2], record->args[3]);
+    } else {
+        printf("\"event\": \"%s\", \"args\": {", info->name);
+        for (int i = 0; i < 4 && info->args[i]; ++i)
+            printf("%s\"%s\": %" PRIu64, i ? ", " : "", info->args[i], ArgumentValue(info->args[i], record->args[i]));
+        printf("}}");
+    }
+    puts(last ? "" : ",");
+}
+
+int main(int argc, char const **argv)
+{
+    int json = argc == 3 && strcmp(argv[1], "--json") == 0;
+    if (argc != 2 + json) {
+        fprintf(stderr, "usage: %s [--json] <dump>\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    FILE *file = fopen(argv[1 + json], "rb");
+    if (!file) {
+        perror(argv[1 + json]);
+        return EXIT_FAILURE;
+    }
+
+    SITraceHeader header;
+    if (fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, "SITRACE", 8) != 0) {
+        fprintf(stderr, "Not a trace dump.\n");
+        return EXIT_FAILURE;
+    }
+    if (header.version != kSITraceVersion || header.recordSize != sizeof(SITraceRecord)) {
+        fprintf(stderr, "Unsupported trace version %u.\n", header.version);
+        return EXIT_FAILURE;
+    }
+
+    SITraceRecord *records = malloc((size_t)header.numRecords * sizeof(SITraceRecord) + 1);
+    if (!records || fread(records, sizeof(SITraceRecord), (size_t)header.numRecords, file) != header.numRecords) {
+        fprintf(stderr, "Trace dump is truncated.\n");
+        return EXIT_FAILURE;
+    }
+    fclose(file);
+
+    // Each thread's records are in order, but the threads are interleaved.
+    qsort(records, (size_t)header.numRecords, sizeof(SITraceRecord), CompareRecords);
+
+    if (json)
+        puts("[");
+    for (uint64_t i = 0; i < header.numRecords; ++i) {
+        if (json)
+            PrintJSON(&header, &records[i], i + 1 == header.numRecords);
+        else
+            PrintText(&header, &records[i]);
+    }
+    if (json)
+        puts("]");
+
+    free(records);
+    return EXIT_SUCCESS;
+}